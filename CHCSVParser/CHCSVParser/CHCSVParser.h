@@ -47,9 +47,90 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
      *  must have the same number of fields. If they do not, parsing is aborted and this error is returned.
      */
     CHCSVErrorCodeIncorrectNumberOfFields,
+    
+    /**
+     *  Indicates that a @c CHCSVRecordIndex could not be read, or that the file it describes
+     *  has been modified since the index was built.
+     */
+    CHCSVErrorCodeInvalidIndex,
+};
+
+/**
+ *  The UTF-8 bytes of a single field
+ *
+ *  If @c needsUnescaping is @c YES, then the parser is sanitizing fields, and @c bytes are the field exactly as it
+ *  appears in the file (with its quotes, doubled quotes and backslashes). Use the @c CHCSVRecordBatch methods
+ *  to get its sanitized value. Otherwise, @c bytes are already the field's value.
+ */
+typedef struct {
+    const uint8_t *bytes;
+    NSUInteger length;
+    BOOL needsUnescaping;
+} CHCSVFieldSpan;
+
+/**
+ *  The kinds of values a @c CHCSVColumn can hold
+ */
+typedef NS_ENUM(NSInteger, CHCSVColumnType) {
+    /**
+     *  @c values points to @c int64_t values
+     */
+    CHCSVColumnTypeInt64,
+    /**
+     *  @c values points to @c double values, which are written with @c precision
+     */
+    CHCSVColumnTypeDouble,
+    /**
+     *  @c values points to @c CHCSVFieldSpan values holding UTF-8 bytes. The bytes are written as the field's value
+     *  (escaped as necessary), even if the span's @c needsUnescaping is @c YES. A span that isn't valid UTF-8
+     *  is read as ISO Latin 1 instead, in every encoding, as the parser reads such fields
+     */
+    CHCSVColumnTypeUTF8,
+    /**
+     *  @c values points to @c BOOL values, which are written as @c true or @c false.
+     *  When parsing, @c true, @c false, @c yes and @c no (in any case), @c 1 and @c 0 are recognized
+     */
+    CHCSVColumnTypeBoolean,
+    /**
+     *  @c values points to @c double values, the number of seconds since 1970-01-01 00:00:00 UTC (as in @c NSDate).
+     *  They are written in ISO 8601 format, in UTC, with @c precision digits of fractional seconds (at most 9);
+     *  if @c precision is negative, with as many digits as needed, up to 6. A timestamp that isn't finite is written as an empty field.
+     *  When parsing, a date (@c YYYY-MM-DD), optionally followed by @c T or a space and a time (@c hh:mm, @c hh:mm:ss or
+     *  @c hh:mm:ss.sss with any number of decimals), optionally followed by @c Z or an offset from UTC (@c +hh:mm, @c +hhmm or @c +hh),
+     *  is recognized. A time without an offset is in UTC
+     */
+    CHCSVColumnTypeTimestamp,
 };
 
+/**
+ *  One column of the rows written by @c -[CHCSVWriter writeRows:columns:count:], or of the records
+ *  converted by a parser with @c CHCSVParser.columnTypes
+ */
+typedef struct {
+    CHCSVColumnType type;
+    /**
+     *  One value for each row, of the kind indicated by @c type
+     */
+    const void *values;
+    /**
+     *  If this is not @c NULL, then a row whose flag is @c YES gets an empty field instead of its value.
+     *  In converted records, a field that is empty, missing or could not be converted is flagged
+     */
+    const BOOL *nulls;
+    /**
+     *  For @c CHCSVColumnTypeDouble, the number of digits after the decimal point (at most 17). If this is negative,
+     *  each value is written with the fewest significant digits that read back as the same @c double.
+     *  For @c CHCSVColumnTypeTimestamp, the number of digits of fractional seconds
+     */
+    NSInteger precision;
+} CHCSVColumn;
+
 @class CHCSVParser;
+@class CHCSVRecordBatch;
+@class CHCSVRecordIndex;
+@class CHCSVScanSummary;
+@class CHCSVParserStatistics;
+@class CHCSVWriterStatistics;
 @protocol CHCSVParserDelegate <NSObject>
 
 @optional
@@ -91,10 +172,38 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
  *
  *  @param parser     The @c CHCSVParser instance
  *  @param field      The parsed string. If configured to do so, this string may be sanitized and trimmed
- *  @param fieldIndex The 0-based index of the field within the current record
+ *  @param fieldIndex The 0-based index of the field within the current record. This is the field's column,
+ *  even if @c CHCSVParser.includedColumns leaves out some of the columns before it
  */
 - (void)parser:(CHCSVParser *)parser didReadField:(NSString *)field atIndex:(NSInteger)fieldIndex;
 
+/**
+ *  Indicates the parser has parsed one or more complete records
+ *
+ *  If the delegate implements this method, then @c parser:didBeginLine:, @c parser:didEndLine:
+ *  and @c parser:didReadField:atIndex: are not invoked. Comments and errors are still reported through their own methods,
+ *  after every record that precedes them has been delivered.
+ *
+ *  @param parser  The @c CHCSVParser instance
+ *  @param records Up to @c CHCSVParser.recordBatchSize consecutive records. This object, and the bytes of its fields,
+ *  are only valid until this method returns
+ */
+- (void)parser:(CHCSVParser *)parser didReadRecords:(CHCSVRecordBatch *)records;
+
+/**
+ *  Indicates that a field of a column in @c CHCSVParser.columnTypes could not be converted
+ *
+ *  Parsing continues, and the field is flagged as null in @c -[CHCSVRecordBatch valuesOfColumn:].
+ *  This method is invoked just before the batch that holds the record is delivered to @c parser:didReadRecords:
+ *
+ *  @param parser       The @c CHCSVParser instance
+ *  @param field        The field's value
+ *  @param recordNumber The 1-based number of the record
+ *  @param column       The 0-based column of the field
+ *  @param type         The type the field should have had
+ */
+- (void)parser:(CHCSVParser *)parser didFailToConvertField:(NSString *)field ofRecord:(NSUInteger)recordNumber column:(NSUInteger)column toType:(CHCSVColumnType)type;
+
 /**
  *  Indicates the parser has encountered a comment
  *
@@ -159,12 +268,111 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
 @property (nonatomic, assign) BOOL recognizesLeadingEqualSign;
 
 /**
- *  The number of bytes that have been read from the input stream so far
+ *  If @c YES, then large UTF-8 files are split into chunks that are parsed concurrently on all available cores.
+ *  The delegate still receives every callback in order, on the thread that invoked @c -parse, and with the same
+ *  record numbers as a sequential parse. Only a parser created with the URL of a local file can parse in parallel;
+ *  otherwise this property is ignored. The default value is @c NO.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, assign) BOOL parsesInParallel;
+
+/**
+ *  The largest number of records delivered by a single call to @c parser:didReadRecords:
+ *  The default value is 128. Setting this to 1 delivers every record as soon as it has been parsed.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, assign) NSUInteger recordBatchSize;
+
+/**
+ *  If non-zero, then the input stream is read on a separate thread, into buffers of this many bytes, while the parser
+ *  works through the ones already read. It must be between 1MB and 16MB. Local files that don't need decompressing are
+ *  memory-mapped rather than read, and ignore this. Input compressed with gzip is always decompressed on a separate thread,
+ *  into buffers of this size (or 4MB, if this is 0). A buffer is handed to the parser as soon as the input has nothing more
+ *  to give for the moment, so input that arrives slowly is still parsed as it arrives.
+ *  The default value is 0, which reads the input on the parsing thread.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, assign) NSUInteger readAheadBufferSize;
+
+/**
+ *  If non-nil, then only the fields in these 0-based columns are reported. The fields of other columns are still
+ *  scanned (so quoted delimiters and newlines are honored), but they are not sanitized, trimmed or turned into strings.
+ *  Batched records only contain the fields of these columns. The default value is @c nil, which reports every column.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, copy) NSIndexSet *includedColumns;
+
+/**
+ *  If non-nil, then the first record is treated as a header, and only the columns whose header field is one of these
+ *  names are reported (including in the header itself). Names that do not appear in the header are ignored.
+ *  This takes precedence over @c includedColumns. The default value is @c nil.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, copy) NSArray *includedColumnNames;
+
+/**
+ *  If non-nil, then the fields of some columns are converted to native values straight from their bytes, as records are parsed.
+ *  The keys are 0-based columns and the values are their @c CHCSVColumnType, both as @c NSNumbers.
+ *  The values are available from @c -[CHCSVRecordBatch valuesOfColumn:], so only a delegate that implements
+ *  @c parser:didReadRecords: receives them. Fields that can't be converted are reported to @c parser:didFailToConvertField:ofRecord:column:toType:
+ *  Columns that @c includedColumns or @c includedColumnNames leave out are not converted, and neither is the header
+ *  when @c includedColumnNames is used. Fields are converted as they would be by @c CHCSVRecordBatch,
+ *  so quoted fields should be sanitized. The default value is @c nil.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, copy) NSDictionary *columnTypes;
+
+/**
+ *  If non-zero, then while parsing a local UTF-8 file, the parser notes where every @c recordIndexInterval-th record starts.
+ *  The notes are available from @c recordIndex once parsing has finished. A smaller interval makes an index that is larger,
+ *  but that leaves fewer records to be skipped when starting from it. The default value is 0, which doesn't build an index.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, assign) NSUInteger recordIndexInterval;
+
+/**
+ *  The index built while parsing, if @c recordIndexInterval is non-zero and the parser was created with the URL of a local UTF-8 file.
+ *  If parsing was cancelled or failed, the index covers the records that were parsed. Otherwise this is @c nil.
+ */
+@property (readonly) CHCSVRecordIndex *recordIndex;
+
+/**
+ *  The number of bytes that had been read from the input stream when @c statistics was last published, or 0 before then
  *
- *  This property is key-value observable.
+ *  This property is key-value observable, and may be read from any thread. Observers are notified whenever @c statistics is published.
  */
 @property (readonly) NSUInteger totalBytesRead;
 
+/**
+ *  If @c YES, the parser measures how long it spends reading, decoding, tokenizing and invoking the delegate,
+ *  which costs a clock read before and after every delegate callback. Everything else in the statistics is counted either way.
+ *  The default value is @c NO.
+ *  @warning Do not mutate this property after parsing has begun
+ */
+@property (nonatomic, assign) BOOL measuresTime;
+
+/**
+ *  If non-zero, @c statistics (and so @c totalBytesRead) is published at most this often (in seconds) while parsing, as input is read.
+ *  If 0, they're published only once parsing has finished. The default value is 0.1.
+ */
+@property (nonatomic, assign) NSTimeInterval statisticsInterval;
+
+/**
+ *  The statistics most recently published by the parser: every @c statisticsInterval while parsing, and when parsing finishes.
+ *  This is @c nil until the first time they're published.
+ *
+ *  This property is key-value observable, and may be read from any thread. Notifications are sent on the thread that is parsing.
+ */
+@property (readonly) CHCSVParserStatistics *statistics;
+
+/**
+ *  Statistics of what the parser has done so far. Unlike @c statistics, this must be invoked on the thread that is parsing
+ *  (such as from a delegate method), or when the parser isn't parsing.
+ *
+ *  @return A new snapshot of the parser's counters
+ */
+- (CHCSVParserStatistics *)currentStatistics;
+
 
 /**
  * This method is unavailable, because there is nothing supplied to parse.
@@ -175,7 +383,8 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
  *  The designated initializer
  *
  *  @param stream    The @c NSInputStream from which bytes will be read and parsed. Must not be @c nil
- *  @param encoding  A pointer to an @c NSStringEncoding. If non-nil, this will be filled in with the encoding used to parse the stream
+ *  @param encoding  A pointer to an @c NSStringEncoding. If non-nil, this will be filled in with the encoding used to parse the stream.
+ *                   When the encoding is inferred, a stream of gzip-compressed bytes is also recognized, and decompressed as it's parsed
  *  @param delimiter The delimiter character to be used when parsing the stream. Must not be @c nil, and may not be the double quote character
  *
  *  @return a @c CHCSVParser instance, or @c nil if initialization failed
@@ -223,6 +432,9 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
  *  Internally it calls the designated initializer and provides a stream to the URL as well as the provided delimiter.
  *  The parser attempts to infer the encoding from the stream.
  *
+ *  If the URL refers to a local file, the file is memory-mapped and parsed in place instead of being read through a stream.
+ *  The file must not be modified or truncated while the parser, or any string it has reported, is still alive.
+ *
  *  @param URL       The @c NSURL to the delimited file
  *  @param delimiter The delimiter character to be used when parsing the string. Must not be @c nil, and may not be the double quote character
  *
@@ -230,6 +442,49 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
  */
 - (instancetype)initWithContentsOfDelimitedURL:(NSURL *)URL delimiter:(unichar)delimiter;
 
+/**
+ *  An initializer for a parser whose input is given to it a piece at a time, with @c -feedData: and @c -finish
+ *
+ *  This suits input that arrives over time, such as from a pipe or a socket: the parser never waits for bytes,
+ *  and each record is reported as soon as the piece of data that completes it has been fed.
+ *  The input must be UTF-8 (a leading byte order mark is skipped). Do not invoke @c -parse on this parser.
+ *
+ *  @param delimiter The delimiter character to be used when parsing. Must be an ASCII character (or an @c NSInvalidArgumentException
+ *  is raised), and may not be the double quote character
+ *
+ *  @return a @c CHCSVParser instance, or @c nil if initialization failed
+ */
+- (instancetype)initForIncrementalParsingWithDelimiter:(unichar)delimiter;
+
+/**
+ *  Instruct the parser to begin parsing at a record other than the first one
+ *
+ *  The index finds where an earlier record starts, and the records in between are scanned without being reported.
+ *  Record numbers (and the header, if @c includedColumnNames is set) are the same as if the whole file had been parsed.
+ *  Records are parsed sequentially, even if @c parsesInParallel is @c YES. This must be invoked before @c -parse
+ *
+ *  @param recordNumber The 1-based number of the first record to report
+ *  @param index        An index built from the file this parser was created with
+ *
+ *  @return @c YES if parsing will start at the record, or @c NO if the parser isn't parsing a local UTF-8 file,
+ *          or if the index was built from a different version of the file
+ */
+- (BOOL)startAtRecord:(NSUInteger)recordNumber usingIndex:(CHCSVRecordIndex *)index;
+
+/**
+ *  Instruct the parser to begin parsing at a byte offset in the file
+ *
+ *  The offset must be where a record starts, such as one that was reported by a @c CHCSVRecordIndex.
+ *  Records are parsed sequentially, even if @c parsesInParallel is @c YES. This must be invoked before @c -parse
+ *
+ *  @param offset       The offset of the first byte of the record, from the start of the file (including any byte order mark)
+ *  @param recordNumber The 1-based number of the record that starts at @c offset
+ *
+ *  @return @c YES if parsing will start at the offset, or @c NO if the parser isn't parsing a local UTF-8 file,
+ *          or if the offset is outside of the file
+ */
+- (BOOL)startAtByteOffset:(unsigned long long)offset recordNumber:(NSUInteger)recordNumber;
+
 /**
  *  Instruct the parser to begin parsing
  *
@@ -237,6 +492,38 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
  */
 - (void)parse;
 
+/**
+ *  Instruct the parser to check the structure of the input, without reporting anything to the delegate
+ *
+ *  The input is tokenized exactly as @c -parse would (with the same options), but no field is sanitized, trimmed or
+ *  turned into a string, so this runs at the speed of finding the boundaries of fields. Scanning stops at the first error.
+ *  @c includedColumns, @c includedColumnNames, @c columnTypes and @c parsesInParallel are ignored.
+ *  You should invoke either this method or @c -parse, and only once. It can't be used by an incremental parser.
+ *
+ *  @return a summary of what was found
+ */
+- (CHCSVScanSummary *)scan;
+
+/**
+ *  Gives more input to a parser created with @c -initForIncrementalParsingWithDelimiter:
+ *
+ *  Every record that the data completes is parsed and reported before this method returns. Anything after the last complete
+ *  record (including part of a quoted field, or part of a multibyte character) is kept until more data is fed.
+ *  The first invocation reports the beginning of the document. Data fed after parsing fails or is cancelled is ignored.
+ *  This and @c -finish must not be invoked on more than one thread at a time.
+ *
+ *  @param data The next bytes of the input
+ */
+- (void)feedData:(NSData *)data;
+
+/**
+ *  Tells a parser created with @c -initForIncrementalParsingWithDelimiter: that there is no more input
+ *
+ *  The last record is parsed even if it isn't followed by a newline, and then the end of the document (or an error) is reported.
+ *  Invoking this method more than once has no effect.
+ */
+- (void)finish;
+
 /**
  *  Instruct the parser to abort parsing
  *
@@ -246,6 +533,110 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
 
 @end
 
+/**
+ *  A group of consecutive records, as reported to @c parser:didReadRecords:
+ *
+ *  The fields of every record are stored back to back in @c fieldSpans, in the order they appear in the file.
+ *  If the parser sanitizes or trims fields, the spans contain the sanitized and trimmed bytes.
+ */
+@interface CHCSVRecordBatch : NSObject
+
+- (instancetype)init NS_UNAVAILABLE;
+
+/**
+ *  The 1-based record number of the first record in the batch
+ */
+@property (readonly) NSUInteger firstRecordNumber;
+
+/**
+ *  The number of records in the batch
+ */
+@property (readonly) NSUInteger count;
+
+/**
+ *  The fields of all of the records in the batch
+ */
+@property (readonly) const CHCSVFieldSpan *fieldSpans;
+
+/**
+ *  The location and number of the fields of a record within @c fieldSpans
+ *
+ *  @param index The 0-based index of the record within the batch
+ *
+ *  @return The range of @c fieldSpans that holds the record's fields
+ */
+- (NSRange)fieldRangeOfRecordAtIndex:(NSUInteger)index;
+
+/**
+ *  The fields of a record, as strings
+ *
+ *  @param index The 0-based index of the record within the batch
+ *
+ *  @return An @c NSArray of @c NSStrings
+ */
+- (NSArray *)fieldsOfRecordAtIndex:(NSUInteger)index;
+
+/**
+ *  A field, as a string
+ *
+ *  @param index The index of the field within @c fieldSpans
+ *
+ *  @return The field's value
+ */
+- (NSString *)stringForFieldAtIndex:(NSUInteger)index;
+
+/**
+ *  The sanitized bytes of a field, without creating a string
+ *
+ *  @param index The index of the field within @c fieldSpans
+ *
+ *  @return A span whose @c needsUnescaping is @c NO. If the field had to be unescaped, its bytes
+ *  are only valid until the next time a field of this batch is unescaped, compared or converted
+ */
+- (CHCSVFieldSpan)unescapedFieldAtIndex:(NSUInteger)index;
+
+/**
+ *  Compares a field to a string, without creating a string
+ *
+ *  @param index  The index of the field within @c fieldSpans
+ *  @param string A NUL-terminated UTF-8 string
+ *
+ *  @return @c YES if the field's value is byte-for-byte the same as @c string
+ */
+- (BOOL)fieldAtIndex:(NSUInteger)index isEqualToUTF8String:(const char *)string;
+
+/**
+ *  Parses a field as a decimal integer, without creating a string
+ *
+ *  @param value Filled in with the integer, if the field is one
+ *  @param index The index of the field within @c fieldSpans
+ *
+ *  @return @c YES if the entire field is an optionally-signed decimal integer that fits in a @c long @c long
+ */
+- (BOOL)getIntegerValue:(long long *)value ofFieldAtIndex:(NSUInteger)index;
+
+/**
+ *  Parses a field as a floating point number, without creating a string
+ *
+ *  @param value Filled in with the number, if the field is one
+ *  @param index The index of the field within @c fieldSpans
+ *
+ *  @return @c YES if the entire field is a number, as understood by @c strtod in the "C" locale
+ */
+- (BOOL)getDoubleValue:(double *)value ofFieldAtIndex:(NSUInteger)index;
+
+/**
+ *  The converted values of a column in @c CHCSVParser.columnTypes
+ *
+ *  @param column The 0-based column
+ *
+ *  @return One value for each record in the batch. A @c CHCSVColumnTypeUTF8 column holds sanitized spans.
+ *  The values are only valid as long as the batch is. Raises an @c NSInvalidArgumentException if the column wasn't converted
+ */
+- (CHCSVColumn)valuesOfColumn:(NSUInteger)column;
+
+@end
+
 @interface CHCSVWriter : NSObject
 
 /**
@@ -274,6 +665,63 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
  */
 - (instancetype)initWithOutputStream:(NSOutputStream *)stream encoding:(NSStringEncoding)encoding delimiter:(unichar)delimiter NS_DESIGNATED_INITIALIZER;
 
+/**
+ *  The number of bytes the writer collects before writing them to the stream
+ *
+ *  Fields are encoded into a buffer of this size, which is written to the stream whenever it fills up,
+ *  when you invoke @c flush, and when the stream is closed. The default value is 65536; it must be at least 16.
+ *  Changing it flushes whatever has been buffered so far.
+ */
+@property (nonatomic, assign) NSUInteger bufferSize;
+
+/**
+ *  If @c YES, then lines are formatted on all available cores
+ *
+ *  Lines are collected into batches of @c linesPerBatch lines, and each batch is quoted, escaped and encoded
+ *  on a separate thread. A single thread writes the formatted batches to the stream, in the order in which
+ *  the lines were given, so the output is exactly the same as when writing sequentially.
+ *  Fields are retained until their batch has been formatted, and their @c description is invoked on a
+ *  background thread. The default value is @c NO.
+ *  @warning You may only change this property between lines
+ */
+@property (nonatomic, assign) BOOL writesInParallel;
+
+/**
+ *  The number of lines formatted together when writing in parallel. The default value is 1024.
+ */
+@property (nonatomic, assign) NSUInteger linesPerBatch;
+
+/**
+ *  The largest number of batches that may be formatted, or waiting to be written, at once
+ *
+ *  When this many batches are in flight, the methods that write lines wait for the oldest one to be written.
+ *  This bounds the memory used by parallel writing. The default value is twice the number of active processors.
+ */
+@property (nonatomic, assign) NSUInteger maximumBatchesInFlight;
+
+/**
+ *  Statistics of what the writer has done so far. Invoke this on the thread that is writing.
+ *
+ *  When writing in parallel, this waits until every batch submitted so far has been formatted and written, and those
+ *  bytes are counted. The lines and fields of the batch still being collected are counted, but not their bytes;
+ *  invoke @c flush first to include them.
+ *
+ *  @return A new snapshot of the writer's counters
+ */
+- (CHCSVWriterStatistics *)currentStatistics;
+
+/**
+ *  Write everything that has been buffered so far to the output stream
+ *
+ *  This is invoked automatically by @c closeStream, but you need to invoke it yourself
+ *  before reading from the stream's destination while the writer is still open.
+ *  When writing in parallel, this waits until every finished line has been formatted and written.
+ *
+ *  @return @c YES if the stream has accepted every byte so far. If it fails, the bytes are discarded,
+ *  and the stream's @c streamError describes what went wrong.
+ */
+- (BOOL)flush;
+
 /**
  *  Write a field to the output stream
  *
@@ -299,6 +747,21 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
  */
 - (void)writeLineOfFields:(id<NSFastEnumeration>)fields;
 
+/**
+ *  Write a series of lines whose values are stored by column
+ *
+ *  If another line is already in progress, it is terminated first. Numbers are formatted in the "C" locale,
+ *  and no objects are created for the values, so this is much faster than writing them one by one.
+ *  These lines are not used as the keys for @c writeLineWithDictionary:
+ *  When writing in parallel, this returns once every line has been formatted, so the columns only need
+ *  to remain valid until then.
+ *
+ *  @param rowCount    The number of lines to write, and the number of values in each column
+ *  @param columns     The columns, in the order in which their fields appear in each line (see @c CHCSVColumnType for how each kind is written)
+ *  @param columnCount The number of columns
+ */
+- (void)writeRows:(NSUInteger)rowCount columns:(const CHCSVColumn *)columns count:(NSUInteger)columnCount;
+
 /**
  *  Write the contents of an @c NSDictionary as a new line
  *
@@ -320,7 +783,7 @@ typedef NS_ENUM(NSInteger, CHCSVErrorCode) {
 - (void)writeComment:(NSString *)comment;
 
 /**
- *  Closes the output stream.
+ *  Flushes the buffered bytes and closes the output stream.
  *  You do not have to invoke this method yourself, as it is invoked during deallocation.
  */
 - (void)closeStream;
@@ -366,7 +829,19 @@ typedef NS_OPTIONS(NSUInteger, CHCSVParserOptions) {
      *  @see CHCSVParser.recognizesLeadingEqualSign
      *  @link http://edoceo.com/utilitas/csv-file-format
      */
-    CHCSVParserOptionsRecognizesLeadingEqualSign = 1 << 5
+    CHCSVParserOptionsRecognizesLeadingEqualSign = 1 << 5,
+    /**
+     *  Parses large local files on multiple cores. The result is identical to parsing sequentially.
+     *  @see CHCSVParser.parsesInParallel
+     */
+    CHCSVParserOptionsParsesInParallel = 1 << 6,
+    /**
+     *  Makes the @c NSArray methods keep what they parse in a @c .chcsvcache file next to the file,
+     *  and use it instead of parsing the file again until the file changes.
+     *  It has no effect when only some columns are parsed, or on a @c CHCSVParser.
+     *  @see +[NSArray arrayWithContentsOfDelimitedURL:options:delimiter:cacheDirectory:error:]
+     */
+    CHCSVParserOptionsUsesCache = 1 << 7
 };
 
 /**
@@ -436,6 +911,41 @@ typedef NS_OPTIONS(NSUInteger, CHCSVParserOptions) {
  */
 + (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter error:(NSError *__autoreleasing *)error;
 
+/**
+ *  A convenience constructor to parse some of the columns of a delimited file
+ *
+ *  @param fileURL   The @c NSURL to the delimited file
+ *  @param options   A bitwise-OR of @c CHCSVParserOptions to control how parsing should occur
+ *  @param delimiter The delimiter used in the file
+ *  @param columns   The columns to include, as @c NSNumbers of 0-based column indexes, or as @c NSStrings of header names
+ *  (which requires @c CHCSVParserOptionsUsesFirstLineAsKeys). If @c nil, every column is included
+ *  @param error     A pointer to an @c NSError*, which will be filled in if parsing fails
+ *
+ *  @return An @c NSArray of @c NSArrays of @c NSStrings, if parsing succeeds; @c nil otherwise.
+ */
++ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter columns:(NSArray *)columns error:(NSError *__autoreleasing *)error;
+
+/**
+ *  A convenience constructor to parse a delimited file, keeping what it parses in a cache
+ *
+ *  The first time a file is parsed, its records are written to a cache. Until the file's size or modification date changes,
+ *  later calls with the same options and delimiter map the cache instead of parsing the file, and make each record as it is used.
+ *  A cache that is out of date or damaged is ignored, and replaced once the file has been parsed again.
+ *
+ *  @warning Only the cache's header and the offsets of its columns are checksummed, not the fields themselves,
+ *  so damage to a cache's field data goes unnoticed and returns wrong records. Keep caches somewhere only this app writes to.
+ *
+ *  @param fileURL        The @c NSURL to the delimited file
+ *  @param options        A bitwise-OR of @c CHCSVParserOptions to control how parsing should occur
+ *  @param delimiter      The delimiter used in the file
+ *  @param cacheDirectory The directory to keep the cache in. If @c nil, the cache is kept next to the file,
+ *  with @c .chcsvcache appended to its name
+ *  @param error          A pointer to an @c NSError*, which will be filled in if parsing fails
+ *
+ *  @return An @c NSArray of @c NSArrays of @c NSStrings, if parsing succeeds; @c nil otherwise.
+ */
++ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter cacheDirectory:(NSURL *)cacheDirectory error:(NSError *__autoreleasing *)error;
+
 /**
  *  If the receiver is an @c NSArray of @c NSArrays of objects, this will turn it into a comma-delimited string
  *  Returns the string of CSV, if writing succeeds; @c nil otherwise.
@@ -491,6 +1001,349 @@ typedef NS_OPTIONS(NSUInteger, CHCSVParserOptions) {
  */
 - (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter options:(CHCSVParserOptions)options error:(NSError *__autoreleasing *)error;
 
+/**
+ *  Parses some of the columns of the receiver as a delimited string
+ *
+ *  @param delimiter The delimiter used in the string
+ *  @param options   A bitwise-OR of @c CHCSVParserOptions to control how parsing should occur
+ *  @param columns   The columns to include, as @c NSNumbers of 0-based column indexes, or as @c NSStrings of header names
+ *  (which requires @c CHCSVParserOptionsUsesFirstLineAsKeys). If @c nil, every column is included
+ *  @param error     A pointer to an @c NSError*, which will be filled in if parsing fails
+ *
+ *  @return An @c NSArray of @c NSArrays of @c NSStrings, if parsing succeeds; @c nil otherwise.
+ */
+- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter options:(CHCSVParserOptions)options columns:(NSArray *)columns error:(NSError *__autoreleasing *)error;
+
+@end
+
+/**
+ *  The records of a delimited file, stored by column
+ *
+ *  A table holds its fields as UTF-8 bytes instead of one @c NSString each. The bytes of each column are stored
+ *  contiguously, with one offset per field, and a column with few distinct values stores each of them only once,
+ *  along with a small index per field. Any field can be looked up in constant time.
+ *  Comments are not included. A table is immutable, and may be read from any thread.
+ */
+@interface CHCSVTable : NSObject
+
+/**
+ *  This method is unavailable; use one of the convenience constructors
+ */
+- (instancetype)init NS_UNAVAILABLE;
+
+/**
+ *  A convenience constructor to parse a delimited file into a table
+ *
+ *  @param fileURL   The @c NSURL to the delimited file
+ *  @param options   A bitwise-OR of @c CHCSVParserOptions to control how parsing should occur.
+ *  With @c CHCSVParserOptionsUsesFirstLineAsKeys, the first line becomes the @c columnNames, and every other line must have as many fields
+ *  @param delimiter The delimiter used in the file
+ *  @param columns   The columns to include, as for @c -[NSArray arrayWithContentsOfDelimitedURL:options:delimiter:columns:error:]
+ *  @param error     A pointer to an @c NSError*, which will be filled in if parsing fails
+ *
+ *  @return A table, if parsing succeeds; @c nil otherwise
+ */
++ (instancetype)tableWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter columns:(NSArray *)columns error:(NSError *__autoreleasing *)error;
+
+/**
+ *  A convenience constructor to parse a delimited string into a table
+ *
+ *  @see tableWithContentsOfDelimitedURL:options:delimiter:columns:error:
+ */
++ (instancetype)tableWithDelimitedString:(NSString *)string options:(CHCSVParserOptions)options delimiter:(unichar)delimiter columns:(NSArray *)columns error:(NSError *__autoreleasing *)error;
+
+/**
+ *  The number of records in the table, not counting the line of column names
+ */
+@property (readonly) NSUInteger rowCount;
+
+/**
+ *  The largest number of fields in any record
+ */
+@property (readonly) NSUInteger columnCount;
+
+/**
+ *  The fields of the first line, if the table was made with @c CHCSVParserOptionsUsesFirstLineAsKeys; @c nil otherwise
+ */
+@property (readonly) NSArray *columnNames;
+
+/**
+ *  The number of fields in a record, which is less than @c columnCount if the record is shorter than others
+ */
+- (NSUInteger)fieldCountOfRowAtIndex:(NSUInteger)row;
+
+/**
+ *  The bytes of a field
+ *
+ *  @return The field's UTF-8 bytes, which remain valid as long as the table does, and never need unescaping.
+ *  A field past the end of a shorter record is empty.
+ */
+- (CHCSVFieldSpan)fieldSpanAtRow:(NSUInteger)row column:(NSUInteger)column;
+
+/**
+ *  A field as a string
+ *
+ *  @return A new string, or @c nil if the record does not have that many fields
+ */
+- (NSString *)stringAtRow:(NSUInteger)row column:(NSUInteger)column;
+
+/**
+ *  All of the fields of a record, as strings
+ */
+- (NSArray *)fieldsOfRowAtIndex:(NSUInteger)row;
+
+/**
+ *  Whether a column stores each of its distinct values only once
+ *
+ *  Every column starts out this way, and switches to storing every field's bytes if it turns out to have too many distinct values.
+ */
+- (BOOL)isDictionaryEncodedColumn:(NSUInteger)column;
+
+@end
+
+/**
+ *  A sparse index of where the records of a local file start, as built by a parser whose @c recordIndexInterval is set.
+ *
+ *  An index remembers the size and modification date of the file it was built from, and can't be used once the file changes.
+ */
+@interface CHCSVRecordIndex : NSObject
+
+/**
+ * This method is unavailable, because indexes are built by parsers.
+ */
+- (instancetype)init NS_UNAVAILABLE;
+
+/**
+ *  Reads an index that was written with @c -writeToURL:error:
+ *
+ *  @param indexURL The URL of the index
+ *  @param fileURL  The URL of the file that the index describes
+ *  @param error    If the index can't be read, or the file has been modified since the index was built, this is filled in
+ *
+ *  @return a @c CHCSVRecordIndex instance, or @c nil if the index can't be used with the file
+ */
++ (instancetype)indexWithContentsOfURL:(NSURL *)indexURL forFileAtURL:(NSURL *)fileURL error:(NSError *__autoreleasing *)error;
+
+/**
+ *  The conventional location of the index of a file, next to the file itself
+ */
++ (NSURL *)sidecarURLForFileAtURL:(NSURL *)fileURL;
+
+/**
+ *  Writes the index atomically, in a compact binary format that can be read with @c +indexWithContentsOfURL:forFileAtURL:error:
+ */
+- (BOOL)writeToURL:(NSURL *)indexURL error:(NSError *__autoreleasing *)error;
+
+/**
+ *  The largest number of records between two records whose start is known
+ */
+@property (readonly) NSUInteger recordInterval;
+
+/**
+ *  The number of the last record that was parsed while building the index
+ */
+@property (readonly) NSUInteger recordCount;
+
+/**
+ *  The size of the file that the index describes
+ */
+@property (readonly) unsigned long long fileSize;
+
+/**
+ *  The modification date of the file that the index describes
+ */
+@property (readonly) NSDate *fileModificationDate;
+
+/**
+ *  Finds the closest record at or before a record whose start is known
+ *
+ *  @param offset        Filled in with the byte offset of the indexed record, from the start of the file
+ *  @param indexedRecord Filled in with the number of the indexed record
+ *  @param recordNumber  The 1-based number of the record to look for
+ *
+ *  @return @c YES if a record was found
+ */
+- (BOOL)getByteOffset:(unsigned long long *)offset recordNumber:(NSUInteger *)indexedRecord nearestToRecord:(NSUInteger)recordNumber;
+
+/**
+ *  Whether the file at @c fileURL has the same size and modification date as the file the index was built from
+ */
+- (BOOL)isValidForFileAtURL:(NSURL *)fileURL;
+
+@end
+
+/**
+ *  The structure of some delimited input, as found by @c -[CHCSVParser scan]
+ */
+@interface CHCSVScanSummary : NSObject
+
+/**
+ * This method is unavailable, because summaries are made by parsers.
+ */
+- (instancetype)init NS_UNAVAILABLE;
+
+/**
+ *  The number of records that were found. If the parser started partway through the input, this is the number of the last record
+ */
+@property (readonly) NSUInteger recordCount;
+
+/**
+ *  The number of comments that were found. Comments are only recognized if the parser's @c recognizesComments is @c YES
+ */
+@property (readonly) NSUInteger commentCount;
+
+/**
+ *  The fewest fields in any record, or 0 if there are no records
+ */
+@property (readonly) NSUInteger minimumFieldCount;
+
+/**
+ *  The most fields in any record, or 0 if there are no records
+ */
+@property (readonly) NSUInteger maximumFieldCount;
+
+/**
+ *  For each number of fields that a record has, the number of records that have it. Both are @c NSNumbers
+ */
+@property (readonly) NSDictionary *fieldCountHistogram;
+
+/**
+ *  The length of the longest field as it appears in the input (including quotes, escapes and whitespace).
+ *  This is in bytes of UTF-8, or in characters if the input isn't parsed as UTF-8 (see "Data Encoding" in the README)
+ */
+@property (readonly) NSUInteger maximumFieldLength;
+
+/**
+ *  The first error that was found, or @c nil if the input is valid
+ */
+@property (readonly) NSError *error;
+
+/**
+ *  The 1-based number of the record in which the error was found, or @c NSNotFound if there was no error
+ */
+@property (readonly) NSUInteger errorRecordNumber;
+
+/**
+ *  Where the error was found, or @c NSNotFound if there was no error. For UTF-8 input, this is the byte offset from the start
+ *  of the input (including any byte order mark). Input in other encodings is counted in the UTF-8 it was converted to,
+ *  after the byte order mark, or in characters if the input isn't parsed as UTF-8
+ */
+@property (readonly) unsigned long long errorOffset;
+
+@end
+
+#pragma mark - Statistics
+
+/**
+ *  What a @c CHCSVParser had done when the statistics were taken. The parser keeps these counts as it goes,
+ *  and only makes one of these when it publishes its @c statistics or when asked for its @c currentStatistics.
+ */
+@interface CHCSVParserStatistics : NSObject
+
+/**
+ * This method is unavailable, because statistics are made by parsers.
+ */
+- (instancetype)init NS_UNAVAILABLE;
+
+/**
+ *  The number of bytes read from the input (after decompressing it, if it's compressed with gzip)
+ */
+@property (readonly) unsigned long long bytesRead;
+
+/**
+ *  How much of the input has been decoded. This is in bytes of UTF-8 (after converting UTF-16, UTF-32 and single-byte encodings),
+ *  or in characters if the input isn't parsed as UTF-8 (see "Data Encoding" in the README)
+ */
+@property (readonly) unsigned long long decodedLength;
+
+/**
+ *  The number of records that were found
+ */
+@property (readonly) NSUInteger recordCount;
+
+/**
+ *  The number of fields that were found, including those of columns that aren't included
+ */
+@property (readonly) NSUInteger fieldCount;
+
+/**
+ *  The time since parsing began, until it finished or until the statistics were taken
+ */
+@property (readonly) NSTimeInterval elapsedTime;
+
+/**
+ *  The time spent waiting for the input stream. Memory-mapped files aren't read, so this is 0 for them.
+ *  This and the other times are only measured if the parser's @c measuresTime is @c YES; otherwise they are 0
+ */
+@property (readonly) NSTimeInterval readingTime;
+
+/**
+ *  The time spent converting the input to UTF-8 (or to characters, if it isn't parsed as UTF-8)
+ */
+@property (readonly) NSTimeInterval decodingTime;
+
+/**
+ *  The time spent in delegate methods
+ */
+@property (readonly) NSTimeInterval delegateTime;
+
+/**
+ *  The rest of the elapsed time, which is spent finding fields and records (and, when parsing in parallel, waiting for them)
+ */
+@property (readonly) NSTimeInterval tokenizingTime;
+
+/**
+ *  The largest that the parser's buffers have been at once, in bytes. Memory-mapped files aren't counted
+ */
+@property (readonly) NSUInteger peakBufferSize;
+
+/**
+ *  The number of times the parser allocated or grew one of its buffers. Objects made for the delegate aren't counted
+ */
+@property (readonly) NSUInteger allocationCount;
+
+@end
+
+/**
+ *  What a @c CHCSVWriter had done when the statistics were taken
+ */
+@interface CHCSVWriterStatistics : NSObject
+
+/**
+ * This method is unavailable, because statistics are made by writers.
+ */
+- (instancetype)init NS_UNAVAILABLE;
+
+/**
+ *  The number of bytes that the output stream has accepted. Bytes that are still buffered aren't counted
+ */
+@property (readonly) unsigned long long bytesWritten;
+
+/**
+ *  The number of lines that were finished, not counting comments
+ */
+@property (readonly) NSUInteger lineCount;
+
+/**
+ *  The number of fields that were written
+ */
+@property (readonly) NSUInteger fieldCount;
+
+/**
+ *  The time spent waiting for the output stream to accept bytes
+ */
+@property (readonly) NSTimeInterval writingTime;
+
+/**
+ *  The largest that the writer's buffer has been, in bytes
+ */
+@property (readonly) NSUInteger peakBufferSize;
+
+/**
+ *  The number of times the writer allocated or grew its buffer
+ */
+@property (readonly) NSUInteger allocationCount;
+
 @end
 
 #pragma mark - Deprecated stuff
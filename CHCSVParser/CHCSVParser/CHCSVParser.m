@@ -25,6 +25,22 @@
 
 #import "CHCSVParser.h"
 
+#import <fcntl.h>
+#import <mach/mach_time.h>
+#import <unistd.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <xlocale.h>
+#import <zlib.h>
+
+#if defined(__AVX2__)
+#import <immintrin.h>
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#endif
+
 #if !__has_feature(objc_arc)
 #error CHCSVParser requires ARC.  If the rest of your project is non-ARC, add the "-fobjc-arc" compiler flag for this file.
 #endif
@@ -32,6 +48,50 @@
 NSString *const CHCSVErrorDomain = @"com.davedelong.csv";
 
 #define CHUNK_SIZE 512
+#define UTF8_CHUNK_SIZE (64 * 1024)
+#define UTF8_LOOKAHEAD 4
+// each byte read from a stream that isn't UTF-8 can become as many as three bytes, so this much always fits in a UTF8_CHUNK_SIZE
+#define TRANSCODE_CHUNK_SIZE (UTF8_CHUNK_SIZE / 3 - 4)
+#define MAPPED_STRING_MINIMUM_LENGTH 32
+#define MAPPED_DISCARD_SIZE (8 * 1024 * 1024)
+#define PARALLEL_CHUNK_SIZE (2 * 1024 * 1024)
+// how far a chunk may run past its end before the rest of the file is parsed sequentially instead
+#define PARALLEL_OVERRUN_LIMIT PARALLEL_CHUNK_SIZE
+#define RECORD_BATCH_SIZE 128
+// often enough for a progress bar, rarely enough to cost nothing
+#define STATISTICS_INTERVAL 0.1
+#define READ_AHEAD_MINIMUM_BUFFER_SIZE (1024 * 1024)
+#define READ_AHEAD_MAXIMUM_BUFFER_SIZE (16 * 1024 * 1024)
+// compressed input is always read ahead, into buffers of this size
+#define READ_AHEAD_BUFFER_SIZE (4 * 1024 * 1024)
+// one buffer being parsed, one waiting and one being filled
+#define READ_AHEAD_BUFFER_COUNT 3
+#define READ_AHEAD_INPUT_SIZE (256 * 1024)
+#define RECORD_INDEX_MAGIC "CHCSVIDX"
+#define RECORD_INDEX_VERSION 1
+// the magic number, then the version, interval, record count, file size, modification time (seconds and nanoseconds) and checkpoint count
+#define RECORD_INDEX_HEADER_SIZE (8 + 7 * sizeof(uint64_t))
+#define RECORD_CACHE_MAGIC "CHCSVRCC"
+#define RECORD_CACHE_VERSION 1
+// the version, file size, modification time (seconds and nanoseconds), delimiter, options, whether the first row holds the keys,
+// row count, column count and the length of the file's path
+#define RECORD_CACHE_HEADER_COUNT 10
+#define RECORD_CACHE_HEADER_SIZE (8 + RECORD_CACHE_HEADER_COUNT * sizeof(uint64_t))
+// each column's offset of its ends, offset of its bytes and length of its bytes
+#define RECORD_CACHE_COLUMN_SIZE (3 * sizeof(uint64_t))
+#define RECORD_CACHE_WRITE_SIZE (1024 * 1024)
+#define WRITER_BUFFER_SIZE (64 * 1024)
+// enough room for any single character in any encoding
+#define WRITER_MINIMUM_BUFFER_SIZE 16
+#define WRITER_MAXIMUM_PRECISION 17
+#define WRITER_MAXIMUM_TIMESTAMP_PRECISION 9
+// enough for DBL_MAX written out in full, with a sign, a decimal point and WRITER_MAXIMUM_PRECISION decimals
+#define FORMATTED_NUMBER_SIZE 352
+#define WRITER_BATCH_SIZE 1024
+// a table column stays dictionary-encoded while it has at most 65536 distinct values, and (once it has
+// TABLE_DICTIONARY_SAMPLE_SIZE fields) each value is used by TABLE_DICTIONARY_MINIMUM_REPETITION fields on average
+#define TABLE_DICTIONARY_SAMPLE_SIZE 4096
+#define TABLE_DICTIONARY_MINIMUM_REPETITION 4
 #define DOUBLE_QUOTE '"'
 #define COMMA ','
 #define OCTOTHORPE '#'
@@ -40,867 +100,6016 @@ NSString *const CHCSVErrorDomain = @"com.davedelong.csv";
 #define NULLCHAR '\0'
 
 @interface CHCSVParser ()
-@property (assign) NSUInteger totalBytesRead;
+@property (strong) CHCSVParserStatistics *statistics;
+- (BOOL)_loadMoreBytes;
+- (void)_publishStatistics;
 @end
 
-@implementation CHCSVParser {
-    NSInputStream *_stream;
-    NSStringEncoding _streamEncoding;
-    NSMutableData *_stringBuffer;
-    NSMutableString *_string;
-    NSCharacterSet *_validFieldCharacters;
-    
-    NSUInteger _nextIndex;
-    
-    NSInteger _fieldIndex;
-    NSRange _fieldRange;
-    NSMutableString *_sanitizedField;
-    
-    unichar _delimiter;
-    
-    NSError *_error;
-    
-    NSUInteger _currentRecord;
-    BOOL _cancelled;
-}
+#pragma mark - Mapped Files
 
-- (id)initWithCSVString:(NSString *)csv {
-    return [self initWithDelimitedString:csv delimiter:COMMA];
-}
+/**
+ *  A read-only mapping of a local file. The mapping lives until this object is deallocated.
+ */
+@interface _CHCSVMappedFile : NSObject
 
-- (instancetype)initWithDelimitedString:(NSString *)string delimiter:(unichar)delimiter {
-    NSInputStream *stream = [NSInputStream inputStreamWithData:[string dataUsingEncoding:NSUTF8StringEncoding]];
-    return [self initWithInputStream:stream usedEncoding:NULL delimiter:delimiter];
-}
+- (instancetype)initWithURL:(NSURL *)URL;
 
-- (instancetype)initWithContentsOfCSVURL:(NSURL *)csvURL {
-    return [self initWithContentsOfDelimitedURL:csvURL delimiter:COMMA];
-}
+@property (readonly) const uint8_t *bytes;
+@property (readonly) NSUInteger length;
+@property (readonly) struct timespec modificationTime;
 
-- (instancetype)initWithContentsOfDelimitedURL:(NSURL *)URL delimiter:(unichar)delimiter {
-    NSInputStream *stream = [NSInputStream inputStreamWithURL:URL];
-    return [self initWithInputStream:stream usedEncoding:NULL delimiter:delimiter];
-}
+@end
 
-- (id)initWithInputStream:(NSInputStream *)stream usedEncoding:(NSStringEncoding *)encoding delimiter:(unichar)delimiter {
-    NSParameterAssert(stream);
-    NSParameterAssert(delimiter);
-    NSAssert([[NSCharacterSet newlineCharacterSet] characterIsMember:delimiter] == NO, @"The field delimiter may not be a newline");
-    NSAssert(delimiter != DOUBLE_QUOTE, @"The field delimiter may not be a double quote");
+@implementation _CHCSVMappedFile
+
+- (instancetype)initWithURL:(NSURL *)URL {
+    if ([URL isFileURL] == NO) { return nil; }
     
     self = [super init];
     if (self) {
-        _stream = stream;
-        [_stream open];
-        
-        _stringBuffer = [[NSMutableData alloc] init];
-        _string = [[NSMutableString alloc] init];
+        int fd = open([[URL path] fileSystemRepresentation], O_RDONLY);
+        if (fd < 0) { return nil; }
         
-        _delimiter = delimiter;
-        
-        _nextIndex = 0;
-        _recognizesComments = NO;
-        _recognizesBackslashesAsEscapes = NO;
-        _sanitizesFields = NO;
-        _sanitizedField = [[NSMutableString alloc] init];
-        _trimsWhitespace = NO;
-        _recognizesLeadingEqualSign = NO;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || S_ISREG(info.st_mode) == 0 || info.st_size <= 0) {
+            close(fd);
+            return nil;
+        }
         
-        NSMutableCharacterSet *m = [[NSCharacterSet newlineCharacterSet] mutableCopy];
-        NSString *invalid = [NSString stringWithFormat:@"%c%C", DOUBLE_QUOTE, _delimiter];
-        [m addCharactersInString:invalid];
-        _validFieldCharacters = [m invertedSet];
+        void *bytes = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (bytes == MAP_FAILED) { return nil; }
         
-        if (encoding == NULL || *encoding == 0) {
-            // we need to determine the encoding
-            [self _sniffEncoding];
-            if (encoding) {
-                *encoding = _streamEncoding;
-            }
-        } else {
-            _streamEncoding = *encoding;
-        }
+        madvise(bytes, (size_t)info.st_size, MADV_SEQUENTIAL);
+        _bytes = bytes;
+        _length = (NSUInteger)info.st_size;
+        _modificationTime = info.st_mtimespec;
     }
     return self;
 }
 
 - (void)dealloc {
-    [_stream close];
+    if (_bytes != NULL) {
+        munmap((void *)_bytes, _length);
+    }
 }
 
-#pragma mark -
+@end
 
-- (void)setRecognizesBackslashesAsEscapes:(BOOL)recognizesBackslashesAsEscapes {
-    _recognizesBackslashesAsEscapes = recognizesBackslashesAsEscapes;
-    if (_delimiter == BACKSLASH && _recognizesBackslashesAsEscapes) {
-        [NSException raise:NSInternalInconsistencyException format:@"Cannot recognize backslashes as escapes when using '\\' as the delimiter"];
-    }
+// Strings created directly on top of a mapping retain an allocator that owns the _CHCSVMappedFile,
+// so the mapping stays valid for as long as any of them are alive.
+static const void *_CHCSVMappedFileRetain(const void *info) {
+    return CFRetain(info);
 }
 
-- (void)setRecognizesComments:(BOOL)recognizesComments {
-    _recognizesComments = recognizesComments;
-    if (_delimiter == OCTOTHORPE && _recognizesComments) {
-        [NSException raise:NSInternalInconsistencyException format:@"Cannot recognize comments when using '#' as the delimiter"];
-    }
+static void _CHCSVMappedFileRelease(const void *info) {
+    CFRelease(info);
 }
 
-- (void)setRecognizesLeadingEqualSign:(BOOL)recognizesLeadingEqualSign {
-    _recognizesLeadingEqualSign = recognizesLeadingEqualSign;
-    if (_delimiter == EQUAL && _recognizesLeadingEqualSign) {
-        [NSException raise:NSInternalInconsistencyException format:@"Cannot recognize leading equal sign when using '=' as the delimiter"];
+static void _CHCSVMappedFileDeallocate(void *ptr, void *info) {
+    // nothing to do; the mapping is released along with the allocator
+}
+
+#pragma mark - Record Indexes
+
+// where a record starts, as an offset from the start of the file
+typedef struct {
+    uint64_t record;
+    uint64_t offset;
+} _CHCSVRecordCheckpoint;
+
+static BOOL _CHCSVGetFileAttributes(NSURL *URL, uint64_t *size, struct timespec *modificationTime) {
+    struct stat info;
+    if ([URL isFileURL] == NO || stat([[URL path] fileSystemRepresentation], &info) != 0) { return NO; }
+    
+    *size = (uint64_t)info.st_size;
+    *modificationTime = info.st_mtimespec;
+    return YES;
+}
+
+NS_INLINE void _CHCSVAppendUInt64(NSMutableData *data, uint64_t value) {
+    value = NSSwapHostLongLongToLittle(value);
+    [data appendBytes:&value length:sizeof(value)];
+}
+
+NS_INLINE uint64_t _CHCSVReadUInt64(const uint8_t *bytes) {
+    uint64_t value = 0;
+    memcpy(&value, bytes, sizeof(value));
+    return NSSwapLittleLongLongToHost(value);
+}
+
+NS_INLINE void _CHCSVAppendUInt32(NSMutableData *data, uint32_t value) {
+    value = NSSwapHostIntToLittle(value);
+    [data appendBytes:&value length:sizeof(value)];
+}
+
+NS_INLINE uint32_t _CHCSVReadUInt32(const uint8_t *bytes) {
+    uint32_t value = 0;
+    memcpy(&value, bytes, sizeof(value));
+    return NSSwapLittleIntToHost(value);
+}
+
+// FNV-1a, which is all a checksum of a few hundred bytes (or a cache's name) needs
+NS_INLINE uint64_t _CHCSVChecksum(uint64_t checksum, const uint8_t *bytes, NSUInteger length) {
+    for (NSUInteger i = 0; i < length; i++) {
+        checksum = (checksum ^ bytes[i]) * 0x100000001B3ULL;
     }
+    return checksum;
 }
+#define CHCSV_CHECKSUM_SEED 0xCBF29CE484222325ULL
 
-#pragma mark -
+@interface CHCSVRecordIndex ()
 
-- (void)_sniffEncoding {
-    NSStringEncoding encoding = NSUTF8StringEncoding;
+- (instancetype)_initWithCheckpoints:(NSData *)checkpoints interval:(NSUInteger)interval recordCount:(NSUInteger)recordCount fileSize:(uint64_t)fileSize modificationTime:(struct timespec)modificationTime NS_DESIGNATED_INITIALIZER;
+- (BOOL)_isValidForFileSize:(uint64_t)fileSize modificationTime:(struct timespec)modificationTime;
+
+@end
+
+@implementation CHCSVRecordIndex {
+    // _CHCSVRecordCheckpoints, in order
+    NSData *_checkpoints;
+    NSUInteger _checkpointCount;
+    struct timespec _modificationTime;
+}
+
++ (instancetype)indexWithContentsOfURL:(NSURL *)indexURL forFileAtURL:(NSURL *)fileURL error:(NSError *__autoreleasing *)error {
+    NSData *data = [NSData dataWithContentsOfURL:indexURL options:0 error:error];
+    if (data == nil) { return nil; }
     
-    uint8_t bytes[CHUNK_SIZE];
-    NSInteger readLength = [_stream read:bytes maxLength:CHUNK_SIZE];
-    if (readLength > 0 && readLength <= CHUNK_SIZE) {
-        [_stringBuffer appendBytes:bytes length:readLength];
-        [self setTotalBytesRead:[self totalBytesRead] + readLength];
-        
-        NSInteger bomLength = 0;
-        
-        if (readLength > 3 && bytes[0] == 0x00 && bytes[1] == 0x00 && bytes[2] == 0xFE && bytes[3] == 0xFF) {
-            encoding = NSUTF32BigEndianStringEncoding;
-            bomLength = 4;
-        } else if (readLength > 3 && bytes[0] == 0xFF && bytes[1] == 0xFE && bytes[2] == 0x00 && bytes[3] == 0x00) {
-            encoding = NSUTF32LittleEndianStringEncoding;
-            bomLength = 4;
-        } else if (readLength > 3 && bytes[0] == 0x1B && bytes[1] == 0x24 && bytes[2] == 0x29 && bytes[3] == 0x43) {
-            encoding = CFStringConvertEncodingToNSStringEncoding(kCFStringEncodingISO_2022_KR);
-            bomLength = 4;
-        } else if (readLength > 1 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
-            encoding = NSUTF16BigEndianStringEncoding;
-            bomLength = 2;
-        } else if (readLength > 1 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
-            encoding = NSUTF16LittleEndianStringEncoding;
-            bomLength = 2;
-        } else if (readLength > 2 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
-            encoding = NSUTF8StringEncoding;
-            bomLength = 3;
-        } else {
-            NSString *bufferAsUTF8 = nil;
-            
-            for (NSInteger triedLength = 0; triedLength < 4; ++triedLength) {
-                bufferAsUTF8 = [[NSString alloc] initWithBytes:bytes length:readLength-triedLength encoding:NSUTF8StringEncoding];
-                if (bufferAsUTF8 != nil) {
-                    break;
-                }
-            }
-            
-            if (bufferAsUTF8 != nil) {
-                encoding = NSUTF8StringEncoding;
-            } else {
-                NSLog(@"unable to determine stream encoding; assuming MacOSRoman");
-                encoding = NSMacOSRomanStringEncoding;
-            }
-        }
-        
-        if (bomLength > 0) {
-            [_stringBuffer replaceBytesInRange:NSMakeRange(0, bomLength) withBytes:NULL length:0];
+    NSString *problem = nil;
+    CHCSVRecordIndex *index = [self _indexWithData:data];
+    if (index == nil) {
+        problem = @"The record index is damaged, or was written by an incompatible version.";
+    } else if ([index isValidForFileAtURL:fileURL] == NO) {
+        problem = @"The file has been modified since the record index was built.";
+    }
+    
+    if (problem != nil) {
+        if (error) {
+            *error = [NSError errorWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeInvalidIndex userInfo:@{NSLocalizedDescriptionKey: problem}];
         }
+        return nil;
     }
-    _streamEncoding = encoding;
+    return index;
 }
 
-- (void)_loadMoreIfNecessary {
-    NSUInteger stringLength = [_string length];
-    NSUInteger reloadPortion = stringLength / 3;
-    if (reloadPortion < 10) { reloadPortion = 10; }
++ (instancetype)_indexWithData:(NSData *)data {
+    const uint8_t *bytes = [data bytes];
+    NSUInteger length = [data length];
+    if (length < RECORD_INDEX_HEADER_SIZE || memcmp(bytes, RECORD_INDEX_MAGIC, 8) != 0) { return nil; }
     
-    if (_nextIndex+reloadPortion >= stringLength && [_stream hasBytesAvailable]) {
-        // read more from the stream
-        uint8_t buffer[CHUNK_SIZE];
-        NSInteger readBytes = [_stream read:buffer maxLength:CHUNK_SIZE];
-        if (readBytes > 0) {
-            // append it to the buffer
-            [_stringBuffer appendBytes:buffer length:readBytes];
-            [self setTotalBytesRead:[self totalBytesRead] + readBytes];
-        }
+    uint64_t header[7];
+    for (NSUInteger i = 0; i < 7; i++) {
+        header[i] = _CHCSVReadUInt64(bytes + 8 + i * sizeof(uint64_t));
+    }
+    uint64_t count = header[6];
+    if (header[0] != RECORD_INDEX_VERSION || header[1] == 0 || count > (length - RECORD_INDEX_HEADER_SIZE) / sizeof(_CHCSVRecordCheckpoint) ||
+        length != RECORD_INDEX_HEADER_SIZE + count * sizeof(_CHCSVRecordCheckpoint)) {
+        return nil;
     }
     
-    if ([_stringBuffer length] > 0) {
-        // try to turn the next portion of the buffer into a string
-        NSUInteger readLength = [_stringBuffer length];
-        while (readLength > 0) {
-            NSString *readString = [[NSString alloc] initWithBytes:[_stringBuffer bytes] length:readLength encoding:_streamEncoding];
-            if (readString == nil) {
-                readLength--;
-            } else {
-                [_string appendString:readString];
-                break;
-            }
-        };
-        
-        [_stringBuffer replaceBytesInRange:NSMakeRange(0, readLength) withBytes:NULL length:0];
+    NSMutableData *checkpoints = [NSMutableData dataWithLength:(NSUInteger)count * sizeof(_CHCSVRecordCheckpoint)];
+    _CHCSVRecordCheckpoint *checkpoint = [checkpoints mutableBytes];
+    const uint8_t *read = bytes + RECORD_INDEX_HEADER_SIZE;
+    uint64_t previousRecord = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        checkpoint[i].record = _CHCSVReadUInt64(read);
+        checkpoint[i].offset = _CHCSVReadUInt64(read + sizeof(uint64_t));
+        read += sizeof(_CHCSVRecordCheckpoint);
+        // the lookup relies on the records being in order, and the parser on the offsets being inside the file
+        if (checkpoint[i].record <= previousRecord || checkpoint[i].offset > header[3]) { return nil; }
+        previousRecord = checkpoint[i].record;
     }
+    
+    struct timespec modificationTime = { (time_t)header[4], (long)header[5] };
+    return [[self alloc] _initWithCheckpoints:checkpoints interval:(NSUInteger)header[1] recordCount:(NSUInteger)header[2] fileSize:header[3] modificationTime:modificationTime];
 }
 
-- (void)_advance {
-    [self _loadMoreIfNecessary];
-    _nextIndex++;
++ (NSURL *)sidecarURLForFileAtURL:(NSURL *)fileURL {
+    return [fileURL URLByAppendingPathExtension:@"chcsvindex"];
 }
 
-- (unichar)_peekCharacter {
-    [self _loadMoreIfNecessary];
-    if (_nextIndex >= [_string length]) { return NULLCHAR; }
-    
-    return [_string characterAtIndex:_nextIndex];
+- (instancetype)_initWithCheckpoints:(NSData *)checkpoints interval:(NSUInteger)interval recordCount:(NSUInteger)recordCount fileSize:(uint64_t)fileSize modificationTime:(struct timespec)modificationTime {
+    self = [super init];
+    if (self) {
+        _checkpoints = [checkpoints copy];
+        _checkpointCount = [_checkpoints length] / sizeof(_CHCSVRecordCheckpoint);
+        _recordInterval = interval;
+        _recordCount = recordCount;
+        _fileSize = fileSize;
+        _modificationTime = modificationTime;
+    }
+    return self;
 }
 
-- (unichar)_peekPeekCharacter {
-    [self _loadMoreIfNecessary];
-    NSUInteger nextNextIndex = _nextIndex+1;
-    if (nextNextIndex >= [_string length]) { return NULLCHAR; }
+- (BOOL)writeToURL:(NSURL *)indexURL error:(NSError *__autoreleasing *)error {
+    NSMutableData *data = [NSMutableData dataWithCapacity:RECORD_INDEX_HEADER_SIZE + [_checkpoints length]];
+    [data appendBytes:RECORD_INDEX_MAGIC length:8];
     
-    return [_string characterAtIndex:nextNextIndex];
+    uint64_t header[7] = { RECORD_INDEX_VERSION, _recordInterval, _recordCount, _fileSize, (uint64_t)_modificationTime.tv_sec, (uint64_t)_modificationTime.tv_nsec, _checkpointCount };
+    for (NSUInteger i = 0; i < 7; i++) {
+        _CHCSVAppendUInt64(data, header[i]);
+    }
+    
+    const _CHCSVRecordCheckpoint *checkpoints = [_checkpoints bytes];
+    for (NSUInteger i = 0; i < _checkpointCount; i++) {
+        _CHCSVAppendUInt64(data, checkpoints[i].record);
+        _CHCSVAppendUInt64(data, checkpoints[i].offset);
+    }
+    return [data writeToURL:indexURL options:NSDataWritingAtomic error:error];
 }
 
-#pragma mark -
+- (NSDate *)fileModificationDate {
+    return [NSDate dateWithTimeIntervalSince1970:(double)_modificationTime.tv_sec + (double)_modificationTime.tv_nsec / NSEC_PER_SEC];
+}
 
-- (void)parse {
-    @autoreleasepool {
-        [self _beginDocument];
-        
-        _currentRecord = 0;
-        while ([self _parseRecord]) {
-            ; // yep;
-        }
-        
-        if (_error != nil) {
-            [self _error];
+- (BOOL)getByteOffset:(unsigned long long *)offset recordNumber:(NSUInteger *)indexedRecord nearestToRecord:(NSUInteger)recordNumber {
+    const _CHCSVRecordCheckpoint *checkpoints = [_checkpoints bytes];
+    
+    // finds the first checkpoint past the record; the one before it is the nearest
+    NSUInteger low = 0;
+    NSUInteger high = _checkpointCount;
+    while (low < high) {
+        NSUInteger middle = low + (high - low) / 2;
+        if (checkpoints[middle].record <= recordNumber) {
+            low = middle + 1;
         } else {
-            [self _endDocument];
+            high = middle;
         }
     }
+    if (low == 0) { return NO; }
+    
+    if (offset) { *offset = checkpoints[low - 1].offset; }
+    if (indexedRecord) { *indexedRecord = (NSUInteger)checkpoints[low - 1].record; }
+    return YES;
 }
 
-- (void)cancelParsing {
-    _cancelled = YES;
+- (BOOL)isValidForFileAtURL:(NSURL *)fileURL {
+    uint64_t size = 0;
+    struct timespec modificationTime = { 0, 0 };
+    if (_CHCSVGetFileAttributes(fileURL, &size, &modificationTime) == NO) { return NO; }
+    return [self _isValidForFileSize:size modificationTime:modificationTime];
 }
 
-- (BOOL)_parseRecord {
-    while ([self _peekCharacter] == OCTOTHORPE && _recognizesComments) {
-        [self _parseComment];
+- (BOOL)_isValidForFileSize:(uint64_t)fileSize modificationTime:(struct timespec)modificationTime {
+    return (fileSize == _fileSize && modificationTime.tv_sec == _modificationTime.tv_sec && modificationTime.tv_nsec == _modificationTime.tv_nsec);
+}
+
+@end
+
+#pragma mark - Scan Summaries
+
+// What a scanning parser counts, in plain fields, as it finds the boundaries of records
+typedef struct {
+    NSUInteger commentCount;
+    NSUInteger maximumFieldLength;
+    // the number of records with each number of fields, indexed by the number of fields
+    NSUInteger *fieldCountHistogram;
+    NSUInteger histogramLength;
+} _CHCSVScanCounts;
+
+NS_INLINE void _CHCSVScanCountRecord(_CHCSVScanCounts *counts, NSUInteger fieldCount) {
+    if (fieldCount >= counts->histogramLength) {
+        NSUInteger length = MAX(fieldCount + 1, counts->histogramLength * 2);
+        counts->fieldCountHistogram = reallocf(counts->fieldCountHistogram, length * sizeof(NSUInteger));
+        memset(counts->fieldCountHistogram + counts->histogramLength, 0, (length - counts->histogramLength) * sizeof(NSUInteger));
+        counts->histogramLength = length;
     }
-    
-    if ([self _peekCharacter] != NULLCHAR) {
-        @autoreleasepool {
-            [self _beginRecord];
-            while (1) {
-                if (![self _parseField]) {
-                    break;
-                }
-                if (![self _parseDelimiter]) {
-                    break;
-                }
+    counts->fieldCountHistogram[fieldCount]++;
+}
+
+@interface CHCSVScanSummary ()
+
+- (instancetype)_initWithCounts:(const _CHCSVScanCounts *)counts recordCount:(NSUInteger)recordCount error:(NSError *)error errorRecordNumber:(NSUInteger)errorRecordNumber errorOffset:(unsigned long long)errorOffset NS_DESIGNATED_INITIALIZER;
+
+@end
+
+@implementation CHCSVScanSummary
+
+- (instancetype)_initWithCounts:(const _CHCSVScanCounts *)counts recordCount:(NSUInteger)recordCount error:(NSError *)error errorRecordNumber:(NSUInteger)errorRecordNumber errorOffset:(unsigned long long)errorOffset {
+    self = [super init];
+    if (self) {
+        _recordCount = recordCount;
+        _commentCount = counts->commentCount;
+        _maximumFieldLength = counts->maximumFieldLength;
+        _error = error;
+        _errorRecordNumber = errorRecordNumber;
+        _errorOffset = errorOffset;
+        
+        NSMutableDictionary *histogram = [NSMutableDictionary dictionary];
+        BOOL foundMinimum = NO;
+        for (NSUInteger fieldCount = 0; fieldCount < counts->histogramLength; fieldCount++) {
+            NSUInteger records = counts->fieldCountHistogram[fieldCount];
+            if (records == 0) { continue; }
+            
+            histogram[@(fieldCount)] = @(records);
+            if (foundMinimum == NO) {
+                _minimumFieldCount = fieldCount;
+                foundMinimum = YES;
             }
-            [self _endRecord];
+            _maximumFieldCount = fieldCount;
         }
+        _fieldCountHistogram = [histogram copy];
     }
-    
-    BOOL followedByNewline = [self _parseNewline];
-    return (followedByNewline && _error == nil && [self _peekCharacter] != NULLCHAR);
+    return self;
 }
 
-- (BOOL)_parseNewline {
+@end
+
+#pragma mark - Statistics
+
+// What a parser counts as it goes, in plain fields. Times are in mach_absolute_time() units.
+typedef struct {
+    unsigned long long bytesRead;
+    unsigned long long decodedLength;
+    NSUInteger recordCount;
+    NSUInteger fieldCount;
+    uint64_t startTime;
+    uint64_t endTime;
+    uint64_t readingTime;
+    uint64_t decodingTime;
+    uint64_t delegateTime;
+    NSUInteger peakBufferSize;
+    NSUInteger allocationCount;
+} _CHCSVParserCounts;
+
+typedef struct {
+    unsigned long long bytesWritten;
+    NSUInteger fieldCount;
+    uint64_t writingTime;
+    NSUInteger peakBufferSize;
+    NSUInteger allocationCount;
+} _CHCSVWriterCounts;
+
+static double _CHCSVSecondsPerTick(void) {
+    static double secondsPerTick = 0;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        secondsPerTick = (double)timebase.numer / timebase.denom / NSEC_PER_SEC;
+    });
+    return secondsPerTick;
+}
+
+NS_INLINE uint64_t _CHCSVStartTiming(BOOL measuresTime) {
+    return measuresTime ? mach_absolute_time() : 0;
+}
+
+NS_INLINE void _CHCSVEndTiming(BOOL measuresTime, uint64_t *time, uint64_t start) {
+    if (measuresTime) {
+        *time += mach_absolute_time() - start;
+    }
+}
+
+@interface CHCSVParserStatistics ()
+
+- (instancetype)_initWithCounts:(const _CHCSVParserCounts *)counts measuresTime:(BOOL)measuresTime NS_DESIGNATED_INITIALIZER;
+
+@end
+
+@implementation CHCSVParserStatistics
+
+- (instancetype)_initWithCounts:(const _CHCSVParserCounts *)counts measuresTime:(BOOL)measuresTime {
+    self = [super init];
+    if (self) {
+        double secondsPerTick = _CHCSVSecondsPerTick();
+        _bytesRead = counts->bytesRead;
+        _decodedLength = counts->decodedLength;
+        _recordCount = counts->recordCount;
+        _fieldCount = counts->fieldCount;
+        _peakBufferSize = counts->peakBufferSize;
+        _allocationCount = counts->allocationCount;
+        
+        if (counts->startTime != 0) {
+            uint64_t endTime = (counts->endTime != 0) ? counts->endTime : mach_absolute_time();
+            _elapsedTime = (endTime - counts->startTime) * secondsPerTick;
+        }
+        if (measuresTime) {
+            _readingTime = counts->readingTime * secondsPerTick;
+            _decodingTime = counts->decodingTime * secondsPerTick;
+            _delegateTime = counts->delegateTime * secondsPerTick;
+            _tokenizingTime = MAX(_elapsedTime - _readingTime - _decodingTime - _delegateTime, 0);
+        }
+    }
+    return self;
+}
+
+@end
+
+@interface CHCSVWriterStatistics ()
+
+- (instancetype)_initWithCounts:(const _CHCSVWriterCounts *)counts lineCount:(NSUInteger)lineCount NS_DESIGNATED_INITIALIZER;
+
+@end
+
+@implementation CHCSVWriterStatistics
+
+- (instancetype)_initWithCounts:(const _CHCSVWriterCounts *)counts lineCount:(NSUInteger)lineCount {
+    self = [super init];
+    if (self) {
+        _bytesWritten = counts->bytesWritten;
+        _lineCount = lineCount;
+        _fieldCount = counts->fieldCount;
+        _writingTime = counts->writingTime * _CHCSVSecondsPerTick();
+        _peakBufferSize = counts->peakBufferSize;
+        _allocationCount = counts->allocationCount;
+    }
+    return self;
+}
+
+@end
+
+#pragma mark - Reading Ahead
+
+/**
+ *  An input stream that reads another stream on a thread of its own, into a ring of large buffers, so that reading
+ *  (and decompressing) the input overlaps with parsing it. Bytes are handed out in the order the buffers were filled.
+ */
+@interface _CHCSVReadAheadStream : NSInputStream
+
+// the source stream must already be open. Its bytes are preceded by those in `prefix`, and inflated if `decompresses` is YES
+- (instancetype)initWithStream:(NSInputStream *)stream prefix:(NSData *)prefix bufferSize:(NSUInteger)bufferSize decompresses:(BOOL)decompresses;
+
+// the size of the buffers that are filled from now on
+- (void)setBufferSize:(NSUInteger)bufferSize;
+
+@end
+
+NS_INLINE BOOL _CHCSVIsGzipped(const uint8_t *bytes, NSUInteger length) {
+    return (length >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B);
+}
+
+@implementation _CHCSVReadAheadStream {
+    NSInputStream *_source;
+    NSData *_prefix;
+    NSUInteger _prefixOffset;
+    BOOL _decompresses;
+    
+    // buffers [_consumedCount, _filledCount) (modulo READ_AHEAD_BUFFER_COUNT) hold bytes that haven't been read yet;
+    // the reader thread fills the next one whenever there's room. Everything in this group is guarded by _condition
+    NSCondition *_condition;
+    NSUInteger _bufferSize;
+    uint8_t *_buffers[READ_AHEAD_BUFFER_COUNT];
+    NSUInteger _capacities[READ_AHEAD_BUFFER_COUNT];
+    NSUInteger _lengths[READ_AHEAD_BUFFER_COUNT];
+    NSUInteger _filledCount;
+    NSUInteger _consumedCount;
+    BOOL _readerFinished;
+    BOOL _closed;
+    NSError *_error;
+    
+    // only touched by whoever is reading from this stream
+    NSStreamStatus _status;
+    BOOL _holdsBuffer;
+    const uint8_t *_readBytes;
+    NSUInteger _readLength;
+    NSUInteger _readOffset;
+}
+
+- (instancetype)initWithStream:(NSInputStream *)stream prefix:(NSData *)prefix bufferSize:(NSUInteger)bufferSize decompresses:(BOOL)decompresses {
+    self = [super init];
+    if (self) {
+        _source = stream;
+        _prefix = [prefix copy];
+        _bufferSize = bufferSize;
+        _decompresses = decompresses;
+        _condition = [[NSCondition alloc] init];
+        _status = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    for (NSUInteger i = 0; i < READ_AHEAD_BUFFER_COUNT; i++) {
+        free(_buffers[i]);
+    }
+}
+
+- (void)open {
+    if (_status != NSStreamStatusNotOpen) { return; }
+    _status = NSStreamStatusOpen;
+    // the thread retains this stream until it's done with the source
+    [NSThread detachNewThreadSelector:@selector(_readInBackground) toTarget:self withObject:nil];
+}
+
+- (void)setBufferSize:(NSUInteger)bufferSize {
+    [_condition lock];
+    _bufferSize = bufferSize;
+    [_condition unlock];
+}
+
+- (void)close {
+    [_condition lock];
+    _closed = YES;
+    [_condition broadcast];
+    [_condition unlock];
+    // the reader thread may be blocked reading a source that has gone quiet (such as a socket); closing it makes the read return
+    [_source close];
+    _status = NSStreamStatusClosed;
+}
+
+- (NSStreamStatus)streamStatus {
+    return _status;
+}
+
+- (NSError *)streamError {
+    return (_status == NSStreamStatusError) ? _error : nil;
+}
+
+- (BOOL)hasBytesAvailable {
+    return (_status == NSStreamStatusOpen);
+}
+
+- (BOOL)getBuffer:(uint8_t **)buffer length:(NSUInteger *)len {
+    return NO;
+}
+
+- (id<NSStreamDelegate>)delegate { return nil; }
+- (void)setDelegate:(id<NSStreamDelegate>)delegate { }
+- (id)propertyForKey:(NSString *)key { return nil; }
+- (BOOL)setProperty:(id)property forKey:(NSString *)key { return NO; }
+- (void)scheduleInRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode { }
+- (void)removeFromRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode { }
+
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)maxLength {
+    if (_status == NSStreamStatusError) { return -1; }
+    if (_status != NSStreamStatusOpen) { return 0; }
+    
+    NSUInteger copied = 0;
+    while (copied < maxLength) {
+        if (_readOffset == _readLength) {
+            // hand back what's been copied so far, rather than waiting for the next buffer
+            if (copied > 0 || [self _takeNextBuffer] == NO) { break; }
+            continue;
+        }
+        NSUInteger length = MIN(maxLength - copied, _readLength - _readOffset);
+        memcpy(buffer + copied, _readBytes + _readOffset, length);
+        _readOffset += length;
+        copied += length;
+    }
+    
+    if (copied == 0 && _status == NSStreamStatusError) { return -1; }
+    return (NSInteger)copied;
+}
+
+- (BOOL)_takeNextBuffer {
+    [_condition lock];
+    if (_holdsBuffer) {
+        // the buffer that was just read can be filled again
+        _consumedCount++;
+        _holdsBuffer = NO;
+        [_condition broadcast];
+    }
+    while (_consumedCount == _filledCount && _readerFinished == NO) {
+        [_condition wait];
+    }
+    
+    BOOL available = (_consumedCount < _filledCount);
+    if (available) {
+        NSUInteger index = _consumedCount % READ_AHEAD_BUFFER_COUNT;
+        _readBytes = _buffers[index];
+        _readLength = _lengths[index];
+        _readOffset = 0;
+        _holdsBuffer = YES;
+    } else {
+        _status = (_error != nil) ? NSStreamStatusError : NSStreamStatusAtEnd;
+    }
+    [_condition unlock];
+    return available;
+}
+
+#pragma mark Reader Thread
+
+- (void)_readInBackground {
+    @autoreleasepool {
+        z_stream inflater;
+        memset(&inflater, 0, sizeof(inflater));
+        uint8_t *input = NULL;
+        // gzip files can be several compressed members, one after another; the input may only end between them
+        BOOL betweenMembers = NO;
+        // whether the compressed input that was last read is all the source had at the time
+        BOOL sourceCaughtUp = NO;
+        NSError *error = nil;
+        BOOL finished = NO;
+        
+        if (_decompresses) {
+            input = malloc(READ_AHEAD_INPUT_SIZE);
+            // a window size of 15, plus 32 to accept either a gzip or a zlib header
+            if (inflateInit2(&inflater, 15 + 32) != Z_OK) {
+                error = [self _damagedInputError];
+                finished = YES;
+            }
+        }
+        
+        while (finished == NO) {
+            [_condition lock];
+            while (_closed == NO && _filledCount - _consumedCount == READ_AHEAD_BUFFER_COUNT) {
+                [_condition wait];
+            }
+            BOOL closed = _closed;
+            NSUInteger index = _filledCount % READ_AHEAD_BUFFER_COUNT;
+            NSUInteger bufferSize = _bufferSize;
+            [_condition unlock];
+            if (closed) { break; }
+            
+            if (_capacities[index] != bufferSize) {
+                free(_buffers[index]);
+                _buffers[index] = malloc(bufferSize);
+                _capacities[index] = bufferSize;
+            }
+            uint8_t *buffer = _buffers[index];
+            NSUInteger length = 0;
+            
+            // A buffer is handed over as soon as the source has nothing more for now (a short read, or no bytes available),
+            // so that input arriving slowly (such as from a pipe or a socket) is parsed as it arrives rather than once a buffer is full.
+            BOOL caughtUp = NO;
+            while (length < bufferSize && finished == NO && caughtUp == NO) {
+                if (_decompresses == NO) {
+                    NSUInteger requested = bufferSize - length;
+                    NSInteger readLength = [self _readSource:buffer + length maxLength:requested];
+                    if (readLength > 0) {
+                        length += readLength;
+                        caughtUp = ((NSUInteger)readLength < requested || [_source hasBytesAvailable] == NO);
+                    } else {
+                        if (readLength < 0) { error = [_source streamError]; }
+                        finished = YES;
+                    }
+                    continue;
+                }
+                
+                if (inflater.avail_in == 0) {
+                    NSInteger readLength = [self _readSource:input maxLength:READ_AHEAD_INPUT_SIZE];
+                    if (readLength <= 0) {
+                        if (readLength < 0) {
+                            error = [_source streamError];
+                        } else if (betweenMembers == NO) {
+                            error = [self _damagedInputError];
+                        }
+                        finished = YES;
+                        continue;
+                    }
+                    inflater.next_in = input;
+                    inflater.avail_in = (uInt)readLength;
+                    sourceCaughtUp = ((NSUInteger)readLength < READ_AHEAD_INPUT_SIZE || [_source hasBytesAvailable] == NO);
+                }
+                if (betweenMembers) {
+                    inflateReset(&inflater);
+                    betweenMembers = NO;
+                }
+                
+                inflater.next_out = buffer + length;
+                inflater.avail_out = (uInt)(bufferSize - length);
+                int status = inflate(&inflater, Z_NO_FLUSH);
+                length = bufferSize - inflater.avail_out;
+                if (status == Z_STREAM_END) {
+                    betweenMembers = YES;
+                } else if (status != Z_OK && status != Z_BUF_ERROR) {
+                    error = [self _damagedInputError];
+                    finished = YES;
+                }
+                caughtUp = (inflater.avail_in == 0 && sourceCaughtUp && length > 0);
+            }
+            
+            [_condition lock];
+            if (length > 0) {
+                _lengths[index] = length;
+                _filledCount++;
+            }
+            if (finished) {
+                _error = error;
+                _readerFinished = YES;
+            }
+            [_condition broadcast];
+            [_condition unlock];
+        }
+        
+        if (_decompresses) {
+            inflateEnd(&inflater);
+            free(input);
+        }
+        [_source close];
+    }
+}
+
+- (NSInteger)_readSource:(uint8_t *)buffer maxLength:(NSUInteger)maxLength {
+    NSUInteger prefixLength = [_prefix length];
+    if (_prefixOffset < prefixLength) {
+        NSUInteger length = MIN(maxLength, prefixLength - _prefixOffset);
+        memcpy(buffer, (const uint8_t *)[_prefix bytes] + _prefixOffset, length);
+        _prefixOffset += length;
+        return (NSInteger)length;
+    }
+    return [_source read:buffer maxLength:maxLength];
+}
+
+- (NSError *)_damagedInputError {
+    return [NSError errorWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeInvalidFormat userInfo:@{NSLocalizedDescriptionKey : @"The compressed input is damaged or incomplete"}];
+}
+
+@end
+
+#pragma mark - UTF-8 Helpers
+
+NS_INLINE NSUInteger _CHCSVUTF8SequenceLength(uint8_t lead) {
+    if (lead < 0x80) { return 1; }
+    if (lead >= 0xF0) { return 4; }
+    if (lead >= 0xE0) { return 3; }
+    if (lead >= 0xC0) { return 2; }
+    return 1; // a stray continuation byte
+}
+
+// whether bytes are well-formed UTF-8: no stray continuation bytes, overlong forms, surrogates or scalars above U+10FFFF
+static BOOL _CHCSVIsValidUTF8(const uint8_t *bytes, NSUInteger length) {
+    NSUInteger i = 0;
+    while (i < length) {
+        uint8_t lead = bytes[i];
+        if (lead < 0x80) {
+            i++;
+            continue;
+        }
+        
+        NSUInteger sequenceLength = _CHCSVUTF8SequenceLength(lead);
+        if (lead < 0xC2 || lead > 0xF4 || sequenceLength > length - i) { return NO; }
+        uint8_t second = bytes[i + 1];
+        if ((lead == 0xE0 && second < 0xA0) || (lead == 0xED && second > 0x9F) || (lead == 0xF0 && second < 0x90) || (lead == 0xF4 && second > 0x8F)) { return NO; }
+        for (NSUInteger j = 1; j < sequenceLength; j++) {
+            if ((bytes[i + j] & 0xC0) != 0x80) { return NO; }
+        }
+        i += sequenceLength;
+    }
+    return YES;
+}
+
+// the UTF-8 length of the -[NSCharacterSet newlineCharacterSet] member at the start of bytes, or 0
+NS_INLINE NSUInteger _CHCSVUTF8NewlineLength(const uint8_t *bytes, NSUInteger available) {
+    if (available == 0) { return 0; }
+    uint8_t b = bytes[0];
+    if (b >= '\n' && b <= '\r') { return 1; }
+    if (b == 0xC2) {
+        // U+0085
+        return (available > 1 && bytes[1] == 0x85) ? 2 : 0;
+    }
+    if (b == 0xE2) {
+        // U+2028, U+2029
+        return (available > 2 && bytes[1] == 0x80 && (bytes[2] == 0xA8 || bytes[2] == 0xA9)) ? 3 : 0;
+    }
+    return 0;
+}
+
+// the UTF-8 length of the -[NSCharacterSet whitespaceCharacterSet] member at the start of bytes, or 0
+NS_INLINE NSUInteger _CHCSVUTF8WhitespaceLength(const uint8_t *bytes, NSUInteger available) {
+    if (available == 0) { return 0; }
+    uint8_t b = bytes[0];
+    if (b == ' ' || b == '\t') { return 1; }
+    if (b < 0xC2) { return 0; }
+    if (b == 0xC2) {
+        // U+00A0
+        return (available > 1 && bytes[1] == 0xA0) ? 2 : 0;
+    }
+    if (available < 3) { return 0; }
+    if (b == 0xE1) {
+        // U+1680
+        return (bytes[1] == 0x9A && bytes[2] == 0x80) ? 3 : 0;
+    }
+    if (b == 0xE2) {
+        // U+2000 - U+200A, U+202F, U+205F
+        if (bytes[1] == 0x80) { return ((bytes[2] >= 0x80 && bytes[2] <= 0x8A) || bytes[2] == 0xAF) ? 3 : 0; }
+        if (bytes[1] == 0x81) { return (bytes[2] == 0x9F) ? 3 : 0; }
+        return 0;
+    }
+    if (b == 0xE3) {
+        // U+3000
+        return (bytes[1] == 0x80 && bytes[2] == 0x80) ? 3 : 0;
+    }
+    return 0;
+}
+
+// the equivalent of trimming with -[NSCharacterSet whitespaceAndNewlineCharacterSet]
+static NSRange _CHCSVUTF8TrimmedRange(const uint8_t *bytes, NSRange range) {
+    NSUInteger start = range.location;
+    NSUInteger end = NSMaxRange(range);
+    while (start < end) {
+        NSUInteger length = _CHCSVUTF8WhitespaceLength(bytes + start, end - start);
+        if (length == 0) { length = _CHCSVUTF8NewlineLength(bytes + start, end - start); }
+        if (length == 0) { break; }
+        start += length;
+    }
+    while (end > start) {
+        // back up to the beginning of the last character
+        NSUInteger characterStart = end - 1;
+        while (characterStart > start && end - characterStart < 4 && (bytes[characterStart] & 0xC0) == 0x80) {
+            characterStart--;
+        }
+        NSUInteger length = _CHCSVUTF8WhitespaceLength(bytes + characterStart, end - characterStart);
+        if (length == 0) { length = _CHCSVUTF8NewlineLength(bytes + characterStart, end - characterStart); }
+        if (length == 0 || characterStart + length != end) { break; }
+        end = characterStart;
+    }
+    return NSMakeRange(start, end - start);
+}
+
+// Sanitizes a raw field (as the parser would have while parsing it) into `unescaped`, which must be at least `length` bytes.
+// Only the trimming, backslash and leading equal sign options are consulted. Returns the length of the sanitized field.
+static NSUInteger _CHCSVUnescapeField(const uint8_t *raw, NSUInteger length, CHCSVParserOptions options, uint8_t *unescaped) {
+    BOOL trims = !!(options & CHCSVParserOptionsTrimsWhitespace);
+    BOOL backslashes = !!(options & CHCSVParserOptionsRecognizesBackslashesAsEscapes);
+    NSUInteger index = 0;
+    NSUInteger unescapedLength = 0;
+    
+    // leading whitespace
+    while (index < length) {
+        NSUInteger whitespace = _CHCSVUTF8WhitespaceLength(raw + index, length - index);
+        if (whitespace == 0) { break; }
+        if (trims == NO) {
+            memcpy(unescaped + unescapedLength, raw + index, whitespace);
+            unescapedLength += whitespace;
+        }
+        index += whitespace;
+    }
+    
+    BOOL escaped = NO;
+    if (index < length && raw[index] == DOUBLE_QUOTE) {
+        escaped = YES;
+        index++;
+    } else if ((options & CHCSVParserOptionsRecognizesLeadingEqualSign) && index + 1 < length && raw[index] == EQUAL && raw[index + 1] == DOUBLE_QUOTE) {
+        escaped = YES;
+        index += 2;
+    }
+    
+    while (index < length) {
+        uint8_t byte = raw[index];
+        if (byte == BACKSLASH && backslashes) {
+            // a backslash at the very end escapes nothing
+            if (index + 1 < length) { unescaped[unescapedLength++] = raw[index + 1]; }
+            index += 2;
+        } else if (byte == DOUBLE_QUOTE && escaped) {
+            index++;
+            if (index < length && raw[index] == DOUBLE_QUOTE) {
+                unescaped[unescapedLength++] = DOUBLE_QUOTE;
+                index++;
+            } else {
+                // the closing quote; only whitespace can follow it
+                if (trims == NO) {
+                    memcpy(unescaped + unescapedLength, raw + index, length - index);
+                    unescapedLength += length - index;
+                }
+                break;
+            }
+        } else {
+            unescaped[unescapedLength++] = byte;
+            index++;
+        }
+    }
+    
+    if (escaped == NO && trims) {
+        NSRange trimmed = _CHCSVUTF8TrimmedRange(unescaped, NSMakeRange(0, unescapedLength));
+        memmove(unescaped, unescaped + trimmed.location, trimmed.length);
+        unescapedLength = trimmed.length;
+    }
+    return unescapedLength;
+}
+
+#pragma mark - Structural Scanning
+
+/**
+ *  Bitmasks of the structural bytes within a 64-byte block. Bit N corresponds to byte N of the block.
+ */
+typedef struct {
+    uint64_t delimiter;
+    uint64_t quote;
+    uint64_t newline; // \n, \v, \f, \r, and the lead bytes of U+0085, U+2028 and U+2029
+    uint64_t backslash;
+    uint64_t null;
+} _CHCSVBlockMasks;
+
+typedef NS_OPTIONS(NSUInteger, _CHCSVStructuralBytes) {
+    _CHCSVStructuralDelimiter = 1 << 0,
+    _CHCSVStructuralQuote = 1 << 1,
+    _CHCSVStructuralNewline = 1 << 2,
+    _CHCSVStructuralBackslash = 1 << 3
+};
+
+static void _CHCSVScanBlock(const uint8_t *bytes, uint8_t delimiter, _CHCSVBlockMasks *masks) {
+#if defined(__AVX2__)
+    const __m256i delimiters = _mm256_set1_epi8((char)delimiter);
+    const __m256i quotes = _mm256_set1_epi8(DOUBLE_QUOTE);
+    const __m256i backslashes = _mm256_set1_epi8(BACKSLASH);
+    const __m256i nulls = _mm256_setzero_si256();
+    const __m256i lineFeeds = _mm256_set1_epi8('\n');
+    const __m256i three = _mm256_set1_epi8(3);
+    const __m256i c2 = _mm256_set1_epi8((char)0xC2);
+    const __m256i e2 = _mm256_set1_epi8((char)0xE2);
+    
+    *masks = (_CHCSVBlockMasks){0};
+    for (int half = 0; half < 2; half++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + 32 * half));
+        // \n through \r are contiguous, so one unsigned range check covers them
+        __m256i fromLineFeed = _mm256_sub_epi8(v, lineFeeds);
+        __m256i newlines = _mm256_cmpeq_epi8(_mm256_min_epu8(fromLineFeed, three), fromLineFeed);
+        newlines = _mm256_or_si256(newlines, _mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, e2)));
+        
+        int shift = 32 * half;
+        masks->delimiter |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, delimiters)) << shift;
+        masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quotes)) << shift;
+        masks->newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(newlines) << shift;
+        masks->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslashes)) << shift;
+        masks->null |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nulls)) << shift;
+    }
+#elif defined(__SSE2__)
+    const __m128i delimiters = _mm_set1_epi8((char)delimiter);
+    const __m128i quotes = _mm_set1_epi8(DOUBLE_QUOTE);
+    const __m128i backslashes = _mm_set1_epi8(BACKSLASH);
+    const __m128i nulls = _mm_setzero_si128();
+    const __m128i lineFeeds = _mm_set1_epi8('\n');
+    const __m128i three = _mm_set1_epi8(3);
+    const __m128i c2 = _mm_set1_epi8((char)0xC2);
+    const __m128i e2 = _mm_set1_epi8((char)0xE2);
+    
+    *masks = (_CHCSVBlockMasks){0};
+    for (int quarter = 0; quarter < 4; quarter++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + 16 * quarter));
+        // \n through \r are contiguous, so one unsigned range check covers them
+        __m128i fromLineFeed = _mm_sub_epi8(v, lineFeeds);
+        __m128i newlines = _mm_cmpeq_epi8(_mm_min_epu8(fromLineFeed, three), fromLineFeed);
+        newlines = _mm_or_si128(newlines, _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, e2)));
+        
+        int shift = 16 * quarter;
+        masks->delimiter |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, delimiters)) << shift;
+        masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quotes)) << shift;
+        masks->newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(newlines) << shift;
+        masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslashes)) << shift;
+        masks->null |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nulls)) << shift;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t delimiters = vdupq_n_u8(delimiter);
+    const uint8x16_t quotes = vdupq_n_u8(DOUBLE_QUOTE);
+    const uint8x16_t backslashes = vdupq_n_u8(BACKSLASH);
+    const uint8x16_t lineFeeds = vdupq_n_u8('\n');
+    const uint8x16_t three = vdupq_n_u8(3);
+    const uint8x16_t c2 = vdupq_n_u8(0xC2);
+    const uint8x16_t e2 = vdupq_n_u8(0xE2);
+    const uint8x16_t bits = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+    
+    uint8x16_t d[4], q[4], n[4], b[4], z[4];
+    for (int quarter = 0; quarter < 4; quarter++) {
+        uint8x16_t v = vld1q_u8(bytes + 16 * quarter);
+        uint8x16_t newlines = vcleq_u8(vsubq_u8(v, lineFeeds), three);
+        newlines = vorrq_u8(newlines, vorrq_u8(vceqq_u8(v, c2), vceqq_u8(v, e2)));
+        
+        d[quarter] = vandq_u8(vceqq_u8(v, delimiters), bits);
+        q[quarter] = vandq_u8(vceqq_u8(v, quotes), bits);
+        n[quarter] = vandq_u8(newlines, bits);
+        b[quarter] = vandq_u8(vceqq_u8(v, backslashes), bits);
+        z[quarter] = vandq_u8(vceqzq_u8(v), bits);
+    }
+    // there's no movemask on NEON; fold the weighted lanes together with pairwise adds instead
+#define _CHCSV_NEON_MOVEMASK(_m) ({ \
+    uint8x16_t _sum = vpaddq_u8(vpaddq_u8(_m[0], _m[1]), vpaddq_u8(_m[2], _m[3])); \
+    _sum = vpaddq_u8(_sum, _sum); \
+    vgetq_lane_u64(vreinterpretq_u64_u8(_sum), 0); \
+})
+    masks->delimiter = _CHCSV_NEON_MOVEMASK(d);
+    masks->quote = _CHCSV_NEON_MOVEMASK(q);
+    masks->newline = _CHCSV_NEON_MOVEMASK(n);
+    masks->backslash = _CHCSV_NEON_MOVEMASK(b);
+    masks->null = _CHCSV_NEON_MOVEMASK(z);
+#undef _CHCSV_NEON_MOVEMASK
+#else
+    *masks = (_CHCSVBlockMasks){0};
+    for (NSUInteger i = 0; i < 64; i++) {
+        uint8_t byte = bytes[i];
+        uint64_t bit = 1ULL << i;
+        if (byte == delimiter) { masks->delimiter |= bit; }
+        if (byte == DOUBLE_QUOTE) { masks->quote |= bit; }
+        if ((byte >= '\n' && byte <= '\r') || byte == 0xC2 || byte == 0xE2) { masks->newline |= bit; }
+        if (byte == BACKSLASH) { masks->backslash |= bit; }
+        if (byte == NULLCHAR) { masks->null |= bit; }
+    }
+#endif
+}
+
+// bit N of the result is the parity of bits 0...N of the input
+NS_INLINE uint64_t _CHCSVPrefixXOR(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+NS_INLINE NSString *_CHCSVUTF8String(const uint8_t *bytes, NSUInteger length) {
+    NSString *string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+    if (string == nil) {
+        // malformed UTF-8; map the bytes one-to-one rather than dropping the field
+        string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSISOLatin1StringEncoding];
+    }
+    return string;
+}
+
+// If `deallocator` is non-NULL, the bytes are part of a mapped file, and long strings are made without copying them
+NS_INLINE NSString *_CHCSVMappedString(const uint8_t *bytes, NSUInteger length, CFAllocatorRef deallocator) {
+    if (deallocator != NULL && length >= MAPPED_STRING_MINIMUM_LENGTH) {
+        // short strings are cheaper to copy (they often don't need an allocation at all)
+        CFStringRef string = CFStringCreateWithBytesNoCopy(kCFAllocatorDefault, bytes, length, kCFStringEncodingUTF8, false, deallocator);
+        if (string != NULL) {
+            return CFBridgingRelease(string);
+        }
+    }
+    return _CHCSVUTF8String(bytes, length);
+}
+
+#pragma mark - Transcoding
+
+typedef NS_ENUM(NSUInteger, _CHCSVSourceEncoding) {
+    _CHCSVSourceEncodingUTF16LittleEndian,
+    _CHCSVSourceEncodingUTF16BigEndian,
+    _CHCSVSourceEncodingUTF32LittleEndian,
+    _CHCSVSourceEncodingUTF32BigEndian,
+    _CHCSVSourceEncodingSingleByte
+};
+
+/**
+ *  Converts a stream in another encoding to UTF-8 as it is read, so that the byte parser can parse it.
+ *  A code unit that is split between two reads, and the first half of a surrogate pair, are carried over to the next read.
+ */
+typedef struct {
+    _CHCSVSourceEncoding source;
+    NSUInteger unitLength;
+    uint8_t carried[4];
+    NSUInteger carriedLength;
+    uint32_t highSurrogate;
+    // for single-byte encodings, the UTF-8 sequence of every byte: its length, followed by up to 3 bytes
+    uint8_t (*singleByteTable)[4];
+} _CHCSVTranscoder;
+
+NS_INLINE uint8_t *_CHCSVEncodeUTF8(uint32_t scalar, uint8_t *output) {
+    if (scalar < 0x80) {
+        *output++ = (uint8_t)scalar;
+    } else if (scalar < 0x800) {
+        *output++ = (uint8_t)(0xC0 | (scalar >> 6));
+        *output++ = (uint8_t)(0x80 | (scalar & 0x3F));
+    } else if (scalar < 0x10000) {
+        *output++ = (uint8_t)(0xE0 | (scalar >> 12));
+        *output++ = (uint8_t)(0x80 | ((scalar >> 6) & 0x3F));
+        *output++ = (uint8_t)(0x80 | (scalar & 0x3F));
+    } else {
+        *output++ = (uint8_t)(0xF0 | (scalar >> 18));
+        *output++ = (uint8_t)(0x80 | ((scalar >> 12) & 0x3F));
+        *output++ = (uint8_t)(0x80 | ((scalar >> 6) & 0x3F));
+        *output++ = (uint8_t)(0x80 | (scalar & 0x3F));
+    }
+    return output;
+}
+
+static BOOL _CHCSVTranscoderInit(_CHCSVTranscoder *transcoder, NSStringEncoding encoding) {
+    *transcoder = (_CHCSVTranscoder){0};
+    if (encoding == NSUTF16LittleEndianStringEncoding) {
+        transcoder->source = _CHCSVSourceEncodingUTF16LittleEndian;
+        transcoder->unitLength = 2;
+    } else if (encoding == NSUTF16BigEndianStringEncoding) {
+        transcoder->source = _CHCSVSourceEncodingUTF16BigEndian;
+        transcoder->unitLength = 2;
+    } else if (encoding == NSUTF32LittleEndianStringEncoding) {
+        transcoder->source = _CHCSVSourceEncodingUTF32LittleEndian;
+        transcoder->unitLength = 4;
+    } else if (encoding == NSUTF32BigEndianStringEncoding) {
+        transcoder->source = _CHCSVSourceEncodingUTF32BigEndian;
+        transcoder->unitLength = 4;
+    } else {
+        // any encoding with one byte per character can be looked up in a table
+        CFStringEncoding cfEncoding = CFStringConvertNSStringEncodingToEncoding(encoding);
+        if (cfEncoding == kCFStringEncodingInvalidId || CFStringGetMaximumSizeForEncoding(1, cfEncoding) != 1) { return NO; }
+        
+        transcoder->source = _CHCSVSourceEncodingSingleByte;
+        transcoder->unitLength = 1;
+        transcoder->singleByteTable = malloc(256 * sizeof(*transcoder->singleByteTable));
+        for (NSUInteger byte = 0; byte < 256; byte++) {
+            uint8_t *sequence = transcoder->singleByteTable[byte];
+            uint8_t character = (uint8_t)byte;
+            CFIndex used = 0;
+            CFStringRef string = CFStringCreateWithBytes(kCFAllocatorDefault, &character, 1, cfEncoding, false);
+            if (string != NULL) {
+                if (CFStringGetLength(string) == 1) {
+                    CFStringGetBytes(string, CFRangeMake(0, 1), kCFStringEncodingUTF8, 0, false, sequence + 1, 3, &used);
+                }
+                CFRelease(string);
+            }
+            if (used == 0) {
+                // a byte that doesn't stand for anything becomes U+FFFD REPLACEMENT CHARACTER
+                used = _CHCSVEncodeUTF8(0xFFFD, sequence + 1) - (sequence + 1);
+            }
+            sequence[0] = (uint8_t)used;
+        }
+
+        // runs of bytes below 0x80 are copied without the table, and the byte parser looks for ASCII delimiters and
+        // quotes, so an encoding that doesn't keep ASCII where it is (such as EBCDIC) is read as an NSString instead
+        for (NSUInteger byte = 0; byte < 0x80; byte++) {
+            if (transcoder->singleByteTable[byte][0] != 1 || transcoder->singleByteTable[byte][1] != byte) {
+                free(transcoder->singleByteTable);
+                transcoder->singleByteTable = NULL;
+                return NO;
+            }
+        }
+    }
+    return YES;
+}
+
+NS_INLINE uint32_t _CHCSVReadUnit(const _CHCSVTranscoder *transcoder, const uint8_t *bytes) {
+    switch (transcoder->source) {
+        case _CHCSVSourceEncodingUTF16LittleEndian: return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8);
+        case _CHCSVSourceEncodingUTF16BigEndian: return ((uint32_t)bytes[0] << 8) | (uint32_t)bytes[1];
+        case _CHCSVSourceEncodingUTF32LittleEndian: return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+        case _CHCSVSourceEncodingUTF32BigEndian: return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+        case _CHCSVSourceEncodingSingleByte: return bytes[0];
+    }
+    return 0;
+}
+
+NS_INLINE uint8_t *_CHCSVTranscodeUnit(_CHCSVTranscoder *transcoder, uint32_t unit, uint8_t *output) {
+    if (transcoder->source == _CHCSVSourceEncodingSingleByte) {
+        const uint8_t *sequence = transcoder->singleByteTable[unit];
+        memcpy(output, sequence + 1, 3);
+        return output + sequence[0];
+    }
+    
+    if (transcoder->highSurrogate != 0) {
+        uint32_t highSurrogate = transcoder->highSurrogate;
+        transcoder->highSurrogate = 0;
+        if (unit >= 0xDC00 && unit <= 0xDFFF) {
+            return _CHCSVEncodeUTF8(0x10000 + ((highSurrogate - 0xD800) << 10) + (unit - 0xDC00), output);
+        }
+        output = _CHCSVEncodeUTF8(0xFFFD, output);
+    }
+    
+    if (unit >= 0xD800 && unit <= 0xDBFF && transcoder->unitLength == 2) {
+        transcoder->highSurrogate = unit;
+        return output;
+    }
+    if ((unit >= 0xD800 && unit <= 0xDFFF) || unit > 0x10FFFF) {
+        // unpaired surrogates and values beyond Unicode become U+FFFD REPLACEMENT CHARACTER
+        unit = 0xFFFD;
+    }
+    return _CHCSVEncodeUTF8(unit, output);
+}
+
+// Converts up to 8 ASCII characters at once, and returns how many bytes of input were consumed (0 if they weren't all ASCII).
+// `input` must have at least 16 bytes.
+NS_INLINE NSUInteger _CHCSVTranscodeASCII(const _CHCSVTranscoder *transcoder, const uint8_t *input, uint8_t *output) {
+    switch (transcoder->source) {
+        case _CHCSVSourceEncodingUTF16LittleEndian:
+        case _CHCSVSourceEncodingUTF16BigEndian: {
+            BOOL bigEndian = (transcoder->source == _CHCSVSourceEncodingUTF16BigEndian);
+#if defined(__SSE2__)
+            __m128i units = _mm_loadu_si128((const __m128i *)input);
+            if (bigEndian) {
+                units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+            }
+            __m128i nonASCII = _mm_and_si128(units, _mm_set1_epi16((short)0xFF80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonASCII, _mm_setzero_si128())) != 0xFFFF) { return 0; }
+            _mm_storel_epi64((__m128i *)output, _mm_packus_epi16(units, units));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+            uint8x16_t bytes = vld1q_u8(input);
+            if (bigEndian) {
+                bytes = vrev16q_u8(bytes);
+            }
+            uint16x8_t units = vreinterpretq_u16_u8(bytes);
+            if (vmaxvq_u16(units) >= 0x80) { return 0; }
+            vst1_u8(output, vmovn_u16(units));
+#else
+            uint64_t words[2];
+            memcpy(words, input, 16);
+            uint64_t nonASCII = bigEndian ? 0x80FF80FF80FF80FFULL : 0xFF80FF80FF80FF80ULL;
+            if (((words[0] | words[1]) & nonASCII) != 0) { return 0; }
+            for (NSUInteger i = 0; i < 8; i++) {
+                output[i] = input[2 * i + (bigEndian ? 1 : 0)];
+            }
+#endif
+            return 16;
+        }
+        case _CHCSVSourceEncodingUTF32LittleEndian:
+        case _CHCSVSourceEncodingUTF32BigEndian: {
+            BOOL bigEndian = (transcoder->source == _CHCSVSourceEncodingUTF32BigEndian);
+            uint64_t words[2];
+            memcpy(words, input, 16);
+            uint64_t nonASCII = bigEndian ? 0x80FFFFFF80FFFFFFULL : 0xFFFFFF80FFFFFF80ULL;
+            if (((words[0] | words[1]) & nonASCII) != 0) { return 0; }
+            for (NSUInteger i = 0; i < 4; i++) {
+                output[i] = input[4 * i + (bigEndian ? 3 : 0)];
+            }
+            return 16;
+        }
+        case _CHCSVSourceEncodingSingleByte: {
+            uint64_t words[2];
+            memcpy(words, input, 16);
+            if (((words[0] | words[1]) & 0x8080808080808080ULL) != 0) { return 0; }
+            memcpy(output, input, 16);
+            return 16;
+        }
+    }
+    return 0;
+}
+
+// Converts `length` bytes of input to UTF-8, and returns the number of bytes written to `output`,
+// which must have room for 3 * (length + 4) bytes
+static NSUInteger _CHCSVTranscode(_CHCSVTranscoder *transcoder, const uint8_t *input, NSUInteger length, uint8_t *output) {
+    uint8_t *start = output;
+    NSUInteger unitLength = transcoder->unitLength;
+    
+    // finish the code unit that was split by the previous read
+    if (transcoder->carriedLength > 0) {
+        NSUInteger needed = MIN(unitLength - transcoder->carriedLength, length);
+        memcpy(transcoder->carried + transcoder->carriedLength, input, needed);
+        transcoder->carriedLength += needed;
+        input += needed;
+        length -= needed;
+        if (transcoder->carriedLength < unitLength) { return 0; }
+        
+        output = _CHCSVTranscodeUnit(transcoder, _CHCSVReadUnit(transcoder, transcoder->carried), output);
+        transcoder->carriedLength = 0;
+    }
+    
+    const uint8_t *end = input + length;
+    while (input + unitLength <= end) {
+        if (end - input >= 16 && transcoder->highSurrogate == 0) {
+            NSUInteger consumed = _CHCSVTranscodeASCII(transcoder, input, output);
+            if (consumed > 0) {
+                input += consumed;
+                output += consumed / unitLength;
+                continue;
+            }
+        }
+        // these units aren't all ASCII, so they are converted one at a time
+        for (NSUInteger i = 0; i < 16 / unitLength && input + unitLength <= end; i++) {
+            output = _CHCSVTranscodeUnit(transcoder, _CHCSVReadUnit(transcoder, input), output);
+            input += unitLength;
+        }
+    }
+    
+    transcoder->carriedLength = (NSUInteger)(end - input);
+    memcpy(transcoder->carried, input, transcoder->carriedLength);
+    return (NSUInteger)(output - start);
+}
+
+// Flushes anything left over once the input has ended, which can only be an incomplete character
+static NSUInteger _CHCSVTranscoderFinish(_CHCSVTranscoder *transcoder, uint8_t *output) {
+    if (transcoder->carriedLength == 0 && transcoder->highSurrogate == 0) { return 0; }
+    
+    transcoder->carriedLength = 0;
+    transcoder->highSurrogate = 0;
+    return (NSUInteger)(_CHCSVEncodeUTF8(0xFFFD, output) - output);
+}
+
+#pragma mark - Field Conversion
+
+NS_INLINE size_t _CHCSVColumnValueSize(CHCSVColumnType type) {
+    switch (type) {
+        case CHCSVColumnTypeInt64: return sizeof(int64_t);
+        case CHCSVColumnTypeDouble: return sizeof(double);
+        case CHCSVColumnTypeUTF8: return sizeof(CHCSVFieldSpan);
+        case CHCSVColumnTypeBoolean: return sizeof(BOOL);
+        case CHCSVColumnTypeTimestamp: return sizeof(double);
+    }
+    return 0;
+}
+
+// an optionally-signed decimal integer, and nothing else
+static BOOL _CHCSVParseInt64(const uint8_t *bytes, NSUInteger length, int64_t *value) {
+    const uint8_t *end = bytes + length;
+    
+    BOOL negative = NO;
+    if (bytes < end && (*bytes == '-' || *bytes == '+')) {
+        negative = (*bytes == '-');
+        bytes++;
+    }
+    if (bytes == end) { return NO; }
+    
+    // accumulate negatively, so that INT64_MIN can be represented
+    int64_t result = 0;
+    for (; bytes < end; bytes++) {
+        if (*bytes < '0' || *bytes > '9') { return NO; }
+        int digit = *bytes - '0';
+        if (result < (INT64_MIN + digit) / 10) { return NO; }
+        result = result * 10 - digit;
+    }
+    if (negative == NO) {
+        if (result == INT64_MIN) { return NO; }
+        result = -result;
+    }
+    
+    *value = result;
+    return YES;
+}
+
+// Numbers with at most 19 significant digits and a small enough exponent need a single multiplication or division
+// by an exact power of 10, which is correctly rounded, so the result is the same as strtod's (Clinger's fast path).
+// Returns NO if the number isn't one of those (even if it is a number).
+static BOOL _CHCSVParseSimpleDouble(const uint8_t *bytes, NSUInteger length, double *value) {
+    static const double powersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const NSInteger maximumPower = (NSInteger)(sizeof(powersOf10) / sizeof(powersOf10[0])) - 1;
+    const uint8_t *end = bytes + length;
+    
+    BOOL negative = NO;
+    if (bytes < end && (*bytes == '-' || *bytes == '+')) {
+        negative = (*bytes == '-');
+        bytes++;
+    }
+    
+    uint64_t mantissa = 0;
+    NSInteger significantDigits = 0;
+    NSInteger exponent = 0;
+    BOOL hasDigits = NO;
+    BOOL inFraction = NO;
+    for (; bytes < end; bytes++) {
+        if (*bytes == '.' && inFraction == NO) {
+            inFraction = YES;
+            continue;
+        }
+        if (*bytes < '0' || *bytes > '9') { break; }
+        
+        hasDigits = YES;
+        if (inFraction) { exponent--; }
+        // leading zeros aren't significant
+        if (mantissa == 0 && *bytes == '0') { continue; }
+        if (significantDigits == 19) { return NO; }
+        mantissa = mantissa * 10 + (uint64_t)(*bytes - '0');
+        significantDigits++;
+    }
+    if (hasDigits == NO) { return NO; }
+    
+    if (bytes < end && (*bytes == 'e' || *bytes == 'E')) {
+        bytes++;
+        BOOL negativeExponent = NO;
+        if (bytes < end && (*bytes == '-' || *bytes == '+')) {
+            negativeExponent = (*bytes == '-');
+            bytes++;
+        }
+        if (bytes == end) { return NO; }
+        
+        NSInteger explicitExponent = 0;
+        for (; bytes < end && *bytes >= '0' && *bytes <= '9'; bytes++) {
+            // anything this large is out of range anyway
+            if (explicitExponent < 100000) { explicitExponent = explicitExponent * 10 + (*bytes - '0'); }
+        }
+        exponent += negativeExponent ? -explicitExponent : explicitExponent;
+    }
+    if (bytes != end) { return NO; }
+    
+    double result = (double)mantissa;
+    if (mantissa == 0) {
+        result = 0;
+    } else if (mantissa > (1ULL << 53)) {
+        return NO;
+    } else if (exponent >= 0 && exponent <= maximumPower) {
+        result *= powersOf10[exponent];
+    } else if (exponent < 0 && -exponent <= maximumPower) {
+        result /= powersOf10[-exponent];
+    } else {
+        return NO;
+    }
+    
+    *value = negative ? -result : result;
+    return YES;
+}
+
+// a number, as understood by strtod in the "C" locale, and nothing else
+static BOOL _CHCSVParseDouble(const uint8_t *bytes, NSUInteger length, double *value) {
+    // strtod skips leading whitespace, which would not be the entire field
+    if (length == 0 || _CHCSVUTF8WhitespaceLength(bytes, length) > 0 || _CHCSVUTF8NewlineLength(bytes, length) > 0) { return NO; }
+    if (_CHCSVParseSimpleDouble(bytes, length, value)) { return YES; }
+    
+    // strtod needs a NUL-terminated copy
+    char small[64];
+    char *terminated = (length < sizeof(small)) ? small : malloc(length + 1);
+    memcpy(terminated, bytes, length);
+    terminated[length] = NULLCHAR;
+    
+    char *end = NULL;
+    double result = strtod_l(terminated, &end, NULL);
+    BOOL parsed = (end == terminated + length);
+    if (terminated != small) { free(terminated); }
+    
+    if (parsed) { *value = result; }
+    return parsed;
+}
+
+static BOOL _CHCSVParseBoolean(const uint8_t *bytes, NSUInteger length, BOOL *value) {
+    static const struct { const char *name; BOOL value; } names[] = {
+        { "true", YES }, { "false", NO }, { "yes", YES }, { "no", NO }, { "1", YES }, { "0", NO }
+    };
+    for (NSUInteger i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i].name) == length && strncasecmp_l((const char *)bytes, names[i].name, length, NULL) == 0) {
+            *value = names[i].value;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// reads exactly `count` decimal digits
+NS_INLINE BOOL _CHCSVReadDigits(const uint8_t **bytes, const uint8_t *end, NSUInteger count, NSInteger *value) {
+    if ((NSUInteger)(end - *bytes) < count) { return NO; }
+    NSInteger result = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        uint8_t digit = (*bytes)[i];
+        if (digit < '0' || digit > '9') { return NO; }
+        result = result * 10 + (digit - '0');
+    }
+    *bytes += count;
+    *value = result;
+    return YES;
+}
+
+NS_INLINE BOOL _CHCSVReadByte(const uint8_t **bytes, const uint8_t *end, uint8_t byte) {
+    if (*bytes == end || **bytes != byte) { return NO; }
+    (*bytes)++;
+    return YES;
+}
+
+NS_INLINE BOOL _CHCSVIsLeapYear(int64_t year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+// the number of days from 1970-01-01 to a date in the proleptic Gregorian calendar
+// (Howard Hinnant's days_from_civil)
+NS_INLINE int64_t _CHCSVDaysFromCivil(int64_t year, int64_t month, int64_t day) {
+    year -= (month <= 2);
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+// the inverse of _CHCSVDaysFromCivil
+NS_INLINE void _CHCSVCivilFromDays(int64_t days, int64_t *year, int64_t *month, int64_t *day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t dayOfEra = days - era * 146097;
+    int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int64_t shiftedMonth = (5 * dayOfYear + 2) / 153;
+    *day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+    *month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+    *year = yearOfEra + era * 400 + (*month <= 2);
+}
+
+// a fixed-format ISO 8601 date or date and time, as the number of seconds since 1970-01-01 00:00:00 UTC
+static BOOL _CHCSVParseTimestamp(const uint8_t *bytes, NSUInteger length, double *value) {
+    static const NSInteger daysInMonth[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    static const double powersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+    const uint8_t *end = bytes + length;
+    
+    NSInteger year = 0, month = 0, day = 0;
+    if (_CHCSVReadDigits(&bytes, end, 4, &year) == NO || _CHCSVReadByte(&bytes, end, '-') == NO ||
+        _CHCSVReadDigits(&bytes, end, 2, &month) == NO || _CHCSVReadByte(&bytes, end, '-') == NO ||
+        _CHCSVReadDigits(&bytes, end, 2, &day) == NO) {
+        return NO;
+    }
+    if (month < 1 || month > 12) { return NO; }
+    if (day < 1 || day > daysInMonth[month - 1] + (month == 2 && _CHCSVIsLeapYear(year))) { return NO; }
+    
+    NSInteger hour = 0, minute = 0, second = 0, offset = 0;
+    double fraction = 0;
+    if (bytes < end) {
+        if (*bytes != 'T' && *bytes != 't' && *bytes != ' ') { return NO; }
+        bytes++;
+        if (_CHCSVReadDigits(&bytes, end, 2, &hour) == NO || _CHCSVReadByte(&bytes, end, ':') == NO ||
+            _CHCSVReadDigits(&bytes, end, 2, &minute) == NO) {
+            return NO;
+        }
+        if (_CHCSVReadByte(&bytes, end, ':')) {
+            if (_CHCSVReadDigits(&bytes, end, 2, &second) == NO) { return NO; }
+            if (_CHCSVReadByte(&bytes, end, '.')) {
+                // digits past what a double can hold are still allowed, but ignored
+                int64_t numerator = 0;
+                NSInteger digits = 0;
+                const uint8_t *start = bytes;
+                for (; bytes < end && *bytes >= '0' && *bytes <= '9'; bytes++) {
+                    if (digits < 15) {
+                        numerator = numerator * 10 + (*bytes - '0');
+                        digits++;
+                    }
+                }
+                if (bytes == start) { return NO; }
+                fraction = (double)numerator / powersOf10[digits];
+            }
+        }
+        if (hour > 23 || minute > 59 || second > 59) { return NO; }
+        
+        if (bytes < end) {
+            if (*bytes == 'Z' || *bytes == 'z') {
+                bytes++;
+            } else if (*bytes == '+' || *bytes == '-') {
+                NSInteger sign = (*bytes == '-') ? -1 : 1;
+                bytes++;
+                NSInteger offsetHours = 0, offsetMinutes = 0;
+                if (_CHCSVReadDigits(&bytes, end, 2, &offsetHours) == NO) { return NO; }
+                if (bytes < end) {
+                    (void)_CHCSVReadByte(&bytes, end, ':');
+                    if (_CHCSVReadDigits(&bytes, end, 2, &offsetMinutes) == NO) { return NO; }
+                }
+                if (offsetHours > 23 || offsetMinutes > 59) { return NO; }
+                offset = sign * (offsetHours * 3600 + offsetMinutes * 60);
+            }
+            if (bytes != end) { return NO; }
+        }
+    }
+    
+    int64_t seconds = _CHCSVDaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offset;
+    *value = (double)seconds + fraction;
+    return YES;
+}
+
+#pragma mark - Record Batches
+
+// a column in CHCSVParser.columnTypes, and which of a (projected) record's fields is in it
+typedef struct {
+    NSUInteger column;
+    NSUInteger position;
+    CHCSVColumnType type;
+} _CHCSVTypedColumn;
+
+typedef struct {
+    _CHCSVTypedColumn typedColumn;
+    void *values;
+    BOOL *nulls;
+} _CHCSVConvertedColumn;
+
+typedef struct {
+    NSUInteger record;
+    NSUInteger field;
+    const _CHCSVTypedColumn *typedColumn;
+} _CHCSVConversionFailure;
+
+@interface CHCSVRecordBatch ()
+
+@property (assign) NSUInteger firstRecordNumber;
+@property (assign) NSUInteger count;
+@property (assign) const CHCSVFieldSpan *fieldSpans;
+
+- (instancetype)_initWithMappedBytes:(const uint8_t *)bytes length:(NSUInteger)length deallocator:(CFAllocatorRef)deallocator unescapeOptions:(CHCSVParserOptions)options;
+- (void)_resetWithFirstRecordNumber:(NSUInteger)firstRecordNumber count:(NSUInteger)count fieldSpans:(const CHCSVFieldSpan *)fieldSpans recordStarts:(const NSUInteger *)recordStarts;
+- (CHCSVRecordBatch *)_detachedCopy;
+- (void)_makeStrings;
+- (void)_convertColumns:(const _CHCSVTypedColumn *)typedColumns count:(NSUInteger)typedColumnCount skipsFirstRecord:(BOOL)skipsFirstRecord;
+- (void)_enumerateConversionFailures:(void (^)(NSString *field, NSUInteger recordNumber, NSUInteger column, CHCSVColumnType type))block;
+
+@end
+
+@implementation CHCSVRecordBatch {
+    const NSUInteger *_recordStarts;
+    
+    // spans inside the mapped file can be turned into strings without copying their bytes
+    const uint8_t *_mappedBytes;
+    NSUInteger _mappedLength;
+    CFAllocatorRef _mappedStringDeallocator;
+    
+    // a detached batch owns the spans and bytes it points to (other than those in the mapped file), and may have made its strings up front
+    void *_ownedMemory;
+    NSArray *_strings;
+    
+    // how fields that need unescaping are sanitized, and where they are sanitized into
+    CHCSVParserOptions _unescapeOptions;
+    uint8_t *_scratch;
+    NSUInteger _scratchCapacity;
+    
+    // the values of the columns in CHCSVParser.columnTypes (with room for _convertedCapacity records each),
+    // the sanitized bytes of their text fields, and the fields that could not be converted
+    _CHCSVConvertedColumn *_convertedColumns;
+    NSUInteger _convertedColumnCount;
+    NSUInteger _convertedCapacity;
+    uint8_t *_convertedText;
+    NSUInteger _convertedTextCapacity;
+    _CHCSVConversionFailure *_failures;
+    NSUInteger _failureCount;
+    NSUInteger _failureCapacity;
+}
+
+- (instancetype)_initWithMappedBytes:(const uint8_t *)bytes length:(NSUInteger)length deallocator:(CFAllocatorRef)deallocator unescapeOptions:(CHCSVParserOptions)options {
+    self = [super init];
+    if (self) {
+        _mappedBytes = bytes;
+        _mappedLength = length;
+        _unescapeOptions = options;
+        if (deallocator != NULL) {
+            // the deallocator keeps the mapped file alive
+            _mappedStringDeallocator = CFRetain(deallocator);
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(_ownedMemory);
+    free(_scratch);
+    [self _freeConvertedColumns];
+    free(_convertedText);
+    free(_failures);
+    if (_mappedStringDeallocator != NULL) {
+        CFRelease(_mappedStringDeallocator);
+    }
+}
+
+- (void)_resetWithFirstRecordNumber:(NSUInteger)firstRecordNumber count:(NSUInteger)count fieldSpans:(const CHCSVFieldSpan *)fieldSpans recordStarts:(const NSUInteger *)recordStarts {
+    self.firstRecordNumber = firstRecordNumber;
+    self.count = count;
+    self.fieldSpans = fieldSpans;
+    _recordStarts = recordStarts;
+}
+
+- (BOOL)_isMappedSpan:(CHCSVFieldSpan)span {
+    return _mappedBytes != NULL && span.bytes >= _mappedBytes && span.bytes + span.length <= _mappedBytes + _mappedLength;
+}
+
+// A copy that stays valid after the parser moves on
+- (CHCSVRecordBatch *)_detachedCopy {
+    const CHCSVFieldSpan *spans = self.fieldSpans;
+    NSUInteger count = self.count;
+    NSUInteger fieldCount = _recordStarts[count];
+    
+    NSUInteger copiedLength = 0;
+    for (NSUInteger i = 0; i < fieldCount; i++) {
+        if ([self _isMappedSpan:spans[i]] == NO) { copiedLength += spans[i].length; }
+    }
+    
+    NSUInteger spansSize = fieldCount * sizeof(CHCSVFieldSpan);
+    NSUInteger startsSize = (count + 1) * sizeof(NSUInteger);
+    uint8_t *memory = malloc(spansSize + startsSize + copiedLength);
+    CHCSVFieldSpan *copiedSpans = (CHCSVFieldSpan *)memory;
+    NSUInteger *copiedStarts = (NSUInteger *)(memory + spansSize);
+    uint8_t *copiedBytes = memory + spansSize + startsSize;
+    
+    for (NSUInteger i = 0; i < fieldCount; i++) {
+        copiedSpans[i] = spans[i];
+        if ([self _isMappedSpan:spans[i]] == NO) {
+            memcpy(copiedBytes, spans[i].bytes, spans[i].length);
+            copiedSpans[i].bytes = copiedBytes;
+            copiedBytes += spans[i].length;
+        }
+    }
+    memcpy(copiedStarts, _recordStarts, startsSize);
+    
+    CHCSVRecordBatch *copy = [[CHCSVRecordBatch alloc] _initWithMappedBytes:_mappedBytes length:_mappedLength deallocator:_mappedStringDeallocator unescapeOptions:_unescapeOptions];
+    [copy _resetWithFirstRecordNumber:self.firstRecordNumber count:count fieldSpans:copiedSpans recordStarts:copiedStarts];
+    copy->_ownedMemory = memory;
+    return copy;
+}
+
+- (void)_makeStrings {
+    NSUInteger fieldCount = _recordStarts[self.count];
+    NSMutableArray *strings = [NSMutableArray arrayWithCapacity:fieldCount];
+    for (NSUInteger i = 0; i < fieldCount; i++) {
+        [strings addObject:[self _stringForSpan:self.fieldSpans[i]]];
+    }
+    _strings = strings;
+}
+
+- (NSString *)_stringForSpan:(CHCSVFieldSpan)span {
+    if (span.needsUnescaping) {
+        span = [self _unescapedSpan:span];
+        return _CHCSVUTF8String(span.bytes, span.length);
+    }
+    return _CHCSVMappedString(span.bytes, span.length, [self _isMappedSpan:span] ? _mappedStringDeallocator : NULL);
+}
+
+- (uint8_t *)_scratchOfLength:(NSUInteger)length {
+    if (length > _scratchCapacity) {
+        _scratchCapacity = MAX(_scratchCapacity * 2, MAX(length, 64));
+        _scratch = reallocf(_scratch, _scratchCapacity);
+    }
+    return _scratch;
+}
+
+- (CHCSVFieldSpan)_unescapedSpan:(CHCSVFieldSpan)span {
+    if (span.needsUnescaping == NO) { return span; }
+    
+    uint8_t *unescaped = [self _scratchOfLength:span.length];
+    NSUInteger length = _CHCSVUnescapeField(span.bytes, span.length, _unescapeOptions, unescaped);
+    return (CHCSVFieldSpan){ unescaped, length, NO };
+}
+
+- (CHCSVFieldSpan)_fieldSpanAtIndex:(NSUInteger)index {
+    NSParameterAssert(index < _recordStarts[self.count]);
+    return self.fieldSpans[index];
+}
+
+- (NSRange)fieldRangeOfRecordAtIndex:(NSUInteger)index {
+    NSParameterAssert(index < self.count);
+    return NSMakeRange(_recordStarts[index], _recordStarts[index + 1] - _recordStarts[index]);
+}
+
+- (NSString *)stringForFieldAtIndex:(NSUInteger)index {
+    if (_strings != nil) {
+        return _strings[index];
+    }
+    return [self _stringForSpan:[self _fieldSpanAtIndex:index]];
+}
+
+- (CHCSVFieldSpan)unescapedFieldAtIndex:(NSUInteger)index {
+    return [self _unescapedSpan:[self _fieldSpanAtIndex:index]];
+}
+
+- (BOOL)fieldAtIndex:(NSUInteger)index isEqualToUTF8String:(const char *)string {
+    CHCSVFieldSpan field = [self unescapedFieldAtIndex:index];
+    return strlen(string) == field.length && memcmp(field.bytes, string, field.length) == 0;
+}
+
+- (BOOL)getIntegerValue:(long long *)value ofFieldAtIndex:(NSUInteger)index {
+    CHCSVFieldSpan field = [self unescapedFieldAtIndex:index];
+    int64_t result = 0;
+    if (_CHCSVParseInt64(field.bytes, field.length, &result) == NO) { return NO; }
+    
+    if (value) { *value = result; }
+    return YES;
+}
+
+- (BOOL)getDoubleValue:(double *)value ofFieldAtIndex:(NSUInteger)index {
+    CHCSVFieldSpan field = [self unescapedFieldAtIndex:index];
+    double result = 0;
+    if (_CHCSVParseDouble(field.bytes, field.length, &result) == NO) { return NO; }
+    
+    if (value) { *value = result; }
+    return YES;
+}
+
+- (NSArray *)fieldsOfRecordAtIndex:(NSUInteger)index {
+    NSRange range = [self fieldRangeOfRecordAtIndex:index];
+    if (_strings != nil) {
+        return [_strings subarrayWithRange:range];
+    }
+    
+    const CHCSVFieldSpan *spans = self.fieldSpans;
+    NSMutableArray *fields = [NSMutableArray arrayWithCapacity:range.length];
+    for (NSUInteger i = range.location; i < NSMaxRange(range); i++) {
+        [fields addObject:[self _stringForSpan:spans[i]]];
+    }
+    return fields;
+}
+
+#pragma mark Converted Columns
+
+- (void)_freeConvertedColumns {
+    for (NSUInteger i = 0; i < _convertedColumnCount; i++) {
+        free(_convertedColumns[i].values);
+        free(_convertedColumns[i].nulls);
+    }
+    free(_convertedColumns);
+    _convertedColumns = NULL;
+    _convertedColumnCount = 0;
+    _convertedCapacity = 0;
+}
+
+- (void)_prepareConvertedColumns:(const _CHCSVTypedColumn *)typedColumns count:(NSUInteger)typedColumnCount {
+    NSUInteger count = self.count;
+    // the parser's batch is converted over and over, with the same columns each time
+    if (_convertedColumnCount != typedColumnCount || _convertedCapacity < count) {
+        [self _freeConvertedColumns];
+        _convertedColumns = calloc(MAX(typedColumnCount, 1), sizeof(_CHCSVConvertedColumn));
+        _convertedColumnCount = typedColumnCount;
+        _convertedCapacity = count;
+        for (NSUInteger i = 0; i < typedColumnCount; i++) {
+            _convertedColumns[i].values = malloc(MAX(count, 1) * _CHCSVColumnValueSize(typedColumns[i].type));
+            _convertedColumns[i].nulls = malloc(MAX(count, 1) * sizeof(BOOL));
+        }
+    }
+    for (NSUInteger i = 0; i < typedColumnCount; i++) {
+        _convertedColumns[i].typedColumn = typedColumns[i];
+    }
+    _failureCount = 0;
+}
+
+- (void)_addConversionFailureOfRecord:(NSUInteger)record field:(NSUInteger)field typedColumn:(const _CHCSVTypedColumn *)typedColumn {
+    if (_failureCount == _failureCapacity) {
+        _failureCapacity = MAX(_failureCapacity * 2, 16);
+        _failures = reallocf(_failures, _failureCapacity * sizeof(_CHCSVConversionFailure));
+    }
+    _failures[_failureCount++] = (_CHCSVConversionFailure){ record, field, typedColumn };
+}
+
+- (void)_convertColumns:(const _CHCSVTypedColumn *)typedColumns count:(NSUInteger)typedColumnCount skipsFirstRecord:(BOOL)skipsFirstRecord {
+    [self _prepareConvertedColumns:typedColumns count:typedColumnCount];
+    NSUInteger count = self.count;
+    const CHCSVFieldSpan *spans = self.fieldSpans;
+    
+    // text that has to be unescaped is copied out of the scratch buffer, into room for all of it
+    NSUInteger textLength = 0;
+    for (NSUInteger i = 0; i < typedColumnCount; i++) {
+        if (typedColumns[i].type != CHCSVColumnTypeUTF8) { continue; }
+        for (NSUInteger record = 0; record < count; record++) {
+            NSRange fields = [self fieldRangeOfRecordAtIndex:record];
+            if (typedColumns[i].position < fields.length && spans[fields.location + typedColumns[i].position].needsUnescaping) {
+                textLength += spans[fields.location + typedColumns[i].position].length;
+            }
+        }
+    }
+    if (textLength > _convertedTextCapacity) {
+        _convertedTextCapacity = textLength;
+        _convertedText = reallocf(_convertedText, _convertedTextCapacity);
+    }
+    uint8_t *text = _convertedText;
+    
+    for (NSUInteger i = 0; i < typedColumnCount; i++) {
+        memset(_convertedColumns[i].values, 0, count * _CHCSVColumnValueSize(typedColumns[i].type));
+    }
+    
+    // record by record, so that failures are found in the order of the file
+    for (NSUInteger record = 0; record < count; record++) {
+        NSRange fields = [self fieldRangeOfRecordAtIndex:record];
+        
+        for (NSUInteger i = 0; i < typedColumnCount; i++) {
+            _CHCSVConvertedColumn *converted = &_convertedColumns[i];
+            const _CHCSVTypedColumn *typedColumn = &converted->typedColumn;
+            if ((skipsFirstRecord && record == 0) || typedColumn->position >= fields.length) {
+                converted->nulls[record] = YES;
+                continue;
+            }
+            
+            NSUInteger fieldIndex = fields.location + typedColumn->position;
+            CHCSVFieldSpan field = [self _unescapedSpan:spans[fieldIndex]];
+            if (field.length == 0) {
+                converted->nulls[record] = YES;
+                continue;
+            }
+            
+            BOOL converts = NO;
+            switch (typedColumn->type) {
+                case CHCSVColumnTypeInt64:
+                    converts = _CHCSVParseInt64(field.bytes, field.length, (int64_t *)converted->values + record);
+                    break;
+                case CHCSVColumnTypeDouble:
+                    converts = _CHCSVParseDouble(field.bytes, field.length, (double *)converted->values + record);
+                    break;
+                case CHCSVColumnTypeUTF8:
+                    if (spans[fieldIndex].needsUnescaping) {
+                        memcpy(text, field.bytes, field.length);
+                        field.bytes = text;
+                        text += field.length;
+                    }
+                    ((CHCSVFieldSpan *)converted->values)[record] = field;
+                    converts = YES;
+                    break;
+                case CHCSVColumnTypeBoolean:
+                    converts = _CHCSVParseBoolean(field.bytes, field.length, (BOOL *)converted->values + record);
+                    break;
+                case CHCSVColumnTypeTimestamp:
+                    converts = _CHCSVParseTimestamp(field.bytes, field.length, (double *)converted->values + record);
+                    break;
+            }
+            
+            converted->nulls[record] = !converts;
+            if (converts == NO) {
+                [self _addConversionFailureOfRecord:record field:fieldIndex typedColumn:typedColumn];
+            }
+        }
+    }
+}
+
+- (void)_enumerateConversionFailures:(void (^)(NSString *field, NSUInteger recordNumber, NSUInteger column, CHCSVColumnType type))block {
+    for (NSUInteger i = 0; i < _failureCount; i++) {
+        _CHCSVConversionFailure failure = _failures[i];
+        block([self stringForFieldAtIndex:failure.field], self.firstRecordNumber + failure.record, failure.typedColumn->column, failure.typedColumn->type);
+    }
+}
+
+- (CHCSVColumn)valuesOfColumn:(NSUInteger)column {
+    for (NSUInteger i = 0; i < _convertedColumnCount; i++) {
+        if (_convertedColumns[i].typedColumn.column == column) {
+            return (CHCSVColumn){ _convertedColumns[i].typedColumn.type, _convertedColumns[i].values, _convertedColumns[i].nulls, -1 };
+        }
+    }
+    [NSException raise:NSInvalidArgumentException format:@"Column %lu was not converted", (unsigned long)column];
+    return (CHCSVColumn){ CHCSVColumnTypeUTF8, NULL, NULL, -1 };
+}
+
+@end
+
+// the delegate's implementations, looked up once when parsing begins (NULL if the delegate doesn't implement the method)
+typedef struct {
+    void (*didBeginDocument)(id, SEL, CHCSVParser *);
+    void (*didEndDocument)(id, SEL, CHCSVParser *);
+    void (*didBeginLine)(id, SEL, CHCSVParser *, NSUInteger);
+    void (*didEndLine)(id, SEL, CHCSVParser *, NSUInteger);
+    void (*didReadField)(id, SEL, CHCSVParser *, NSString *, NSInteger);
+    void (*didReadRecords)(id, SEL, CHCSVParser *, CHCSVRecordBatch *);
+    void (*didFailToConvertField)(id, SEL, CHCSVParser *, NSString *, NSUInteger, NSUInteger, CHCSVColumnType);
+    void (*didReadComment)(id, SEL, CHCSVParser *, NSString *);
+    void (*didFailWithError)(id, SEL, CHCSVParser *, NSError *);
+} _CHCSVDelegateMethods;
+
+// a field waiting to be delivered in a batch; it is either copied into the batch's bytes, or still in the parser's buffer
+typedef struct {
+    NSUInteger location;
+    NSUInteger length;
+    BOOL copied;
+    BOOL needsUnescaping;
+} _CHCSVBatchField;
+
+#pragma mark - Parallel Parsing
+
+/**
+ *  A slice of a mapped file that is parsed on its own, along with everything that was read from it.
+ *
+ *  A chunk is parsed from a guessed record boundary, and stops before the first record that starts at or after
+ *  @c stop (the next chunk's guess). The guess is only trusted if it is where the previous chunk actually ended.
+ */
+@interface _CHCSVParallelChunk : NSObject <CHCSVParserDelegate>
+
+@property (assign) NSUInteger start;
+@property (assign) NSUInteger stop;
+@property (assign) NSUInteger end;
+@property (assign) BOOL endsDocument;
+// whether parsing gave up more than PARALLEL_OVERRUN_LIMIT past stop, still inside a record (and the events are incomplete)
+@property (assign) BOOL overruns;
+@property (strong) NSError *error;
+// the number of fields the chunk's parser found, for the statistics
+@property (assign) NSUInteger fieldCount;
+
+// records (as arrays of fields, or as batches) and comments (as strings), in the order they were read
+@property (strong) NSMutableArray *events;
+@property (strong) NSMutableArray *currentLine;
+
+// whether records should be collected in batches, because that's how they will be delivered
+@property (assign) BOOL receivesBatches;
+
+// where records start, numbered from the start of the chunk, if the parser is building a record index
+@property (strong) NSData *recordCheckpoints;
+
+// owned by the queue until it finishes; the operation's block already retains the chunk
+@property (weak) NSOperation *operation;
+
+@end
+
+@implementation _CHCSVParallelChunk
+
+- (BOOL)respondsToSelector:(SEL)selector {
+    if (selector == @selector(parser:didReadRecords:)) {
+        return self.receivesBatches;
+    }
+    return [super respondsToSelector:selector];
+}
+
+- (void)parser:(CHCSVParser *)parser didReadRecords:(CHCSVRecordBatch *)records {
+    // the strings are made here, so that it happens in parallel too
+    CHCSVRecordBatch *copy = [records _detachedCopy];
+    [copy _makeStrings];
+    [self.events addObject:copy];
+}
+
+- (void)parser:(CHCSVParser *)parser didBeginLine:(NSUInteger)recordNumber {
+    self.currentLine = [[NSMutableArray alloc] init];
+}
+
+- (void)parser:(CHCSVParser *)parser didEndLine:(NSUInteger)recordNumber {
+    [self.events addObject:self.currentLine];
+    self.currentLine = nil;
+}
+
+- (void)parser:(CHCSVParser *)parser didReadField:(NSString *)field atIndex:(NSInteger)fieldIndex {
+    [self.currentLine addObject:field];
+}
+
+- (void)parser:(CHCSVParser *)parser didReadComment:(NSString *)comment {
+    [self.events addObject:comment];
+}
+
+@end
+
+NS_INLINE BOOL _CHCSVIsFieldBoundary(uint8_t byte, uint8_t delimiter) {
+    return byte == delimiter || byte == '\n' || byte == '\r';
+}
+
+// Guesses where the first record at or after `index` begins: just past the first newline that isn't inside a quoted field.
+// Whether `index` itself is inside a quoted field is inferred from the first quote that can only be opening or closing one;
+// counting quotes from there breaks down if unquoted fields contain quotes, but a wrong guess is caught (and fixed) later.
+static NSUInteger _CHCSVGuessRecordStart(const uint8_t *bytes, NSUInteger length, NSUInteger index, uint8_t delimiter) {
+    BOOL quoted = NO;
+    NSUInteger quotes = 0;
+    NSUInteger limit = MIN(length, index + UTF8_CHUNK_SIZE);
+    for (NSUInteger i = index; i < limit; i++) {
+        if (bytes[i] != DOUBLE_QUOTE) { continue; }
+        
+        uint8_t previous = (i > 0) ? bytes[i - 1] : '\n';
+        uint8_t next = (i + 1 < length) ? bytes[i + 1] : '\n';
+        if (_CHCSVIsFieldBoundary(previous, delimiter) && _CHCSVIsFieldBoundary(next, delimiter) == NO && next != DOUBLE_QUOTE) {
+            // opens a field, so there were an even number of quotes before it
+            quoted = (quotes % 2 == 1);
+            break;
+        }
+        if (_CHCSVIsFieldBoundary(previous, delimiter) == NO && previous != DOUBLE_QUOTE && _CHCSVIsFieldBoundary(next, delimiter)) {
+            // closes a field, so there were an odd number of quotes before it
+            quoted = (quotes % 2 == 0);
+            break;
+        }
+        quotes++;
+    }
+    
+    for (NSUInteger i = index; i < length; i++) {
+        if (bytes[i] == DOUBLE_QUOTE) {
+            quoted = !quoted;
+        } else if (quoted == NO) {
+            NSUInteger newline = _CHCSVUTF8NewlineLength(bytes + i, length - i);
+            if (newline > 0) {
+                if (bytes[i] == '\r' && i + 1 < length && bytes[i + 1] == '\n') { newline = 2; }
+                return i + newline;
+            }
+        }
+    }
+    return length;
+}
+
+#pragma mark - Incremental Parsing
+
+// Where a boundary scanner is within a record
+typedef NS_ENUM(uint8_t, _CHCSVBoundaryState) {
+    _CHCSVBoundaryRecordStart,
+    _CHCSVBoundaryFieldStart,
+    _CHCSVBoundaryUnquotedField,
+    _CHCSVBoundaryQuotedField,
+    // a double quote inside a quoted field, which is either doubled or closes the field
+    _CHCSVBoundaryQuote,
+    // after the closing double quote of a field
+    _CHCSVBoundaryClosedField,
+    _CHCSVBoundaryComment,
+};
+
+/**
+ *  Finds where records end in input that arrives a piece at a time, following the same rules as the byte parser.
+ *  Its state carries over from one piece to the next, so every byte is only scanned once.
+ */
+typedef struct {
+    _CHCSVBoundaryState state;
+    BOOL backslashEscaped;
+    // the last record scanned ended with a carriage return at the very end of the input, so a line feed may follow
+    BOOL followsCarriageReturn;
+    
+    uint8_t delimiter;
+    BOOL recognizesBackslashesAsEscapes;
+    BOOL recognizesComments;
+    BOOL recognizesLeadingEqualSign;
+} _CHCSVBoundaryScanner;
+
+// Scans bytes from *index, and returns the index just past the newline that ends the last complete record (or NSNotFound).
+// Scanning stops before a character that is incomplete, or a leading equal sign whose next byte hasn't arrived; *index is where it stopped.
+static NSUInteger _CHCSVScanForRecordEnds(_CHCSVBoundaryScanner *scanner, const uint8_t *bytes, NSUInteger *index, NSUInteger length) {
+    NSUInteger boundary = NSNotFound;
+    NSUInteger i = *index;
+    while (i < length) {
+        uint8_t byte = bytes[i];
+        NSUInteger available = length - i;
+        if (_CHCSVUTF8SequenceLength(byte) > available) { break; }
+        
+        if (scanner->backslashEscaped) {
+            // a backslash escapes a single byte
+            scanner->backslashEscaped = NO;
+            i++;
+            continue;
+        }
+        
+        _CHCSVBoundaryState state = scanner->state;
+        BOOL escapes = (byte == BACKSLASH && scanner->recognizesBackslashesAsEscapes);
+        
+        if (state == _CHCSVBoundaryQuotedField) {
+            if (escapes) {
+                scanner->backslashEscaped = YES;
+            } else if (byte == DOUBLE_QUOTE) {
+                scanner->state = _CHCSVBoundaryQuote;
+            }
+            i++;
+            continue;
+        }
+        if (state == _CHCSVBoundaryQuote) {
+            if (byte == DOUBLE_QUOTE) {
+                scanner->state = _CHCSVBoundaryQuotedField;
+                i++;
+            } else {
+                scanner->state = _CHCSVBoundaryClosedField;
+            }
+            continue;
+        }
+        
+        NSUInteger newline = _CHCSVUTF8NewlineLength(bytes + i, available);
+        if (newline > 0) {
+            if (byte == '\r') {
+                if (available > 1 && bytes[i + 1] == '\n') {
+                    newline = 2;
+                } else if (available == 1) {
+                    scanner->followsCarriageReturn = YES;
+                }
+            }
+            i += newline;
+            boundary = i;
+            scanner->state = _CHCSVBoundaryRecordStart;
+            continue;
+        }
+        
+        if (state == _CHCSVBoundaryComment) {
+            scanner->backslashEscaped = escapes;
+            i++;
+        } else if (state == _CHCSVBoundaryRecordStart && byte == OCTOTHORPE && scanner->recognizesComments) {
+            scanner->state = _CHCSVBoundaryComment;
+            i++;
+        } else if (byte == scanner->delimiter) {
+            scanner->state = _CHCSVBoundaryFieldStart;
+            i++;
+        } else if (state == _CHCSVBoundaryUnquotedField || state == _CHCSVBoundaryClosedField) {
+            // anything but a delimiter after a closing quote is an error, which the parser reports
+            scanner->backslashEscaped = (escapes && state == _CHCSVBoundaryUnquotedField);
+            i++;
+        } else {
+            // the start of a field, where leading whitespace is skipped
+            NSUInteger whitespace = _CHCSVUTF8WhitespaceLength(bytes + i, available);
+            if (whitespace > 0) {
+                scanner->state = _CHCSVBoundaryFieldStart;
+                i += whitespace;
+            } else if (byte == DOUBLE_QUOTE) {
+                scanner->state = _CHCSVBoundaryQuotedField;
+                i++;
+            } else if (byte == EQUAL && scanner->recognizesLeadingEqualSign) {
+                if (available < 2) { break; }
+                scanner->state = (bytes[i + 1] == DOUBLE_QUOTE) ? _CHCSVBoundaryQuotedField : _CHCSVBoundaryUnquotedField;
+                i += (bytes[i + 1] == DOUBLE_QUOTE) ? 2 : 1;
+            } else {
+                scanner->state = _CHCSVBoundaryUnquotedField;
+                scanner->backslashEscaped = escapes;
+                i++;
+            }
+        }
+    }
+    
+    *index = i;
+    return boundary;
+}
+
+@implementation CHCSVParser {
+    NSInputStream *_stream;
+    NSStringEncoding _streamEncoding;
+    NSMutableData *_stringBuffer;
+    NSMutableString *_string;
+    NSCharacterSet *_validFieldCharacters;
+    
+    NSUInteger _nextIndex;
+    
+    NSInteger _fieldIndex;
+    NSRange _fieldRange;
+    
+    // When parsing characters, the sanitized field is built out of runs of literal characters, copied out of _string in bulk.
+    // The start of the open run is kept relative to _fieldRange.location, because discarding the start of _string moves both.
+    unichar *_sanitizedCharacters;
+    NSUInteger _sanitizedCharactersLength;
+    NSUInteger _sanitizedCharactersCapacity;
+    NSUInteger _sanitizedRunStart;
+    
+    unichar _delimiter;
+    
+    NSError *_error;
+    
+    NSUInteger _currentRecord;
+    BOOL _cancelled;
+    
+    // When the stream is UTF-8 (and the delimiter is ASCII), the parser works directly on the bytes.
+    // In this mode, _nextIndex and _fieldRange are byte offsets into _bytes.
+    BOOL _parsesBytes;
+    uint8_t *_bytes;
+    NSUInteger _bytesLength;
+    NSUInteger _bytesCapacity;
+    BOOL _bytesExhausted;
+    
+    // UTF-16, UTF-32 and single-byte encodings are converted to UTF-8 as they are read, and parsed as bytes too
+    BOOL _transcodes;
+    _CHCSVTranscoder _transcoder;
+    uint8_t *_transcodeBuffer;
+    
+    uint8_t *_sanitizedBytes;
+    NSUInteger _sanitizedLength;
+    NSUInteger _sanitizedCapacity;
+    
+    // the masks of the most recently scanned 64-byte block of _bytes
+    NSUInteger _blockStart;
+    _CHCSVBlockMasks _blockMasks;
+    
+    // whether the current field contains quotes or escapes that sanitizing would remove
+    BOOL _fieldNeedsUnescaping;
+    
+    // Sanitized fields are built while parsing only if they are delivered one at a time.
+    // Batched fields that need unescaping are delivered raw, and unescaped on demand.
+    BOOL _sanitizesWhileParsing;
+    // whether the current field's sanitized bytes are being built
+    BOOL _buildsSanitizedField;
+    
+    // When only some columns are reported, column i is included if _includedColumnFlags[i] is YES.
+    // Fields in other columns are skipped: their boundaries are found, but nothing else is done with them.
+    BOOL _projectsColumns;
+    BOOL *_includedColumnFlags;
+    NSUInteger _includedColumnCount;
+    BOOL _skipsField;
+    // while reading the header, columns are included as the fields naming them are found
+    BOOL _resolvesColumnNames;
+    NSSet *_columnNameSet;
+    
+    // When parsing a local UTF-8 file, _bytes points into the mapping instead of a copy of the stream,
+    // and _bytesLength grows towards _mappedLength as the parser advances.
+    _CHCSVMappedFile *_mappedFile;
+    BOOL _bytesAreMapped;
+    NSUInteger _mappedLength;
+    NSUInteger _mappedDiscardedLength;
+    CFAllocatorRef _mappedStringDeallocator;
+    
+    _CHCSVDelegateMethods _delegateMethods;
+    
+    // When the delegate takes whole records, fields are collected until a batch is full.
+    // Fields that are still in _bytes are referenced in place (by their offset from the start of the stream),
+    // and compacting the buffer leaves them alone until the batch has been delivered.
+    CHCSVRecordBatch *_batch;
+    _CHCSVBatchField *_batchFields;
+    CHCSVFieldSpan *_batchSpans;
+    NSUInteger _batchFieldCount;
+    NSUInteger _batchFieldCapacity;
+    NSUInteger *_batchRecordStarts;
+    NSUInteger _batchRecordCount;
+    uint8_t *_batchBytes;
+    NSUInteger _batchBytesLength;
+    NSUInteger _batchBytesCapacity;
+    NSUInteger _batchRetainedLocation;
+    NSUInteger _bytesDiscarded;
+    
+    // the columns in columnTypes that are reported, once the header (if any) has been read
+    _CHCSVTypedColumn *_typedColumns;
+    NSUInteger _typedColumnCount;
+    BOOL _resolvedTypedColumns;
+    
+    // When building a record index, where a record starts is noted if it's at least _recordIndexInterval records past the last note.
+    // Only the parser that actually reads the bytes takes notes; a parallel parse collects them from its chunks.
+    NSMutableData *_recordCheckpoints;
+    BOOL _indexesRecords;
+    NSUInteger _nextCheckpointRecord;
+    
+    // where -parse begins, if not at the start of the file
+    BOOL _startsPartway;
+    NSUInteger _startIndex;
+    NSUInteger _startRecord;
+    NSUInteger _recordsToSkip;
+    
+    // When input is fed a piece at a time, _bytes holds what hasn't been parsed yet, and only complete records are parsed.
+    // _incrementalScanIndex is how far the boundary scanner has looked for the ends of records.
+    BOOL _parsesIncrementally;
+    BOOL _beganIncrementalParsing;
+    BOOL _finishedIncrementalInput;
+    BOOL _incrementalParsingEnded;
+    BOOL _checkedByteOrderMark;
+    _CHCSVBoundaryScanner _boundaryScanner;
+    NSUInteger _incrementalScanIndex;
+    
+    // When scanning, every field is skipped and nothing is reported; only the structure of the input is counted.
+    // Where an error was found is worked out from how much of the input has been discarded before _nextIndex.
+    BOOL _scans;
+    _CHCSVScanCounts _scanCounts;
+    NSUInteger _byteOrderMarkLength;
+    NSUInteger _charactersDiscarded;
+    
+    // Statistics are counted in plain fields, and only made into a CHCSVParserStatistics when they're published or asked for.
+    // While parsing, they're published whenever input is read and at least _publicationInterval has passed since last time.
+    _CHCSVParserCounts _counts;
+    uint64_t _publicationInterval;
+    uint64_t _nextPublicationTime;
+}
+
+// invokes a delegate method, adding the time it takes to the statistics if they're measuring time
+#define CHCSV_TIME_DELEGATE(invocation) do { \
+    uint64_t delegateStart = _CHCSVStartTiming(_measuresTime); \
+    invocation; \
+    _CHCSVEndTiming(_measuresTime, &_counts.delegateTime, delegateStart); \
+} while (0)
+
+// the bytes held by the parser's buffers (other than the mapping of a file)
+NS_INLINE void _CHCSVNoteBufferSize(CHCSVParser *parser) {
+    NSUInteger size = parser->_sanitizedCapacity + parser->_sanitizedCharactersCapacity * sizeof(unichar) + parser->_batchBytesCapacity;
+    size += parser->_batchFieldCapacity * (sizeof(_CHCSVBatchField) + sizeof(CHCSVFieldSpan));
+    size += [parser->_string length] * sizeof(unichar) + [parser->_stringBuffer length];
+    if (parser->_bytesAreMapped == NO) { size += parser->_bytesCapacity; }
+    if (parser->_transcodes) { size += TRANSCODE_CHUNK_SIZE; }
+    parser->_counts.peakBufferSize = MAX(parser->_counts.peakBufferSize, size);
+}
+
+NS_INLINE void _CHCSVNoteAllocation(CHCSVParser *parser) {
+    parser->_counts.allocationCount++;
+    _CHCSVNoteBufferSize(parser);
+}
+
+NS_INLINE void _CHCSVPublishStatisticsIfNecessary(CHCSVParser *parser) {
+    if (parser->_publicationInterval > 0 && mach_absolute_time() >= parser->_nextPublicationTime) {
+        [parser _publishStatistics];
+    }
+}
+
+// the index of the earliest byte in _bytes that is still needed
+NS_INLINE NSUInteger _CHCSVRetainedIndex(CHCSVParser *parser) {
+    NSUInteger retained = parser->_fieldRange.location;
+    if (parser->_batchRetainedLocation != NSNotFound) {
+        retained = MIN(retained, parser->_batchRetainedLocation - parser->_bytesDiscarded);
+    }
+    return retained;
+}
+
+NS_INLINE void _CHCSVBatchAddField(CHCSVParser *parser, NSUInteger location, NSUInteger length, BOOL copied, BOOL needsUnescaping) {
+    if (parser->_batchFieldCount == parser->_batchFieldCapacity) {
+        parser->_batchFieldCapacity = MAX(parser->_batchFieldCapacity * 2, RECORD_BATCH_SIZE);
+        parser->_batchFields = reallocf(parser->_batchFields, parser->_batchFieldCapacity * sizeof(_CHCSVBatchField));
+        parser->_batchSpans = reallocf(parser->_batchSpans, parser->_batchFieldCapacity * sizeof(CHCSVFieldSpan));
+        _CHCSVNoteAllocation(parser);
+    }
+    parser->_batchFields[parser->_batchFieldCount] = (_CHCSVBatchField){ location, length, copied, needsUnescaping };
+    parser->_batchFieldCount++;
+}
+
+NS_INLINE uint8_t *_CHCSVBatchReserveBytes(CHCSVParser *parser, NSUInteger length) {
+    if (parser->_batchBytesLength + length > parser->_batchBytesCapacity) {
+        parser->_batchBytesCapacity = MAX(parser->_batchBytesCapacity * 2, parser->_batchBytesLength + length);
+        parser->_batchBytes = reallocf(parser->_batchBytes, parser->_batchBytesCapacity);
+        _CHCSVNoteAllocation(parser);
+    }
+    return parser->_batchBytes + parser->_batchBytesLength;
+}
+
+NS_INLINE void _CHCSVBatchAddBufferedField(CHCSVParser *parser, NSRange range, BOOL needsUnescaping) {
+    NSUInteger location = parser->_bytesDiscarded + range.location;
+    if (parser->_batchRetainedLocation == NSNotFound) {
+        parser->_batchRetainedLocation = location;
+    }
+    _CHCSVBatchAddField(parser, location, range.length, NO, needsUnescaping);
+}
+
+// copies the characters of `string` in `range` as UTF-8, without making a substring first
+NS_INLINE void _CHCSVBatchAddString(CHCSVParser *parser, NSString *string, NSRange range) {
+    NSUInteger maximumLength = range.length * 3;
+    NSUInteger length = 0;
+    [string getBytes:_CHCSVBatchReserveBytes(parser, maximumLength) maxLength:maximumLength usedLength:&length encoding:NSUTF8StringEncoding options:0 range:range remainingRange:NULL];
+    _CHCSVBatchAddField(parser, parser->_batchBytesLength, length, YES, NO);
+    parser->_batchBytesLength += length;
+}
+
+// A pipe or socket can have nothing to read for a moment without having ended, so the stream is read (which waits for bytes)
+// until it says it has ended, rather than only while it says it has bytes available.
+NS_INLINE BOOL _CHCSVStreamHasEnded(NSInputStream *stream) {
+    NSStreamStatus status = [stream streamStatus];
+    return (status == NSStreamStatusAtEnd || status == NSStreamStatusClosed || status == NSStreamStatusError);
+}
+
+NS_INLINE BOOL _CHCSVIncludesColumn(CHCSVParser *parser, NSUInteger column) {
+    if (parser->_projectsColumns == NO || parser->_resolvesColumnNames) { return YES; }
+    return column < parser->_includedColumnCount && parser->_includedColumnFlags[column];
+}
+
+NS_INLINE void _CHCSVIncludeColumn(CHCSVParser *parser, NSUInteger column) {
+    if (column >= parser->_includedColumnCount) {
+        parser->_includedColumnFlags = reallocf(parser->_includedColumnFlags, (column + 1) * sizeof(BOOL));
+        memset(parser->_includedColumnFlags + parser->_includedColumnCount, 0, (column + 1 - parser->_includedColumnCount) * sizeof(BOOL));
+        parser->_includedColumnCount = column + 1;
+    }
+    parser->_includedColumnFlags[column] = YES;
+}
+
+NS_INLINE NSUInteger _CHCSVAvailableBytes(CHCSVParser *parser) {
+    NSUInteger available = parser->_bytesLength - parser->_nextIndex;
+    while (available < UTF8_LOOKAHEAD && parser->_bytesExhausted == NO) {
+        [parser _loadMoreBytes];
+        available = parser->_bytesLength - parser->_nextIndex;
+    }
+    return available;
+}
+
+NS_INLINE uint8_t _CHCSVPeekByte(CHCSVParser *parser) {
+    if (_CHCSVAvailableBytes(parser) == 0) { return NULLCHAR; }
+    return parser->_bytes[parser->_nextIndex];
+}
+
+NS_INLINE uint8_t _CHCSVPeekPeekByte(CHCSVParser *parser) {
+    if (_CHCSVAvailableBytes(parser) < 2) { return NULLCHAR; }
+    return parser->_bytes[parser->_nextIndex + 1];
+}
+
+NS_INLINE const _CHCSVBlockMasks *_CHCSVMasksForBlock(CHCSVParser *parser, NSUInteger blockStart) {
+    if (parser->_blockStart != blockStart) {
+        _CHCSVScanBlock(parser->_bytes + blockStart, (uint8_t)parser->_delimiter, &parser->_blockMasks);
+        parser->_blockStart = blockStart;
+    }
+    return &parser->_blockMasks;
+}
+
+// Returns the index of the first byte at or after _nextIndex that is a NUL or one of `stops`.
+// Only complete blocks are scanned; if the buffer ends first, the index where scanning stopped is returned.
+NS_INLINE NSUInteger _CHCSVSkipToStructuralByte(CHCSVParser *parser, _CHCSVStructuralBytes stops) {
+    NSUInteger index = parser->_nextIndex;
+    while (1) {
+        NSUInteger blockStart = index & ~(NSUInteger)63;
+        if (blockStart + 64 > parser->_bytesLength) { return index; }
+        
+        const _CHCSVBlockMasks *masks = _CHCSVMasksForBlock(parser, blockStart);
+        uint64_t stop = masks->null;
+        if (stops & _CHCSVStructuralDelimiter) { stop |= masks->delimiter; }
+        if (stops & _CHCSVStructuralQuote) { stop |= masks->quote; }
+        if (stops & _CHCSVStructuralNewline) { stop |= masks->newline; }
+        if (stops & _CHCSVStructuralBackslash) { stop |= masks->backslash; }
+        
+        stop &= ~0ULL << (index - blockStart);
+        if (stop != 0) { return blockStart + __builtin_ctzll(stop); }
+        index = blockStart + 64;
+    }
+}
+
+// Inside an escaped field, doubled quotes are literal and the first unpaired quote closes the field.
+// Tracking quote parity lets whole blocks of content, including delimiters, newlines and doubled quotes, be skipped at once.
+// Returns the index of the closing quote or of a NUL, or where scanning stopped if the buffer ends first.
+NS_INLINE NSUInteger _CHCSVSkipToClosingQuote(CHCSVParser *parser) {
+    NSUInteger index = parser->_nextIndex;
+    while (1) {
+        NSUInteger blockStart = index & ~(NSUInteger)63;
+        // the byte after the block is needed to tell whether its last quote is doubled
+        if (blockStart + 65 > parser->_bytesLength) { return index; }
+        
+        const _CHCSVBlockMasks *masks = _CHCSVMasksForBlock(parser, blockStart);
+        uint64_t fromIndex = ~0ULL << (index - blockStart);
+        uint64_t quotes = masks->quote & fromIndex;
+        uint64_t followedByQuote = (masks->quote >> 1) | ((uint64_t)(parser->_bytes[blockStart + 64] == DOUBLE_QUOTE) << 63);
+        uint64_t parity = _CHCSVPrefixXOR(quotes);
+        uint64_t closing = quotes & parity & ~followedByQuote;
+        
+        uint64_t stop = closing | (masks->null & fromIndex);
+        if (stop != 0) { return blockStart + __builtin_ctzll(stop); }
+        
+        // an odd number of quotes means the last one is doubled by the first byte of the next block
+        index = blockStart + 64 + (NSUInteger)(parity >> 63);
+    }
+}
+
+NS_INLINE NSString *_CHCSVFieldString(CHCSVParser *parser, NSRange range) {
+    return _CHCSVMappedString(parser->_bytes + range.location, range.length, parser->_mappedStringDeallocator);
+}
+
+NS_INLINE void _CHCSVAppendSanitizedBytes(CHCSVParser *parser, const uint8_t *bytes, NSUInteger length) {
+    if (parser->_sanitizedLength + length > parser->_sanitizedCapacity) {
+        parser->_sanitizedCapacity = MAX(parser->_sanitizedCapacity * 2, parser->_sanitizedLength + length);
+        parser->_sanitizedBytes = reallocf(parser->_sanitizedBytes, parser->_sanitizedCapacity);
+        _CHCSVNoteAllocation(parser);
+    }
+    memcpy(parser->_sanitizedBytes + parser->_sanitizedLength, bytes, length);
+    parser->_sanitizedLength += length;
+}
+
+// starts a run of literal characters at _nextIndex, unless one is already open
+NS_INLINE void _CHCSVBeginSanitizedRun(CHCSVParser *parser) {
+    if (parser->_buildsSanitizedField && parser->_sanitizedRunStart == NSNotFound) {
+        parser->_sanitizedRunStart = parser->_nextIndex - parser->_fieldRange.location;
+    }
+}
+
+// copies the open run, which ends just before _nextIndex, into the sanitized field
+NS_INLINE void _CHCSVEndSanitizedRun(CHCSVParser *parser) {
+    if (parser->_sanitizedRunStart == NSNotFound) { return; }
+    
+    NSUInteger start = parser->_fieldRange.location + parser->_sanitizedRunStart;
+    NSUInteger length = parser->_nextIndex - start;
+    if (parser->_sanitizedCharactersLength + length > parser->_sanitizedCharactersCapacity) {
+        parser->_sanitizedCharactersCapacity = MAX(parser->_sanitizedCharactersCapacity * 2, MAX(parser->_sanitizedCharactersLength + length, CHUNK_SIZE));
+        parser->_sanitizedCharacters = reallocf(parser->_sanitizedCharacters, parser->_sanitizedCharactersCapacity * sizeof(unichar));
+        _CHCSVNoteAllocation(parser);
+    }
+    [parser->_string getCharacters:parser->_sanitizedCharacters + parser->_sanitizedCharactersLength range:NSMakeRange(start, length)];
+    parser->_sanitizedCharactersLength += length;
+    parser->_sanitizedRunStart = NSNotFound;
+}
+
+NS_INLINE NSRange _CHCSVTrimmedCharacterRange(const unichar *characters, NSRange range) {
+    NSCharacterSet *whitespace = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+    while (range.length > 0 && [whitespace characterIsMember:characters[range.location]]) {
+        range.location++;
+        range.length--;
+    }
+    while (range.length > 0 && [whitespace characterIsMember:characters[NSMaxRange(range) - 1]]) {
+        range.length--;
+    }
+    return range;
+}
+
+- (id)initWithCSVString:(NSString *)csv {
+    return [self initWithDelimitedString:csv delimiter:COMMA];
+}
+
+- (instancetype)initWithDelimitedString:(NSString *)string delimiter:(unichar)delimiter {
+    NSInputStream *stream = [NSInputStream inputStreamWithData:[string dataUsingEncoding:NSUTF8StringEncoding]];
+    return [self initWithInputStream:stream usedEncoding:NULL delimiter:delimiter];
+}
+
+- (instancetype)initWithContentsOfCSVURL:(NSURL *)csvURL {
+    return [self initWithContentsOfDelimitedURL:csvURL delimiter:COMMA];
+}
+
+- (instancetype)initWithContentsOfDelimitedURL:(NSURL *)URL delimiter:(unichar)delimiter {
+    _CHCSVMappedFile *file = [[_CHCSVMappedFile alloc] initWithURL:URL];
+    if (file != nil && _CHCSVIsGzipped(file.bytes, file.length) == NO) {
+        return [self _initWithMappedFile:file delimiter:delimiter];
+    }
+    
+    // compressed files are read as a stream, which is decompressed while it's being parsed (see -_sniffEncoding)
+    NSInputStream *stream = [NSInputStream inputStreamWithURL:URL];
+    return [self initWithInputStream:stream usedEncoding:NULL delimiter:delimiter];
+}
+
+- (instancetype)initForIncrementalParsingWithDelimiter:(unichar)delimiter {
+    if (delimiter >= 0x80) {
+        [NSException raise:NSInvalidArgumentException format:@"The field delimiter of an incremental parser must be an ASCII character"];
+    }
+    
+    NSStringEncoding encoding = NSUTF8StringEncoding;
+    self = [self initWithInputStream:[NSInputStream inputStreamWithData:[NSData data]] usedEncoding:&encoding delimiter:delimiter];
+    if (self) {
+        _parsesIncrementally = YES;
+    }
+    return self;
+}
+
+- (instancetype)_initWithMappedFile:(_CHCSVMappedFile *)file delimiter:(unichar)delimiter {
+    // the encoding is sniffed through a stream over the mapping, which is also what non-UTF-8 files are parsed from
+    NSData *data = [NSData dataWithBytesNoCopy:(void *)file.bytes length:file.length freeWhenDone:NO];
+    self = [self initWithInputStream:[NSInputStream inputStreamWithData:data] usedEncoding:NULL delimiter:delimiter];
+    if (self) {
+        _mappedFile = file;
+        
+        if (_parsesBytes && _transcodes == NO) {
+            // parse straight out of the mapping, picking up after any byte order mark
+            free(_bytes);
+            _bytes = (uint8_t *)file.bytes + _byteOrderMarkLength;
+            _bytesCapacity = file.length - _byteOrderMarkLength;
+            _mappedLength = file.length - _byteOrderMarkLength;
+            _bytesAreMapped = YES;
+            // the buffer that was just freed doesn't count
+            _counts.allocationCount--;
+            _counts.peakBufferSize = 0;
+            _CHCSVNoteBufferSize(self);
+            
+            CFAllocatorContext context = {
+                .info = (__bridge void *)file,
+                .retain = _CHCSVMappedFileRetain,
+                .release = _CHCSVMappedFileRelease,
+                .deallocate = _CHCSVMappedFileDeallocate
+            };
+            _mappedStringDeallocator = CFAllocatorCreate(kCFAllocatorDefault, &context);
+        }
+    }
+    return self;
+}
+
+- (id)initWithInputStream:(NSInputStream *)stream usedEncoding:(NSStringEncoding *)encoding delimiter:(unichar)delimiter {
+    NSParameterAssert(stream);
+    NSParameterAssert(delimiter);
+    NSAssert([[NSCharacterSet newlineCharacterSet] characterIsMember:delimiter] == NO, @"The field delimiter may not be a newline");
+    NSAssert(delimiter != DOUBLE_QUOTE, @"The field delimiter may not be a double quote");
+    
+    self = [super init];
+    if (self) {
+        _stream = stream;
+        [_stream open];
+        
+        _stringBuffer = [[NSMutableData alloc] init];
+        _string = [[NSMutableString alloc] init];
+        
+        _delimiter = delimiter;
+        
+        _nextIndex = 0;
+        _recognizesComments = NO;
+        _recognizesBackslashesAsEscapes = NO;
+        _sanitizesFields = NO;
+        _trimsWhitespace = NO;
+        _recognizesLeadingEqualSign = NO;
+        _parsesInParallel = NO;
+        _recordBatchSize = RECORD_BATCH_SIZE;
+        _statisticsInterval = STATISTICS_INTERVAL;
+        _batchRetainedLocation = NSNotFound;
+        
+        NSMutableCharacterSet *m = [[NSCharacterSet newlineCharacterSet] mutableCopy];
+        NSString *invalid = [NSString stringWithFormat:@"%c%C", DOUBLE_QUOTE, _delimiter];
+        [m addCharactersInString:invalid];
+        _validFieldCharacters = [m invertedSet];
+        
+        if (encoding == NULL || *encoding == 0) {
+            // we need to determine the encoding
+            [self _sniffEncoding];
+            if (encoding) {
+                *encoding = _streamEncoding;
+            }
+        } else {
+            _streamEncoding = *encoding;
+        }
+        
+        // Other encodings with more than one byte per character (such as Shift JIS) are still parsed as NSStrings,
+        // and so is everything if the delimiter is outside of ASCII.
+        if (_streamEncoding != NSUTF8StringEncoding && _delimiter < 0x80) {
+            _transcodes = _CHCSVTranscoderInit(&_transcoder, _streamEncoding);
+        }
+        
+        _parsesBytes = ((_streamEncoding == NSUTF8StringEncoding || _transcodes) && _delimiter < 0x80);
+        if (_parsesBytes) {
+            _blockStart = NSNotFound;
+            _bytesCapacity = UTF8_CHUNK_SIZE * 2;
+            _bytes = malloc(_bytesCapacity);
+            _sanitizedCapacity = CHUNK_SIZE;
+            _sanitizedBytes = malloc(_sanitizedCapacity);
+            
+            // move over anything that was read while sniffing the encoding
+            if (_transcodes) {
+                _transcodeBuffer = malloc(TRANSCODE_CHUNK_SIZE);
+                _bytesLength = _CHCSVTranscode(&_transcoder, [_stringBuffer bytes], [_stringBuffer length], _bytes);
+            } else {
+                _bytesLength = [_stringBuffer length];
+                memcpy(_bytes, [_stringBuffer bytes], _bytesLength);
+                _byteOrderMarkLength = (NSUInteger)_counts.bytesRead - _bytesLength;
+            }
+            _counts.decodedLength = _bytesLength;
+            [_stringBuffer setLength:0];
+            // the bytes, the sanitized bytes and (when transcoding) the transcoded bytes
+            _counts.allocationCount += (_transcodes ? 3 : 2);
+            _CHCSVNoteBufferSize(self);
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_stream close];
+    if (_bytesAreMapped == NO) {
+        free(_bytes);
+    }
+    free(_sanitizedBytes);
+    free(_sanitizedCharacters);
+    free(_transcodeBuffer);
+    free(_transcoder.singleByteTable);
+    free(_batchFields);
+    free(_batchSpans);
+    free(_batchRecordStarts);
+    free(_typedColumns);
+    free(_batchBytes);
+    free(_includedColumnFlags);
+    free(_scanCounts.fieldCountHistogram);
+    if (_mappedStringDeallocator != NULL) {
+        CFRelease(_mappedStringDeallocator);
+    }
+}
+
+#pragma mark -
+
+- (void)setRecognizesBackslashesAsEscapes:(BOOL)recognizesBackslashesAsEscapes {
+    _recognizesBackslashesAsEscapes = recognizesBackslashesAsEscapes;
+    if (_delimiter == BACKSLASH && _recognizesBackslashesAsEscapes) {
+        [NSException raise:NSInternalInconsistencyException format:@"Cannot recognize backslashes as escapes when using '\\' as the delimiter"];
+    }
+}
+
+- (void)setRecognizesComments:(BOOL)recognizesComments {
+    _recognizesComments = recognizesComments;
+    if (_delimiter == OCTOTHORPE && _recognizesComments) {
+        [NSException raise:NSInternalInconsistencyException format:@"Cannot recognize comments when using '#' as the delimiter"];
+    }
+}
+
+- (void)setRecognizesLeadingEqualSign:(BOOL)recognizesLeadingEqualSign {
+    _recognizesLeadingEqualSign = recognizesLeadingEqualSign;
+    if (_delimiter == EQUAL && _recognizesLeadingEqualSign) {
+        [NSException raise:NSInternalInconsistencyException format:@"Cannot recognize leading equal sign when using '=' as the delimiter"];
+    }
+}
+
+- (void)setRecordBatchSize:(NSUInteger)recordBatchSize {
+    if (recordBatchSize == 0) {
+        [NSException raise:NSInvalidArgumentException format:@"The record batch size must be at least 1"];
+    }
+    _recordBatchSize = recordBatchSize;
+}
+
+- (void)setReadAheadBufferSize:(NSUInteger)readAheadBufferSize {
+    if (readAheadBufferSize != 0 && (readAheadBufferSize < READ_AHEAD_MINIMUM_BUFFER_SIZE || readAheadBufferSize > READ_AHEAD_MAXIMUM_BUFFER_SIZE)) {
+        [NSException raise:NSInvalidArgumentException format:@"The read-ahead buffer size must be between 1MB and 16MB"];
+    }
+    _readAheadBufferSize = readAheadBufferSize;
+}
+
+- (NSUInteger)totalBytesRead {
+    // _counts belongs to the parsing thread, so this reads the (atomic) published snapshot instead
+    return (NSUInteger)self.statistics.bytesRead;
+}
+
+- (CHCSVParserStatistics *)currentStatistics {
+    return [[CHCSVParserStatistics alloc] _initWithCounts:&_counts measuresTime:_measuresTime];
+}
+
+- (void)_beginStatistics {
+    _counts.startTime = mach_absolute_time();
+    _publicationInterval = (_statisticsInterval > 0) ? MAX((uint64_t)(_statisticsInterval / _CHCSVSecondsPerTick()), 1) : 0;
+    _nextPublicationTime = _counts.startTime + _publicationInterval;
+}
+
+- (void)_publishStatistics {
+    _nextPublicationTime = mach_absolute_time() + _publicationInterval;
+    // totalBytesRead is read from the statistics, so its observers are notified along with theirs
+    [self willChangeValueForKey:@"totalBytesRead"];
+    self.statistics = [self currentStatistics];
+    [self didChangeValueForKey:@"totalBytesRead"];
+}
+
+- (void)_finishStatistics {
+    _counts.endTime = mach_absolute_time();
+    [self _publishStatistics];
+}
+
+#pragma mark -
+
+- (void)_sniffEncoding {
+    NSStringEncoding encoding = NSUTF8StringEncoding;
+    
+    uint8_t bytes[CHUNK_SIZE];
+    NSInteger readLength = [_stream read:bytes maxLength:CHUNK_SIZE];
+    if (readLength > 0 && _CHCSVIsGzipped(bytes, (NSUInteger)readLength)) {
+        // gzip-compressed input is inflated on a reader thread, and the encoding is sniffed from what comes out of it
+        NSData *prefix = [NSData dataWithBytes:bytes length:(NSUInteger)readLength];
+        // (readAheadBufferSize can only be set once this parser exists, so -parse passes it on)
+        _stream = [[_CHCSVReadAheadStream alloc] initWithStream:_stream prefix:prefix bufferSize:READ_AHEAD_BUFFER_SIZE decompresses:YES];
+        [_stream open];
+        readLength = [_stream read:bytes maxLength:CHUNK_SIZE];
+    }
+    if (readLength > 0 && readLength <= CHUNK_SIZE) {
+        [_stringBuffer appendBytes:bytes length:readLength];
+        _counts.bytesRead += readLength;
+        
+        NSInteger bomLength = 0;
+        
+        if (readLength > 3 && bytes[0] == 0x00 && bytes[1] == 0x00 && bytes[2] == 0xFE && bytes[3] == 0xFF) {
+            encoding = NSUTF32BigEndianStringEncoding;
+            bomLength = 4;
+        } else if (readLength > 3 && bytes[0] == 0xFF && bytes[1] == 0xFE && bytes[2] == 0x00 && bytes[3] == 0x00) {
+            encoding = NSUTF32LittleEndianStringEncoding;
+            bomLength = 4;
+        } else if (readLength > 3 && bytes[0] == 0x1B && bytes[1] == 0x24 && bytes[2] == 0x29 && bytes[3] == 0x43) {
+            encoding = CFStringConvertEncodingToNSStringEncoding(kCFStringEncodingISO_2022_KR);
+            bomLength = 4;
+        } else if (readLength > 1 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
+            encoding = NSUTF16BigEndianStringEncoding;
+            bomLength = 2;
+        } else if (readLength > 1 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+            encoding = NSUTF16LittleEndianStringEncoding;
+            bomLength = 2;
+        } else if (readLength > 2 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+            encoding = NSUTF8StringEncoding;
+            bomLength = 3;
+        } else {
+            NSString *bufferAsUTF8 = nil;
+            
+            for (NSInteger triedLength = 0; triedLength < 4; ++triedLength) {
+                bufferAsUTF8 = [[NSString alloc] initWithBytes:bytes length:readLength-triedLength encoding:NSUTF8StringEncoding];
+                if (bufferAsUTF8 != nil) {
+                    break;
+                }
+            }
+            
+            if (bufferAsUTF8 != nil) {
+                encoding = NSUTF8StringEncoding;
+            } else {
+                NSLog(@"unable to determine stream encoding; assuming MacOSRoman");
+                encoding = NSMacOSRomanStringEncoding;
+            }
+        }
+        
+        if (bomLength > 0) {
+            [_stringBuffer replaceBytesInRange:NSMakeRange(0, bomLength) withBytes:NULL length:0];
+        }
+    }
+    _streamEncoding = encoding;
+}
+
+- (void)_loadMoreIfNecessary {
+    NSUInteger stringLength = [_string length];
+    NSUInteger reloadPortion = (stringLength - _fieldRange.location) / 3;
+    if (reloadPortion < 10) { reloadPortion = 10; }
+    
+    if (_nextIndex+reloadPortion >= stringLength && _CHCSVStreamHasEnded(_stream) == NO) {
+        // everything before the current field has already been reported.
+        // only discard it once it makes up the bulk of the buffer, so each character is moved O(1) times
+        NSUInteger consumed = _fieldRange.location;
+        if (consumed > 0 && consumed >= stringLength / 2) {
+            [_string deleteCharactersInRange:NSMakeRange(0, consumed)];
+            _charactersDiscarded += consumed;
+            _nextIndex -= consumed;
+            _fieldRange.location = 0;
+        }
+        
+        // read more from the stream
+        uint8_t buffer[CHUNK_SIZE];
+        uint64_t readStart = _CHCSVStartTiming(_measuresTime);
+        NSInteger readBytes = [_stream read:buffer maxLength:CHUNK_SIZE];
+        _CHCSVEndTiming(_measuresTime, &_counts.readingTime, readStart);
+        if (readBytes > 0) {
+            // append it to the buffer
+            [_stringBuffer appendBytes:buffer length:readBytes];
+            _counts.bytesRead += readBytes;
+            _CHCSVPublishStatisticsIfNecessary(self);
+        } else if (readBytes < 0 && _error == nil) {
+            // such as compressed input that turned out to be damaged
+            _error = [_stream streamError];
+        }
+    }
+    
+    if ([_stringBuffer length] > 0) {
+        // try to turn the next portion of the buffer into a string
+        uint64_t decodeStart = _CHCSVStartTiming(_measuresTime);
+        NSUInteger readLength = [_stringBuffer length];
+        while (readLength > 0) {
+            NSString *readString = [[NSString alloc] initWithBytes:[_stringBuffer bytes] length:readLength encoding:_streamEncoding];
+            if (readString == nil) {
+                readLength--;
+            } else {
+                [_string appendString:readString];
+                _counts.decodedLength += [readString length];
+                break;
+            }
+        };
+        _CHCSVNoteBufferSize(self);
+        
+        [_stringBuffer replaceBytesInRange:NSMakeRange(0, readLength) withBytes:NULL length:0];
+        _CHCSVEndTiming(_measuresTime, &_counts.decodingTime, decodeStart);
+    }
+}
+
+- (void)_advance {
+    [self _loadMoreIfNecessary];
+    _nextIndex++;
+}
+
+- (unichar)_peekCharacter {
+    [self _loadMoreIfNecessary];
+    if (_nextIndex >= [_string length]) { return NULLCHAR; }
+    
+    return [_string characterAtIndex:_nextIndex];
+}
+
+- (unichar)_peekPeekCharacter {
+    [self _loadMoreIfNecessary];
+    NSUInteger nextNextIndex = _nextIndex+1;
+    if (nextNextIndex >= [_string length]) { return NULLCHAR; }
+    
+    return [_string characterAtIndex:nextNextIndex];
+}
+
+#pragma mark -
+
+- (BOOL)startAtRecord:(NSUInteger)recordNumber usingIndex:(CHCSVRecordIndex *)index {
+    NSParameterAssert(recordNumber > 0);
+    if (_bytesAreMapped == NO || [index _isValidForFileSize:[_mappedFile length] modificationTime:[_mappedFile modificationTime]] == NO) { return NO; }
+    
+    unsigned long long offset = 0;
+    NSUInteger indexedRecord = 0;
+    if ([index getByteOffset:&offset recordNumber:&indexedRecord nearestToRecord:recordNumber] == NO) { return NO; }
+    if ([self startAtByteOffset:offset recordNumber:indexedRecord] == NO) { return NO; }
+    
+    _recordsToSkip = recordNumber - indexedRecord;
+    return YES;
+}
+
+- (BOOL)startAtByteOffset:(unsigned long long)offset recordNumber:(NSUInteger)recordNumber {
+    NSParameterAssert(recordNumber > 0);
+    if (_bytesAreMapped == NO) { return NO; }
+    
+    // offsets count the byte order mark, but _bytes starts after it
+    NSUInteger bomLength = (NSUInteger)(_bytes - [_mappedFile bytes]);
+    if (offset < bomLength || offset > [_mappedFile length]) { return NO; }
+    
+    _startsPartway = YES;
+    _startIndex = (NSUInteger)offset - bomLength;
+    _startRecord = recordNumber;
+    _recordsToSkip = 0;
+    return YES;
+}
+
+- (void)parse {
+    if (_parsesIncrementally) {
+        [NSException raise:NSInternalInconsistencyException format:@"An incremental parser is given its input with -feedData: and -finish"];
+    }
+    
+    [self _lookUpDelegateMethods];
+    [self _prepareIncludedColumns];
+    
+    if (_readAheadBufferSize > 0 && _mappedFile == nil && [_stream isKindOfClass:[_CHCSVReadAheadStream class]] == NO) {
+        // whatever was read while sniffing the encoding is already buffered; the reader thread picks up after it
+        _stream = [[_CHCSVReadAheadStream alloc] initWithStream:_stream prefix:nil bufferSize:_readAheadBufferSize decompresses:NO];
+        [_stream open];
+    } else if (_readAheadBufferSize > 0 && [_stream isKindOfClass:[_CHCSVReadAheadStream class]]) {
+        // compressed input is already being read ahead, into buffers of the default size until now
+        [(_CHCSVReadAheadStream *)_stream setBufferSize:_readAheadBufferSize];
+    }
+    
+    if (_recordIndexInterval > 0 && _bytesAreMapped) {
+        _recordCheckpoints = [[NSMutableData alloc] init];
+    }
+    [self _beginStatistics];
+    
+    if (_parsesInParallel && _bytesAreMapped && _startsPartway == NO && _mappedLength >= PARALLEL_CHUNK_SIZE * 2) {
+        @autoreleasepool {
+            [self _parseInParallel];
+        }
+        return;
+    }
+    
+    @autoreleasepool {
+        [self _beginDocument];
+        
+        _currentRecord = 0;
+        if (_startsPartway) {
+            [self _moveToStart];
+        }
+        _indexesRecords = (_recordCheckpoints != nil);
+        if (_error == nil) {
+            [self _parseRecordsUntilIndex:NSUIntegerMax];
+        }
+        [self _finishRecordIndex];
+        [self _finishStatistics];
+        
+        if (_error != nil) {
+            [self _error];
+        } else {
+            [self _endDocument];
+        }
+    }
+}
+
+- (CHCSVScanSummary *)scan {
+    if (_parsesIncrementally) {
+        [NSException raise:NSInternalInconsistencyException format:@"An incremental parser is given its input with -feedData: and -finish"];
+    }
+    
+    // no delegate methods are looked up, and no column is included, so every field is skipped as soon as its end is found
+    _scans = YES;
+    _projectsColumns = YES;
+    _includedColumnCount = 0;
+    _resolvesColumnNames = NO;
+    _sanitizesWhileParsing = NO;
+    [self _beginStatistics];
+    
+    @autoreleasepool {
+        _currentRecord = 0;
+        if (_startsPartway) {
+            [self _moveToStart];
+        }
+        if (_error == nil) {
+            [self _parseRecordsUntilIndex:NSUIntegerMax];
+        }
+    }
+    [self _finishStatistics];
+    
+    NSUInteger errorRecordNumber = NSNotFound;
+    unsigned long long errorOffset = NSNotFound;
+    if (_error != nil) {
+        errorRecordNumber = _currentRecord;
+        errorOffset = _parsesBytes ? (unsigned long long)_byteOrderMarkLength + _bytesDiscarded + _nextIndex : (unsigned long long)_charactersDiscarded + _nextIndex;
+    }
+    return [[CHCSVScanSummary alloc] _initWithCounts:&_scanCounts recordCount:_currentRecord error:_error errorRecordNumber:errorRecordNumber errorOffset:errorOffset];
+}
+
+- (void)cancelParsing {
+    _cancelled = YES;
+}
+
+// Skips to where -startAtRecord:usingIndex: or -startAtByteOffset:recordNumber: asked parsing to begin
+- (void)_moveToStart {
+    if (_resolvesColumnNames) {
+        [self _resolveColumnNamesFromHeader];
+    }
+    
+    NSUInteger index = _startIndex;
+    if (_recordsToSkip > 0) {
+        // the records between the indexed one and the first one to report only need their boundaries found
+        CHCSVParser *skipper = [self _chunkParserWithDelegate:nil];
+        skipper->_projectsColumns = YES;
+        skipper->_resolvesColumnNames = NO;
+        skipper->_includedColumnCount = 0;
+        [skipper _moveToIndex:index];
+        for (NSUInteger skipped = 0; skipped < _recordsToSkip && [skipper _parseUTF8Record]; skipped++) {}
+        
+        index = skipper->_nextIndex;
+        _error = skipper->_error;
+    }
+    
+    [self _moveToIndex:index];
+    _counts.bytesRead = (unsigned long long)((_bytes + _bytesLength) - [_mappedFile bytes]);
+    _counts.decodedLength = _bytesLength;
+    _currentRecord = _startRecord + _recordsToSkip - 1;
+}
+
+// Moves a parser of the mapped file to `index`, which must be where a record starts
+- (void)_moveToIndex:(NSUInteger)index {
+    _nextIndex = index;
+    _fieldRange = NSMakeRange(index, 0);
+    _bytesLength = MAX(_bytesLength, index);
+    // the mapping may be shared with other parsers, so each one only discards the pages it has parsed itself
+    NSUInteger pageSize = (NSUInteger)getpagesize();
+    _mappedDiscardedLength = (NSUInteger)((_bytes + index) - [_mappedFile bytes]) & ~(pageSize - 1);
+}
+
+- (void)_finishRecordIndex {
+    if (_recordCheckpoints == nil) { return; }
+    
+    _recordIndex = [[CHCSVRecordIndex alloc] _initWithCheckpoints:_recordCheckpoints interval:_recordIndexInterval recordCount:_currentRecord fileSize:[_mappedFile length] modificationTime:[_mappedFile modificationTime]];
+}
+
+- (void)_lookUpDelegateMethods {
+    id delegate = _delegate;
+#define CHCSV_LOOK_UP(method, selector) \
+    _delegateMethods.method = [delegate respondsToSelector:selector] ? (__typeof__(_delegateMethods.method))[delegate methodForSelector:selector] : NULL
+    
+    CHCSV_LOOK_UP(didBeginDocument, @selector(parserDidBeginDocument:));
+    CHCSV_LOOK_UP(didEndDocument, @selector(parserDidEndDocument:));
+    CHCSV_LOOK_UP(didBeginLine, @selector(parser:didBeginLine:));
+    CHCSV_LOOK_UP(didEndLine, @selector(parser:didEndLine:));
+    CHCSV_LOOK_UP(didReadField, @selector(parser:didReadField:atIndex:));
+    CHCSV_LOOK_UP(didReadRecords, @selector(parser:didReadRecords:));
+    CHCSV_LOOK_UP(didFailToConvertField, @selector(parser:didFailToConvertField:ofRecord:column:toType:));
+    CHCSV_LOOK_UP(didReadComment, @selector(parser:didReadComment:));
+    CHCSV_LOOK_UP(didFailWithError, @selector(parser:didFailWithError:));
+#undef CHCSV_LOOK_UP
+    
+    if (_delegateMethods.didReadRecords != NULL && _batch == nil) {
+        CHCSVParserOptions unescapeOptions = 0;
+        if (_trimsWhitespace) { unescapeOptions |= CHCSVParserOptionsTrimsWhitespace; }
+        if (_recognizesBackslashesAsEscapes) { unescapeOptions |= CHCSVParserOptionsRecognizesBackslashesAsEscapes; }
+        if (_recognizesLeadingEqualSign) { unescapeOptions |= CHCSVParserOptionsRecognizesLeadingEqualSign; }
+        
+        _batch = [[CHCSVRecordBatch alloc] _initWithMappedBytes:(_bytesAreMapped ? _bytes : NULL) length:_mappedLength deallocator:_mappedStringDeallocator unescapeOptions:unescapeOptions];
+        _batchRecordStarts = calloc(_recordBatchSize + 1, sizeof(NSUInteger));
+    }
+    _sanitizesWhileParsing = (_sanitizesFields && _batch == nil);
+}
+
+- (void)_prepareIncludedColumns {
+    _projectsColumns = (_includedColumns != nil || _includedColumnNames != nil);
+    _resolvesColumnNames = (_includedColumnNames != nil);
+    if (_resolvesColumnNames) {
+        _columnNameSet = [NSSet setWithArray:_includedColumnNames];
+    } else {
+        [_includedColumns enumerateIndexesUsingBlock:^(NSUInteger column, BOOL *stop) {
+            _CHCSVIncludeColumn(self, column);
+        }];
+    }
+}
+
+// Parses records until the input ends, or until a record would start at or after `stop` (a byte index, only used by the byte parser)
+- (void)_parseRecordsUntilIndex:(NSUInteger)stop {
+    // batched records share an autorelease pool; otherwise each record gets its own
+    NSUInteger recordsPerPool = (_batch != nil) ? _recordBatchSize : 1;
+    
+    BOOL more = YES;
+    while (more) {
+        @autoreleasepool {
+            for (NSUInteger i = 0; more && i < recordsPerPool; i++) {
+                if (_parsesBytes) {
+                    more = (_nextIndex < stop && [self _parseUTF8Record]);
+                } else {
+                    more = [self _parseRecord];
+                }
+            }
+        }
+    }
+    
+    @autoreleasepool {
+        [self _deliverRecords];
+    }
+}
+
+- (BOOL)_parseRecord {
+    while ([self _peekCharacter] == OCTOTHORPE && _recognizesComments) {
+        [self _parseComment];
+    }
+    
+    if ([self _peekCharacter] != NULLCHAR) {
+        [self _beginRecord];
+        while (1) {
+            if (![self _parseField]) {
+                break;
+            }
+            if (![self _parseDelimiter]) {
+                break;
+            }
+        }
+        [self _endRecord];
+    }
+    
+    BOOL followedByNewline = [self _parseNewline];
+    return (followedByNewline && _error == nil && [self _peekCharacter] != NULLCHAR);
+}
+
+- (BOOL)_parseNewline {
+    if (_cancelled) { return NO; }
+    
+    NSUInteger charCount = 0;
+    unichar peek = [self _peekCharacter];
+    unichar peekPeek = [self _peekPeekCharacter];
+    
+    if (peek == '\r' && peekPeek == '\n') {
+        // assume \r\n is a single delimiter
+        charCount += 2;
+        [self _advance];
+        [self _advance];
+    } else if ([[NSCharacterSet newlineCharacterSet] characterIsMember:peek]) {
+        charCount++;
+        [self _advance];
+    }
+    return (charCount > 0);
+}
+
+- (BOOL)_parseComment {
+    [self _advance]; // consume the octothorpe
+    
+    NSCharacterSet *newlines = [NSCharacterSet newlineCharacterSet];
+    
+    [self _beginComment];
+    BOOL isBackslashEscaped = NO;
+    while (1) {
+        unichar next = [self _peekCharacter];
+        if (next == NULLCHAR) { break; }
+        
+        if (isBackslashEscaped == NO) {
+            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
+                isBackslashEscaped = YES;
+                [self _advance];
+            } else if ([newlines characterIsMember:next] == NO) {
+                [self _advance];
+            } else {
+                // it's a newline
+                break;
+            }
+        } else {
+            isBackslashEscaped = NO;
+            [self _advance];
+        }
+    }
+    [self _endComment];
+    
+    return [self _parseNewline];
+}
+
+- (void)_parseFieldWhitespace {
+    // if we're trimming, then these characters are stripped (because they're not part of a run)
+    if (_trimsWhitespace == NO) {
+        _CHCSVBeginSanitizedRun(self);
+    }
+    
+    NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
+    while ([self _peekCharacter] != NULLCHAR &&
+           [whitespace characterIsMember:[self _peekCharacter]] &&
+           [self _peekCharacter] != _delimiter) {
+        [self _advance];
+    }
+    _CHCSVEndSanitizedRun(self);
+}
+
+- (BOOL)_parseField {
+    if (_cancelled) { return NO; }
+    
+    BOOL parsedField = NO;
+    [self _beginField];
+    
+    // consume leading whitespace
+    [self _parseFieldWhitespace];
+    
+    if ([self _peekCharacter] == DOUBLE_QUOTE) {
+        parsedField = [self _parseEscapedField];
+    } else if (_recognizesLeadingEqualSign && [self _peekCharacter] == EQUAL && [self _peekPeekCharacter] == DOUBLE_QUOTE) {
+        [self _advance]; // consume the equal sign
+        parsedField = [self _parseEscapedField];
+    } else {
+        parsedField = [self _parseUnescapedField];
+        if (_trimsWhitespace && _buildsSanitizedField) {
+            NSRange trimmed = _CHCSVTrimmedCharacterRange(_sanitizedCharacters, NSMakeRange(0, _sanitizedCharactersLength));
+            memmove(_sanitizedCharacters, _sanitizedCharacters + trimmed.location, trimmed.length * sizeof(unichar));
+            _sanitizedCharactersLength = trimmed.length;
+        }
+    }
+    
+    if (parsedField) {
+        // consume trailing whitespace
+        [self _parseFieldWhitespace];
+        [self _endField];
+    }
+    return parsedField;
+}
+
+- (BOOL)_parseEscapedField {
+    [self _advance]; // consume the opening double quote
+    _CHCSVBeginSanitizedRun(self);
+    
+    NSCharacterSet *newlines = [NSCharacterSet newlineCharacterSet];
+    BOOL isBackslashEscaped = NO;
+    while (1) {
+        unichar next = [self _peekCharacter];
+        if (next == NULLCHAR) { break; }
+        
+        if (isBackslashEscaped == NO) {
+            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
+                isBackslashEscaped = YES;
+                _CHCSVEndSanitizedRun(self);
+                [self _advance]; // consume the backslash
+                _CHCSVBeginSanitizedRun(self);
+            } else if ([_validFieldCharacters characterIsMember:next] ||
+                       [newlines characterIsMember:next] ||
+                       next == _delimiter) {
+                [self _advance];
+            } else if (next == DOUBLE_QUOTE && [self _peekPeekCharacter] == DOUBLE_QUOTE) {
+                // the first quote is kept, and the second one is left out
+                [self _advance];
+                _CHCSVEndSanitizedRun(self);
+                [self _advance];
+                _CHCSVBeginSanitizedRun(self);
+            } else {
+                // not valid, or it's not a doubled double quote
+                break;
+            }
+        } else {
+            isBackslashEscaped = NO;
+            [self _advance];
+        }
+    }
+    _CHCSVEndSanitizedRun(self);
+    
+    if ([self _peekCharacter] == DOUBLE_QUOTE) {
+        [self _advance];
+        return YES;
+    }
+    
+    return NO;
+}
+
+- (BOOL)_parseUnescapedField {
+    _CHCSVBeginSanitizedRun(self);
+    
+    NSCharacterSet *newlines = [NSCharacterSet newlineCharacterSet];
+    BOOL isBackslashEscaped = NO;
+    while (1) {
+        unichar next = [self _peekCharacter];
+        if (next == NULLCHAR) { break; }
+        
+        if (isBackslashEscaped == NO) {
+            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
+                isBackslashEscaped = YES;
+                _CHCSVEndSanitizedRun(self);
+                [self _advance];
+                _CHCSVBeginSanitizedRun(self);
+            } else if ([newlines characterIsMember:next] == YES || next == _delimiter) {
+                break;
+            } else {
+                [self _advance];
+            }
+        } else {
+            isBackslashEscaped = NO;
+            [self _advance];
+        }
+    }
+    _CHCSVEndSanitizedRun(self);
+    
+    return YES;
+}
+
+- (BOOL)_parseDelimiter {
+    unichar next = [self _peekCharacter];
+    if (next == _delimiter) {
+        [self _advance];
+        return YES;
+    }
+    if (next != NULLCHAR && [[NSCharacterSet newlineCharacterSet] characterIsMember:next] == NO) {
+        NSString *description = [NSString stringWithFormat:@"Unexpected delimiter. Expected '%C' (0x%X), but got '%C' (0x%X)", _delimiter, _delimiter, [self _peekCharacter], [self _peekCharacter]];
+        _error = [[NSError alloc] initWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeInvalidFormat userInfo:@{NSLocalizedDescriptionKey : description}];
+    }
+    return NO;
+}
+
+#pragma mark - UTF-8 Parsing
+
+- (BOOL)_loadMoreBytes {
+    if (_bytesExhausted) { return NO; }
+    
+    if (_bytesAreMapped) {
+        return [self _loadMoreMappedBytes];
+    }
+    
+    if (_bytesCapacity - _bytesLength < UTF8_CHUNK_SIZE) {
+        [self _discardConsumedBytes];
+        if (_bytesCapacity - _bytesLength < UTF8_CHUNK_SIZE) {
+            _bytesCapacity = MAX(_bytesCapacity * 2, _bytesLength + UTF8_CHUNK_SIZE);
+            _bytes = reallocf(_bytes, _bytesCapacity);
+            _CHCSVNoteAllocation(self);
+        }
+    }
+    
+    NSInteger readBytes = 0;
+    uint64_t readStart = _CHCSVStartTiming(_measuresTime);
+    if (_CHCSVStreamHasEnded(_stream) == NO) {
+        if (_transcodes) {
+            readBytes = [_stream read:_transcodeBuffer maxLength:TRANSCODE_CHUNK_SIZE];
+        } else {
+            readBytes = [_stream read:_bytes + _bytesLength maxLength:_bytesCapacity - _bytesLength];
+        }
+    }
+    _CHCSVEndTiming(_measuresTime, &_counts.readingTime, readStart);
+    if (readBytes <= 0) {
+        _bytesExhausted = YES;
+        if (readBytes < 0 && _error == nil) {
+            // such as compressed input that turned out to be damaged
+            _error = [_stream streamError];
+        }
+        if (_transcodes) {
+            // an incomplete character at the end of the stream becomes U+FFFD
+            NSUInteger finished = _CHCSVTranscoderFinish(&_transcoder, _bytes + _bytesLength);
+            _bytesLength += finished;
+            _counts.decodedLength += finished;
+            return (finished > 0);
+        }
+        return NO;
+    }
+    
+    NSUInteger decodedLength = (NSUInteger)readBytes;
+    if (_transcodes) {
+        uint64_t decodeStart = _CHCSVStartTiming(_measuresTime);
+        decodedLength = _CHCSVTranscode(&_transcoder, _transcodeBuffer, (NSUInteger)readBytes, _bytes + _bytesLength);
+        _CHCSVEndTiming(_measuresTime, &_counts.decodingTime, decodeStart);
+    }
+    _bytesLength += decodedLength;
+    _counts.bytesRead += readBytes;
+    _counts.decodedLength += decodedLength;
+    _CHCSVPublishStatisticsIfNecessary(self);
+    return YES;
+}
+
+// Moves the bytes that are still needed to the start of _bytes, and returns how far they moved
+- (NSUInteger)_discardConsumedBytes {
+    // everything before the current field (and the fields waiting to be delivered) has already been reported
+    NSUInteger consumed = _CHCSVRetainedIndex(self);
+    if (consumed > 0) {
+        memmove(_bytes, _bytes + consumed, _bytesLength - consumed);
+        _bytesLength -= consumed;
+        _bytesDiscarded += consumed;
+        _nextIndex -= consumed;
+        _fieldRange.location -= consumed;
+        _blockStart = NSNotFound;
+    }
+    return consumed;
+}
+
+- (BOOL)_loadMoreMappedBytes {
+    NSUInteger revealed = MIN(_mappedLength - _bytesLength, UTF8_CHUNK_SIZE);
+    if (revealed == 0) {
+        _bytesExhausted = YES;
+        return NO;
+    }
+    
+    // Let the kernel drop the pages that have already been parsed, so memory use doesn't grow with the file.
+    // Anything still referencing them (such as strings made from the mapping) just faults them back in.
+    const uint8_t *base = [_mappedFile bytes];
+    NSUInteger pageSize = (NSUInteger)getpagesize();
+    NSUInteger consumed = (NSUInteger)((_bytes + _CHCSVRetainedIndex(self)) - base) & ~(pageSize - 1);
+    if (consumed >= _mappedDiscardedLength + MAPPED_DISCARD_SIZE) {
+        madvise((void *)(base + _mappedDiscardedLength), consumed - _mappedDiscardedLength, MADV_DONTNEED);
+        _mappedDiscardedLength = consumed;
+    }
+    
+    _bytesLength += revealed;
+    _counts.bytesRead += revealed;
+    _counts.decodedLength += revealed;
+    _CHCSVPublishStatisticsIfNecessary(self);
+    return YES;
+}
+
+- (BOOL)_parseUTF8Record {
+    while (_CHCSVPeekByte(self) == OCTOTHORPE && _recognizesComments) {
+        [self _parseUTF8Comment];
+    }
+    
+    if (_CHCSVPeekByte(self) != NULLCHAR) {
+        [self _beginRecord];
+        while (1) {
+            if (![self _parseUTF8Field]) {
+                break;
+            }
+            if (![self _parseUTF8Delimiter]) {
+                break;
+            }
+        }
+        [self _endRecord];
+    }
+    
+    BOOL followedByNewline = [self _parseUTF8Newline];
+    return (followedByNewline && _error == nil && _CHCSVPeekByte(self) != NULLCHAR);
+}
+
+- (BOOL)_parseUTF8Newline {
+    if (_cancelled) { return NO; }
+    
+    NSUInteger available = _CHCSVAvailableBytes(self);
+    const uint8_t *bytes = _bytes + _nextIndex;
+    
+    NSUInteger length = 0;
+    if (available > 1 && bytes[0] == '\r' && bytes[1] == '\n') {
+        // assume \r\n is a single delimiter
+        length = 2;
+    } else {
+        length = _CHCSVUTF8NewlineLength(bytes, available);
+    }
+    _nextIndex += length;
+    return (length > 0);
+}
+
+- (BOOL)_parseUTF8Comment {
+    _nextIndex++; // consume the octothorpe
+    
+    [self _beginUTF8Comment];
+    _CHCSVStructuralBytes stops = _CHCSVStructuralNewline | (_recognizesBackslashesAsEscapes ? _CHCSVStructuralBackslash : 0);
+    BOOL isBackslashEscaped = NO;
+    while (1) {
+        if (isBackslashEscaped == NO) {
+            _nextIndex = _CHCSVSkipToStructuralByte(self, stops);
+        }
+        
+        NSUInteger available = _CHCSVAvailableBytes(self);
+        if (available == 0 || _bytes[_nextIndex] == NULLCHAR) { break; }
+        
+        uint8_t next = _bytes[_nextIndex];
+        if (isBackslashEscaped == NO) {
+            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
+                isBackslashEscaped = YES;
+                _nextIndex++;
+            } else if (_CHCSVUTF8NewlineLength(_bytes + _nextIndex, available) == 0) {
+                _nextIndex++;
+            } else {
+                // it's a newline
+                break;
+            }
+        } else {
+            isBackslashEscaped = NO;
+            _nextIndex++;
+        }
+    }
+    [self _endUTF8Comment];
+    
+    return [self _parseUTF8Newline];
+}
+
+- (void)_parseUTF8FieldWhitespace {
+    while (1) {
+        NSUInteger available = _CHCSVAvailableBytes(self);
+        const uint8_t *bytes = _bytes + _nextIndex;
+        if (available == 0 || bytes[0] == _delimiter) { break; }
+        
+        NSUInteger length = _CHCSVUTF8WhitespaceLength(bytes, available);
+        if (length == 0) { break; }
+        
+        if (_trimsWhitespace == NO && _buildsSanitizedField) {
+            _CHCSVAppendSanitizedBytes(self, bytes, length);
+        }
+        _nextIndex += length;
+    }
+}
+
+- (BOOL)_parseUTF8Field {
     if (_cancelled) { return NO; }
     
-    NSUInteger charCount = 0;
-    unichar peek = [self _peekCharacter];
-    unichar peekPeek = [self _peekPeekCharacter];
+    BOOL parsedField = NO;
+    [self _beginUTF8Field];
+    
+    // consume leading whitespace
+    [self _parseUTF8FieldWhitespace];
+    
+    uint8_t next = _CHCSVPeekByte(self);
+    if (next == DOUBLE_QUOTE) {
+        parsedField = [self _parseUTF8EscapedField];
+    } else if (_recognizesLeadingEqualSign && next == EQUAL && _CHCSVPeekPeekByte(self) == DOUBLE_QUOTE) {
+        _nextIndex++; // consume the equal sign
+        parsedField = [self _parseUTF8EscapedField];
+    } else {
+        parsedField = [self _parseUTF8UnescapedField];
+        if (_trimsWhitespace && _buildsSanitizedField) {
+            NSRange trimmed = _CHCSVUTF8TrimmedRange(_sanitizedBytes, NSMakeRange(0, _sanitizedLength));
+            memmove(_sanitizedBytes, _sanitizedBytes + trimmed.location, trimmed.length);
+            _sanitizedLength = trimmed.length;
+        }
+    }
+    
+    if (parsedField) {
+        // consume trailing whitespace
+        [self _parseUTF8FieldWhitespace];
+        [self _endUTF8Field];
+    }
+    return parsedField;
+}
+
+- (BOOL)_parseUTF8EscapedField {
+    _nextIndex++; // consume the opening double quote
+    _fieldNeedsUnescaping = YES;
+    
+    // without building the sanitized field or backslashes, the contents don't need to be examined at all until the closing quote
+    BOOL skipsToClosingQuote = (_buildsSanitizedField == NO && _recognizesBackslashesAsEscapes == NO);
+    _CHCSVStructuralBytes stops = _CHCSVStructuralQuote | (_recognizesBackslashesAsEscapes ? _CHCSVStructuralBackslash : 0);
+    BOOL isBackslashEscaped = NO;
+    while (1) {
+        if (isBackslashEscaped == NO) {
+            // skip over plain field content in bulk
+            NSUInteger stop = skipsToClosingQuote ? _CHCSVSkipToClosingQuote(self) : _CHCSVSkipToStructuralByte(self, stops);
+            if (_buildsSanitizedField) { _CHCSVAppendSanitizedBytes(self, _bytes + _nextIndex, stop - _nextIndex); }
+            _nextIndex = stop;
+        }
+        
+        NSUInteger available = _CHCSVAvailableBytes(self);
+        if (available == 0) { break; }
+        
+        const uint8_t *bytes = _bytes + _nextIndex;
+        uint8_t next = bytes[0];
+        if (next == NULLCHAR) { break; }
+        
+        if (isBackslashEscaped == NO) {
+            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
+                isBackslashEscaped = YES;
+                _nextIndex++; // consume the backslash
+            } else if (next != DOUBLE_QUOTE) {
+                // delimiters and newlines are allowed inside an escaped field
+                if (_buildsSanitizedField) { _CHCSVAppendSanitizedBytes(self, bytes, 1); }
+                _nextIndex++;
+            } else if (available > 1 && bytes[1] == DOUBLE_QUOTE) {
+                if (_buildsSanitizedField) { _CHCSVAppendSanitizedBytes(self, bytes, 1); }
+                _nextIndex += 2;
+            } else {
+                // not a doubled double quote
+                break;
+            }
+        } else {
+            if (_buildsSanitizedField) { _CHCSVAppendSanitizedBytes(self, bytes, 1); }
+            isBackslashEscaped = NO;
+            _nextIndex++;
+        }
+    }
+    
+    if (_CHCSVPeekByte(self) == DOUBLE_QUOTE) {
+        _nextIndex++;
+        return YES;
+    }
+    
+    return NO;
+}
+
+- (BOOL)_parseUTF8UnescapedField {
+    _CHCSVStructuralBytes stops = _CHCSVStructuralDelimiter | _CHCSVStructuralNewline | (_recognizesBackslashesAsEscapes ? _CHCSVStructuralBackslash : 0);
+    BOOL isBackslashEscaped = NO;
+    while (1) {
+        if (isBackslashEscaped == NO) {
+            // skip over plain field content in bulk
+            NSUInteger stop = _CHCSVSkipToStructuralByte(self, stops);
+            if (_buildsSanitizedField) { _CHCSVAppendSanitizedBytes(self, _bytes + _nextIndex, stop - _nextIndex); }
+            _nextIndex = stop;
+        }
+        
+        NSUInteger available = _CHCSVAvailableBytes(self);
+        if (available == 0) { break; }
+        
+        const uint8_t *bytes = _bytes + _nextIndex;
+        uint8_t next = bytes[0];
+        if (next == NULLCHAR) { break; }
+        
+        if (isBackslashEscaped == NO) {
+            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
+                isBackslashEscaped = YES;
+                _fieldNeedsUnescaping = YES;
+                _nextIndex++;
+            } else if (next == _delimiter || _CHCSVUTF8NewlineLength(bytes, available) > 0) {
+                break;
+            } else {
+                if (_buildsSanitizedField) { _CHCSVAppendSanitizedBytes(self, bytes, 1); }
+                _nextIndex++;
+            }
+        } else {
+            isBackslashEscaped = NO;
+            if (_buildsSanitizedField) { _CHCSVAppendSanitizedBytes(self, bytes, 1); }
+            _nextIndex++;
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)_parseUTF8Delimiter {
+    NSUInteger available = _CHCSVAvailableBytes(self);
+    const uint8_t *bytes = _bytes + _nextIndex;
+    if (available > 0 && bytes[0] == _delimiter) {
+        _nextIndex++;
+        return YES;
+    }
+    if (available > 0 && bytes[0] != NULLCHAR && _CHCSVUTF8NewlineLength(bytes, available) == 0) {
+        NSString *unexpected = _CHCSVUTF8String(bytes, MIN(_CHCSVUTF8SequenceLength(bytes[0]), available));
+        unichar character = [unexpected length] > 0 ? [unexpected characterAtIndex:0] : bytes[0];
+        NSString *description = [NSString stringWithFormat:@"Unexpected delimiter. Expected '%C' (0x%X), but got '%C' (0x%X)", _delimiter, _delimiter, character, character];
+        _error = [[NSError alloc] initWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeInvalidFormat userInfo:@{NSLocalizedDescriptionKey : description}];
+    }
+    return NO;
+}
+
+- (void)_beginUTF8Field {
+    if (_cancelled) { return; }
+    
+    _sanitizedLength = 0;
+    _fieldNeedsUnescaping = NO;
+    _fieldRange.location = _nextIndex;
+    _skipsField = (_CHCSVIncludesColumn(self, _fieldIndex) == NO);
+    // a header field's sanitized value is needed to look up its name
+    _buildsSanitizedField = (_skipsField == NO && (_sanitizesWhileParsing || (_sanitizesFields && _resolvesColumnNames)));
+}
+
+- (void)_endUTF8Field {
+    if (_cancelled) { return; }
+    
+    _fieldRange.length = (_nextIndex - _fieldRange.location);
+    
+    // without quotes or escapes, the sanitized field is the same as the raw one
+    BOOL unescaped = (_sanitizesFields && _fieldNeedsUnescaping);
+    NSRange range = _fieldRange;
+    if (unescaped == NO && _trimsWhitespace && _skipsField == NO) {
+        range = _CHCSVUTF8TrimmedRange(_bytes, range);
+    }
+    
+    NSString *field = nil;
+    if (_resolvesColumnNames) {
+        field = unescaped ? _CHCSVUTF8String(_sanitizedBytes, _sanitizedLength) : _CHCSVFieldString(self, range);
+        if ([_columnNameSet containsObject:field]) {
+            _CHCSVIncludeColumn(self, _fieldIndex);
+        } else {
+            _skipsField = YES;
+        }
+    }
+    
+    if (_skipsField) {
+        // only the boundaries of a skipped field were needed
+        if (_scans) { _scanCounts.maximumFieldLength = MAX(_scanCounts.maximumFieldLength, _fieldRange.length); }
+    } else if (_batch != nil) {
+        // fields that need unescaping are delivered as they are, and only unescaped if they are looked at
+        _CHCSVBatchAddBufferedField(self, range, unescaped);
+    } else if (_delegateMethods.didReadField != NULL) {
+        if (field == nil) {
+            field = unescaped ? _CHCSVUTF8String(_sanitizedBytes, _sanitizedLength) : _CHCSVFieldString(self, range);
+        }
+        CHCSV_TIME_DELEGATE(_delegateMethods.didReadField(_delegate, @selector(parser:didReadField:atIndex:), self, field, _fieldIndex));
+    }
+    
+    _fieldRange.location = _nextIndex;
+    _fieldIndex++;
+    _counts.fieldCount++;
+}
+
+- (void)_beginUTF8Comment {
+    if (_cancelled) { return; }
+    
+    _fieldRange.location = _nextIndex;
+}
+
+- (void)_endUTF8Comment {
+    if (_cancelled) { return; }
+    
+    _fieldRange.length = (_nextIndex - _fieldRange.location);
+    if (_scans) { _scanCounts.commentCount++; }
+    if (_delegateMethods.didReadComment != NULL) {
+        [self _deliverRecords];
+        NSString *comment = _CHCSVFieldString(self, _fieldRange);
+        CHCSV_TIME_DELEGATE(_delegateMethods.didReadComment(_delegate, @selector(parser:didReadComment:), self, comment));
+    }
+    
+    _fieldRange.location = _nextIndex;
+}
+
+#pragma mark - Parallel Parsing
+
+- (void)_parseInParallel {
+    [self _beginDocument];
+    _currentRecord = 0;
+    
+    if (_resolvesColumnNames) {
+        // every chunk has to know which columns to report before it starts, so the header is read first
+        [self _resolveColumnNamesFromHeader];
+    }
+    if (_columnTypes != nil) {
+        [self _resolveTypedColumns];
+    }
+    
+    NSUInteger chunkCount = (_mappedLength + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+    NSMutableArray *chunks = [NSMutableArray arrayWithCapacity:chunkCount];
+    for (NSUInteger i = 0; i < chunkCount; i++) {
+        [chunks addObject:[[_CHCSVParallelChunk alloc] init]];
+    }
+    
+    NSUInteger processorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    NSOperationQueue *queue = [[NSOperationQueue alloc] init];
+    [queue setMaxConcurrentOperationCount:processorCount];
+    
+    // Records are delivered in order on this thread, so only a few chunks are parsed ahead of the delegate.
+    // This bounds how many parsed (but undelivered) records are held in memory at once.
+    NSUInteger lookahead = processorCount * 2;
+    NSUInteger scheduled = 0;
+    
+    NSUInteger start = 0;
+    BOOL finished = NO;
+    for (NSUInteger i = 0; i < chunkCount && finished == NO; i++) {
+        while (scheduled < chunkCount && scheduled <= i + lookahead) {
+            [self _scheduleChunkAtIndex:scheduled of:chunks onQueue:queue];
+            scheduled++;
+        }
+        
+        _CHCSVParallelChunk *chunk = chunks[i];
+        // if the operation is already gone, it has finished
+        [chunk.operation waitUntilFinished];
+        if (chunk.start != start) {
+            // the guessed start was inside a record that the previous chunk finished; parse again from where it ended
+            [self _parseChunk:chunk fromIndex:start];
+        }
+        if (chunk.overruns) {
+            // a record is too long to find the end of in parallel (or the input keeps fooling the guesses)
+            [queue cancelAllOperations];
+            [queue waitUntilAllOperationsAreFinished];
+            [self _parseSequentiallyFromIndex:start];
+            break;
+        }
+        
+        [self _deliverChunk:chunk];
+        [chunks replaceObjectAtIndex:i withObject:[NSNull null]];
+        
+        start = chunk.end;
+        _error = chunk.error;
+        finished = (_error != nil || _cancelled || chunk.endsDocument);
+    }
+    
+    [queue cancelAllOperations];
+    [queue waitUntilAllOperationsAreFinished];
+    [self _finishRecordIndex];
+    [self _finishStatistics];
+    
+    if (_error != nil) {
+        [self _error];
+    } else {
+        [self _endDocument];
+    }
+}
+
+// Parses the rest of the file on this thread, from `index` (where the chunks delivered so far ended)
+- (void)_parseSequentiallyFromIndex:(NSUInteger)index {
+    [self _moveToIndex:index];
+    _indexesRecords = (_recordCheckpoints != nil);
+    _nextCheckpointRecord = _currentRecord + 1;
+    [self _parseRecordsUntilIndex:NSUIntegerMax];
+}
+
+// Includes the columns named in the header, without reporting the header
+- (void)_resolveColumnNamesFromHeader {
+    CHCSVParser *header = [self _chunkParserWithDelegate:nil];
+    [header _parseRecordsUntilIndex:1];
+    for (NSUInteger column = 0; column < header->_includedColumnCount; column++) {
+        if (header->_includedColumnFlags[column]) { _CHCSVIncludeColumn(self, column); }
+    }
+    _resolvesColumnNames = NO;
+}
+
+- (void)_scheduleChunkAtIndex:(NSUInteger)index of:(NSArray *)chunks onQueue:(NSOperationQueue *)queue {
+    _CHCSVParallelChunk *chunk = chunks[index];
+    NSOperation *operation = [NSBlockOperation blockOperationWithBlock:^{
+        // both guesses are deterministic, so this chunk's stop is always the next chunk's guessed start
+        NSUInteger start = 0;
+        if (index > 0) {
+            start = _CHCSVGuessRecordStart(_bytes, _mappedLength, index * PARALLEL_CHUNK_SIZE, (uint8_t)_delimiter);
+        }
+        NSUInteger stop = _mappedLength;
+        if ((index + 1) * PARALLEL_CHUNK_SIZE < _mappedLength) {
+            stop = _CHCSVGuessRecordStart(_bytes, _mappedLength, (index + 1) * PARALLEL_CHUNK_SIZE, (uint8_t)_delimiter);
+        }
+        chunk.stop = stop;
+        [self _parseChunk:chunk fromIndex:start];
+    }];
+    chunk.operation = operation;
+    [queue addOperation:operation];
+}
+
+- (void)_parseChunk:(_CHCSVParallelChunk *)chunk fromIndex:(NSUInteger)start {
+    @autoreleasepool {
+        chunk.receivesBatches = (_delegateMethods.didReadRecords != NULL);
+        CHCSVParser *parser = [self _chunkParserWithDelegate:chunk];
+        [parser _moveToIndex:start];
+        if (_recordCheckpoints != nil) {
+            parser->_recordIndexInterval = _recordIndexInterval;
+            parser->_recordCheckpoints = [[NSMutableData alloc] init];
+            parser->_indexesRecords = YES;
+        }
+        
+        // A wrong guess can leave the parser inside a quoted field that runs on to the end of the file, so it is only shown
+        // so much of what comes after stop. Running out of that means the chunk overran, and its events are thrown away.
+        NSUInteger limit = MIN(_mappedLength, chunk.stop + PARALLEL_OVERRUN_LIMIT);
+        parser->_mappedLength = limit;
+        
+        chunk.start = start;
+        chunk.events = [[NSMutableArray alloc] init];
+        [parser _parseRecordsUntilIndex:chunk.stop];
+        chunk.overruns = (limit < _mappedLength && parser->_nextIndex >= limit);
+        
+        if (_columnTypes != nil && chunk.receivesBatches) {
+            // the fields are converted here, so that it happens in parallel too
+            BOOL skipsHeader = (_includedColumnNames != nil && start == 0);
+            for (id event in chunk.events) {
+                if ([event isKindOfClass:[CHCSVRecordBatch class]] == NO) { continue; }
+                [event _convertColumns:_typedColumns count:_typedColumnCount skipsFirstRecord:skipsHeader];
+                skipsHeader = NO;
+            }
+        }
+        
+        chunk.end = parser->_nextIndex;
+        chunk.fieldCount = parser->_counts.fieldCount;
+        chunk.error = parser->_error;
+        chunk.recordCheckpoints = parser->_recordCheckpoints;
+        // stopping short of the next chunk means the document ended (or failed) in this one
+        chunk.endsDocument = (parser->_error != nil || parser->_nextIndex < chunk.stop);
+    }
+}
+
+// A parser for part of the mapped file, configured the same way as the receiver
+- (CHCSVParser *)_chunkParserWithDelegate:(id<CHCSVParserDelegate>)delegate {
+    CHCSVParser *parser = [[CHCSVParser alloc] _initWithMappedFile:_mappedFile delimiter:_delimiter];
+    parser.sanitizesFields = _sanitizesFields;
+    parser.trimsWhitespace = _trimsWhitespace;
+    parser.recognizesBackslashesAsEscapes = _recognizesBackslashesAsEscapes;
+    parser.recognizesComments = _recognizesComments;
+    parser.recognizesLeadingEqualSign = _recognizesLeadingEqualSign;
+    parser.recordBatchSize = _recordBatchSize;
+    parser.delegate = delegate;
+    [parser _lookUpDelegateMethods];
+    
+    parser->_projectsColumns = _projectsColumns;
+    parser->_resolvesColumnNames = _resolvesColumnNames;
+    parser->_columnNameSet = _columnNameSet;
+    for (NSUInteger column = 0; column < _includedColumnCount; column++) {
+        if (_includedColumnFlags[column]) { _CHCSVIncludeColumn(parser, column); }
+    }
+    return parser;
+}
+
+- (void)_deliverChunk:(_CHCSVParallelChunk *)chunk {
+    NSUInteger recordsBefore = _currentRecord;
+    for (id event in chunk.events) {
+        if (_cancelled) { break; }
+        
+        @autoreleasepool {
+            if ([event isKindOfClass:[CHCSVRecordBatch class]]) {
+                CHCSVRecordBatch *records = event;
+                [records setFirstRecordNumber:_currentRecord + 1];
+                _currentRecord += [records count];
+                _counts.recordCount += [records count];
+                [self _deliverBatch:records];
+            } else if ([event isKindOfClass:[NSArray class]]) {
+                [self _beginRecord];
+                for (NSString *field in event) {
+                    if (_cancelled) { break; }
+                    // skipped columns weren't collected, so each field's column is found again
+                    while (_CHCSVIncludesColumn(self, _fieldIndex) == NO) { _fieldIndex++; }
+                    if (_delegateMethods.didReadField != NULL) {
+                        CHCSV_TIME_DELEGATE(_delegateMethods.didReadField(_delegate, @selector(parser:didReadField:atIndex:), self, field, _fieldIndex));
+                    }
+                    _fieldIndex++;
+                }
+                [self _endRecord];
+            } else if (_delegateMethods.didReadComment != NULL) {
+                CHCSV_TIME_DELEGATE(_delegateMethods.didReadComment(_delegate, @selector(parser:didReadComment:), self, event));
+            }
+        }
+    }
+    
+    // the chunk numbered its records from 1, and only the ones that were delivered count
+    const _CHCSVRecordCheckpoint *checkpoints = [chunk.recordCheckpoints bytes];
+    NSUInteger checkpointCount = [chunk.recordCheckpoints length] / sizeof(_CHCSVRecordCheckpoint);
+    for (NSUInteger i = 0; i < checkpointCount && recordsBefore + checkpoints[i].record <= _currentRecord; i++) {
+        _CHCSVRecordCheckpoint checkpoint = { recordsBefore + checkpoints[i].record, checkpoints[i].offset };
+        [_recordCheckpoints appendBytes:&checkpoint length:sizeof(checkpoint)];
+    }
+    
+    chunk.events = nil;
+    _counts.fieldCount += chunk.fieldCount;
+    _counts.bytesRead = (unsigned long long)((_bytes + chunk.end) - [_mappedFile bytes]);
+    _counts.decodedLength = chunk.end;
+    _CHCSVPublishStatisticsIfNecessary(self);
+}
+
+#pragma mark - Incremental Parsing
+
+- (void)feedData:(NSData *)data {
+    if (_parsesIncrementally == NO) {
+        [NSException raise:NSInternalInconsistencyException format:@"Only a parser created with -initForIncrementalParsingWithDelimiter: can be fed data"];
+    }
+    if (_finishedIncrementalInput) {
+        [NSException raise:NSInternalInconsistencyException format:@"Cannot feed data to a parser after -finish"];
+    }
+    
+    @autoreleasepool {
+        [self _beginIncrementalParsing];
+        if (_incrementalParsingEnded) { return; }
+        
+        [self _appendIncrementalBytes:[data bytes] length:[data length]];
+        [self _parseIncrementalRecordsFinishing:NO];
+    }
+}
+
+- (void)finish {
+    if (_parsesIncrementally == NO) {
+        [NSException raise:NSInternalInconsistencyException format:@"Only a parser created with -initForIncrementalParsingWithDelimiter: can be finished"];
+    }
+    if (_finishedIncrementalInput) { return; }
+    _finishedIncrementalInput = YES;
+    
+    @autoreleasepool {
+        [self _beginIncrementalParsing];
+        if (_incrementalParsingEnded == NO) {
+            [self _parseIncrementalRecordsFinishing:YES];
+        }
+        
+        [self _finishStatistics];
+        if (_error != nil) {
+            [self _error];
+        } else {
+            [self _endDocument];
+        }
+    }
+}
+
+- (void)_beginIncrementalParsing {
+    if (_beganIncrementalParsing) { return; }
+    _beganIncrementalParsing = YES;
+    
+    [self _lookUpDelegateMethods];
+    [self _prepareIncludedColumns];
+    _boundaryScanner = (_CHCSVBoundaryScanner){
+        .state = _CHCSVBoundaryRecordStart,
+        .delimiter = (uint8_t)_delimiter,
+        .recognizesBackslashesAsEscapes = _recognizesBackslashesAsEscapes,
+        .recognizesComments = _recognizesComments,
+        .recognizesLeadingEqualSign = _recognizesLeadingEqualSign
+    };
+    
+    [self _beginStatistics];
+    [self _beginDocument];
+    _currentRecord = 0;
+}
+
+- (void)_appendIncrementalBytes:(const void *)bytes length:(NSUInteger)length {
+    if (_bytesCapacity - _bytesLength < length) {
+        _incrementalScanIndex -= [self _discardConsumedBytes];
+        if (_bytesCapacity - _bytesLength < length) {
+            _bytesCapacity = MAX(_bytesCapacity * 2, _bytesLength + length);
+            _bytes = reallocf(_bytes, _bytesCapacity);
+            _CHCSVNoteAllocation(self);
+        }
+    }
+    memcpy(_bytes + _bytesLength, bytes, length);
+    _bytesLength += length;
+    _counts.bytesRead += length;
+    _counts.decodedLength += length;
+    _CHCSVPublishStatisticsIfNecessary(self);
+}
+
+- (void)_parseIncrementalRecordsFinishing:(BOOL)finishing {
+    if (_checkedByteOrderMark == NO) {
+        if (_bytesLength < 3 && finishing == NO) { return; }
+        _checkedByteOrderMark = YES;
+        if (_bytesLength >= 3 && _bytes[0] == 0xEF && _bytes[1] == 0xBB && _bytes[2] == 0xBF) {
+            _incrementalScanIndex = 3;
+            _nextIndex = 3;
+            _fieldRange.location = 3;
+        }
+    }
+    
+    if (_boundaryScanner.followsCarriageReturn && _incrementalScanIndex < _bytesLength) {
+        // a CRLF split between two pieces of data; the record before it has already been parsed
+        _boundaryScanner.followsCarriageReturn = NO;
+        if (_bytes[_incrementalScanIndex] == '\n') {
+            _incrementalScanIndex++;
+            _nextIndex++;
+            _fieldRange.location = _nextIndex;
+        }
+    }
+    
+    NSUInteger stop = _bytesLength;
+    if (finishing == NO) {
+        stop = _CHCSVScanForRecordEnds(&_boundaryScanner, _bytes, &_incrementalScanIndex, _bytesLength);
+        if (stop == NSNotFound) { return; }
+    }
+    
+    // The parser only sees complete records, so it never has to wait for bytes in the middle of one.
+    // Whatever follows them stays in the buffer for next time.
+    NSUInteger length = _bytesLength;
+    _bytesLength = stop;
+    _bytesExhausted = YES;
+    [self _parseRecordsUntilIndex:stop];
+    _bytesLength = length;
+    _bytesExhausted = finishing;
+    
+    // as when parsing all at once, an error (or a NUL) ends the document
+    if (_error != nil || _cancelled || _nextIndex < stop) {
+        _incrementalParsingEnded = YES;
+    }
+}
+
+#pragma mark -
+
+- (void)_beginDocument {
+    if (_delegateMethods.didBeginDocument != NULL) {
+        CHCSV_TIME_DELEGATE(_delegateMethods.didBeginDocument(_delegate, @selector(parserDidBeginDocument:), self));
+    }
+}
+
+- (void)_endDocument {
+    if (_delegateMethods.didEndDocument != NULL) {
+        CHCSV_TIME_DELEGATE(_delegateMethods.didEndDocument(_delegate, @selector(parserDidEndDocument:), self));
+    }
+}
+
+- (void)_beginRecord {
+    if (_cancelled) { return; }
+    
+    _fieldIndex = 0;
+    _currentRecord++;
+    _counts.recordCount++;
+    if (_indexesRecords && _currentRecord >= _nextCheckpointRecord) {
+        _CHCSVRecordCheckpoint checkpoint = { _currentRecord, (uint64_t)((_bytes + _nextIndex) - [_mappedFile bytes]) };
+        [_recordCheckpoints appendBytes:&checkpoint length:sizeof(checkpoint)];
+        _nextCheckpointRecord = _currentRecord + _recordIndexInterval;
+    }
+    if (_batch == nil && _delegateMethods.didBeginLine != NULL) {
+        CHCSV_TIME_DELEGATE(_delegateMethods.didBeginLine(_delegate, @selector(parser:didBeginLine:), self, _currentRecord));
+    }
+}
+
+- (void)_endRecord {
+    if (_cancelled) { return; }
+    
+    // every column named in the header has been found
+    _resolvesColumnNames = NO;
+    
+    if (_scans) {
+        _CHCSVScanCountRecord(&_scanCounts, (NSUInteger)_fieldIndex);
+    } else if (_batch != nil) {
+        _batchRecordCount++;
+        _batchRecordStarts[_batchRecordCount] = _batchFieldCount;
+        if (_batchRecordCount == _recordBatchSize) {
+            [self _deliverRecords];
+        }
+    } else if (_delegateMethods.didEndLine != NULL) {
+        CHCSV_TIME_DELEGATE(_delegateMethods.didEndLine(_delegate, @selector(parser:didEndLine:), self, _currentRecord));
+    }
+}
+
+- (void)_deliverRecords {
+    if (_cancelled || _batchRecordCount == 0) { return; }
+    
+    NSUInteger fieldCount = _batchRecordStarts[_batchRecordCount];
+    for (NSUInteger i = 0; i < fieldCount; i++) {
+        _CHCSVBatchField field = _batchFields[i];
+        const uint8_t *bytes = field.copied ? _batchBytes + field.location : _bytes + (field.location - _bytesDiscarded);
+        _batchSpans[i] = (CHCSVFieldSpan){ bytes, field.length, field.needsUnescaping };
+    }
+    
+    [_batch _resetWithFirstRecordNumber:_currentRecord - _batchRecordCount + 1 count:_batchRecordCount fieldSpans:_batchSpans recordStarts:_batchRecordStarts];
+    if (_columnTypes != nil) {
+        [self _resolveTypedColumns];
+        [_batch _convertColumns:_typedColumns count:_typedColumnCount skipsFirstRecord:(_includedColumnNames != nil && [_batch firstRecordNumber] == 1)];
+    }
+    [self _deliverBatch:_batch];
+    
+    _batchRecordCount = 0;
+    _batchFieldCount = 0;
+    _batchBytesLength = 0;
+    _batchRetainedLocation = NSNotFound;
+}
+
+- (void)_deliverBatch:(CHCSVRecordBatch *)batch {
+    if (_delegateMethods.didFailToConvertField != NULL) {
+        [batch _enumerateConversionFailures:^(NSString *field, NSUInteger recordNumber, NSUInteger column, CHCSVColumnType type) {
+            if (_cancelled) { return; }
+            CHCSV_TIME_DELEGATE(_delegateMethods.didFailToConvertField(_delegate, @selector(parser:didFailToConvertField:ofRecord:column:toType:), self, field, recordNumber, column, type));
+        }];
+    }
+    if (_cancelled) { return; }
+    CHCSV_TIME_DELEGATE(_delegateMethods.didReadRecords(_delegate, @selector(parser:didReadRecords:), self, batch));
+}
+
+// Finds where the fields of each typed column are within the records, which depends on the columns that are included
+- (void)_resolveTypedColumns {
+    if (_resolvedTypedColumns) { return; }
+    _resolvedTypedColumns = YES;
+    
+    NSArray *columns = [[_columnTypes allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    _typedColumns = calloc(MAX([columns count], 1), sizeof(_CHCSVTypedColumn));
+    for (NSNumber *column in columns) {
+        NSUInteger index = [column unsignedIntegerValue];
+        CHCSVColumnType type = [_columnTypes[column] integerValue];
+        if (type < CHCSVColumnTypeInt64 || type > CHCSVColumnTypeTimestamp) {
+            [NSException raise:NSInvalidArgumentException format:@"Column %lu has an invalid type (%ld)", (unsigned long)index, (long)type];
+        }
+        if (_CHCSVIncludesColumn(self, index) == NO) { continue; }
+        
+        NSUInteger position = index;
+        if (_projectsColumns) {
+            position = 0;
+            for (NSUInteger included = 0; included < index; included++) {
+                if (_includedColumnFlags[included]) { position++; }
+            }
+        }
+        _typedColumns[_typedColumnCount++] = (_CHCSVTypedColumn){ index, position, type };
+    }
+}
+
+- (void)_beginField {
+    if (_cancelled) { return; }
+    
+    _sanitizedCharactersLength = 0;
+    _sanitizedRunStart = NSNotFound;
+    _fieldRange.location = _nextIndex;
+    _skipsField = (_CHCSVIncludesColumn(self, _fieldIndex) == NO);
+    _buildsSanitizedField = (_skipsField == NO && _sanitizesFields);
+}
+
+- (void)_endField {
+    if (_cancelled) { return; }
+    
+    _fieldRange.length = (_nextIndex - _fieldRange.location);
+    
+    NSString *field = nil;
+    if (_resolvesColumnNames) {
+        field = [self _fieldString];
+        if ([_columnNameSet containsObject:field]) {
+            _CHCSVIncludeColumn(self, _fieldIndex);
+        } else {
+            _skipsField = YES;
+        }
+    }
+    
+    if (_skipsField) {
+        // only the boundaries of a skipped field were needed
+        if (_scans) { _scanCounts.maximumFieldLength = MAX(_scanCounts.maximumFieldLength, _fieldRange.length); }
+    } else if (_batch != nil) {
+        // the field's characters are copied straight into the batch, without copying them into a string first
+        if (_sanitizesFields) {
+            NSString *sanitized = CFBridgingRelease(CFStringCreateWithCharactersNoCopy(kCFAllocatorDefault, _sanitizedCharacters, _sanitizedCharactersLength, kCFAllocatorNull));
+            _CHCSVBatchAddString(self, sanitized, NSMakeRange(0, _sanitizedCharactersLength));
+        } else {
+            _CHCSVBatchAddString(self, _string, [self _trimmedFieldRange]);
+        }
+    } else if (_delegateMethods.didReadField != NULL) {
+        if (field == nil) {
+            field = [self _fieldString];
+        }
+        CHCSV_TIME_DELEGATE(_delegateMethods.didReadField(_delegate, @selector(parser:didReadField:atIndex:), self, field, _fieldIndex));
+    }
+    
+    _fieldRange.location = _nextIndex;
+    _fieldIndex++;
+    _counts.fieldCount++;
+}
+
+- (NSRange)_trimmedFieldRange {
+    if (_trimsWhitespace == NO) {
+        return _fieldRange;
+    }
+    
+    NSCharacterSet *whitespace = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+    NSRange range = _fieldRange;
+    while (range.length > 0 && [whitespace characterIsMember:[_string characterAtIndex:range.location]]) {
+        range.location++;
+        range.length--;
+    }
+    while (range.length > 0 && [whitespace characterIsMember:[_string characterAtIndex:NSMaxRange(range) - 1]]) {
+        range.length--;
+    }
+    return range;
+}
+
+- (NSString *)_fieldString {
+    if (_sanitizesFields) {
+        return [[NSString alloc] initWithCharacters:_sanitizedCharacters length:_sanitizedCharactersLength];
+    }
+    return [_string substringWithRange:[self _trimmedFieldRange]];
+}
+
+- (void)_beginComment {
+    if (_cancelled) { return; }
+    
+    _fieldRange.location = _nextIndex;
+}
+
+- (void)_endComment {
+    if (_cancelled) { return; }
+    
+    _fieldRange.length = (_nextIndex - _fieldRange.location);
+    if (_scans) { _scanCounts.commentCount++; }
+    if (_delegateMethods.didReadComment != NULL) {
+        [self _deliverRecords];
+        NSString *comment = [_string substringWithRange:_fieldRange];
+        CHCSV_TIME_DELEGATE(_delegateMethods.didReadComment(_delegate, @selector(parser:didReadComment:), self, comment));
+    }
+    
+    _fieldRange.location = _nextIndex;
+}
+
+- (void)_error {
+    if (_cancelled) { return; }
+    
+    if (_delegateMethods.didFailWithError != NULL) {
+        CHCSV_TIME_DELEGATE(_delegateMethods.didFailWithError(_delegate, @selector(parser:didFailWithError:), self, _error));
+    }
+}
+
+@end
+
+#pragma mark - Writing
+
+typedef struct {
+    uint8_t bytes[WRITER_MINIMUM_BUFFER_SIZE];
+    NSUInteger length;
+} _CHCSVEncodedCharacter;
+
+static _CHCSVEncodedCharacter _CHCSVEncodeCharacter(unichar character, NSStringEncoding encoding) {
+    _CHCSVEncodedCharacter encoded = {{0}, 0};
+    NSString *string = [NSString stringWithCharacters:&character length:1];
+    [string getBytes:encoded.bytes maxLength:sizeof(encoded.bytes) usedLength:&encoded.length encoding:encoding options:NSStringEncodingConversionAllowLossy range:NSMakeRange(0, 1) remainingRange:NULL];
+    return encoded;
+}
+
+// writes the digits of value at the end of the buffer, with at least minimumDigits of them, and returns where they start
+NS_INLINE char *_CHCSVFormatDigits(unsigned long long value, NSInteger minimumDigits, char *end) {
+    char *digits = end;
+    while (value > 0 || minimumDigits > 0) {
+        *--digits = (char)('0' + value % 10);
+        value /= 10;
+        minimumDigits--;
+    }
+    return digits;
+}
+
+static NSUInteger _CHCSVFormatInt64(int64_t value, char *buffer) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    // negate as unsigned, so that INT64_MIN works too
+    unsigned long long magnitude = (value < 0) ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    char *start = _CHCSVFormatDigits(magnitude, 1, end);
+    
+    NSUInteger length = 0;
+    if (value < 0) { buffer[length++] = '-'; }
+    memcpy(buffer + length, start, end - start);
+    return length + (end - start);
+}
+
+static NSUInteger _CHCSVFormatDouble(double value, NSInteger precision, char *buffer) {
+    static const double powersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+    
+    if (precision < 0) {
+        // integers below 1e15 are written the same way by %.15g
+        if (value == trunc(value) && fabs(value) < 1e15) {
+            if (value == 0 && signbit(value)) {
+                memcpy(buffer, "-0", 2);
+                return 2;
+            }
+            return _CHCSVFormatInt64((int64_t)value, buffer);
+        }
+        
+        int length = 0;
+        for (int digits = 15; digits <= 17; digits++) {
+            length = snprintf_l(buffer, FORMATTED_NUMBER_SIZE, NULL, "%.*g", digits, value);
+            if (strtod_l(buffer, NULL, NULL) == value) { break; }
+        }
+        return (NSUInteger)length;
+    }
+    
+    if (precision < (NSInteger)(sizeof(powersOf10) / sizeof(powersOf10[0]))) {
+        // Scaling by an exact power of 10 is off by at most 2^-10 this far below 2^43, so unless the value is almost
+        // exactly halfway between two results, rounding the scaled value gives the same digits as printf does.
+        double scaled = fabs(value) * powersOf10[precision];
+        if (scaled < 0x1p43) {
+            double fraction = scaled - floor(scaled);
+            if (fabs(fraction - 0.5) > 0x1p-8) {
+                char digits[24];
+                char *end = digits + sizeof(digits);
+                char *start = _CHCSVFormatDigits((unsigned long long)llround(scaled), precision + 1, end);
+                NSUInteger integerDigits = (end - start) - precision;
+                
+                NSUInteger length = 0;
+                if (signbit(value)) { buffer[length++] = '-'; }
+                memcpy(buffer + length, start, integerDigits);
+                length += integerDigits;
+                if (precision > 0) {
+                    buffer[length++] = '.';
+                    memcpy(buffer + length, start + integerDigits, precision);
+                    length += precision;
+                }
+                return length;
+            }
+        }
+    }
+    
+    return (NSUInteger)snprintf_l(buffer, FORMATTED_NUMBER_SIZE, NULL, "%.*f", (int)precision, value);
+}
+
+// ISO 8601, in UTC; returns 0 (for an empty field) if the timestamp isn't finite, or is tens of millions of years away
+static NSUInteger _CHCSVFormatTimestamp(double value, NSInteger precision, char *buffer) {
+    static const int64_t powersOf10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+    if (!(fabs(value) < 1e15)) { return 0; }
+    
+    NSInteger digits = (precision < 0) ? 6 : precision;
+    double whole = floor(value);
+    int64_t seconds = (int64_t)whole;
+    int64_t fraction = llround((value - whole) * (double)powersOf10[digits]);
+    if (fraction == powersOf10[digits]) {
+        seconds++;
+        fraction = 0;
+    }
+    if (precision < 0) {
+        while (digits > 0 && fraction % 10 == 0) {
+            fraction /= 10;
+            digits--;
+        }
+    }
+    
+    int64_t days = seconds / 86400;
+    int64_t secondOfDay = seconds % 86400;
+    if (secondOfDay < 0) {
+        secondOfDay += 86400;
+        days--;
+    }
+    int64_t year = 0, month = 0, day = 0;
+    _CHCSVCivilFromDays(days, &year, &month, &day);
+    
+    char digitBuffer[24];
+    char *digitsEnd = digitBuffer + sizeof(digitBuffer);
+    NSUInteger length = 0;
+#define CHCSV_APPEND_DIGITS(_value, _minimumDigits) do { \
+    char *_start = _CHCSVFormatDigits((unsigned long long)(_value), (_minimumDigits), digitsEnd); \
+    memcpy(buffer + length, _start, digitsEnd - _start); \
+    length += digitsEnd - _start; \
+} while (0)
+    
+    if (year < 0) { buffer[length++] = '-'; }
+    CHCSV_APPEND_DIGITS(llabs(year), 4);
+    buffer[length++] = '-';
+    CHCSV_APPEND_DIGITS(month, 2);
+    buffer[length++] = '-';
+    CHCSV_APPEND_DIGITS(day, 2);
+    buffer[length++] = 'T';
+    CHCSV_APPEND_DIGITS(secondOfDay / 3600, 2);
+    buffer[length++] = ':';
+    CHCSV_APPEND_DIGITS(secondOfDay / 60 % 60, 2);
+    buffer[length++] = ':';
+    CHCSV_APPEND_DIGITS(secondOfDay % 60, 2);
+    if (digits > 0) {
+        buffer[length++] = '.';
+        CHCSV_APPEND_DIGITS(fraction, digits);
+    }
+    buffer[length++] = 'Z';
+#undef CHCSV_APPEND_DIGITS
+    
+    return length;
+}
+
+@interface CHCSVWriter ()
+- (instancetype)_initForBatchOfWriter:(CHCSVWriter *)writer NS_DESIGNATED_INITIALIZER;
+- (BOOL)_writeBuffer;
+@end
+
+@implementation CHCSVWriter {
+    NSOutputStream *_stream;
+    NSStringEncoding _streamEncoding;
+    
+    // everything is encoded straight into this buffer, which is written to the stream once it fills up
+    uint8_t *_buffer;
+    NSUInteger _bufferLength;
+    NSUInteger _bufferCapacity;
+    
+    // the encoded forms of the characters the writer adds on its own
+    _CHCSVEncodedCharacter _delimiter;
+    _CHCSVEncodedCharacter _quote;
+    _CHCSVEncodedCharacter _newline;
+    _CHCSVEncodedCharacter _octothorpe;
+    
+    // which ASCII characters force a field to be quoted; the delimiter might be outside of ASCII
+    BOOL _quotedCharacters[128];
+    unichar _delimiterCharacter;
+    
+    // formatted numbers are ASCII; if the encoding doesn't write ASCII as is, this holds how it writes each character
+    _CHCSVEncodedCharacter *_encodedASCII;
+    
+    NSUInteger _currentLine;
+    NSUInteger _currentField;
+    NSMutableArray *_firstLineKeys;
+    
+    // set once the stream has refused some of the bytes
+    BOOL _streamFailed;
+    // a writer that formats a batch for another writer collects its output in the buffer, which grows as needed
+    BOOL _collectsOutput;
+    
+    // In parallel mode, lines are collected into batches. Each batch is formatted by its own writer on _formatQueue,
+    // and the formatted bytes are appended to this writer's buffer on _writeQueue, in the order the batches were made.
+    NSOperationQueue *_formatQueue;
+    NSOperationQueue *_writeQueue;
+    NSOperation *_lastWrite;
+    dispatch_semaphore_t _batchesInFlight;
+    // the finished lines (as arrays of fields) and comments (as strings) of the next batch, and the line in progress
+    NSMutableArray *_pendingLines;
+    NSMutableArray *_pendingFields;
+    
+    // when writing in parallel, the bytes are written (and counted) on _writeQueue
+    _CHCSVWriterCounts _counts;
+}
+
+NS_INLINE void _CHCSVWriterAppendBytes(CHCSVWriter *writer, const void *bytes, NSUInteger length) {
+    while (writer->_bufferCapacity - writer->_bufferLength < length) {
+        NSUInteger available = writer->_bufferCapacity - writer->_bufferLength;
+        memcpy(writer->_buffer + writer->_bufferLength, bytes, available);
+        writer->_bufferLength += available;
+        bytes = (const uint8_t *)bytes + available;
+        length -= available;
+        [writer _writeBuffer];
+    }
+    memcpy(writer->_buffer + writer->_bufferLength, bytes, length);
+    writer->_bufferLength += length;
+}
+
+NS_INLINE void _CHCSVWriterAppendCharacter(CHCSVWriter *writer, const _CHCSVEncodedCharacter *character) {
+    _CHCSVWriterAppendBytes(writer, character->bytes, character->length);
+}
+
+static void _CHCSVWriterAppendString(CHCSVWriter *writer, NSString *string, NSRange range) {
+    while (range.length > 0) {
+        if (writer->_bufferCapacity - writer->_bufferLength < WRITER_MINIMUM_BUFFER_SIZE) {
+            [writer _writeBuffer];
+        }
+        
+        NSUInteger used = 0;
+        NSRange remaining = NSMakeRange(NSMaxRange(range), 0);
+        [string getBytes:writer->_buffer + writer->_bufferLength
+               maxLength:writer->_bufferCapacity - writer->_bufferLength
+              usedLength:&used
+                encoding:writer->_streamEncoding
+                 options:NSStringEncodingConversionAllowLossy
+                   range:range
+          remainingRange:&remaining];
+        writer->_bufferLength += used;
+        
+        // no progress with room for any character means the encoding can't represent the rest
+        if (remaining.length == range.length) { break; }
+        range = remaining;
+    }
+}
+
+static void _CHCSVWriterAppendField(CHCSVWriter *writer, NSString *string) {
+    NSUInteger length = [string length];
+    
+    CFStringInlineBuffer characters;
+    CFStringInitInlineBuffer((__bridge CFStringRef)string, &characters, CFRangeMake(0, (CFIndex)length));
+    
+    BOOL needsQuotes = NO;
+    BOOL containsQuote = NO;
+    for (NSUInteger i = 0; i < length; i++) {
+        UniChar character = CFStringGetCharacterFromInlineBuffer(&characters, (CFIndex)i);
+        if (character < 128) {
+            if (writer->_quotedCharacters[character]) {
+                needsQuotes = YES;
+                if (character == DOUBLE_QUOTE) {
+                    containsQuote = YES;
+                    break;
+                }
+            }
+        } else if (character == writer->_delimiterCharacter || character == 0x0085 || character == 0x2028 || character == 0x2029) {
+            needsQuotes = YES;
+        }
+    }
+    
+    if (needsQuotes == NO) {
+        _CHCSVWriterAppendString(writer, string, NSMakeRange(0, length));
+        return;
+    }
+    
+    // surround in double quotes, and double up the double quotes inside
+    _CHCSVWriterAppendCharacter(writer, &writer->_quote);
+    NSUInteger runStart = 0;
+    if (containsQuote) {
+        for (NSUInteger i = 0; i < length; i++) {
+            if (CFStringGetCharacterFromInlineBuffer(&characters, (CFIndex)i) == DOUBLE_QUOTE) {
+                _CHCSVWriterAppendString(writer, string, NSMakeRange(runStart, i + 1 - runStart));
+                _CHCSVWriterAppendCharacter(writer, &writer->_quote);
+                runStart = i + 1;
+            }
+        }
+    }
+    _CHCSVWriterAppendString(writer, string, NSMakeRange(runStart, length - runStart));
+    _CHCSVWriterAppendCharacter(writer, &writer->_quote);
+}
+
+static void _CHCSVWriterAppendUTF8Field(CHCSVWriter *writer, const uint8_t *bytes, NSUInteger length) {
+    if (_CHCSVIsValidUTF8(bytes, length) == NO) {
+        // malformed UTF-8 is mapped one-to-one (as the parser does), whatever the stream's encoding
+        _CHCSVWriterAppendField(writer, _CHCSVUTF8String(bytes, length));
+        return;
+    }
+    if (writer->_streamEncoding != NSUTF8StringEncoding) {
+        NSString *string = (__bridge_transfer NSString *)CFStringCreateWithBytesNoCopy(kCFAllocatorDefault, bytes, (CFIndex)length, kCFStringEncodingUTF8, false, kCFAllocatorNull);
+        _CHCSVWriterAppendField(writer, string);
+        return;
+    }
+    
+    BOOL needsQuotes = NO;
+    BOOL containsQuote = NO;
+    for (NSUInteger i = 0; i < length; i++) {
+        uint8_t byte = bytes[i];
+        if (byte < 0x80) {
+            if (writer->_quotedCharacters[byte]) {
+                needsQuotes = YES;
+                if (byte == DOUBLE_QUOTE) {
+                    containsQuote = YES;
+                    break;
+                }
+            }
+        } else if (_CHCSVUTF8NewlineLength(bytes + i, length - i) > 0 ||
+                   (writer->_delimiterCharacter >= 0x80 && length - i >= writer->_delimiter.length && memcmp(bytes + i, writer->_delimiter.bytes, writer->_delimiter.length) == 0)) {
+            needsQuotes = YES;
+        }
+    }
+    
+    if (needsQuotes == NO) {
+        _CHCSVWriterAppendBytes(writer, bytes, length);
+        return;
+    }
+    
+    _CHCSVWriterAppendCharacter(writer, &writer->_quote);
+    NSUInteger runStart = 0;
+    if (containsQuote) {
+        const uint8_t *quote = NULL;
+        while ((quote = memchr(bytes + runStart, DOUBLE_QUOTE, length - runStart)) != NULL) {
+            NSUInteger runEnd = (quote - bytes) + 1;
+            _CHCSVWriterAppendBytes(writer, bytes + runStart, runEnd - runStart);
+            _CHCSVWriterAppendCharacter(writer, &writer->_quote);
+            runStart = runEnd;
+        }
+    }
+    _CHCSVWriterAppendBytes(writer, bytes + runStart, length - runStart);
+    _CHCSVWriterAppendCharacter(writer, &writer->_quote);
+}
+
+static void _CHCSVWriterAppendNumber(CHCSVWriter *writer, const char *characters, NSUInteger length) {
+    // numbers (and booleans and timestamps) never contain quotes or newlines, but they might contain the delimiter
+    BOOL needsQuotes = NO;
+    for (NSUInteger i = 0; i < length; i++) {
+        needsQuotes |= writer->_quotedCharacters[(uint8_t)characters[i]];
+    }
+    
+    if (needsQuotes) { _CHCSVWriterAppendCharacter(writer, &writer->_quote); }
+    if (writer->_encodedASCII == NULL) {
+        _CHCSVWriterAppendBytes(writer, characters, length);
+    } else {
+        for (NSUInteger i = 0; i < length; i++) {
+            _CHCSVWriterAppendCharacter(writer, &writer->_encodedASCII[(uint8_t)characters[i]]);
+        }
+    }
+    if (needsQuotes) { _CHCSVWriterAppendCharacter(writer, &writer->_quote); }
+}
+
+- (instancetype)initForWritingToCSVFile:(NSString *)path {
+    NSOutputStream *stream = [NSOutputStream outputStreamToFileAtPath:path append:NO];
+    return [self initWithOutputStream:stream encoding:NSUTF8StringEncoding delimiter:COMMA];
+}
+
+- (instancetype)initWithOutputStream:(NSOutputStream *)stream encoding:(NSStringEncoding)encoding delimiter:(unichar)delimiter {
+    self = [super init];
+    if (self) {
+        _stream = stream;
+        _streamEncoding = encoding;
+        
+        if ([_stream streamStatus] == NSStreamStatusNotOpen) {
+            [_stream open];
+        }
+        
+        _bufferCapacity = WRITER_BUFFER_SIZE;
+        _buffer = malloc(_bufferCapacity);
+        _counts.allocationCount = 1;
+        _counts.peakBufferSize = _bufferCapacity;
+        
+        NSData *a = [@"a" dataUsingEncoding:_streamEncoding];
+        NSData *aa = [@"aa" dataUsingEncoding:_streamEncoding];
+        if ([a length] * 2 != [aa length]) {
+            NSUInteger characterLength = [aa length] - [a length];
+            NSData *bom = [a subdataWithRange:NSMakeRange(0, [a length] - characterLength)];
+            _CHCSVWriterAppendBytes(self, [bom bytes], [bom length]);
+        }
+        
+        _delimiterCharacter = delimiter;
+        _delimiter = _CHCSVEncodeCharacter(delimiter, _streamEncoding);
+        _quote = _CHCSVEncodeCharacter(DOUBLE_QUOTE, _streamEncoding);
+        _newline = _CHCSVEncodeCharacter('\n', _streamEncoding);
+        _octothorpe = _CHCSVEncodeCharacter(OCTOTHORPE, _streamEncoding);
+        
+        NSCharacterSet *newlines = [NSCharacterSet newlineCharacterSet];
+        for (unichar character = 0; character < 128; character++) {
+            _quotedCharacters[character] = [newlines characterIsMember:character];
+        }
+        _quotedCharacters[DOUBLE_QUOTE] = YES;
+        if (delimiter < 128) {
+            _quotedCharacters[delimiter] = YES;
+        }
+        
+        if (_streamEncoding != NSUTF8StringEncoding) {
+            char ascii[128];
+            uint8_t encoded[128];
+            for (NSUInteger character = 0; character < 128; character++) {
+                ascii[character] = (char)character;
+            }
+            NSString *asciiString = [[NSString alloc] initWithBytes:ascii length:sizeof(ascii) encoding:NSASCIIStringEncoding];
+            NSUInteger used = 0;
+            [asciiString getBytes:encoded maxLength:sizeof(encoded) usedLength:&used encoding:_streamEncoding options:0 range:NSMakeRange(0, sizeof(ascii)) remainingRange:NULL];
+            if (used != sizeof(ascii) || memcmp(encoded, ascii, sizeof(ascii)) != 0) {
+                _encodedASCII = malloc(128 * sizeof(_CHCSVEncodedCharacter));
+                for (unichar character = 0; character < 128; character++) {
+                    _encodedASCII[character] = _CHCSVEncodeCharacter(character, _streamEncoding);
+                }
+            }
+        }
+        
+        _firstLineKeys = [NSMutableArray array];
+        _linesPerBatch = WRITER_BATCH_SIZE;
+        _maximumBatchesInFlight = [[NSProcessInfo processInfo] activeProcessorCount] * 2;
+    }
+    return self;
+}
+
+- (instancetype)_initForBatchOfWriter:(CHCSVWriter *)writer {
+    self = [super init];
+    if (self) {
+        _streamEncoding = writer->_streamEncoding;
+        _collectsOutput = YES;
+        _bufferCapacity = WRITER_BUFFER_SIZE;
+        _buffer = malloc(_bufferCapacity);
+        _counts.allocationCount = 1;
+        _counts.peakBufferSize = _bufferCapacity;
+        
+        _delimiter = writer->_delimiter;
+        _quote = writer->_quote;
+        _newline = writer->_newline;
+        _octothorpe = writer->_octothorpe;
+        memcpy(_quotedCharacters, writer->_quotedCharacters, sizeof(_quotedCharacters));
+        _delimiterCharacter = writer->_delimiterCharacter;
+        if (writer->_encodedASCII != NULL) {
+            _encodedASCII = malloc(128 * sizeof(_CHCSVEncodedCharacter));
+            memcpy(_encodedASCII, writer->_encodedASCII, 128 * sizeof(_CHCSVEncodedCharacter));
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self closeStream];
+    free(_buffer);
+    free(_encodedASCII);
+}
+
+- (NSUInteger)bufferSize {
+    return _bufferCapacity;
+}
+
+- (void)setBufferSize:(NSUInteger)bufferSize {
+    if (bufferSize < WRITER_MINIMUM_BUFFER_SIZE) {
+        [NSException raise:NSInvalidArgumentException format:@"The buffer size must be at least %d bytes", WRITER_MINIMUM_BUFFER_SIZE];
+    }
+    [self flush];
+    _bufferCapacity = bufferSize;
+    _buffer = reallocf(_buffer, _bufferCapacity);
+    _counts.allocationCount++;
+    _counts.peakBufferSize = MAX(_counts.peakBufferSize, _bufferCapacity);
+}
+
+- (CHCSVWriterStatistics *)currentStatistics {
+    if (_writesInParallel == NO) {
+        return [[CHCSVWriterStatistics alloc] _initWithCounts:&_counts lineCount:_currentLine];
+    }
+    
+    // the bytes are counted on _writeQueue, so the snapshot is taken there, once every batch submitted before it is written
+    __block CHCSVWriterStatistics *statistics = nil;
+    NSUInteger lineCount = _currentLine;
+    NSOperation *snapshot = [NSBlockOperation blockOperationWithBlock:^{
+        statistics = [[CHCSVWriterStatistics alloc] _initWithCounts:&self->_counts lineCount:lineCount];
+    }];
+    [_writeQueue addOperation:snapshot];
+    [snapshot waitUntilFinished];
+    return statistics;
+}
+
+- (BOOL)flush {
+    [self _finishBatches];
+    [self _writeBuffer];
+    return (_streamFailed == NO);
+}
+
+- (BOOL)_writeBuffer {
+    if (_collectsOutput) {
+        // nothing is written; the writer that made this batch takes the whole buffer once it has been formatted
+        _bufferCapacity *= 2;
+        _buffer = reallocf(_buffer, _bufferCapacity);
+        _counts.allocationCount++;
+        _counts.peakBufferSize = MAX(_counts.peakBufferSize, _bufferCapacity);
+        return YES;
+    }
     
-    if (peek == '\r' && peekPeek == '\n') {
-        // assume \r\n is a single delimiter
-        charCount += 2;
-        [self _advance];
-        [self _advance];
-    } else if ([[NSCharacterSet newlineCharacterSet] characterIsMember:peek]) {
-        charCount++;
-        [self _advance];
+    NSUInteger written = 0;
+    BOOL succeeded = YES;
+    uint64_t writeStart = mach_absolute_time();
+    while (written < _bufferLength) {
+        // streams are allowed to accept fewer bytes than they were given
+        NSInteger result = [_stream write:_buffer + written maxLength:_bufferLength - written];
+        if (result <= 0) {
+            // the stream has failed (or is full), and there's nowhere else for these bytes to go
+            _streamFailed = YES;
+            succeeded = NO;
+            break;
+        }
+        written += result;
+    }
+    _counts.writingTime += mach_absolute_time() - writeStart;
+    _counts.bytesWritten += written;
+    _bufferLength = 0;
+    return succeeded;
+}
+
+#pragma mark Parallel Writing
+
+- (void)setWritesInParallel:(BOOL)writesInParallel {
+    if (writesInParallel == _writesInParallel) { return; }
+    if (_currentField != 0) {
+        [NSException raise:NSInternalInconsistencyException format:@"Cannot switch to or from parallel writing while a line is in progress"];
+    }
+    
+    [self _finishBatches];
+    _writesInParallel = writesInParallel;
+    if (_writesInParallel) {
+        _formatQueue = [[NSOperationQueue alloc] init];
+        [_formatQueue setMaxConcurrentOperationCount:[[NSProcessInfo processInfo] activeProcessorCount]];
+        _writeQueue = [[NSOperationQueue alloc] init];
+        [_writeQueue setMaxConcurrentOperationCount:1];
+        _batchesInFlight = dispatch_semaphore_create((long)_maximumBatchesInFlight);
+        _pendingLines = [[NSMutableArray alloc] init];
+        _pendingFields = [[NSMutableArray alloc] init];
+    } else {
+        _formatQueue = nil;
+        _writeQueue = nil;
+        _batchesInFlight = nil;
+        _pendingLines = nil;
+        _pendingFields = nil;
+    }
+}
+
+- (void)setLinesPerBatch:(NSUInteger)linesPerBatch {
+    if (linesPerBatch == 0) {
+        [NSException raise:NSInvalidArgumentException format:@"A batch must have at least 1 line"];
+    }
+    _linesPerBatch = linesPerBatch;
+}
+
+- (void)setMaximumBatchesInFlight:(NSUInteger)maximumBatchesInFlight {
+    if (maximumBatchesInFlight == 0) {
+        [NSException raise:NSInvalidArgumentException format:@"At least 1 batch must be allowed in flight"];
+    }
+    // the semaphore has to be back at its starting value before it is replaced
+    [self _finishBatches];
+    _maximumBatchesInFlight = maximumBatchesInFlight;
+    if (_writesInParallel) {
+        _batchesInFlight = dispatch_semaphore_create((long)_maximumBatchesInFlight);
+    }
+}
+
+// Formats a batch on another thread, and queues its bytes to be written after every batch submitted before it.
+// Waits while the maximum number of batches are already in flight.
+- (NSOperation *)_submitBatch:(void (^)(CHCSVWriter *batchWriter))format {
+    dispatch_semaphore_t batchesInFlight = _batchesInFlight;
+    dispatch_semaphore_wait(batchesInFlight, DISPATCH_TIME_FOREVER);
+    
+    // every batch is written before the writer goes away (see -closeStream), so it doesn't need to be retained
+    __unsafe_unretained CHCSVWriter *writer = self;
+    CHCSVWriter *batchWriter = [[CHCSVWriter alloc] _initForBatchOfWriter:self];
+    NSOperation *formatting = [NSBlockOperation blockOperationWithBlock:^{
+        @autoreleasepool {
+            format(batchWriter);
+        }
+    }];
+    // A serial queue runs operations without dependencies in the order they were added, so the writes stay in order.
+    // (Depending on the formatting instead of waiting for it would let a later write that is ready go first.)
+    NSOperation *writing = [NSBlockOperation blockOperationWithBlock:^{
+        [formatting waitUntilFinished];
+        _CHCSVWriterAppendBytes(writer, batchWriter->_buffer, batchWriter->_bufferLength);
+        dispatch_semaphore_signal(batchesInFlight);
+    }];
+    _lastWrite = writing;
+    
+    [_formatQueue addOperation:formatting];
+    [_writeQueue addOperation:writing];
+    return formatting;
+}
+
+- (void)_submitPendingLines {
+    if ([_pendingLines count] == 0) { return; }
+    
+    NSArray *lines = _pendingLines;
+    _pendingLines = [[NSMutableArray alloc] init];
+    [self _submitBatch:^(CHCSVWriter *batchWriter) {
+        for (id line in lines) {
+            if ([line isKindOfClass:[NSString class]]) {
+                [batchWriter writeComment:line];
+            } else {
+                [batchWriter writeLineOfFields:line];
+            }
+        }
+    }];
+}
+
+// submits the lines that have been finished, and waits until everything submitted has been written to the buffer
+- (void)_finishBatches {
+    if (_writesInParallel == NO) { return; }
+    
+    [self _submitPendingLines];
+    [_lastWrite waitUntilFinished];
+    _lastWrite = nil;
+}
+
+
+- (void)_writeString:(NSString *)string {
+    _CHCSVWriterAppendString(self, string, NSMakeRange(0, [string length]));
+}
+
+- (void)_writeDelimiter {
+    _CHCSVWriterAppendCharacter(self, &_delimiter);
+}
+
+- (void)writeField:(id)field {
+    if (_currentLine == 0) {
+        [_firstLineKeys addObject:field];
+    }
+    _counts.fieldCount++;
+    
+    if (_writesInParallel) {
+        // Strings and numbers are described when the batch is formatted, on another thread, so strings are copied
+        // (which only retains immutable ones). Anything else might change before then, so it is described now.
+        id pending = @"";
+        if ([field isKindOfClass:[NSString class]]) {
+            pending = [field copy];
+        } else if ([field isKindOfClass:[NSNumber class]]) {
+            pending = field;
+        } else if (field != nil) {
+            pending = [field description];
+        }
+        [_pendingFields addObject:pending];
+        _currentField++;
+        return;
+    }
+    
+    if (_currentField > 0) {
+        [self _writeDelimiter];
+    }
+    
+    NSString *string = field ? [field description] : @"";
+    _CHCSVWriterAppendField(self, string);
+    _currentField++;
+}
+
+- (void)finishLine {
+    if (_writesInParallel) {
+        [_pendingLines addObject:_pendingFields];
+        _pendingFields = [[NSMutableArray alloc] init];
+        if ([_pendingLines count] >= _linesPerBatch) {
+            [self _submitPendingLines];
+        }
+    } else {
+        _CHCSVWriterAppendCharacter(self, &_newline);
+    }
+    _currentField = 0;
+    _currentLine++;
+}
+
+- (void)_finishLineIfNecessary {
+    if (_currentField != 0) {
+        [self finishLine];
+    }
+}
+
+- (void)writeLineOfFields:(id<NSFastEnumeration>)fields {
+    [self _finishLineIfNecessary];
+    
+    for (id field in fields) {
+        [self writeField:field];
+    }
+    [self finishLine];
+}
+
+- (void)writeRows:(NSUInteger)rowCount columns:(const CHCSVColumn *)columns count:(NSUInteger)columnCount {
+    NSParameterAssert(columns != NULL || columnCount == 0);
+    for (NSUInteger column = 0; column < columnCount; column++) {
+        NSParameterAssert(columns[column].values != NULL || rowCount == 0);
+        if (columns[column].type == CHCSVColumnTypeDouble && columns[column].precision > WRITER_MAXIMUM_PRECISION) {
+            [NSException raise:NSInvalidArgumentException format:@"Doubles can be written with at most %d decimals", WRITER_MAXIMUM_PRECISION];
+        }
+        if (columns[column].type == CHCSVColumnTypeTimestamp && columns[column].precision > WRITER_MAXIMUM_TIMESTAMP_PRECISION) {
+            [NSException raise:NSInvalidArgumentException format:@"Timestamps can be written with at most %d decimals", WRITER_MAXIMUM_TIMESTAMP_PRECISION];
+        }
+    }
+    
+    [self _finishLineIfNecessary];
+    _counts.fieldCount += rowCount * columnCount;
+    
+    if (_writesInParallel) {
+        [self _submitPendingLines];
+        
+        // the columns only have to stay valid until this method returns, so it waits for the batches to be formatted
+        NSMutableArray *formatting = [NSMutableArray array];
+        for (NSUInteger firstRow = 0; firstRow < rowCount; firstRow += _linesPerBatch) {
+            NSUInteger batchRowCount = MIN(_linesPerBatch, rowCount - firstRow);
+            NSMutableData *batchColumns = [NSMutableData dataWithBytes:columns length:columnCount * sizeof(CHCSVColumn)];
+            CHCSVColumn *batch = [batchColumns mutableBytes];
+            for (NSUInteger column = 0; column < columnCount; column++) {
+                batch[column].values = (const uint8_t *)batch[column].values + firstRow * _CHCSVColumnValueSize(batch[column].type);
+                if (batch[column].nulls != NULL) {
+                    batch[column].nulls += firstRow;
+                }
+            }
+            [formatting addObject:[self _submitBatch:^(CHCSVWriter *batchWriter) {
+                [batchWriter writeRows:batchRowCount columns:[batchColumns bytes] count:columnCount];
+            }]];
+        }
+        for (NSOperation *operation in formatting) {
+            [operation waitUntilFinished];
+        }
+        _currentLine += rowCount;
+        return;
+    }
+    
+    char formatted[FORMATTED_NUMBER_SIZE];
+    for (NSUInteger row = 0; row < rowCount; row++) {
+        for (NSUInteger column = 0; column < columnCount; column++) {
+            const CHCSVColumn *values = &columns[column];
+            if (column > 0) {
+                _CHCSVWriterAppendCharacter(self, &_delimiter);
+            }
+            if (values->nulls != NULL && values->nulls[row]) { continue; }
+            
+            switch (values->type) {
+                case CHCSVColumnTypeInt64: {
+                    NSUInteger length = _CHCSVFormatInt64(((const int64_t *)values->values)[row], formatted);
+                    _CHCSVWriterAppendNumber(self, formatted, length);
+                    break;
+                }
+                case CHCSVColumnTypeDouble: {
+                    NSUInteger length = _CHCSVFormatDouble(((const double *)values->values)[row], values->precision, formatted);
+                    _CHCSVWriterAppendNumber(self, formatted, length);
+                    break;
+                }
+                case CHCSVColumnTypeUTF8: {
+                    CHCSVFieldSpan span = ((const CHCSVFieldSpan *)values->values)[row];
+                    _CHCSVWriterAppendUTF8Field(self, span.bytes, span.length);
+                    break;
+                }
+                case CHCSVColumnTypeBoolean: {
+                    BOOL value = ((const BOOL *)values->values)[row];
+                    _CHCSVWriterAppendNumber(self, value ? "true" : "false", value ? 4 : 5);
+                    break;
+                }
+                case CHCSVColumnTypeTimestamp: {
+                    NSUInteger length = _CHCSVFormatTimestamp(((const double *)values->values)[row], values->precision, formatted);
+                    if (length > 0) {
+                        _CHCSVWriterAppendNumber(self, formatted, length);
+                    }
+                    break;
+                }
+            }
+        }
+        _CHCSVWriterAppendCharacter(self, &_newline);
+    }
+    _currentLine += rowCount;
+}
+
+- (void)writeLineWithDictionary:(NSDictionary *)dictionary {
+    if (_currentLine == 0) {
+        [NSException raise:NSInternalInconsistencyException format:@"Cannot write a dictionary unless a line of keys has already been given"];
+    }
+    
+    [self _finishLineIfNecessary];
+    
+    for (id key in _firstLineKeys) {
+        id value = [dictionary objectForKey:key];
+        [self writeField:value];
+    }
+    [self finishLine];
+}
+
+- (void)writeComment:(NSString *)comment {
+    [self _finishLineIfNecessary];
+    
+    if (_writesInParallel) {
+        [_pendingLines addObject:[comment copy]];
+        if ([_pendingLines count] >= _linesPerBatch) {
+            [self _submitPendingLines];
+        }
+        return;
+    }
+    
+    NSArray *lines = [comment componentsSeparatedByCharactersInSet:[NSCharacterSet newlineCharacterSet]];
+    for (NSString *line in lines) {
+        _CHCSVWriterAppendCharacter(self, &_octothorpe);
+        [self _writeString:line];
+        _CHCSVWriterAppendCharacter(self, &_newline);
+    }
+}
+
+- (void)closeStream {
+    if (_stream == nil) { return; }
+    
+    if (_writesInParallel) {
+        [self _finishBatches];
+        // an unfinished line is written as it would have been without batches
+        for (NSUInteger index = 0; index < [_pendingFields count]; index++) {
+            if (index > 0) {
+                [self _writeDelimiter];
+            }
+            _CHCSVWriterAppendField(self, [_pendingFields[index] description]);
+        }
+        _pendingFields = nil;
+    }
+    
+    [self _writeBuffer];
+    [_stream close];
+    _stream = nil;
+}
+
+@end
+
+#pragma mark - Convenience Categories
+
+@interface _CHCSVAggregator : NSObject <CHCSVParserDelegate>
+
+@property (strong) NSMutableArray *lines;
+@property (strong) NSError *error;
+
+// returns NO if parsing should stop
+- (BOOL)addLine:(NSArray *)line fromParser:(CHCSVParser *)parser;
+
+@end
+
+@implementation _CHCSVAggregator
+
+- (void)parserDidBeginDocument:(CHCSVParser *)parser {
+    self.lines = [[NSMutableArray alloc] init];
+}
+
+- (void)parser:(CHCSVParser *)parser didReadRecords:(CHCSVRecordBatch *)records {
+    NSUInteger count = [records count];
+    for (NSUInteger i = 0; i < count; i++) {
+        if ([self addLine:[records fieldsOfRecordAtIndex:i] fromParser:parser] == NO) {
+            break;
+        }
+    }
+}
+
+- (BOOL)addLine:(NSArray *)line fromParser:(CHCSVParser *)parser {
+    [self.lines addObject:line];
+    return YES;
+}
+
+- (void)parser:(CHCSVParser *)parser didFailWithError:(NSError *)error {
+    self.error = error;
+    self.lines = nil;
+}
+
+@end
+
+/**
+ *  The keys of a @c CHCSVOrderedDictionary, along with where each key's value is.
+ *  Every row of a file parsed with @c CHCSVParserOptionsUsesFirstLineAsKeys shares the same one.
+ */
+@interface _CHCSVHeaderSchema : NSObject
+
+- (instancetype)initWithKeys:(NSArray *)keys;
+
+@property (readonly) NSArray *keys;
+// the number of distinct keys
+@property (readonly) NSUInteger count;
+// whether a key appears more than once, in which case its last value is the one that counts
+@property (readonly) BOOL hasDuplicateKeys;
+
+// NSNotFound if the key isn't present
+- (NSUInteger)indexOfKey:(id)key;
+// the index of the value for the key at an index
+- (NSUInteger)valueIndexAtIndex:(NSUInteger)index;
+
+@end
+
+@interface CHCSVOrderedDictionary ()
+
+// the values are used as-is, and must not be mutated afterwards
+- (instancetype)_initWithValues:(NSArray *)values schema:(_CHCSVHeaderSchema *)schema NS_DESIGNATED_INITIALIZER;
+
+@end
+
+@interface _CHCSVKeyedAggregator : _CHCSVAggregator
+
+@property (strong) NSArray *firstLine;
+@property (strong) _CHCSVHeaderSchema *schema;
+
+@end
+
+@implementation _CHCSVKeyedAggregator
+
+- (BOOL)addLine:(NSArray *)line fromParser:(CHCSVParser *)parser {
+    if (self.firstLine == nil) {
+        self.firstLine = line;
+        self.schema = [[_CHCSVHeaderSchema alloc] initWithKeys:line];
+    } else if (line.count == self.firstLine.count) {
+        // every line is a new array, so it doesn't need to be copied
+        CHCSVOrderedDictionary *orderedLine = [[CHCSVOrderedDictionary alloc] _initWithValues:line
+                                                                                       schema:self.schema];
+        [self.lines addObject:orderedLine];
+    } else {
+        [parser cancelParsing];
+        self.error = [NSError errorWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeIncorrectNumberOfFields userInfo:nil];
+        return NO;
     }
-    return (charCount > 0);
+    return YES;
 }
 
-- (BOOL)_parseComment {
-    [self _advance]; // consume the octothorpe
-    
-    NSCharacterSet *newlines = [NSCharacterSet newlineCharacterSet];
-    
-    [self _beginComment];
-    BOOL isBackslashEscaped = NO;
-    while (1) {
-        if (isBackslashEscaped == NO) {
-            unichar next = [self _peekCharacter];
-            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
-                isBackslashEscaped = YES;
-                [self _advance];
-            } else if ([newlines characterIsMember:next] == NO && next != NULLCHAR) {
-                [self _advance];
+@end
+
+static void _CHCSVConfigureParser(CHCSVParser *parser, CHCSVParserOptions options, NSArray *columns) {
+    BOOL usesFirstLineAsKeys = !!(options & CHCSVParserOptionsUsesFirstLineAsKeys);
+    if (columns != nil) {
+        NSMutableIndexSet *indexes = [NSMutableIndexSet indexSet];
+        NSMutableArray *names = [NSMutableArray array];
+        for (id column in columns) {
+            if ([column isKindOfClass:[NSString class]]) {
+                [names addObject:column];
+            } else if ([column isKindOfClass:[NSNumber class]]) {
+                [indexes addIndex:[column unsignedIntegerValue]];
             } else {
-                // it's a newline
-                break;
+                [NSException raise:NSInvalidArgumentException format:@"Columns must be NSNumbers or NSStrings, not %@", [column class]];
             }
-        } else {
-            isBackslashEscaped = YES;
-            [self _advance];
         }
-    }
-    [self _endComment];
-    
-    return [self _parseNewline];
-}
-
-- (void)_parseFieldWhitespace {
-    NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
-    while ([self _peekCharacter] != NULLCHAR &&
-           [whitespace characterIsMember:[self _peekCharacter]] &&
-           [self _peekCharacter] != _delimiter) {
         
-        if (_trimsWhitespace == NO) {
-            [_sanitizedField appendFormat:@"%C", [self _peekCharacter]];
-            // if we're sanitizing fields, then these characters would be stripped (because they're not appended to _sanitizedField)
+        if ([names count] > 0 && [indexes count] > 0) {
+            [NSException raise:NSInvalidArgumentException format:@"Columns must either all be indexes or all be names"];
+        }
+        if ([names count] > 0 && usesFirstLineAsKeys == NO) {
+            [NSException raise:NSInvalidArgumentException format:@"Columns can only be named when using the first line as keys"];
+        }
+        
+        if ([names count] > 0) {
+            parser.includedColumnNames = names;
+        } else {
+            parser.includedColumns = indexes;
         }
-        [self _advance];
     }
+    
+    parser.recognizesBackslashesAsEscapes = !!(options & CHCSVParserOptionsRecognizesBackslashesAsEscapes);
+    parser.sanitizesFields = !!(options & CHCSVParserOptionsSanitizesFields);
+    parser.recognizesComments = !!(options & CHCSVParserOptionsRecognizesComments);
+    parser.trimsWhitespace = !!(options & CHCSVParserOptionsTrimsWhitespace);
+    parser.recognizesLeadingEqualSign = !!(options & CHCSVParserOptionsRecognizesLeadingEqualSign);
+    parser.parsesInParallel = !!(options & CHCSVParserOptionsParsesInParallel);
 }
 
-- (BOOL)_parseField {
-    if (_cancelled) { return NO; }
-    
-    BOOL parsedField = NO;
-    [self _beginField];
+NSArray *_CHCSVParserParse(CHCSVParser *parser, CHCSVParserOptions options, NSArray *columns, NSError *__autoreleasing *error);
+NSArray *_CHCSVParserParse(CHCSVParser *parser, CHCSVParserOptions options, NSArray *columns, NSError *__autoreleasing *error) {
+    BOOL usesFirstLineAsKeys = !!(options & CHCSVParserOptionsUsesFirstLineAsKeys);
+    _CHCSVAggregator *aggregator = usesFirstLineAsKeys ? [[_CHCSVKeyedAggregator alloc] init] : [[_CHCSVAggregator alloc] init];
+    parser.delegate = aggregator;
+    _CHCSVConfigureParser(parser, options, columns);
     
-    // consume leading whitespace
-    [self _parseFieldWhitespace];
+    [parser parse];
     
-    if ([self _peekCharacter] == DOUBLE_QUOTE) {
-        parsedField = [self _parseEscapedField];
-    } else if (_recognizesLeadingEqualSign && [self _peekCharacter] == EQUAL && [self _peekPeekCharacter] == DOUBLE_QUOTE) {
-        [self _advance]; // consume the equal sign
-        parsedField = [self _parseEscapedField];
-    } else {
-        parsedField = [self _parseUnescapedField];
-        if (_trimsWhitespace) {
-            NSString *trimmedString = [_sanitizedField stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-            [_sanitizedField setString:trimmedString];
+    if (aggregator.error != nil) {
+        if (error) {
+            *error = aggregator.error;
         }
+        return nil;
+    } else {
+        return aggregator.lines;
     }
-    
-    if (parsedField) {
-        // consume trailing whitespace
-        [self _parseFieldWhitespace];
-        [self _endField];
+}
+
+#pragma mark - Record Caches
+
+/*
+ *  A record cache holds the result of parsing a file with the NSArray methods, stored by column, so that it can be
+ *  mapped and used without parsing the file again. All numbers are little-endian:
+ *
+ *  - the magic number and header (see RECORD_CACHE_HEADER_COUNT), followed by the file's path, padded to 8 bytes
+ *  - the number of fields in each row, as a uint32_t, padded to 8 bytes
+ *  - for each column, its fields' UTF-8 bytes back to back (padded to 8 bytes), then where each row's field ends
+ *    in those bytes, as a uint64_t. A row without a field in the column has an empty one
+ *  - for each column, the offsets and length of its ends and bytes (see RECORD_CACHE_COLUMN_SIZE)
+ *  - a checksum of the header, path and column offsets, and the offset of the column offsets
+ *
+ *  Rows with the keys first have their keys stored as the first row.
+ */
+
+typedef struct {
+    const uint8_t *ends;
+    const uint8_t *bytes;
+    uint64_t length;
+} _CHCSVCachedColumn;
+
+NS_INLINE NSURL *_CHCSVRecordCacheURL(NSURL *fileURL, NSURL *cacheDirectory) {
+    if (cacheDirectory == nil) {
+        return [fileURL URLByAppendingPathExtension:@"chcsvcache"];
     }
-    return parsedField;
+    // files with the same name in different folders get different caches
+    const char *path = [[[fileURL URLByStandardizingPath] path] fileSystemRepresentation];
+    uint64_t hash = _CHCSVChecksum(CHCSV_CHECKSUM_SEED, (const uint8_t *)path, strlen(path));
+    NSString *name = [NSString stringWithFormat:@"%@-%016llx.chcsvcache", [fileURL lastPathComponent], hash];
+    return [cacheDirectory URLByAppendingPathComponent:name];
 }
 
-- (BOOL)_parseEscapedField {
-    [self _advance]; // consume the opening double quote
+// the options that change what the parser returns
+NS_INLINE CHCSVParserOptions _CHCSVRecordCacheOptions(CHCSVParserOptions options) {
+    return options & ~(CHCSVParserOptionsParsesInParallel | CHCSVParserOptionsUsesCache);
+}
+
+NS_INLINE void _CHCSVPadData(NSMutableData *data, uint64_t offset) {
+    static const uint8_t zeros[8] = { 0 };
+    [data appendBytes:zeros length:(NSUInteger)((8 - offset % 8) % 8)];
+}
+
+/**
+ *  The rows of a record cache, which are made from the mapping as they are asked for.
+ *  A damaged cache can't be read outside of its mapping, but it may produce damaged rows.
+ */
+@interface _CHCSVCachedRows : NSArray
+
++ (instancetype)rowsWithContentsOfURL:(NSURL *)cacheURL forFileAtURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter;
+
+@end
+
+@implementation _CHCSVCachedRows {
+    _CHCSVMappedFile *_file;
+    CFAllocatorRef _deallocator;
+    const uint8_t *_fieldCounts;
+    _CHCSVCachedColumn *_columns;
+    NSUInteger _columnCount;
+    NSUInteger _firstRow;
+    NSUInteger _count;
+    _CHCSVHeaderSchema *_schema;
+}
+
++ (instancetype)rowsWithContentsOfURL:(NSURL *)cacheURL forFileAtURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter {
+    uint64_t fileSize = 0;
+    struct timespec modificationTime = { 0, 0 };
+    if (_CHCSVGetFileAttributes(fileURL, &fileSize, &modificationTime) == NO) { return nil; }
     
-    NSCharacterSet *newlines = [NSCharacterSet newlineCharacterSet];
-    BOOL isBackslashEscaped = NO;
-    while (1) {
-        unichar next = [self _peekCharacter];
-        if (next == NULLCHAR) { break; }
-        
-        if (isBackslashEscaped == NO) {
-            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
-                isBackslashEscaped = YES;
-                [self _advance]; // consume the backslash
-            } else if ([_validFieldCharacters characterIsMember:next] ||
-                       [newlines characterIsMember:next] ||
-                       next == _delimiter) {
-                [_sanitizedField appendFormat:@"%C", next];
-                [self _advance];
-            } else if (next == DOUBLE_QUOTE && [self _peekPeekCharacter] == DOUBLE_QUOTE) {
-                [_sanitizedField appendFormat:@"%C", next];
-                [self _advance];
-                [self _advance];
-            } else {
-                // not valid, or it's not a doubled double quote
-                break;
-            }
-        } else {
-            [_sanitizedField appendFormat:@"%C", next];
-            isBackslashEscaped = NO;
-            [self _advance];
-        }
+    _CHCSVMappedFile *file = [[_CHCSVMappedFile alloc] initWithURL:cacheURL];
+    const uint8_t *bytes = file.bytes;
+    uint64_t length = file.length;
+    if (file == nil || length < RECORD_CACHE_HEADER_SIZE + 2 * sizeof(uint64_t) || memcmp(bytes, RECORD_CACHE_MAGIC, 8) != 0) { return nil; }
+    // rows are usually read in order, but not necessarily
+    madvise((void *)bytes, (size_t)length, MADV_NORMAL);
+    
+    uint64_t header[RECORD_CACHE_HEADER_COUNT];
+    for (NSUInteger i = 0; i < RECORD_CACHE_HEADER_COUNT; i++) {
+        header[i] = _CHCSVReadUInt64(bytes + 8 + i * sizeof(uint64_t));
+    }
+    const char *path = [[[fileURL URLByStandardizingPath] path] fileSystemRepresentation];
+    uint64_t pathLength = header[9];
+    if (header[0] != RECORD_CACHE_VERSION || header[1] != fileSize || header[2] != (uint64_t)modificationTime.tv_sec || header[3] != (uint64_t)modificationTime.tv_nsec ||
+        header[4] != delimiter || header[5] != options || pathLength != strlen(path) || pathLength > length - RECORD_CACHE_HEADER_SIZE ||
+        memcmp(bytes + RECORD_CACHE_HEADER_SIZE, path, (size_t)pathLength) != 0) {
+        return nil;
     }
     
-    if ([self _peekCharacter] == DOUBLE_QUOTE) {
-        [self _advance];
-        return YES;
+    uint64_t rowCount = header[7];
+    uint64_t columnCount = header[8];
+    uint64_t columnsOffset = _CHCSVReadUInt64(bytes + length - sizeof(uint64_t));
+    uint64_t fieldCountsOffset = RECORD_CACHE_HEADER_SIZE + pathLength + (8 - pathLength % 8) % 8;
+    if (rowCount > length / sizeof(uint32_t) || columnCount > length / RECORD_CACHE_COLUMN_SIZE || fieldCountsOffset + rowCount * sizeof(uint32_t) > columnsOffset ||
+        columnsOffset > length || length - columnsOffset != columnCount * RECORD_CACHE_COLUMN_SIZE + 2 * sizeof(uint64_t)) {
+        return nil;
     }
     
-    return NO;
-}
-
-- (BOOL)_parseUnescapedField {
+    // the checksum covers everything that's used to find the columns
+    uint64_t checksum = _CHCSVChecksum(CHCSV_CHECKSUM_SEED, bytes, (NSUInteger)(RECORD_CACHE_HEADER_SIZE + pathLength));
+    checksum = _CHCSVChecksum(checksum, bytes + columnsOffset, (NSUInteger)(columnCount * RECORD_CACHE_COLUMN_SIZE));
+    if (checksum != _CHCSVReadUInt64(bytes + length - 2 * sizeof(uint64_t))) { return nil; }
     
-    NSCharacterSet *newlines = [NSCharacterSet newlineCharacterSet];
-    BOOL isBackslashEscaped = NO;
-    while (1) {
-        unichar next = [self _peekCharacter];
-        if (next == NULLCHAR) { break; }
-        
-        if (isBackslashEscaped == NO) {
-            if (next == BACKSLASH && _recognizesBackslashesAsEscapes) {
-                isBackslashEscaped = YES;
-                [self _advance];
-            } else if ([newlines characterIsMember:next] == YES || next == _delimiter) {
-                break;
-            } else {
-                [_sanitizedField appendFormat:@"%C", next];
-                [self _advance];
-            }
-        } else {
-            isBackslashEscaped = NO;
-            [_sanitizedField appendFormat:@"%C", next];
-            [self _advance];
+    BOOL keyed = (header[6] != 0);
+    if (keyed && (rowCount == 0) != (columnCount == 0)) { return nil; }
+    
+    _CHCSVCachedRows *rows = [[self alloc] init];
+    rows->_file = file;
+    rows->_fieldCounts = bytes + fieldCountsOffset;
+    rows->_columnCount = (NSUInteger)columnCount;
+    rows->_columns = calloc(MAX(rows->_columnCount, 1), sizeof(_CHCSVCachedColumn));
+    for (NSUInteger column = 0; column < columnCount; column++) {
+        const uint8_t *offsets = bytes + columnsOffset + column * RECORD_CACHE_COLUMN_SIZE;
+        uint64_t endsOffset = _CHCSVReadUInt64(offsets);
+        uint64_t bytesOffset = _CHCSVReadUInt64(offsets + sizeof(uint64_t));
+        uint64_t bytesLength = _CHCSVReadUInt64(offsets + 2 * sizeof(uint64_t));
+        if (endsOffset > columnsOffset || rowCount * sizeof(uint64_t) > columnsOffset - endsOffset ||
+            bytesOffset > columnsOffset || bytesLength > columnsOffset - bytesOffset) {
+            return nil;
         }
+        rows->_columns[column] = (_CHCSVCachedColumn){ bytes + endsOffset, bytes + bytesOffset, bytesLength };
     }
     
-    return YES;
-}
-
-- (BOOL)_parseDelimiter {
-    unichar next = [self _peekCharacter];
-    if (next == _delimiter) {
-        [self _advance];
-        return YES;
-    }
-    if (next != NULLCHAR && [[NSCharacterSet newlineCharacterSet] characterIsMember:next] == NO) {
-        NSString *description = [NSString stringWithFormat:@"Unexpected delimiter. Expected '%C' (0x%X), but got '%C' (0x%X)", _delimiter, _delimiter, [self _peekCharacter], [self _peekCharacter]];
-        _error = [[NSError alloc] initWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeInvalidFormat userInfo:@{NSLocalizedDescriptionKey : description}];
+    CFAllocatorContext context = {
+        .info = (__bridge void *)file,
+        .retain = _CHCSVMappedFileRetain,
+        .release = _CHCSVMappedFileRelease,
+        .deallocate = _CHCSVMappedFileDeallocate
+    };
+    rows->_deallocator = CFAllocatorCreate(kCFAllocatorDefault, &context);
+    rows->_count = (NSUInteger)rowCount;
+    if (keyed && rowCount > 0) {
+        rows->_schema = [[_CHCSVHeaderSchema alloc] initWithKeys:[rows _fieldsOfRow:0]];
+        rows->_firstRow = 1;
+        rows->_count--;
     }
-    return NO;
+    return rows;
 }
 
-- (void)_beginDocument {
-    if ([_delegate respondsToSelector:@selector(parserDidBeginDocument:)]) {
-        [_delegate parserDidBeginDocument:self];
+- (void)dealloc {
+    free(_columns);
+    if (_deallocator != NULL) {
+        CFRelease(_deallocator);
     }
 }
 
-- (void)_endDocument {
-    if ([_delegate respondsToSelector:@selector(parserDidEndDocument:)]) {
-        [_delegate parserDidEndDocument:self];
+- (NSArray *)_fieldsOfRow:(NSUInteger)row {
+    // keyed rows always have a value for every key
+    NSUInteger fieldCount = (_schema != nil) ? _columnCount : MIN(_CHCSVReadUInt32(_fieldCounts + row * sizeof(uint32_t)), _columnCount);
+    NSMutableArray *fields = [NSMutableArray arrayWithCapacity:fieldCount];
+    for (NSUInteger column = 0; column < fieldCount; column++) {
+        const _CHCSVCachedColumn *cached = &_columns[column];
+        uint64_t start = (row > 0) ? MIN(_CHCSVReadUInt64(cached->ends + (row - 1) * sizeof(uint64_t)), cached->length) : 0;
+        uint64_t end = MIN(MAX(_CHCSVReadUInt64(cached->ends + row * sizeof(uint64_t)), start), cached->length);
+        [fields addObject:_CHCSVMappedString(cached->bytes + start, (NSUInteger)(end - start), _deallocator) ?: @""];
     }
+    return fields;
 }
 
-- (void)_beginRecord {
-    if (_cancelled) { return; }
-    
-    _fieldIndex = 0;
-    _currentRecord++;
-    if ([_delegate respondsToSelector:@selector(parser:didBeginLine:)]) {
-        [_delegate parser:self didBeginLine:_currentRecord];
-    }
+- (NSUInteger)count {
+    return _count;
 }
 
-- (void)_endRecord {
-    if (_cancelled) { return; }
-    
-    if ([_delegate respondsToSelector:@selector(parser:didEndLine:)]) {
-        [_delegate parser:self didEndLine:_currentRecord];
+- (id)objectAtIndex:(NSUInteger)index {
+    if (index >= _count) {
+        [NSException raise:NSRangeException format:@"index %lu beyond bounds [0 .. %lu]", (unsigned long)index, (unsigned long)_count];
+    }
+    NSArray *fields = [self _fieldsOfRow:index + _firstRow];
+    if (_schema != nil) {
+        return [[CHCSVOrderedDictionary alloc] _initWithValues:fields schema:_schema];
     }
+    return fields;
 }
 
-- (void)_beginField {
-    if (_cancelled) { return; }
-    
-    [_sanitizedField setString:@""];
-    _fieldRange.location = _nextIndex;
-}
+@end
 
-- (void)_endField {
-    if (_cancelled) { return; }
+// Writes the rows to a new file that then replaces the cache, so a cache is never seen half-written
+static BOOL _CHCSVWriteRecordCache(NSArray *lines, BOOL keyed, NSURL *cacheURL, NSURL *fileURL, uint64_t fileSize, struct timespec modificationTime, CHCSVParserOptions options, unichar delimiter) {
+    NSUInteger rowCount = [lines count];
+    NSArray *keys = nil;
+    if (keyed && rowCount > 0) {
+        keys = [lines[0] allKeys];
+        rowCount++;
+    }
+    NSArray *(^rowAtIndex)(NSUInteger) = ^NSArray *(NSUInteger row) {
+        if (keys == nil) { return lines[row]; }
+        return (row == 0) ? keys : [lines[row - 1] allValues];
+    };
     
-    _fieldRange.length = (_nextIndex - _fieldRange.location);
-    NSString *field = nil;
+    NSUInteger columnCount = 0;
+    for (NSUInteger row = 0; row < rowCount; row++) {
+        columnCount = MAX(columnCount, [rowAtIndex(row) count]);
+    }
+    if (rowCount > UINT32_MAX || columnCount > UINT32_MAX) { return NO; }
     
-    if (_sanitizesFields) {
-        field = [_sanitizedField copy];
-    } else {
-        field = [_string substringWithRange:_fieldRange];
-        if (_trimsWhitespace) {
-            field = [field stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    // every writer (even another thread of this process) gets its own partial file, and the last rename wins
+    NSString *partialPath = [NSString stringWithFormat:@"%@.%@.partial", [cacheURL path], [[NSUUID UUID] UUIDString]];
+    FILE *file = fopen([partialPath fileSystemRepresentation], "wb");
+    if (file == NULL) { return NO; }
+    
+    __block uint64_t offset = 0;
+    __block BOOL succeeded = YES;
+    NSMutableData *buffer = [NSMutableData dataWithCapacity:RECORD_CACHE_WRITE_SIZE + 8];
+    void (^flush)(BOOL) = ^(BOOL force) {
+        if ([buffer length] >= RECORD_CACHE_WRITE_SIZE || (force && [buffer length] > 0)) {
+            succeeded = (succeeded && fwrite([buffer bytes], 1, [buffer length], file) == [buffer length]);
+            offset += [buffer length];
+            [buffer setLength:0];
         }
+    };
+    
+    const char *path = [[[fileURL URLByStandardizingPath] path] fileSystemRepresentation];
+    uint64_t pathLength = strlen(path);
+    NSMutableData *prefix = [NSMutableData dataWithCapacity:RECORD_CACHE_HEADER_SIZE + (NSUInteger)pathLength];
+    [prefix appendBytes:RECORD_CACHE_MAGIC length:8];
+    uint64_t header[RECORD_CACHE_HEADER_COUNT] = { RECORD_CACHE_VERSION, fileSize, (uint64_t)modificationTime.tv_sec, (uint64_t)modificationTime.tv_nsec,
+                                                   delimiter, options, keyed, rowCount, columnCount, pathLength };
+    for (NSUInteger i = 0; i < RECORD_CACHE_HEADER_COUNT; i++) {
+        _CHCSVAppendUInt64(prefix, header[i]);
     }
+    [prefix appendBytes:path length:(NSUInteger)pathLength];
+    uint64_t checksum = _CHCSVChecksum(CHCSV_CHECKSUM_SEED, [prefix bytes], [prefix length]);
+    [buffer appendData:prefix];
+    _CHCSVPadData(buffer, [buffer length]);
     
-    if ([_delegate respondsToSelector:@selector(parser:didReadField:atIndex:)]) {
-        [_delegate parser:self didReadField:field atIndex:_fieldIndex];
+    for (NSUInteger row = 0; row < rowCount; row++) {
+        _CHCSVAppendUInt32(buffer, (uint32_t)[rowAtIndex(row) count]);
+        flush(NO);
     }
+    _CHCSVPadData(buffer, offset + [buffer length]);
     
-    [_string replaceCharactersInRange:NSMakeRange(0, NSMaxRange(_fieldRange)) withString:@""];
-    _nextIndex = 0;
-    _fieldIndex++;
-}
-
-- (void)_beginComment {
-    if (_cancelled) { return; }
+    NSMutableData *columns = [NSMutableData dataWithCapacity:columnCount * RECORD_CACHE_COLUMN_SIZE];
+    NSMutableData *ends = [NSMutableData dataWithCapacity:rowCount * sizeof(uint64_t)];
+    for (NSUInteger column = 0; column < columnCount && succeeded; column++) {
+        uint64_t bytesOffset = offset + [buffer length];
+        uint64_t bytesLength = 0;
+        [ends setLength:0];
+        for (NSUInteger row = 0; row < rowCount; row++) {
+            @autoreleasepool {
+                NSArray *fields = rowAtIndex(row);
+                if (column < [fields count]) {
+                    NSString *field = [fields[column] description];
+                    NSUInteger maximumLength = [field maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+                    NSUInteger start = [buffer length];
+                    NSUInteger used = 0;
+                    [buffer setLength:start + maximumLength];
+                    [field getBytes:(uint8_t *)[buffer mutableBytes] + start maxLength:maximumLength usedLength:&used encoding:NSUTF8StringEncoding options:0 range:NSMakeRange(0, [field length]) remainingRange:NULL];
+                    [buffer setLength:start + used];
+                    bytesLength += used;
+                }
+                _CHCSVAppendUInt64(ends, bytesLength);
+                flush(NO);
+            }
+        }
+        _CHCSVPadData(buffer, offset + [buffer length]);
+        
+        uint64_t endsOffset = offset + [buffer length];
+        [buffer appendData:ends];
+        flush(NO);
+        _CHCSVAppendUInt64(columns, endsOffset);
+        _CHCSVAppendUInt64(columns, bytesOffset);
+        _CHCSVAppendUInt64(columns, bytesLength);
+    }
     
-    _fieldRange.location = _nextIndex;
-}
-
-- (void)_endComment {
-    if (_cancelled) { return; }
+    uint64_t columnsOffset = offset + [buffer length];
+    [buffer appendData:columns];
+    _CHCSVAppendUInt64(buffer, _CHCSVChecksum(checksum, [columns bytes], [columns length]));
+    _CHCSVAppendUInt64(buffer, columnsOffset);
+    flush(YES);
     
-    _fieldRange.length = (_nextIndex - _fieldRange.location);
-    if ([_delegate respondsToSelector:@selector(parser:didReadComment:)]) {
-        NSString *comment = [_string substringWithRange:_fieldRange];
-        [_delegate parser:self didReadComment:comment];
+    succeeded = (fclose(file) == 0 && succeeded);
+    if (succeeded) {
+        succeeded = (rename([partialPath fileSystemRepresentation], [[cacheURL path] fileSystemRepresentation]) == 0);
     }
-    
-    [_string replaceCharactersInRange:NSMakeRange(0, NSMaxRange(_fieldRange)) withString:@""];
-    _nextIndex = 0;
+    if (succeeded == NO) {
+        unlink([partialPath fileSystemRepresentation]);
+    }
+    return succeeded;
 }
 
-- (void)_error {
-    if (_cancelled) { return; }
+static NSArray *_CHCSVParseUsingCache(NSURL *fileURL, CHCSVParserOptions options, unichar delimiter, NSURL *cacheDirectory, NSError *__autoreleasing *error) {
+    NSURL *cacheURL = _CHCSVRecordCacheURL(fileURL, cacheDirectory);
+    CHCSVParserOptions cacheOptions = _CHCSVRecordCacheOptions(options);
+    NSArray *cached = [_CHCSVCachedRows rowsWithContentsOfURL:cacheURL forFileAtURL:fileURL options:cacheOptions delimiter:delimiter];
+    if (cached != nil) { return cached; }
+    
+    // the file is described as it was before parsing, so if it changes while it's parsed, the cache is already out of date
+    uint64_t fileSize = 0;
+    struct timespec modificationTime = { 0, 0 };
+    BOOL cachesLines = _CHCSVGetFileAttributes(fileURL, &fileSize, &modificationTime);
     
-    if ([_delegate respondsToSelector:@selector(parser:didFailWithError:)]) {
-        [_delegate parser:self didFailWithError:_error];
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfDelimitedURL:fileURL delimiter:delimiter];
+    NSArray *lines = _CHCSVParserParse(parser, options, nil, error);
+    if (lines != nil && cachesLines) {
+        // if the cache can't be written, the file is just parsed again next time
+        BOOL keyed = !!(options & CHCSVParserOptionsUsesFirstLineAsKeys);
+        _CHCSVWriteRecordCache(lines, keyed, cacheURL, fileURL, fileSize, modificationTime, cacheOptions, delimiter);
     }
+    return lines;
 }
 
-@end
+@implementation NSArray (CHCSVAdditions)
 
-@implementation CHCSVWriter {
-    NSOutputStream *_stream;
-    NSStringEncoding _streamEncoding;
-    
-    NSData *_delimiter;
-    NSData *_bom;
-    NSCharacterSet *_illegalCharacters;
-    
-    NSUInteger _currentLine;
-    NSUInteger _currentField;
-    NSMutableArray *_firstLineKeys;
++ (instancetype)arrayWithContentsOfCSVURL:(NSURL *)fileURL {
+    return [self arrayWithContentsOfDelimitedURL:fileURL options:0 delimiter:COMMA error:nil];
 }
 
-- (instancetype)initForWritingToCSVFile:(NSString *)path {
-    NSOutputStream *stream = [NSOutputStream outputStreamToFileAtPath:path append:NO];
-    return [self initWithOutputStream:stream encoding:NSUTF8StringEncoding delimiter:COMMA];
++ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL delimiter:(unichar)delimiter {
+    return [self arrayWithContentsOfDelimitedURL:fileURL options:0 delimiter:delimiter error:nil];
 }
 
-- (instancetype)initWithOutputStream:(NSOutputStream *)stream encoding:(NSStringEncoding)encoding delimiter:(unichar)delimiter {
-    self = [super init];
-    if (self) {
-        _stream = stream;
-        _streamEncoding = encoding;
-        
-        if ([_stream streamStatus] == NSStreamStatusNotOpen) {
-            [_stream open];
-        }
-        
-        NSData *a = [@"a" dataUsingEncoding:_streamEncoding];
-        NSData *aa = [@"aa" dataUsingEncoding:_streamEncoding];
-        if ([a length] * 2 != [aa length]) {
-            NSUInteger characterLength = [aa length] - [a length];
-            _bom = [a subdataWithRange:NSMakeRange(0, [a length] - characterLength)];
-            [self _writeData:_bom];
-        }
-        
-        NSString *delimiterString = [NSString stringWithFormat:@"%C", delimiter];
-        NSData *delimiterData = [delimiterString dataUsingEncoding:_streamEncoding];
-        if ([_bom length] > 0) {
-            _delimiter = [delimiterData subdataWithRange:NSMakeRange([_bom length], [delimiterData length] - [_bom length])];
-        } else {
-            _delimiter = delimiterData;
-        }
-        
-        NSMutableCharacterSet *illegalCharacters = [[NSCharacterSet newlineCharacterSet] mutableCopy];
-        [illegalCharacters addCharactersInString:delimiterString];
-        [illegalCharacters addCharactersInString:@"\""];
-        _illegalCharacters = [illegalCharacters copy];
-        
-        _firstLineKeys = [NSMutableArray array];
-    }
-    return self;
++ (instancetype)arrayWithContentsOfCSVURL:(NSURL *)fileURL options:(CHCSVParserOptions)options {
+    return [self arrayWithContentsOfDelimitedURL:fileURL options:options delimiter:COMMA error:nil];
 }
 
-- (void)dealloc {
-    [self closeStream];
++ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter {
+    return [self arrayWithContentsOfDelimitedURL:fileURL options:options delimiter:delimiter error:nil];
 }
 
-- (void)_writeData:(NSData *)data {
-    if ([data length] > 0) {
-        const void *bytes = [data bytes];
-        [_stream write:bytes maxLength:[data length]];
-    }
++ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter error:(NSError *__autoreleasing *)error {
+    return [self arrayWithContentsOfDelimitedURL:fileURL options:options delimiter:delimiter columns:nil error:error];
 }
 
-- (void)_writeString:(NSString *)string {
-    NSData *stringData = [string dataUsingEncoding:_streamEncoding];
-    NSRange subRange = NSMakeRange(0, stringData.length);
-    if ([_bom length] > 0) {
-        subRange.location = _bom.length;
-        subRange.length -= _bom.length;
++ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter columns:(NSArray *)columns error:(NSError *__autoreleasing *)error {
+    NSParameterAssert(fileURL);
+    if ((options & CHCSVParserOptionsUsesCache) && columns == nil) {
+        return _CHCSVParseUsingCache(fileURL, options, delimiter, nil, error);
     }
-    if (stringData.length <= 0) { return; }
     
-    const int8_t *bytes = stringData.bytes;
-    if (bytes[subRange.location + subRange.length - 1] == NULLCHAR) {
-        subRange.length -= 1;
-    }
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfDelimitedURL:fileURL delimiter:delimiter];
     
-    if (stringData.length <= 0) { return; }
-    if (subRange.length != stringData.length) {
-        stringData = [stringData subdataWithRange:subRange];
-    }
-    [self _writeData:stringData];
+    return _CHCSVParserParse(parser, options, columns, error);
 }
 
-- (void)_writeDelimiter {
-    [self _writeData:_delimiter];
++ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter cacheDirectory:(NSURL *)cacheDirectory error:(NSError *__autoreleasing *)error {
+    NSParameterAssert(fileURL);
+    return _CHCSVParseUsingCache(fileURL, options, delimiter, cacheDirectory, error);
 }
 
-- (void)writeField:(id)field {
-    if (_currentField > 0) {
-        [self _writeDelimiter];
-    }
-    
-    if (_currentLine == 0) {
-        [_firstLineKeys addObject:field];
+- (NSString *)CSVString {
+    NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+    CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:NSUTF8StringEncoding delimiter:COMMA];
+    for (id object in self) {
+        if ([object conformsToProtocol:@protocol(NSFastEnumeration)]) {
+            [writer writeLineOfFields:object];
+        }
     }
+    [writer closeStream];
     
-    NSString *string = field ? [field description] : @"";
-    
-    if ([string rangeOfCharacterFromSet:_illegalCharacters].location != NSNotFound) {
-        // replace double quotes with double double quotes
-        string = [string stringByReplacingOccurrencesOfString:@"\"" withString:@"\"\""];
-        // surround in double quotes
-        string = [NSString stringWithFormat:@"\"%@\"", string];
-    }
-    [self _writeString:string];
-    _currentField++;
+    NSData *buffer = [output propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+    return [[NSString alloc] initWithData:buffer encoding:NSUTF8StringEncoding];
 }
 
-- (void)finishLine {
-    [self _writeString:@"\n"];
-    _currentField = 0;
-    _currentLine++;
+@end
+
+@implementation NSString (CHCSVAdditions)
+
+- (NSArray *)CSVComponents {
+    return [self componentsSeparatedByDelimiter:COMMA options:0 error:nil];
 }
 
-- (void)_finishLineIfNecessary {
-    if (_currentField != 0) {
-        [self finishLine];
-    }
+- (NSArray *)CSVComponentsWithOptions:(CHCSVParserOptions)options {
+    return [self componentsSeparatedByDelimiter:COMMA options:options error:nil];
 }
 
-- (void)writeLineOfFields:(id<NSFastEnumeration>)fields {
-    [self _finishLineIfNecessary];
-    
-    for (id field in fields) {
-        [self writeField:field];
-    }
-    [self finishLine];
+- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter {
+    return [self componentsSeparatedByDelimiter:delimiter options:0 error:nil];
 }
 
-- (void)writeLineWithDictionary:(NSDictionary *)dictionary {
-    if (_currentLine == 0) {
-        [NSException raise:NSInternalInconsistencyException format:@"Cannot write a dictionary unless a line of keys has already been given"];
-    }
-    
-    [self _finishLineIfNecessary];
-    
-    for (id key in _firstLineKeys) {
-        id value = [dictionary objectForKey:key];
-        [self writeField:value];
-    }
-    [self finishLine];
+- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter options:(CHCSVParserOptions)options {
+    return [self componentsSeparatedByDelimiter:delimiter options:options error:nil];
 }
 
-- (void)writeComment:(NSString *)comment {
-    [self _finishLineIfNecessary];
-    
-    NSArray *lines = [comment componentsSeparatedByCharactersInSet:[NSCharacterSet newlineCharacterSet]];
-    for (NSString *line in lines) {
-        NSString *commented = [NSString stringWithFormat:@"#%@\n", line];
-        [self _writeString:commented];
-    }
+- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter options:(CHCSVParserOptions)options error:(NSError *__autoreleasing *)error {
+    return [self componentsSeparatedByDelimiter:delimiter options:options columns:nil error:error];
 }
 
-- (void)closeStream {
-    [_stream close];
-    _stream = nil;
+- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter options:(CHCSVParserOptions)options columns:(NSArray *)columns error:(NSError *__autoreleasing *)error {
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithDelimitedString:self delimiter:delimiter];
+    
+    return _CHCSVParserParse(parser, options, columns, error);
 }
 
 @end
 
-#pragma mark - Convenience Categories
-
-@interface _CHCSVAggregator : NSObject <CHCSVParserDelegate>
+#pragma mark - Tables
 
-@property (strong) NSMutableArray *lines;
-@property (strong) NSError *error;
+// a list of byte strings, stored back to back, along with where each one ends
+typedef struct {
+    uint8_t *bytes;
+    NSUInteger length;
+    NSUInteger capacity;
+    
+    // 32 bits wide, until the bytes outgrow them
+    void *ends;
+    BOOL hasWideEnds;
+    NSUInteger count;
+    NSUInteger endsCapacity;
+} _CHCSVByteList;
+
+NS_INLINE NSUInteger _CHCSVByteListEnd(const _CHCSVByteList *list, NSUInteger index) {
+    return list->hasWideEnds ? (NSUInteger)((const uint64_t *)list->ends)[index] : ((const uint32_t *)list->ends)[index];
+}
 
-@property (strong) NSMutableArray *currentLine;
+NS_INLINE CHCSVFieldSpan _CHCSVByteListGet(const _CHCSVByteList *list, NSUInteger index) {
+    NSUInteger start = (index > 0) ? _CHCSVByteListEnd(list, index - 1) : 0;
+    return (CHCSVFieldSpan){ list->bytes + start, _CHCSVByteListEnd(list, index) - start, NO };
+}
 
-@end
+static void _CHCSVByteListAppend(_CHCSVByteList *list, const uint8_t *bytes, NSUInteger length) {
+    if (list->length + length > list->capacity) {
+        list->capacity = MAX(list->capacity * 2, MAX(list->length + length, 256));
+        list->bytes = reallocf(list->bytes, list->capacity);
+    }
+    if (length > 0) {
+        // empty fields (such as the ones backfilling a new column) have no bytes at all
+        memcpy(list->bytes + list->length, bytes, length);
+    }
+    list->length += length;
+    
+    if (list->hasWideEnds == NO && list->length > UINT32_MAX) {
+        uint64_t *wide = malloc(list->endsCapacity * sizeof(uint64_t));
+        for (NSUInteger i = 0; i < list->count; i++) {
+            wide[i] = ((uint32_t *)list->ends)[i];
+        }
+        free(list->ends);
+        list->ends = wide;
+        list->hasWideEnds = YES;
+    }
+    
+    size_t endSize = list->hasWideEnds ? sizeof(uint64_t) : sizeof(uint32_t);
+    if (list->count == list->endsCapacity) {
+        list->endsCapacity = MAX(list->endsCapacity * 2, 64);
+        list->ends = reallocf(list->ends, list->endsCapacity * endSize);
+    }
+    if (list->hasWideEnds) {
+        ((uint64_t *)list->ends)[list->count] = list->length;
+    } else {
+        ((uint32_t *)list->ends)[list->count] = (uint32_t)list->length;
+    }
+    list->count++;
+}
 
-@implementation _CHCSVAggregator
+static void _CHCSVByteListTrim(_CHCSVByteList *list) {
+    list->capacity = list->length;
+    list->bytes = reallocf(list->bytes, MAX(list->capacity, 1));
+    list->endsCapacity = list->count;
+    list->ends = reallocf(list->ends, MAX(list->endsCapacity, 1) * (list->hasWideEnds ? sizeof(uint64_t) : sizeof(uint32_t)));
+}
 
-- (void)parserDidBeginDocument:(CHCSVParser *)parser {
-    self.lines = [[NSMutableArray alloc] init];
+static void _CHCSVByteListFree(_CHCSVByteList *list) {
+    free(list->bytes);
+    free(list->ends);
+    *list = (_CHCSVByteList){0};
 }
 
-- (void)parser:(CHCSVParser *)parser didBeginLine:(NSUInteger)recordNumber {
-    self.currentLine = [[NSMutableArray alloc] init];
+/**
+ *  A column of a table. While it is dictionary-encoded, @c values holds each distinct value once,
+ *  and @c codes holds the index of each field's value; @c slots is a hash table of the values' indexes (plus 1).
+ *  Otherwise, @c values holds every field.
+ */
+typedef struct {
+    _CHCSVByteList values;
+    BOOL dictionaryEncoded;
+    uint16_t *codes;
+    NSUInteger codesCapacity;
+    uint32_t *slots;
+    NSUInteger slotCount;
+} _CHCSVTableColumn;
+
+NS_INLINE uint32_t _CHCSVHashBytes(const uint8_t *bytes, NSUInteger length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (NSUInteger i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
 }
 
-- (void)parser:(CHCSVParser *)parser didEndLine:(NSUInteger)recordNumber {
-    [self.lines addObject:self.currentLine];
-    self.currentLine = nil;
+NS_INLINE CHCSVFieldSpan _CHCSVTableColumnGet(const _CHCSVTableColumn *column, NSUInteger row) {
+    return _CHCSVByteListGet(&column->values, column->dictionaryEncoded ? column->codes[row] : row);
 }
 
-- (void)parser:(CHCSVParser *)parser didReadField:(NSString *)field atIndex:(NSInteger)fieldIndex {
-    [self.currentLine addObject:field];
+static void _CHCSVTableColumnInsertSlot(_CHCSVTableColumn *column, NSUInteger code) {
+    CHCSVFieldSpan value = _CHCSVByteListGet(&column->values, code);
+    NSUInteger mask = column->slotCount - 1;
+    NSUInteger slot = _CHCSVHashBytes(value.bytes, value.length) & mask;
+    while (column->slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    column->slots[slot] = (uint32_t)code + 1;
 }
 
-- (void)parser:(CHCSVParser *)parser didFailWithError:(NSError *)error {
-    self.error = error;
-    self.lines = nil;
+static void _CHCSVTableColumnDropDictionary(_CHCSVTableColumn *column, NSUInteger rowCount) {
+    _CHCSVByteList dictionary = column->values;
+    column->values = (_CHCSVByteList){0};
+    for (NSUInteger row = 0; row < rowCount; row++) {
+        CHCSVFieldSpan value = _CHCSVByteListGet(&dictionary, column->codes[row]);
+        _CHCSVByteListAppend(&column->values, value.bytes, value.length);
+    }
+    _CHCSVByteListFree(&dictionary);
+    
+    free(column->codes);
+    free(column->slots);
+    column->codes = NULL;
+    column->slots = NULL;
+    column->dictionaryEncoded = NO;
 }
 
-@end
+// appends the field of row `rowCount` (that is, the number of fields the column already has)
+static void _CHCSVTableColumnAppend(_CHCSVTableColumn *column, const uint8_t *bytes, NSUInteger length, NSUInteger rowCount) {
+    if (column->dictionaryEncoded) {
+        NSUInteger mask = column->slotCount - 1;
+        NSUInteger slot = _CHCSVHashBytes(bytes, length) & mask;
+        NSUInteger code = NSNotFound;
+        while (column->slots[slot] != 0) {
+            CHCSVFieldSpan value = _CHCSVByteListGet(&column->values, column->slots[slot] - 1);
+            if (value.length == length && (length == 0 || memcmp(value.bytes, bytes, length) == 0)) {
+                code = column->slots[slot] - 1;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        
+        if (code == NSNotFound) {
+            code = column->values.count;
+            // Too many distinct values (or too many compared to the number of fields) aren't worth a dictionary.
+            if (code > UINT16_MAX || (rowCount >= TABLE_DICTIONARY_SAMPLE_SIZE && code * TABLE_DICTIONARY_MINIMUM_REPETITION > rowCount)) {
+                _CHCSVTableColumnDropDictionary(column, rowCount);
+                _CHCSVByteListAppend(&column->values, bytes, length);
+                return;
+            }
+            
+            _CHCSVByteListAppend(&column->values, bytes, length);
+            column->slots[slot] = (uint32_t)code + 1;
+            if (column->values.count * 2 > column->slotCount) {
+                // keep the hash table at most half full
+                free(column->slots);
+                column->slotCount *= 2;
+                column->slots = calloc(column->slotCount, sizeof(uint32_t));
+                for (NSUInteger i = 0; i < column->values.count; i++) {
+                    _CHCSVTableColumnInsertSlot(column, i);
+                }
+            }
+        }
+        
+        if (rowCount == column->codesCapacity) {
+            column->codesCapacity = MAX(column->codesCapacity * 2, 64);
+            column->codes = reallocf(column->codes, column->codesCapacity * sizeof(uint16_t));
+        }
+        column->codes[rowCount] = (uint16_t)code;
+    } else {
+        _CHCSVByteListAppend(&column->values, bytes, length);
+    }
+}
 
-@interface _CHCSVKeyedAggregator : _CHCSVAggregator
+static void _CHCSVTableColumnInit(_CHCSVTableColumn *column) {
+    *column = (_CHCSVTableColumn){0};
+    column->dictionaryEncoded = YES;
+    column->slotCount = 256;
+    column->slots = calloc(column->slotCount, sizeof(uint32_t));
+}
 
-@property (strong) NSArray *firstLine;
+static void _CHCSVTableColumnTrim(_CHCSVTableColumn *column, NSUInteger rowCount) {
+    _CHCSVByteListTrim(&column->values);
+    if (column->dictionaryEncoded) {
+        // nothing else will be looked up
+        free(column->slots);
+        column->slots = NULL;
+        column->codesCapacity = rowCount;
+        column->codes = reallocf(column->codes, MAX(rowCount, 1) * sizeof(uint16_t));
+    }
+}
 
-@end
+static void _CHCSVTableColumnFree(_CHCSVTableColumn *column) {
+    _CHCSVByteListFree(&column->values);
+    free(column->codes);
+    free(column->slots);
+}
 
-@implementation _CHCSVKeyedAggregator
+@interface CHCSVTable () <CHCSVParserDelegate>
 
-- (void)parser:(CHCSVParser *)parser didEndLine:(NSUInteger)recordNumber {
-    if (self.firstLine == nil) {
-        self.firstLine = self.currentLine;
-    } else if (self.currentLine.count == self.firstLine.count) {
-        CHCSVOrderedDictionary *line = [[CHCSVOrderedDictionary alloc] initWithObjects:self.currentLine
-                                                                               forKeys:self.firstLine];
-        [self.lines addObject:line];
-    } else {
-        [parser cancelParsing];
-        self.error = [NSError errorWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeIncorrectNumberOfFields userInfo:nil];
-    }
-    self.currentLine = nil;
-}
+@property (assign) NSUInteger rowCount;
+@property (assign) NSUInteger columnCount;
+@property (strong) NSArray *columnNames;
 
 @end
 
-NSArray *_CHCSVParserParse(NSInputStream *inputStream, CHCSVParserOptions options, unichar delimiter, NSError *__autoreleasing *error);
-NSArray *_CHCSVParserParse(NSInputStream *inputStream, CHCSVParserOptions options, unichar delimiter, NSError *__autoreleasing *error) {
-    CHCSVParser *parser = [[CHCSVParser alloc] initWithInputStream:inputStream usedEncoding:nil delimiter:delimiter];
-    
-    BOOL usesFirstLineAsKeys = !!(options & CHCSVParserOptionsUsesFirstLineAsKeys);
-    _CHCSVAggregator *aggregator = usesFirstLineAsKeys ? [[_CHCSVKeyedAggregator alloc] init] : [[_CHCSVAggregator alloc] init];
-    parser.delegate = aggregator;
+@implementation CHCSVTable {
+    _CHCSVTableColumn *_columns;
+    NSUInteger _columnCapacity;
+    // the number of fields in each row; rows that are shorter than others are padded with empty fields
+    uint32_t *_fieldCounts;
+    NSUInteger _rowCapacity;
     
-    parser.recognizesBackslashesAsEscapes = !!(options & CHCSVParserOptionsRecognizesBackslashesAsEscapes);
-    parser.sanitizesFields = !!(options & CHCSVParserOptionsSanitizesFields);
-    parser.recognizesComments = !!(options & CHCSVParserOptionsRecognizesComments);
-    parser.trimsWhitespace = !!(options & CHCSVParserOptionsTrimsWhitespace);
-    parser.recognizesLeadingEqualSign = !!(options & CHCSVParserOptionsRecognizesLeadingEqualSign);
+    BOOL _usesFirstLineAsKeys;
+    NSError *_error;
+}
+
++ (instancetype)_tableWithParser:(CHCSVParser *)parser options:(CHCSVParserOptions)options columns:(NSArray *)columns error:(NSError *__autoreleasing *)error {
+    CHCSVTable *table = [[self alloc] _init];
+    table->_usesFirstLineAsKeys = !!(options & CHCSVParserOptionsUsesFirstLineAsKeys);
     
+    // batches of field bytes are delivered without making any strings
+    parser.delegate = table;
+    _CHCSVConfigureParser(parser, options, columns);
     [parser parse];
     
-    if (aggregator.error != nil) {
+    if (table->_error != nil) {
         if (error) {
-            *error = aggregator.error;
+            *error = table->_error;
         }
         return nil;
-    } else {
-        return aggregator.lines;
     }
+    
+    for (NSUInteger column = 0; column < table->_columnCount; column++) {
+        _CHCSVTableColumnTrim(&table->_columns[column], table->_rowCount);
+    }
+    table->_fieldCounts = reallocf(table->_fieldCounts, MAX(table->_rowCount, 1) * sizeof(uint32_t));
+    return table;
 }
 
-@implementation NSArray (CHCSVAdditions)
-
-+ (instancetype)arrayWithContentsOfCSVURL:(NSURL *)fileURL {
-    return [self arrayWithContentsOfDelimitedURL:fileURL options:0 delimiter:COMMA error:nil];
++ (instancetype)tableWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter columns:(NSArray *)columns error:(NSError *__autoreleasing *)error {
+    NSParameterAssert(fileURL);
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfDelimitedURL:fileURL delimiter:delimiter];
+    return [self _tableWithParser:parser options:options columns:columns error:error];
 }
 
-+ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL delimiter:(unichar)delimiter {
-    return [self arrayWithContentsOfDelimitedURL:fileURL options:0 delimiter:delimiter error:nil];
++ (instancetype)tableWithDelimitedString:(NSString *)string options:(CHCSVParserOptions)options delimiter:(unichar)delimiter columns:(NSArray *)columns error:(NSError *__autoreleasing *)error {
+    NSParameterAssert(string);
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithDelimitedString:string delimiter:delimiter];
+    return [self _tableWithParser:parser options:options columns:columns error:error];
 }
 
-+ (instancetype)arrayWithContentsOfCSVURL:(NSURL *)fileURL options:(CHCSVParserOptions)options {
-    return [self arrayWithContentsOfDelimitedURL:fileURL options:options delimiter:COMMA error:nil];
+- (instancetype)_init {
+    return [super init];
 }
 
-+ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter {
-    return [self arrayWithContentsOfDelimitedURL:fileURL options:options delimiter:delimiter error:nil];
+- (void)dealloc {
+    for (NSUInteger column = 0; column < _columnCount; column++) {
+        _CHCSVTableColumnFree(&_columns[column]);
+    }
+    free(_columns);
+    free(_fieldCounts);
 }
 
-+ (instancetype)arrayWithContentsOfDelimitedURL:(NSURL *)fileURL options:(CHCSVParserOptions)options delimiter:(unichar)delimiter error:(NSError *__autoreleasing *)error {
-    NSParameterAssert(fileURL);
-    NSInputStream *stream = [NSInputStream inputStreamWithURL:fileURL];
-    
-    return _CHCSVParserParse(stream, options, delimiter, error);
+- (void)parser:(CHCSVParser *)parser didReadRecords:(CHCSVRecordBatch *)records {
+    NSUInteger count = [records count];
+    for (NSUInteger record = 0; record < count; record++) {
+        NSRange fields = [records fieldRangeOfRecordAtIndex:record];
+        
+        if (_usesFirstLineAsKeys) {
+            if (self.columnNames == nil) {
+                self.columnNames = [records fieldsOfRecordAtIndex:record];
+                continue;
+            }
+            if (fields.length != [self.columnNames count]) {
+                [parser cancelParsing];
+                _error = [NSError errorWithDomain:CHCSVErrorDomain code:CHCSVErrorCodeIncorrectNumberOfFields userInfo:nil];
+                return;
+            }
+        }
+        
+        [self _addRowWithFields:fields ofRecords:records];
+    }
 }
 
-- (NSString *)CSVString {
-    NSOutputStream *output = [NSOutputStream outputStreamToMemory];
-    CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:NSUTF8StringEncoding delimiter:COMMA];
-    for (id object in self) {
-        if ([object conformsToProtocol:@protocol(NSFastEnumeration)]) {
-            [writer writeLineOfFields:object];
+- (void)_addRowWithFields:(NSRange)fields ofRecords:(CHCSVRecordBatch *)records {
+    // this runs for every row, so it uses the ivars rather than the (atomic) property accessors
+    NSUInteger row = _rowCount;
+    NSUInteger columnCount = _columnCount;
+    
+    if (fields.length > columnCount) {
+        if (fields.length > _columnCapacity) {
+            _columnCapacity = MAX(_columnCapacity * 2, fields.length);
+            _columns = reallocf(_columns, _columnCapacity * sizeof(_CHCSVTableColumn));
+        }
+        // a new column is empty in every row before this one
+        for (NSUInteger column = columnCount; column < fields.length; column++) {
+            _CHCSVTableColumnInit(&_columns[column]);
+            for (NSUInteger previous = 0; previous < row; previous++) {
+                _CHCSVTableColumnAppend(&_columns[column], NULL, 0, previous);
+            }
         }
+        columnCount = fields.length;
+        _columnCount = columnCount;
     }
-    [writer closeStream];
     
-    NSData *buffer = [output propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
-    return [[NSString alloc] initWithData:buffer encoding:NSUTF8StringEncoding];
+    for (NSUInteger column = 0; column < columnCount; column++) {
+        if (column < fields.length) {
+            CHCSVFieldSpan field = [records unescapedFieldAtIndex:fields.location + column];
+            _CHCSVTableColumnAppend(&_columns[column], field.bytes, field.length, row);
+        } else {
+            _CHCSVTableColumnAppend(&_columns[column], NULL, 0, row);
+        }
+    }
+    
+    if (row == _rowCapacity) {
+        _rowCapacity = MAX(_rowCapacity * 2, 64);
+        _fieldCounts = reallocf(_fieldCounts, _rowCapacity * sizeof(uint32_t));
+    }
+    _fieldCounts[row] = (uint32_t)fields.length;
+    _rowCount = row + 1;
 }
 
-@end
+- (void)parser:(CHCSVParser *)parser didFailWithError:(NSError *)error {
+    _error = error;
+}
 
-@implementation NSString (CHCSVAdditions)
+- (NSUInteger)fieldCountOfRowAtIndex:(NSUInteger)row {
+    NSParameterAssert(row < self.rowCount);
+    return _fieldCounts[row];
+}
 
-- (NSArray *)CSVComponents {
-    return [self componentsSeparatedByDelimiter:COMMA options:0 error:nil];
+- (CHCSVFieldSpan)fieldSpanAtRow:(NSUInteger)row column:(NSUInteger)column {
+    NSParameterAssert(row < self.rowCount);
+    NSParameterAssert(column < self.columnCount);
+    return _CHCSVTableColumnGet(&_columns[column], row);
 }
 
-- (NSArray *)CSVComponentsWithOptions:(CHCSVParserOptions)options {
-    return [self componentsSeparatedByDelimiter:COMMA options:options error:nil];
+- (NSString *)stringAtRow:(NSUInteger)row column:(NSUInteger)column {
+    if (column >= [self fieldCountOfRowAtIndex:row]) { return nil; }
+    CHCSVFieldSpan field = [self fieldSpanAtRow:row column:column];
+    return _CHCSVUTF8String(field.bytes, field.length);
 }
 
-- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter {
-    return [self componentsSeparatedByDelimiter:delimiter options:0 error:nil];
+- (NSArray *)fieldsOfRowAtIndex:(NSUInteger)row {
+    NSUInteger count = [self fieldCountOfRowAtIndex:row];
+    NSMutableArray *fields = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger column = 0; column < count; column++) {
+        [fields addObject:[self stringAtRow:row column:column]];
+    }
+    return fields;
 }
 
-- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter options:(CHCSVParserOptions)options {
-    return [self componentsSeparatedByDelimiter:delimiter options:options error:nil];
+- (BOOL)isDictionaryEncodedColumn:(NSUInteger)column {
+    NSParameterAssert(column < self.columnCount);
+    return _columns[column].dictionaryEncoded;
 }
 
-- (NSArray *)componentsSeparatedByDelimiter:(unichar)delimiter options:(CHCSVParserOptions)options error:(NSError *__autoreleasing *)error {
-    NSData *csvData = [self dataUsingEncoding:NSUTF8StringEncoding];
-    NSInputStream *stream = [NSInputStream inputStreamWithData:csvData];
-    
-    return _CHCSVParserParse(stream, options, delimiter, error);
+@end
+
+@implementation _CHCSVHeaderSchema {
+    NSDictionary *_indexes;
+    NSUInteger *_valueIndexes;
+}
+
+- (instancetype)initWithKeys:(NSArray *)keys {
+    self = [super init];
+    if (self) {
+        _keys = [keys copy];
+        
+        NSUInteger count = [_keys count];
+        NSMutableDictionary *indexes = [NSMutableDictionary dictionaryWithCapacity:count];
+        for (NSUInteger index = 0; index < count; index++) {
+            indexes[_keys[index]] = @(index);
+        }
+        _indexes = [indexes copy];
+        _count = [_indexes count];
+        _hasDuplicateKeys = (_count < count);
+        
+        if (_hasDuplicateKeys) {
+            _valueIndexes = malloc(MAX(count, 1) * sizeof(NSUInteger));
+            for (NSUInteger index = 0; index < count; index++) {
+                _valueIndexes[index] = [_indexes[_keys[index]] unsignedIntegerValue];
+            }
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(_valueIndexes);
+}
+
+- (NSUInteger)indexOfKey:(id)key {
+    NSNumber *index = (key != nil) ? _indexes[key] : nil;
+    return (index != nil) ? [index unsignedIntegerValue] : NSNotFound;
+}
+
+- (NSUInteger)valueIndexAtIndex:(NSUInteger)index {
+    return _hasDuplicateKeys ? _valueIndexes[index] : index;
 }
 
 @end
 
 @implementation CHCSVOrderedDictionary {
-    NSArray *_keys;
+    _CHCSVHeaderSchema *_schema;
     NSArray *_values;
-    NSDictionary *_dictionary;
+}
+
+- (instancetype)_initWithValues:(NSArray *)values schema:(_CHCSVHeaderSchema *)schema {
+    self = [super init];
+    if (self) {
+        NSAssert([values count] == [schema.keys count], @"There must be a value for each key");
+        _schema = schema;
+        _values = values;
+    }
+    return self;
 }
 
 - (instancetype)initWithObjects:(NSArray *)objects forKeys:(NSArray *)keys {
+    if ([objects count] != [keys count]) {
+        [NSException raise:NSInvalidArgumentException format:@"count of objects (%lu) differs from count of keys (%lu)", (unsigned long)[objects count], (unsigned long)[keys count]];
+    }
     self = [super init];
     if (self) {
-        _keys = keys.copy;
-        _values = objects.copy;
-        _dictionary = [NSDictionary dictionaryWithObjects:_values forKeys:_keys];
+        _schema = [[_CHCSVHeaderSchema alloc] initWithKeys:keys];
+        _values = [objects copy];
     }
     return self;
 }
@@ -919,7 +6128,7 @@ NSArray *_CHCSVParserParse(NSInputStream *inputStream, CHCSVParserOptions option
 }
 
 - (NSArray *)allKeys {
-    return _keys;
+    return _schema.keys;
 }
 
 - (NSArray *)allValues {
@@ -927,24 +6136,27 @@ NSArray *_CHCSVParserParse(NSInputStream *inputStream, CHCSVParserOptions option
 }
 
 - (NSUInteger)count {
-    return _dictionary.count;
+    return _schema.count;
 }
 
 - (id)objectForKey:(id)aKey {
-    return [_dictionary objectForKey:aKey];
+    NSUInteger index = [_schema indexOfKey:aKey];
+    return (index != NSNotFound) ? _values[index] : nil;
 }
 
 - (NSEnumerator *)keyEnumerator {
-    return _keys.objectEnumerator;
+    return _schema.keys.objectEnumerator;
 }
 
 - (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(__unsafe_unretained id [])buffer count:(NSUInteger)len {
-    return [_keys countByEnumeratingWithState:state objects:buffer count:len];
+    return [_schema.keys countByEnumeratingWithState:state objects:buffer count:len];
 }
 
 - (id)objectAtIndex:(NSUInteger)idx {
-    id key = [_keys objectAtIndex:idx];
-    return [self objectForKey:key];
+    if (idx >= [_values count]) {
+        [NSException raise:NSRangeException format:@"index %lu beyond bounds [0 .. %lu]", (unsigned long)idx, (unsigned long)[_values count]];
+    }
+    return _values[[_schema valueIndexAtIndex:idx]];
 }
 
 - (id)objectAtIndexedSubscript:(NSUInteger)idx {
@@ -952,14 +6164,24 @@ NSArray *_CHCSVParserParse(NSInputStream *inputStream, CHCSVParserOptions option
 }
 
 - (NSUInteger)hash {
-    return _dictionary.hash;
+    // the same as NSDictionary's
+    return _schema.count;
 }
 
 - (BOOL)isEqual:(CHCSVOrderedDictionary *)object {
-    if ([super isEqual:object] && [object isKindOfClass:[CHCSVOrderedDictionary class]]) {
+    if (![object isKindOfClass:[CHCSVOrderedDictionary class]]) {
+        return NO;
+    }
+    
+    if (object->_schema == _schema && _schema.hasDuplicateKeys == NO) {
+        // rows of the same file only differ by their values
+        return [object->_values isEqualToArray:_values];
+    }
+    
+    if ([super isEqual:object]) {
         // we've determined that from a dictionary POV, they're equal
         // now we need to test for key ordering
-        return [object->_keys isEqual:_keys];
+        return [object->_schema.keys isEqual:_schema.keys];
     }
     
     return NO;
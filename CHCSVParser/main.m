@@ -1,65 +1,704 @@
 #import <Foundation/Foundation.h>
 #import "CHCSVParser.h"
 
-@interface Delegate : NSObject <CHCSVParserDelegate>
+#import <mach/mach.h>
+#import <mach/mach_time.h>
+#import <malloc/malloc.h>
+#import <stdatomic.h>
+#import <sys/resource.h>
+#import <sys/sysctl.h>
 
-@property (readonly) NSArray *lines;
+/**
+ *  A benchmark suite for CHCSVParser and CHCSVWriter.
+ *
+ *  Synthetic datasets are generated deterministically (the same seed always produces the same bytes) and kept in
+ *  a directory, so they're only generated once. Every measurement runs in a process of its own, so its peak
+ *  resident size isn't inflated by the ones before it. Results are written as JSON.
+ *
+ *  Usage: CHCSVParser [--sizes 1,16,256] [--datasets narrow,wide,...] [--benchmarks parse,array,write]
+ *                     [--options 0,2,66] [--repetitions 3] [--directory path] [--output results.json]
+ */
 
-@end
+// bump this whenever the generated bytes change, so stale datasets aren't reused
+#define BENCHMARK_GENERATOR_VERSION 1
+#define BENCHMARK_RESULTS_VERSION 1
+#define BENCHMARK_MEGABYTE (1024 * 1024)
+#define BENCHMARK_GENERATOR_BUFFER_SIZE (1024 * 1024)
+// the array benchmark keeps every record in memory, so it's skipped for bigger files
+#define BENCHMARK_ARRAY_MAXIMUM_SIZE 256
+#define BENCHMARK_WRITER_POOL_SIZE 4096
+#define BENCHMARK_PARSER_OPTION_COUNT 7
+
+static NSString *const BenchmarkDatasets[] = { @"narrow", @"wide", @"quoted", @"backslash", @"utf8", @"utf16" };
+static const NSUInteger BenchmarkDatasetCount = sizeof(BenchmarkDatasets) / sizeof(BenchmarkDatasets[0]);
+
+static NSString *const BenchmarkOptionNames[BENCHMARK_PARSER_OPTION_COUNT] = {
+    @"recognizesBackslashesAsEscapes", @"sanitizesFields", @"recognizesComments", @"trimsWhitespace",
+    @"usesFirstLineAsKeys", @"recognizesLeadingEqualSign", @"parsesInParallel"
+};
+
+#pragma mark - Allocation Counting
 
-@implementation Delegate {
-    NSMutableArray *_lines;
-    NSMutableArray *_currentLine;
+static _Atomic(uint64_t) _allocationCount;
+static void *(*_systemMalloc)(malloc_zone_t *, size_t);
+static void *(*_systemCalloc)(malloc_zone_t *, size_t, size_t);
+static void *(*_systemRealloc)(malloc_zone_t *, void *, size_t);
+
+static void *_countingMalloc(malloc_zone_t *zone, size_t size) {
+    atomic_fetch_add_explicit(&_allocationCount, 1, memory_order_relaxed);
+    return _systemMalloc(zone, size);
 }
-- (void)parserDidBeginDocument:(CHCSVParser *)parser {
-    _lines = [[NSMutableArray alloc] init];
+
+static void *_countingCalloc(malloc_zone_t *zone, size_t count, size_t size) {
+    atomic_fetch_add_explicit(&_allocationCount, 1, memory_order_relaxed);
+    return _systemCalloc(zone, count, size);
 }
-- (void)parser:(CHCSVParser *)parser didBeginLine:(NSUInteger)recordNumber {
-    _currentLine = [[NSMutableArray alloc] init];
+
+static void *_countingRealloc(malloc_zone_t *zone, void *pointer, size_t size) {
+    atomic_fetch_add_explicit(&_allocationCount, 1, memory_order_relaxed);
+    return _systemRealloc(zone, pointer, size);
 }
-- (void)parser:(CHCSVParser *)parser didReadField:(NSString *)field atIndex:(NSInteger)fieldIndex {
-    NSLog(@"%@", field);
-    [_currentLine addObject:field];
+
+// Counts every block allocated (or reallocated) in the default malloc zone, which is where objects are allocated too
+static void BenchmarkCountAllocations(void) {
+    malloc_zone_t *zone = malloc_default_zone();
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(malloc_zone_t), 0, VM_PROT_READ | VM_PROT_WRITE);
+    _systemMalloc = zone->malloc;
+    _systemCalloc = zone->calloc;
+    _systemRealloc = zone->realloc;
+    zone->malloc = _countingMalloc;
+    zone->calloc = _countingCalloc;
+    zone->realloc = _countingRealloc;
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(malloc_zone_t), 0, VM_PROT_READ);
+}
+
+#pragma mark - Measuring
+
+static double BenchmarkSeconds(void) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom / 1e9;
+}
+
+static uint64_t BenchmarkPeakResidentBytes(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    // bytes, on macOS
+    return (uint64_t)usage.ru_maxrss;
+}
+
+static uint64_t BenchmarkResidentBytes(void) {
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) { return 0; }
+    return info.resident_size;
+}
+
+static NSString *BenchmarkSystemString(const char *name) {
+    size_t length = 0;
+    if (sysctlbyname(name, NULL, &length, NULL, 0) != 0 || length == 0) { return @""; }
+    char *value = malloc(length);
+    sysctlbyname(name, value, &length, NULL, 0);
+    NSString *string = [[NSString alloc] initWithBytes:value length:strnlen(value, length) encoding:NSUTF8StringEncoding];
+    free(value);
+    return string ?: @"";
+}
+
+#pragma mark - Generating Datasets
+
+// xorshift64*, so the datasets are the same on every machine
+typedef struct {
+    uint64_t state;
+} BenchmarkRandom;
+
+static uint64_t BenchmarkNext(BenchmarkRandom *random) {
+    uint64_t x = random->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    random->state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static NSUInteger BenchmarkUniform(BenchmarkRandom *random, NSUInteger bound) {
+    return (NSUInteger)(BenchmarkNext(random) % bound);
+}
+
+static const char *const BenchmarkWords[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel", "india", "juliet",
+    "kilo", "lima", "mike", "november", "oscar", "papa", "quebec", "romeo", "sierra", "tango"
+};
+static const char *const BenchmarkMultibyteWords[] = {
+    "ḟīễłđ➃", "日本語", "Ωμέγα", "Zürich", "naïve café", "Привет", "한국어", "🎉🎈", "ñandú", "العربية"
+};
+#define BENCHMARK_WORD_COUNT (sizeof(BenchmarkWords) / sizeof(BenchmarkWords[0]))
+#define BENCHMARK_MULTIBYTE_WORD_COUNT (sizeof(BenchmarkMultibyteWords) / sizeof(BenchmarkMultibyteWords[0]))
+
+static void BenchmarkAppend(NSMutableData *record, const char *string) {
+    [record appendBytes:string length:strlen(string)];
+}
+
+static void BenchmarkAppendFormat(NSMutableData *record, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void BenchmarkAppendFormat(NSMutableData *record, const char *format, ...) {
+    char field[64];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(field, sizeof(field), format, arguments);
+    va_end(arguments);
+    [record appendBytes:field length:(NSUInteger)MIN(length, (int)sizeof(field) - 1)];
 }
+
+static void BenchmarkAppendWord(NSMutableData *record, BenchmarkRandom *random) {
+    BenchmarkAppend(record, BenchmarkWords[BenchmarkUniform(random, BENCHMARK_WORD_COUNT)]);
+}
+
+// Appends one record, including its newline, in UTF-8
+static void BenchmarkAppendRecord(NSMutableData *record, NSString *dataset, BenchmarkRandom *random, uint64_t recordNumber) {
+    if ([dataset isEqualToString:@"narrow"]) {
+        // short fields, with the occasional comment, padded field and leading equal sign
+        if (BenchmarkUniform(random, 100) == 0) {
+            BenchmarkAppendFormat(record, "#note %llu\n", recordNumber);
+            return;
+        }
+        BenchmarkAppendFormat(record, "%llu,", recordNumber);
+        if (BenchmarkUniform(random, 10) == 0) {
+            BenchmarkAppend(record, " ");
+            BenchmarkAppendWord(record, random);
+            BenchmarkAppend(record, " ");
+        } else {
+            BenchmarkAppendWord(record, random);
+        }
+        BenchmarkAppendFormat(record, ",%ld,", (long)BenchmarkUniform(random, 20000) - 10000);
+        if (BenchmarkUniform(random, 50) == 0) {
+            BenchmarkAppendFormat(record, "=\"%03lu\"", (unsigned long)BenchmarkUniform(random, 1000));
+        } else {
+            BenchmarkAppendFormat(record, "%lu.%02lu", (unsigned long)BenchmarkUniform(random, 1000), (unsigned long)BenchmarkUniform(random, 100));
+        }
+    } else if ([dataset isEqualToString:@"wide"]) {
+        for (NSUInteger i = 0; i < 64; i++) {
+            if (i > 0) { BenchmarkAppend(record, ","); }
+            if (i % 2 == 0) {
+                BenchmarkAppendFormat(record, "%lu", (unsigned long)BenchmarkUniform(random, 1000000));
+            } else {
+                BenchmarkAppendWord(record, random);
+            }
+        }
+    } else if ([dataset isEqualToString:@"quoted"]) {
+        // every field is quoted, many contain delimiters and doubled quotes, and some contain newlines
+        for (NSUInteger i = 0; i < 6; i++) {
+            if (i > 0) { BenchmarkAppend(record, ","); }
+            BenchmarkAppend(record, "\"");
+            BenchmarkAppendWord(record, random);
+            NSUInteger kind = BenchmarkUniform(random, 10);
+            if (kind < 3) {
+                BenchmarkAppend(record, ", ");
+            } else if (kind < 5) {
+                BenchmarkAppend(record, " \"\"");
+            } else if (kind == 5) {
+                BenchmarkAppend(record, "\r\n");
+            }
+            BenchmarkAppendWord(record, random);
+            BenchmarkAppend(record, "\"");
+        }
+    } else if ([dataset isEqualToString:@"backslash"]) {
+        for (NSUInteger i = 0; i < 6; i++) {
+            if (i > 0) { BenchmarkAppend(record, ","); }
+            BenchmarkAppendWord(record, random);
+            NSUInteger kind = BenchmarkUniform(random, 10);
+            if (kind < 3) {
+                BenchmarkAppend(record, "\\,");
+            } else if (kind < 5) {
+                BenchmarkAppend(record, "\\\"");
+            } else if (kind == 5) {
+                BenchmarkAppend(record, "\\\n");
+            }
+            BenchmarkAppendWord(record, random);
+        }
+    } else {
+        // utf8 and utf16 have the same content
+        for (NSUInteger i = 0; i < 6; i++) {
+            if (i > 0) { BenchmarkAppend(record, ","); }
+            BenchmarkAppend(record, BenchmarkMultibyteWords[BenchmarkUniform(random, BENCHMARK_MULTIBYTE_WORD_COUNT)]);
+            if (i % 3 == 1) {
+                BenchmarkAppend(record, " ");
+                BenchmarkAppendWord(record, random);
+            }
+        }
+    }
+    BenchmarkAppend(record, "\n");
+}
+
+static NSStringEncoding BenchmarkEncodingOfDataset(NSString *dataset) {
+    return [dataset isEqualToString:@"utf16"] ? NSUTF16LittleEndianStringEncoding : NSUTF8StringEncoding;
+}
+
+static NSURL *BenchmarkURLOfDataset(NSURL *directory, NSString *dataset, NSUInteger megabytes) {
+    NSString *name = [NSString stringWithFormat:@"%@-%luMB-v%d.csv", dataset, (unsigned long)megabytes, BENCHMARK_GENERATOR_VERSION];
+    return [directory URLByAppendingPathComponent:name];
+}
+
+// Writes about `megabytes` of whole records to the file, unless it has already been generated
+static BOOL BenchmarkGenerateDataset(NSURL *URL, NSString *dataset, NSUInteger megabytes) {
+    if ([[NSFileManager defaultManager] fileExistsAtPath:[URL path]]) { return YES; }
+
+    NSString *partialPath = [[URL path] stringByAppendingPathExtension:@"partial"];
+    FILE *file = fopen([partialPath fileSystemRepresentation], "wb");
+    if (file == NULL) { return NO; }
+
+    BOOL isUTF16 = (BenchmarkEncodingOfDataset(dataset) == NSUTF16LittleEndianStringEncoding);
+    if (isUTF16) {
+        const uint8_t byteOrderMark[] = { 0xFF, 0xFE };
+        fwrite(byteOrderMark, 1, sizeof(byteOrderMark), file);
+    }
+
+    // each dataset has a seed of its own (an FNV-1a hash of its name), so they don't share their sequences of words
+    BenchmarkRandom random = { .state = 0xCBF29CE484222325ULL };
+    for (const char *c = [dataset UTF8String]; *c != '\0'; c++) {
+        random.state = (random.state ^ (uint8_t)*c) * 0x100000001B3ULL;
+    }
+
+    uint64_t target = (uint64_t)megabytes * BENCHMARK_MEGABYTE;
+    uint64_t written = 0;
+    uint64_t recordNumber = 0;
+    BOOL succeeded = YES;
+    NSMutableData *chunk = [NSMutableData dataWithCapacity:BENCHMARK_GENERATOR_BUFFER_SIZE + 4096];
+    while (written < target && succeeded) {
+        @autoreleasepool {
+            [chunk setLength:0];
+            while ([chunk length] < BENCHMARK_GENERATOR_BUFFER_SIZE && written + [chunk length] * (isUTF16 ? 2 : 1) < target) {
+                BenchmarkAppendRecord(chunk, dataset, &random, recordNumber++);
+            }
+
+            NSData *bytes = chunk;
+            if (isUTF16) {
+                // the chunk ends between records, so it's always valid UTF-8 on its own
+                NSString *string = [[NSString alloc] initWithData:chunk encoding:NSUTF8StringEncoding];
+                bytes = [string dataUsingEncoding:NSUTF16LittleEndianStringEncoding];
+            }
+            succeeded = (fwrite([bytes bytes], 1, [bytes length], file) == [bytes length]);
+            written += [bytes length];
+        }
+    }
+
+    succeeded = (fclose(file) == 0 && succeeded);
+    if (succeeded) {
+        succeeded = [[NSFileManager defaultManager] moveItemAtPath:partialPath toPath:[URL path] error:NULL];
+    }
+    if (succeeded == NO) {
+        [[NSFileManager defaultManager] removeItemAtPath:partialPath error:NULL];
+    }
+    return succeeded;
+}
+
+#pragma mark - Parsing
+
+@interface BenchmarkFieldCounter : NSObject <CHCSVParserDelegate>
+@property (readonly) uint64_t records;
+@property (readonly) uint64_t fields;
+@property (readonly) BOOL failed;
+@end
+
+@implementation BenchmarkFieldCounter
 - (void)parser:(CHCSVParser *)parser didEndLine:(NSUInteger)recordNumber {
-    [_lines addObject:_currentLine];
-    _currentLine = nil;
+    _records++;
+}
+- (void)parser:(CHCSVParser *)parser didReadField:(NSString *)field atIndex:(NSInteger)fieldIndex {
+    _fields++;
+}
+- (void)parser:(CHCSVParser *)parser didFailWithError:(NSError *)error {
+    _failed = YES;
 }
-- (void)parserDidEndDocument:(CHCSVParser *)parser {
-    //	NSLog(@"parser ended: %@", csvFile);
+@end
+
+// Only implements -parser:didReadRecords:, so fields are reported as spans and never become strings
+@interface BenchmarkRecordCounter : NSObject <CHCSVParserDelegate>
+@property (readonly) uint64_t records;
+@property (readonly) uint64_t fields;
+@property (readonly) BOOL failed;
+@end
+
+@implementation BenchmarkRecordCounter
+- (void)parser:(CHCSVParser *)parser didReadRecords:(CHCSVRecordBatch *)records {
+    NSUInteger count = records.count;
+    _records += count;
+    for (NSUInteger i = 0; i < count; i++) {
+        _fields += [records fieldRangeOfRecordAtIndex:i].length;
+    }
 }
 - (void)parser:(CHCSVParser *)parser didFailWithError:(NSError *)error {
-	NSLog(@"ERROR: %@", error);
-    _lines = nil;
+    _failed = YES;
 }
 @end
 
+static void BenchmarkConfigureParser(CHCSVParser *parser, CHCSVParserOptions options) {
+    parser.recognizesBackslashesAsEscapes = !!(options & CHCSVParserOptionsRecognizesBackslashesAsEscapes);
+    parser.sanitizesFields = !!(options & CHCSVParserOptionsSanitizesFields);
+    parser.recognizesComments = !!(options & CHCSVParserOptionsRecognizesComments);
+    parser.trimsWhitespace = !!(options & CHCSVParserOptionsTrimsWhitespace);
+    parser.recognizesLeadingEqualSign = !!(options & CHCSVParserOptionsRecognizesLeadingEqualSign);
+    parser.parsesInParallel = !!(options & CHCSVParserOptionsParsesInParallel);
+}
+
+// Runs one parse, as described by the spec, and returns what it measured
+static NSDictionary *BenchmarkRunParse(NSDictionary *spec) {
+    NSURL *URL = [NSURL fileURLWithPath:spec[@"path"]];
+    CHCSVParserOptions options = [spec[@"options"] unsignedIntegerValue];
+    NSString *delivery = spec[@"delivery"];
+
+    uint64_t records = 0;
+    uint64_t fields = 0;
+    BOOL failed = NO;
+    double seconds = 0;
+    uint64_t allocations = 0;
+
+    @autoreleasepool {
+        if ([delivery isEqualToString:@"array"]) {
+            NSError *error = nil;
+            atomic_store(&_allocationCount, 0);
+            double start = BenchmarkSeconds();
+            NSArray *rows = [NSArray arrayWithContentsOfDelimitedURL:URL options:options delimiter:',' error:&error];
+            seconds = BenchmarkSeconds() - start;
+            allocations = atomic_load(&_allocationCount);
+
+            failed = (rows == nil);
+            records = [rows count];
+            for (id row in rows) {
+                fields += [row count];
+            }
+        } else {
+            CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfDelimitedURL:URL delimiter:','];
+            BenchmarkConfigureParser(parser, options);
+            BenchmarkFieldCounter *fieldCounter = nil;
+            BenchmarkRecordCounter *recordCounter = nil;
+            if ([delivery isEqualToString:@"records"]) {
+                recordCounter = [[BenchmarkRecordCounter alloc] init];
+                parser.delegate = recordCounter;
+            } else {
+                fieldCounter = [[BenchmarkFieldCounter alloc] init];
+                parser.delegate = fieldCounter;
+            }
+
+            atomic_store(&_allocationCount, 0);
+            double start = BenchmarkSeconds();
+            [parser parse];
+            seconds = BenchmarkSeconds() - start;
+            allocations = atomic_load(&_allocationCount);
+
+            records = (recordCounter != nil) ? recordCounter.records : fieldCounter.records;
+            fields = (recordCounter != nil) ? recordCounter.fields : fieldCounter.fields;
+            failed = (recordCounter != nil) ? recordCounter.failed : fieldCounter.failed;
+        }
+    }
+
+    return @{ @"seconds" : @(seconds), @"records" : @(records), @"fields" : @(fields), @"allocations" : @(allocations), @"failed" : @(failed) };
+}
+
+#pragma mark - Writing
+
+// Writes the records of a small dataset over and over, until the output is as big as the spec asks for
+static NSDictionary *BenchmarkRunWrite(NSDictionary *spec) {
+    NSString *mode = spec[@"mode"];
+    NSString *outputPath = spec[@"outputPath"];
+    NSStringEncoding encoding = [spec[@"encoding"] unsignedIntegerValue];
+    uint64_t target = [spec[@"bytes"] unsignedLongLongValue];
+
+    // fields for the lines come from the smallest dataset, and columns are synthetic. Neither is timed
+    NSArray *pool = nil;
+    int64_t integers[BENCHMARK_WRITER_POOL_SIZE];
+    double doubles[BENCHMARK_WRITER_POOL_SIZE];
+    CHCSVFieldSpan words[BENCHMARK_WRITER_POOL_SIZE];
+    BOOL flags[BENCHMARK_WRITER_POOL_SIZE];
+    double timestamps[BENCHMARK_WRITER_POOL_SIZE];
+    if ([mode isEqualToString:@"columns"]) {
+        BenchmarkRandom random = { .state = 0x2545F4914F6CDD1DULL };
+        for (NSUInteger i = 0; i < BENCHMARK_WRITER_POOL_SIZE; i++) {
+            integers[i] = (int64_t)BenchmarkNext(&random) >> 20;
+            doubles[i] = (double)BenchmarkUniform(&random, 1000000) / 1000.0;
+            const char *word = BenchmarkWords[BenchmarkUniform(&random, BENCHMARK_WORD_COUNT)];
+            words[i] = (CHCSVFieldSpan){ .bytes = (const uint8_t *)word, .length = strlen(word), .needsUnescaping = NO };
+            flags[i] = (BenchmarkUniform(&random, 2) == 0);
+            timestamps[i] = 1.5e9 + (double)BenchmarkUniform(&random, 100000000);
+        }
+    } else {
+        NSArray *rows = [NSArray arrayWithContentsOfDelimitedURL:[NSURL fileURLWithPath:spec[@"poolPath"]] options:CHCSVParserOptionsSanitizesFields delimiter:',' error:NULL];
+        if ([rows count] == 0) {
+            return @{ @"failed" : @YES };
+        }
+        pool = [rows subarrayWithRange:NSMakeRange(0, MIN([rows count], (NSUInteger)BENCHMARK_WRITER_POOL_SIZE))];
+    }
+    CHCSVColumn columns[] = {
+        { .type = CHCSVColumnTypeInt64, .values = integers },
+        { .type = CHCSVColumnTypeDouble, .values = doubles, .precision = 3 },
+        { .type = CHCSVColumnTypeUTF8, .values = words },
+        { .type = CHCSVColumnTypeBoolean, .values = flags },
+        { .type = CHCSVColumnTypeTimestamp, .values = timestamps, .precision = 0 },
+    };
+
+    uint64_t records = 0;
+    uint64_t fields = 0;
+    double seconds = 0;
+    uint64_t allocations = 0;
+    BOOL failed = NO;
+
+    @autoreleasepool {
+        NSOutputStream *stream = [NSOutputStream outputStreamToFileAtPath:outputPath append:NO];
+        CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:stream encoding:encoding delimiter:','];
+        writer.writesInParallel = [mode isEqualToString:@"parallel"];
+
+        atomic_store(&_allocationCount, 0);
+        double start = BenchmarkSeconds();
+        // the file's size (which lags behind by what's still buffered) is checked once per pass over the pool
+        while ([[stream propertyForKey:NSStreamFileCurrentOffsetKey] unsignedLongLongValue] < target && [stream streamStatus] != NSStreamStatusError) {
+            @autoreleasepool {
+                if (pool != nil) {
+                    for (NSArray *row in pool) {
+                        [writer writeLineOfFields:row];
+                        fields += [row count];
+                    }
+                    records += [pool count];
+                } else {
+                    [writer writeRows:BENCHMARK_WRITER_POOL_SIZE columns:columns count:sizeof(columns) / sizeof(columns[0])];
+                    records += BENCHMARK_WRITER_POOL_SIZE;
+                    fields += BENCHMARK_WRITER_POOL_SIZE * sizeof(columns) / sizeof(columns[0]);
+                }
+            }
+        }
+        failed = ([writer flush] == NO);
+        [writer closeStream];
+        seconds = BenchmarkSeconds() - start;
+        allocations = atomic_load(&_allocationCount);
+    }
+
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:outputPath error:NULL];
+    [[NSFileManager defaultManager] removeItemAtPath:outputPath error:NULL];
+    return @{ @"seconds" : @(seconds), @"records" : @(records), @"fields" : @(fields), @"allocations" : @(allocations),
+              @"failed" : @(failed), @"bytes" : @([attributes fileSize]) };
+}
+
+#pragma mark - Running
+
+// Runs the spec in a fresh copy of this process, and returns the result it printed
+static NSDictionary *BenchmarkRunInChildProcess(NSDictionary *spec) {
+    NSData *specData = [NSJSONSerialization dataWithJSONObject:spec options:0 error:NULL];
+    NSTask *task = [[NSTask alloc] init];
+    task.launchPath = [[NSBundle mainBundle] executablePath];
+    task.arguments = @[@"--run", [[NSString alloc] initWithData:specData encoding:NSUTF8StringEncoding]];
+    NSPipe *pipe = [NSPipe pipe];
+    task.standardOutput = pipe;
+    [task launch];
+    NSData *output = [[pipe fileHandleForReading] readDataToEndOfFile];
+    [task waitUntilExit];
+
+    NSDictionary *result = nil;
+    if ([task terminationStatus] == 0) {
+        result = [NSJSONSerialization JSONObjectWithData:output options:0 error:NULL];
+    }
+    return result ?: @{ @"failed" : @YES };
+}
+
+static int BenchmarkRunSpec(NSString *specString) {
+    NSDictionary *spec = [NSJSONSerialization JSONObjectWithData:[specString dataUsingEncoding:NSUTF8StringEncoding] options:0 error:NULL];
+    if (spec == nil) { return 1; }
+    if ([spec[@"countsAllocations"] boolValue]) {
+        BenchmarkCountAllocations();
+    }
+
+    uint64_t baseline = BenchmarkResidentBytes();
+    NSDictionary *result = [spec[@"benchmark"] isEqualToString:@"write"] ? BenchmarkRunWrite(spec) : BenchmarkRunParse(spec);
+    NSMutableDictionary *measured = [result mutableCopy];
+    measured[@"baselineResidentBytes"] = @(baseline);
+    measured[@"peakResidentBytes"] = @(BenchmarkPeakResidentBytes());
+
+    NSData *output = [NSJSONSerialization dataWithJSONObject:measured options:0 error:NULL];
+    fwrite([output bytes], 1, [output length], stdout);
+    return 0;
+}
+
+// Runs a spec the requested number of times, plus once more to count allocations, and summarizes the runs
+static NSDictionary *BenchmarkMeasure(NSDictionary *spec, NSUInteger repetitions, uint64_t inputBytes) {
+    NSMutableArray *samples = [NSMutableArray array];
+    uint64_t peakResident = 0;
+    uint64_t baselineResident = 0;
+    NSDictionary *last = nil;
+    BOOL failed = NO;
+    for (NSUInteger i = 0; i < repetitions && failed == NO; i++) {
+        last = BenchmarkRunInChildProcess(spec);
+        failed = [last[@"failed"] boolValue];
+        [samples addObject:last[@"seconds"] ?: @0];
+        peakResident = MAX(peakResident, [last[@"peakResidentBytes"] unsignedLongLongValue]);
+        baselineResident = MAX(baselineResident, [last[@"baselineResidentBytes"] unsignedLongLongValue]);
+    }
+
+    NSMutableDictionary *counted = [spec mutableCopy];
+    counted[@"countsAllocations"] = @YES;
+    NSDictionary *allocationRun = failed ? nil : BenchmarkRunInChildProcess(counted);
+
+    NSArray *sorted = [samples sortedArrayUsingSelector:@selector(compare:)];
+    double median = [sorted[[sorted count] / 2] doubleValue];
+    uint64_t records = [last[@"records"] unsignedLongLongValue];
+    uint64_t bytes = (last[@"bytes"] != nil) ? [last[@"bytes"] unsignedLongLongValue] : inputBytes;
+
+    NSMutableDictionary *summary = [spec mutableCopy];
+    [summary removeObjectsForKeys:@[@"path", @"poolPath", @"outputPath"]];
+    [summary addEntriesFromDictionary:@{
+        @"failed" : @(failed),
+        @"bytes" : @(bytes),
+        @"records" : @(records),
+        @"fields" : last[@"fields"] ?: @0,
+        @"seconds" : samples,
+        @"medianSeconds" : @(median),
+        @"megabytesPerSecond" : @(median > 0 ? (double)bytes / BENCHMARK_MEGABYTE / median : 0),
+        @"recordsPerSecond" : @(median > 0 ? (double)records / median : 0),
+        @"allocationsPerRecord" : @(records > 0 ? [allocationRun[@"allocations"] doubleValue] / records : 0),
+        @"peakResidentBytes" : @(peakResident),
+        @"baselineResidentBytes" : @(baselineResident),
+    }];
+    return summary;
+}
+
+static NSArray *BenchmarkOptionNamesOf(CHCSVParserOptions options) {
+    NSMutableArray *names = [NSMutableArray array];
+    for (NSUInteger bit = 0; bit < BENCHMARK_PARSER_OPTION_COUNT; bit++) {
+        if (options & (1 << bit)) {
+            [names addObject:BenchmarkOptionNames[bit]];
+        }
+    }
+    return names;
+}
+
+static NSArray *BenchmarkList(NSDictionary *arguments, NSString *name, NSArray *defaults) {
+    NSString *value = arguments[name];
+    return (value != nil) ? [value componentsSeparatedByString:@","] : defaults;
+}
 
+static void BenchmarkLog(NSString *format, ...) NS_FORMAT_FUNCTION(1, 2);
+static void BenchmarkLog(NSString *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    NSString *message = [[NSString alloc] initWithFormat:format arguments:arguments];
+    va_end(arguments);
+    fprintf(stderr, "%s\n", [message UTF8String]);
+}
 
 int main (int argc, const char * argv[]) {
     @autoreleasepool {
-        NSString *file = @(__FILE__);
-        file = [[file stringByDeletingLastPathComponent] stringByAppendingPathComponent:@"Test.scsv"];
-        
-        NSLog(@"Beginning...");
-        NSStringEncoding encoding = 0;
-        NSInputStream *stream = [NSInputStream inputStreamWithFileAtPath:file];
-        CHCSVParser * p = [[CHCSVParser alloc] initWithInputStream:stream usedEncoding:&encoding delimiter:';'];
-        [p setRecognizesBackslashesAsEscapes:YES];
-        [p setSanitizesFields:YES];
-        
-        NSLog(@"encoding: %@", CFStringGetNameOfEncoding(CFStringConvertNSStringEncodingToEncoding(encoding)));
-        
-        Delegate * d = [[Delegate alloc] init];
-        [p setDelegate:d];
-        
-        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
-        [p parse];
-        NSTimeInterval end = [NSDate timeIntervalSinceReferenceDate];
-        
-        NSLog(@"raw difference: %f", (end-start));
-        
-        NSLog(@"%@", [d lines]);
+        NSMutableDictionary *arguments = [NSMutableDictionary dictionary];
+        for (int i = 1; i + 1 < argc; i += 2) {
+            if (strncmp(argv[i], "--", 2) != 0) { break; }
+            arguments[@(argv[i] + 2)] = @(argv[i + 1]);
+        }
+        if (arguments[@"run"] != nil) {
+            return BenchmarkRunSpec(arguments[@"run"]);
+        }
+
+        NSArray *sizes = BenchmarkList(arguments, @"sizes", @[@"1", @"16"]);
+        NSArray *datasets = BenchmarkList(arguments, @"datasets", [NSArray arrayWithObjects:BenchmarkDatasets count:BenchmarkDatasetCount]);
+        NSArray *benchmarks = BenchmarkList(arguments, @"benchmarks", @[@"parse", @"array", @"write"]);
+        NSUInteger repetitions = MAX(1, [arguments[@"repetitions"] integerValue] ?: 3);
+
+        NSMutableArray *allOptions = [NSMutableArray array];
+        for (NSUInteger options = 0; options < (1 << BENCHMARK_PARSER_OPTION_COUNT); options++) {
+            [allOptions addObject:[@(options) stringValue]];
+        }
+        NSArray *optionList = BenchmarkList(arguments, @"options", allOptions);
+
+        NSString *directoryPath = arguments[@"directory"] ?: [NSTemporaryDirectory() stringByAppendingPathComponent:@"CHCSVParserBenchmarks"];
+        NSURL *directory = [NSURL fileURLWithPath:directoryPath isDirectory:YES];
+        [[NSFileManager defaultManager] createDirectoryAtURL:directory withIntermediateDirectories:YES attributes:nil error:NULL];
+
+        NSMutableArray *results = [NSMutableArray array];
+        for (NSString *dataset in datasets) {
+            NSURL *poolURL = BenchmarkURLOfDataset(directory, dataset, 1);
+            if (BenchmarkGenerateDataset(poolURL, dataset, 1) == NO) {
+                BenchmarkLog(@"Could not generate %@", [poolURL path]);
+                return 1;
+            }
+
+            for (NSString *size in sizes) {
+                NSUInteger megabytes = (NSUInteger)[size integerValue];
+                if (megabytes == 0) { continue; }
+                NSURL *URL = BenchmarkURLOfDataset(directory, dataset, megabytes);
+                BenchmarkLog(@"Generating %@", [URL lastPathComponent]);
+                if (BenchmarkGenerateDataset(URL, dataset, megabytes) == NO) {
+                    BenchmarkLog(@"Could not generate %@", [URL path]);
+                    return 1;
+                }
+                uint64_t inputBytes = [[[NSFileManager defaultManager] attributesOfItemAtPath:[URL path] error:NULL] fileSize];
+
+                for (NSString *benchmark in benchmarks) {
+                    NSMutableArray *specs = [NSMutableArray array];
+                    if ([benchmark isEqualToString:@"write"]) {
+                        for (NSString *mode in @[@"lines", @"parallel"]) {
+                            [specs addObject:@{ @"mode" : mode, @"poolPath" : [poolURL path] }];
+                        }
+                        // the columns are the same for every dataset
+                        if ([dataset isEqualToString:datasets[0]]) {
+                            [specs addObject:@{ @"mode" : @"columns" }];
+                        }
+                    } else {
+                        if ([benchmark isEqualToString:@"array"] && megabytes > BENCHMARK_ARRAY_MAXIMUM_SIZE) { continue; }
+                        NSArray *deliveries = [benchmark isEqualToString:@"array"] ? @[@"array"] : @[@"fields", @"records"];
+                        for (NSString *delivery in deliveries) {
+                            for (NSString *optionString in optionList) {
+                                CHCSVParserOptions options = (CHCSVParserOptions)[optionString integerValue];
+                                // only the NSArray methods use the first line as keys
+                                if ((options & CHCSVParserOptionsUsesFirstLineAsKeys) && [delivery isEqualToString:@"array"] == NO) { continue; }
+                                [specs addObject:@{ @"delivery" : delivery, @"options" : @(options), @"optionNames" : BenchmarkOptionNamesOf(options), @"path" : [URL path] }];
+                            }
+                        }
+                    }
+
+                    for (NSDictionary *specDetails in specs) {
+                        NSMutableDictionary *spec = [specDetails mutableCopy];
+                        spec[@"benchmark"] = ([benchmark isEqualToString:@"write"] ? @"write" : @"parse");
+                        spec[@"dataset"] = ([specDetails[@"mode"] isEqualToString:@"columns"] ? @"columns" : dataset);
+                        spec[@"megabytes"] = @(megabytes);
+                        if ([benchmark isEqualToString:@"write"]) {
+                            spec[@"bytes"] = @((uint64_t)megabytes * BENCHMARK_MEGABYTE);
+                            spec[@"encoding"] = @(BenchmarkEncodingOfDataset(dataset));
+                            spec[@"outputPath"] = [[directory URLByAppendingPathComponent:@"output.csv"] path];
+                        }
+
+                        NSDictionary *result = BenchmarkMeasure(spec, repetitions, inputBytes);
+                        BenchmarkLog(@"%@ %@ %luMB %@ %@: %.1f MB/s%@", spec[@"benchmark"], spec[@"dataset"], (unsigned long)megabytes,
+                                     spec[@"delivery"] ?: spec[@"mode"], spec[@"options"] ?: @"", [result[@"megabytesPerSecond"] doubleValue],
+                                     [result[@"failed"] boolValue] ? @" (failed)" : @"");
+                        [results addObject:result];
+                    }
+                }
+            }
+        }
+
+        NSDictionary *report = @{
+            @"version" : @(BENCHMARK_RESULTS_VERSION),
+            @"generatorVersion" : @(BENCHMARK_GENERATOR_VERSION),
+            @"date" : [[[NSISO8601DateFormatter alloc] init] stringFromDate:[NSDate date]],
+            @"machine" : @{
+                @"model" : BenchmarkSystemString("hw.model"),
+                @"cpu" : BenchmarkSystemString("machdep.cpu.brand_string"),
+                @"activeProcessorCount" : @([[NSProcessInfo processInfo] activeProcessorCount]),
+                @"physicalMemory" : @([[NSProcessInfo processInfo] physicalMemory]),
+                @"operatingSystem" : [[NSProcessInfo processInfo] operatingSystemVersionString],
+            },
+            @"repetitions" : @(repetitions),
+            @"results" : results,
+        };
+        NSData *output = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:NULL];
+        if (arguments[@"output"] != nil) {
+            if ([output writeToFile:arguments[@"output"] atomically:YES] == NO) {
+                BenchmarkLog(@"Could not write %@", arguments[@"output"]);
+                return 1;
+            }
+        } else {
+            fwrite([output bytes], 1, [output length], stdout);
+            fputc('\n', stdout);
+        }
+
+        for (NSDictionary *result in results) {
+            if ([result[@"failed"] boolValue]) { return 1; }
+        }
     }
     return 0;
 }
@@ -26,6 +26,7 @@
 #import "UnitTests.h"
 #import "UnitTestContent.h"
 #import "CHCSVParser.h"
+#import <zlib.h>
 
 #define TEST_ARRAYS(_actual, _expected) do {\
 XCTAssertEqual(_actual.count, _expected.count, @"incorrect number of records"); \
@@ -56,9 +57,137 @@ NSArray *_parsed = [(_csv) CSVComponentsWithOptions:(_option)]; \
 TEST_ARRAYS(_parsed, _expected); \
 } while(0)
 
+// Records every delegate callback as a string, so different ways of delivering the same document can be compared
+@interface CHCSVEventRecorder : NSObject <CHCSVParserDelegate>
+@property (strong) NSMutableArray *events;
+@end
+
+@implementation CHCSVEventRecorder
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _events = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)parser:(CHCSVParser *)parser didBeginLine:(NSUInteger)recordNumber {
+    [self.events addObject:[NSString stringWithFormat:@"begin %lu", (unsigned long)recordNumber]];
+}
+
+- (void)parser:(CHCSVParser *)parser didReadField:(NSString *)field atIndex:(NSInteger)fieldIndex {
+    [self.events addObject:[NSString stringWithFormat:@"%ld: %@", (long)fieldIndex, field]];
+}
+
+- (void)parser:(CHCSVParser *)parser didEndLine:(NSUInteger)recordNumber {
+    [self.events addObject:[NSString stringWithFormat:@"end %lu", (unsigned long)recordNumber]];
+}
+
+- (void)parser:(CHCSVParser *)parser didReadComment:(NSString *)comment {
+    [self.events addObject:[NSString stringWithFormat:@"comment %@", comment]];
+}
+
+- (void)parser:(CHCSVParser *)parser didFailWithError:(NSError *)error {
+    [self.events addObject:@"error"];
+}
+
+@end
+
+@interface CHCSVBatchEventRecorder : CHCSVEventRecorder
+@property (nonatomic, copy) void (^recordsHandler)(CHCSVRecordBatch *records);
+@end
+
+@implementation CHCSVBatchEventRecorder
+
+- (void)parser:(CHCSVParser *)parser didReadRecords:(CHCSVRecordBatch *)records {
+    if (self.recordsHandler != nil) {
+        self.recordsHandler(records);
+    }
+    for (NSUInteger i = 0; i < records.count; i++) {
+        NSUInteger recordNumber = records.firstRecordNumber + i;
+        [self.events addObject:[NSString stringWithFormat:@"begin %lu", (unsigned long)recordNumber]];
+        
+        NSRange fields = [records fieldRangeOfRecordAtIndex:i];
+        for (NSUInteger f = 0; f < fields.length; f++) {
+            NSString *field = [records stringForFieldAtIndex:fields.location + f];
+            [self.events addObject:[NSString stringWithFormat:@"%lu: %@", (unsigned long)f, field]];
+        }
+        
+        [self.events addObject:[NSString stringWithFormat:@"end %lu", (unsigned long)recordNumber]];
+    }
+}
+
+- (void)parser:(CHCSVParser *)parser didFailToConvertField:(NSString *)field ofRecord:(NSUInteger)recordNumber column:(NSUInteger)column toType:(CHCSVColumnType)type {
+    [self.events addObject:[NSString stringWithFormat:@"unconverted %lu.%lu: %@", (unsigned long)recordNumber, (unsigned long)column, field]];
+}
+
+@end
+
+// Signals a semaphore at the end of every record, so that a test can wait for records to arrive
+@interface CHCSVRecordSignaller : CHCSVEventRecorder
+@property (strong) dispatch_semaphore_t recordEnded;
+@end
+
+@implementation CHCSVRecordSignaller
+
+- (void)parser:(CHCSVParser *)parser didEndLine:(NSUInteger)recordNumber {
+    [super parser:parser didEndLine:recordNumber];
+    dispatch_semaphore_signal(self.recordEnded);
+}
+
+@end
+
+// Records the statistics a parser publishes, and how often totalBytesRead changes along with them
+@interface CHCSVStatisticsObserver : NSObject
+@property (strong) NSMutableArray *published;
+@property (assign) NSUInteger totalBytesReadChanges;
+@end
+
+@implementation CHCSVStatisticsObserver
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _published = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context {
+    if ([keyPath isEqualToString:@"statistics"]) {
+        [self.published addObject:[object statistics]];
+    } else {
+        self.totalBytesReadChanges++;
+    }
+}
+
+@end
+
+// Compresses data into a single gzip member
+static NSData *CHCSVGzippedData(NSData *data) {
+    z_stream deflater;
+    memset(&deflater, 0, sizeof(deflater));
+    // a window size of 15, plus 16 to write a gzip header
+    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    NSMutableData *compressed = [NSMutableData dataWithLength:deflateBound(&deflater, (uLong)data.length)];
+    deflater.next_in = (Bytef *)data.bytes;
+    deflater.avail_in = (uInt)data.length;
+    deflater.next_out = compressed.mutableBytes;
+    deflater.avail_out = (uInt)compressed.length;
+    deflate(&deflater, Z_FINISH);
+    compressed.length = deflater.total_out;
+    deflateEnd(&deflater);
+    return compressed;
+}
+
 @implementation UnitTests
 
 - (NSURL *)temporaryURLForDelimitedString:(NSString *)string {
+    return [self temporaryURLForDelimitedString:string encoding:NSUTF8StringEncoding];
+}
+
+- (NSURL *)temporaryURLForDelimitedString:(NSString *)string encoding:(NSStringEncoding)encoding {
     static NSURL *temporaryFolder = nil;
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
@@ -86,12 +215,29 @@ TEST_ARRAYS(_parsed, _expected); \
     NSURL *url = [temporaryFolder URLByAppendingPathComponent:name];
     
     NSError *error = nil;
-    BOOL written = [string writeToURL:url atomically:YES encoding:NSUTF8StringEncoding error:&error];
+    BOOL written = [string writeToURL:url atomically:YES encoding:encoding error:&error];
     XCTAssertTrue(written, @"Unable to write string to temporary folder: %@", error);
     
     return url;
 }
 
+- (NSArray *)charactersParsingOfDelimitedString:(NSString *)string options:(CHCSVParserOptions)options {
+    // a delimiter outside of ASCII makes the parser work on NSStrings instead of bytes
+    NSString *brokenBar = @"\u00A6";
+    NSString *csv = [string stringByReplacingOccurrencesOfString:COMMA withString:brokenBar];
+    NSArray *parsed = [csv componentsSeparatedByDelimiter:[brokenBar characterAtIndex:0] options:options];
+    
+    NSMutableArray *lines = [NSMutableArray array];
+    for (NSArray *line in parsed) {
+        NSMutableArray *fields = [NSMutableArray array];
+        for (NSString *field in line) {
+            [fields addObject:[field stringByReplacingOccurrencesOfString:brokenBar withString:COMMA]];
+        }
+        [lines addObject:fields];
+    }
+    return lines;
+}
+
 - (void)testAvailableEncodings {
     const CFStringEncoding *encodings = CFStringGetListOfAvailableEncodings();
     
@@ -400,6 +546,225 @@ TEST_ARRAYS(_parsed, _expected); \
     }];
 }
 
+- (void)testMappedFieldsOutliveParser {
+    // long fields from a local file are made directly from the mapped file, and must stay valid after parsing is done
+    NSString *longField = [@"" stringByPaddingToLength:100 withString:FIELD1 startingAtIndex:0];
+    NSString *csv = [@[longField, longField, QUOTED_FIELD1, UTF8FIELD4] componentsJoinedByString:COMMA];
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    NSArray *actual = nil;
+    @autoreleasepool {
+        actual = [NSArray arrayWithContentsOfCSVURL:url options:CHCSVParserOptionsSanitizesFields];
+    }
+    NSArray *expected = @[@[longField, longField, FIELD1, UTF8FIELD4]];
+    TEST_ARRAYS(actual, expected);
+}
+
+- (void)testParallelParsingMatchesSequential {
+    // several megabytes of records, many with quoted newlines, so that chunk boundaries land inside quoted fields
+    NSMutableString *csv = [NSMutableString string];
+    for (NSUInteger i = 0; csv.length < 6 * 1024 * 1024; i++) {
+        [csv appendFormat:@"%lu,\"multi" NEWLINE @"line, \"\"quoted\"\"" NEWLINE @"field\",%@,%@" NEWLINE, (unsigned long)i, FIELD1, UTF8FIELD4];
+        if (i % 7 == 0) {
+            [csv appendString:@"#" FIELD2 COMMA FIELD3 NEWLINE];
+        }
+    }
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    CHCSVParserOptions optionSets[] = {
+        0,
+        CHCSVParserOptionsSanitizesFields,
+        CHCSVParserOptionsRecognizesComments | CHCSVParserOptionsTrimsWhitespace,
+        CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsRecognizesBackslashesAsEscapes | CHCSVParserOptionsRecognizesComments,
+        CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsRecognizesComments | CHCSVParserOptionsUsesFirstLineAsKeys
+    };
+    for (NSUInteger i = 0; i < sizeof(optionSets) / sizeof(optionSets[0]); i++) {
+        NSError *sequentialError = nil;
+        NSError *parallelError = nil;
+        NSArray *sequential = [NSArray arrayWithContentsOfDelimitedURL:url options:optionSets[i] delimiter:',' error:&sequentialError];
+        NSArray *parallel = [NSArray arrayWithContentsOfDelimitedURL:url options:optionSets[i] | CHCSVParserOptionsParsesInParallel delimiter:',' error:&parallelError];
+        
+        XCTAssertNotNil(sequential, @"Options %lu", (unsigned long)optionSets[i]);
+        XCTAssertEqualObjects(parallel, sequential, @"Options %lu", (unsigned long)optionSets[i]);
+        XCTAssertEqualObjects(parallelError, sequentialError, @"Options %lu", (unsigned long)optionSets[i]);
+    }
+    
+    // the header is read before any chunk starts, so that every chunk reports the same columns
+    for (NSArray *columns in @[@[@0, @3], @[@"0", FIELD1]]) {
+        CHCSVParserOptions options = CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsRecognizesComments | CHCSVParserOptionsUsesFirstLineAsKeys;
+        NSArray *sequential = [NSArray arrayWithContentsOfDelimitedURL:url options:options delimiter:',' columns:columns error:nil];
+        NSArray *parallel = [NSArray arrayWithContentsOfDelimitedURL:url options:options | CHCSVParserOptionsParsesInParallel delimiter:',' columns:columns error:nil];
+        
+        XCTAssertEqual([[sequential firstObject] count], 2, @"Columns %@", columns);
+        XCTAssertEqualObjects(parallel, sequential, @"Columns %@", columns);
+    }
+}
+
+- (void)testParallelParsingFallsBackOnLongRecords {
+    // a quoted field longer than two chunks, full of lines that look like records, so the guesses inside it are wrong
+    NSMutableString *csv = [NSMutableString stringWithString:FIELD1 COMMA FIELD2 NEWLINE @"\""];
+    while (csv.length < 5 * 1024 * 1024) {
+        [csv appendString:FIELD1 COMMA FIELD3 NEWLINE];
+    }
+    [csv appendString:@"\"" COMMA FIELD2 NEWLINE];
+    for (NSUInteger i = 0; i < 50000; i++) {
+        [csv appendFormat:@"%lu,%@" NEWLINE, (unsigned long)i, UTF8FIELD4];
+    }
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    NSArray *sequential = [NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsSanitizesFields delimiter:',' error:nil];
+    NSArray *parallel = [NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsParsesInParallel delimiter:',' error:nil];
+    XCTAssertEqual(sequential.count, 50002);
+    XCTAssertEqualObjects(parallel, sequential);
+}
+
+- (void)testBatchedRecordsMatchFields {
+    NSString *csv = FIELD1 COMMA QUOTED_FIELD2 NEWLINE @"#" FIELD3 NEWLINE UTF8FIELD4 NEWLINE FIELD1 NEWLINE FIELD2 COMMA @" " FIELD3 @" " COMMA UTF8FIELD4 NEWLINE FIELD1;
+    
+    // a comma is parsed as bytes, a broken bar as characters
+    for (NSString *delimiter in @[COMMA, @"\u00A6"]) {
+        NSURL *url = [self temporaryURLForDelimitedString:[csv stringByReplacingOccurrencesOfString:COMMA withString:delimiter]];
+        
+        NSMutableArray *events = [NSMutableArray array];
+        for (CHCSVEventRecorder *recorder in @[[[CHCSVEventRecorder alloc] init], [[CHCSVBatchEventRecorder alloc] init]]) {
+            CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfDelimitedURL:url delimiter:[delimiter characterAtIndex:0]];
+            parser.sanitizesFields = YES;
+            parser.trimsWhitespace = YES;
+            parser.recognizesComments = YES;
+            parser.recordBatchSize = 2;
+            parser.delegate = recorder;
+            [parser parse];
+            [events addObject:recorder.events];
+        }
+        
+        XCTAssertEqualObjects(events[1], events[0], @"Delimiter %@", delimiter);
+    }
+}
+
+- (void)testSanitizedCharactersMatchBytes {
+    // runs of literal characters are broken up by doubled quotes, backslashes and surrounding whitespace
+    NSString *csv = @" \"a \"\"b\"\" c\" ,\\\"x\\,y\\\\ ," UTF8FIELD4 @"  " NEWLINE @"=\"007\",\"\"\"\"\"\"\", \t" FIELD1 @"\t " NEWLINE @"\"\"," QUOTED_FIELD2;
+    CHCSVParserOptions optionSets[] = {
+        CHCSVParserOptionsSanitizesFields,
+        CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsTrimsWhitespace,
+        CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsRecognizesBackslashesAsEscapes,
+        CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsRecognizesBackslashesAsEscapes | CHCSVParserOptionsTrimsWhitespace | CHCSVParserOptionsRecognizesLeadingEqualSign,
+        CHCSVParserOptionsTrimsWhitespace
+    };
+    
+    NSURL *bytesURL = [self temporaryURLForDelimitedString:csv encoding:NSUTF8StringEncoding];
+    for (NSUInteger i = 0; i < sizeof(optionSets) / sizeof(optionSets[0]); i++) {
+        NSArray *bytes = [NSArray arrayWithContentsOfDelimitedURL:bytesURL options:optionSets[i] delimiter:',' error:nil];
+        NSArray *characters = [self charactersParsingOfDelimitedString:csv options:optionSets[i]];
+        
+        XCTAssertNotNil(bytes, @"Options %lu", (unsigned long)optionSets[i]);
+        XCTAssertEqualObjects(characters, bytes, @"Options %lu", (unsigned long)optionSets[i]);
+    }
+}
+
+- (void)testBatchedFieldViews {
+    NSString *csv = @"\"4\"\"2\", -17 ,\"2.5\"" NEWLINE @"abc,x1,";
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    __block NSUInteger recordCount = 0;
+    CHCSVBatchEventRecorder *recorder = [[CHCSVBatchEventRecorder alloc] init];
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+    parser.sanitizesFields = YES;
+    parser.trimsWhitespace = YES;
+    parser.delegate = recorder;
+    recorder.recordsHandler = ^(CHCSVRecordBatch *records) {
+        for (NSUInteger i = 0; i < records.count; i++) {
+            NSRange fields = [records fieldRangeOfRecordAtIndex:i];
+            long long integer = 0;
+            double number = 0;
+            if (records.firstRecordNumber + i == 1) {
+                XCTAssertTrue(records.fieldSpans[fields.location].needsUnescaping);
+                XCTAssertTrue([records fieldAtIndex:fields.location isEqualToUTF8String:"4\"2"]);
+                XCTAssertFalse([records getIntegerValue:&integer ofFieldAtIndex:fields.location]);
+                XCTAssertTrue([records getIntegerValue:&integer ofFieldAtIndex:fields.location + 1]);
+                XCTAssertEqual(integer, -17);
+                XCTAssertTrue([records getDoubleValue:&number ofFieldAtIndex:fields.location + 2]);
+                XCTAssertEqual(number, 2.5);
+            } else {
+                XCTAssertFalse(records.fieldSpans[fields.location].needsUnescaping);
+                XCTAssertTrue([records fieldAtIndex:fields.location isEqualToUTF8String:"abc"]);
+                XCTAssertFalse([records getIntegerValue:&integer ofFieldAtIndex:fields.location + 1]);
+                XCTAssertFalse([records getDoubleValue:&number ofFieldAtIndex:fields.location + 2]);
+            }
+            recordCount++;
+        }
+    };
+    [parser parse];
+    
+    XCTAssertEqual(recordCount, 2);
+}
+
+- (void)testColumnTypes {
+    NSString *csv = @"id,price,active,when,name" NEWLINE
+                    @"1,2.5,true,2020-02-29T12:00:00Z,\"a,\"\"b\"" NEWLINE
+                    @"x,1e3,NO,1970-01-01,plain" NEWLINE
+                    @"3,,maybe,2020-02-30" NEWLINE
+                    @"-4,-0.125,0,1969-12-31 23:59:59.5-01:00,";
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    for (NSNumber *parallel in @[@NO, @YES]) {
+        __block NSUInteger recordCount = 0;
+        CHCSVBatchEventRecorder *recorder = [[CHCSVBatchEventRecorder alloc] init];
+        CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+        parser.sanitizesFields = YES;
+        parser.parsesInParallel = parallel.boolValue;
+        // the price isn't included, so it isn't converted; the header isn't converted either
+        parser.includedColumnNames = @[@"id", @"active", @"when", @"name"];
+        parser.columnTypes = @{@0: @(CHCSVColumnTypeInt64), @1: @(CHCSVColumnTypeDouble), @2: @(CHCSVColumnTypeBoolean),
+                               @3: @(CHCSVColumnTypeTimestamp), @4: @(CHCSVColumnTypeUTF8)};
+        parser.delegate = recorder;
+        recorder.recordsHandler = ^(CHCSVRecordBatch *records) {
+            XCTAssertEqual(records.count, 5);
+            XCTAssertThrows([records valuesOfColumn:1]);
+            
+            CHCSVColumn ids = [records valuesOfColumn:0];
+            XCTAssertEqual(ids.type, CHCSVColumnTypeInt64);
+            const int64_t *idValues = ids.values;
+            BOOL idNulls[] = {YES, NO, YES, NO, NO};
+            int64_t expectedIDs[] = {0, 1, 0, 3, -4};
+            
+            CHCSVColumn active = [records valuesOfColumn:2];
+            const BOOL *activeValues = active.values;
+            BOOL activeNulls[] = {YES, NO, NO, YES, NO};
+            BOOL expectedActive[] = {NO, YES, NO, NO, NO};
+            
+            CHCSVColumn when = [records valuesOfColumn:3];
+            const double *whenValues = when.values;
+            BOOL whenNulls[] = {YES, NO, NO, YES, NO};
+            double expectedWhen[] = {0, 1582977600, 0, 0, 3599.5};
+            
+            CHCSVColumn names = [records valuesOfColumn:4];
+            const CHCSVFieldSpan *nameValues = names.values;
+            BOOL nameNulls[] = {YES, NO, NO, YES, YES};
+            NSArray *expectedNames = @[EMPTY, @"a,\"b", @"plain", EMPTY, EMPTY];
+            
+            for (NSUInteger i = 0; i < 5; i++) {
+                XCTAssertEqual(ids.nulls[i], idNulls[i], @"Record %lu", (unsigned long)i);
+                XCTAssertEqual(idValues[i], expectedIDs[i], @"Record %lu", (unsigned long)i);
+                XCTAssertEqual(active.nulls[i], activeNulls[i], @"Record %lu", (unsigned long)i);
+                XCTAssertEqual(activeValues[i], expectedActive[i], @"Record %lu", (unsigned long)i);
+                XCTAssertEqual(when.nulls[i], whenNulls[i], @"Record %lu", (unsigned long)i);
+                XCTAssertEqual(whenValues[i], expectedWhen[i], @"Record %lu", (unsigned long)i);
+                XCTAssertEqual(names.nulls[i], nameNulls[i], @"Record %lu", (unsigned long)i);
+                NSString *name = [[NSString alloc] initWithBytes:nameValues[i].bytes length:nameValues[i].length encoding:NSUTF8StringEncoding];
+                XCTAssertEqualObjects(name, expectedNames[i], @"Record %lu", (unsigned long)i);
+            }
+            recordCount += records.count;
+        };
+        [parser parse];
+        
+        XCTAssertEqual(recordCount, 5);
+        NSArray *failures = [recorder.events filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"SELF BEGINSWITH 'unconverted'"]];
+        NSArray *expectedFailures = @[@"unconverted 3.0: x", @"unconverted 4.2: maybe", @"unconverted 4.3: 2020-02-30"];
+        XCTAssertEqualObjects(failures, expectedFailures, @"Parallel: %@", parallel);
+    }
+}
+
 - (void)testEmptyRecords {
     NSString *csv = NEWLINE FIELD1 NEWLINE FIELD1 NEWLINE NEWLINE FIELD1 NEWLINE NEWLINE FIELD1 NEWLINE UTF8FIELD4;
     NSArray *expected = @[@[EMPTY], @[FIELD1], @[FIELD1], @[EMPTY], @[FIELD1], @[EMPTY], @[FIELD1], @[UTF8FIELD4]];
@@ -526,6 +891,126 @@ TEST_ARRAYS(_parsed, _expected); \
     TEST(csv, expected);
 }
 
+- (void)assertUTF8ParsingMatchesUTF16:(NSString *)csv {
+    // UTF-16 input is converted to UTF-8 as it is read, and a non-ASCII delimiter makes the parser go through NSString.
+    // All of them must produce the same fields for every combination of options.
+    NSArray *options = @[@0,
+                         @(CHCSVParserOptionsSanitizesFields),
+                         @(CHCSVParserOptionsTrimsWhitespace),
+                         @(CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsTrimsWhitespace),
+                         @(CHCSVParserOptionsRecognizesComments | CHCSVParserOptionsRecognizesBackslashesAsEscapes | CHCSVParserOptionsRecognizesLeadingEqualSign),
+                         @(CHCSVParserOptionsRecognizesComments | CHCSVParserOptionsRecognizesBackslashesAsEscapes | CHCSVParserOptionsRecognizesLeadingEqualSign | CHCSVParserOptionsSanitizesFields)];
+    
+    NSURL *url = [self temporaryURLForDelimitedString:csv encoding:NSUTF16StringEncoding];
+    for (NSNumber *option in options) {
+        NSArray *expected = [NSArray arrayWithContentsOfDelimitedURL:url options:option.unsignedIntegerValue delimiter:',' error:nil];
+        NSArray *actual = [csv CSVComponentsWithOptions:option.unsignedIntegerValue];
+        TEST_ARRAYS(actual, expected);
+        
+        NSArray *characters = [self charactersParsingOfDelimitedString:csv options:option.unsignedIntegerValue];
+        TEST_ARRAYS(characters, expected);
+    }
+}
+
+- (NSArray *)eventsParsingData:(NSData *)data encoding:(NSStringEncoding)encoding {
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithInputStream:[NSInputStream inputStreamWithData:data] usedEncoding:&encoding delimiter:','];
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    parser.delegate = recorder;
+    [parser parse];
+    return recorder.events;
+}
+
+- (void)testTranscodedEncodingsMatchUTF8 {
+    NSString *csv = FIELD1 COMMA QUOTED_FIELD2 NEWLINE UTF8FIELD4 COMMA @"1\u20E3\U0001F600" NEWLINE FIELD3;
+    NSArray *expected = [self eventsParsingData:[csv dataUsingEncoding:NSUTF8StringEncoding] encoding:NSUTF8StringEncoding];
+    
+    NSArray *encodings = @[@(NSUTF16BigEndianStringEncoding), @(NSUTF16LittleEndianStringEncoding), @(NSUTF32BigEndianStringEncoding), @(NSUTF32LittleEndianStringEncoding)];
+    for (NSNumber *encoding in encodings) {
+        NSData *data = [csv dataUsingEncoding:encoding.unsignedIntegerValue];
+        XCTAssertEqualObjects([self eventsParsingData:data encoding:encoding.unsignedIntegerValue], expected, @"Encoding %@", encoding);
+    }
+    
+    NSString *latin1 = FIELD1 COMMA @"caf\u00E9 \u00BD" NEWLINE @"\u00FF";
+    expected = [self eventsParsingData:[latin1 dataUsingEncoding:NSUTF8StringEncoding] encoding:NSUTF8StringEncoding];
+    XCTAssertEqualObjects([self eventsParsingData:[latin1 dataUsingEncoding:NSISOLatin1StringEncoding] encoding:NSISOLatin1StringEncoding], expected);
+}
+
+- (void)testEBCDICIsNotTranscodedAsASCII {
+    // EBCDIC keeps nothing where ASCII has it, so long runs of bytes below 0x80 must still go through the encoding
+    NSString *csv = FIELD1 @",                    ," QUOTED_FIELD2 NEWLINE @"abcdefghijklmnopqrstuvwxyz0123456789" COMMA FIELD3;
+    NSArray *expected = [self eventsParsingData:[csv dataUsingEncoding:NSUTF8StringEncoding] encoding:NSUTF8StringEncoding];
+    
+    NSStringEncoding ebcdic = CFStringConvertEncodingToNSStringEncoding(kCFStringEncodingEBCDIC_CP037);
+    NSData *data = [csv dataUsingEncoding:ebcdic];
+    XCTAssertNotNil(data);
+    XCTAssertEqualObjects([self eventsParsingData:data encoding:ebcdic], expected);
+}
+
+- (void)testUTF8MatchesUTF16 {
+    NSString *unicodeWhitespace = [NSString stringWithFormat:@"%C" FIELD1 @"%C" COMMA @"%C" COMMA FIELD2 @"%C" FIELD3 @"\r\n" OCTOTHORPE FIELD1,
+                                   (unichar)0x00A0, (unichar)0x3000, (unichar)0x2028, (unichar)0x0085];
+    NSArray *inputs = @[FIELD1 COMMA SPACE QUOTED_FIELD2 SPACE COMMA FIELD3 NEWLINE UTF8FIELD4,
+                        unicodeWhitespace,
+                        FIELD1 BACKSLASH COMMA FIELD2 COMMA EQUAL DOUBLEQUOTE FIELD3 DOUBLEQUOTE DOUBLEQUOTE DOUBLEQUOTE NEWLINE @"1️⃣,2️⃣"];
+    
+    for (NSString *csv in inputs) {
+        [self assertUTF8ParsingMatchesUTF16:csv];
+    }
+}
+
+- (void)testLongFieldsMatchUTF16 {
+    // fields long enough to span several of the 64-byte blocks the UTF-8 scanner examines at once,
+    // with quotes, delimiters, escapes and newlines landing on either side of the block boundaries
+    NSArray *pieces = @[FIELD1, COMMA, DOUBLEQUOTE DOUBLEQUOTE, NEWLINE, BACKSLASH, SPACE, UTF8FIELD4, OCTOTHORPE];
+    for (NSUInteger length = 1; length < 200; length += 7) {
+        NSMutableString *unquoted = [NSMutableString string];
+        NSMutableString *quoted = [NSMutableString stringWithString:DOUBLEQUOTE];
+        for (NSUInteger i = 0; i < length; ++i) {
+            NSString *piece = pieces[(i * length) % pieces.count];
+            [quoted appendString:piece];
+            if ([piece isEqual:DOUBLEQUOTE DOUBLEQUOTE] == NO) {
+                [unquoted appendString:piece];
+            }
+        }
+        [quoted appendString:DOUBLEQUOTE];
+        
+        NSString *csv = [@[unquoted, quoted, unquoted, quoted] componentsJoinedByString:COMMA];
+        [self assertUTF8ParsingMatchesUTF16:csv];
+    }
+}
+
+#pragma mark - Testing Performance
+
+- (void)measureParsingRowsWithColumns:(NSUInteger)columns {
+    // the total number of fields stays the same, so the time per field should stay flat as the rows get wider
+    NSUInteger totalFields = 100000;
+    NSMutableString *csv = [NSMutableString string];
+    for (NSUInteger field = 0; field < totalFields; ++field) {
+        [csv appendString:FIELD1];
+        [csv appendString:(field % columns == columns - 1) ? NEWLINE : COMMA];
+    }
+    
+    // a delimiter outside of ASCII keeps the parser reading NSStrings rather than bytes
+    NSString *delimited = [csv stringByReplacingOccurrencesOfString:COMMA withString:@"\u00A6"];
+    NSURL *url = [self temporaryURLForDelimitedString:delimited encoding:NSUTF16StringEncoding];
+    [self measureBlock:^{
+        NSArray *parsed = [NSArray arrayWithContentsOfDelimitedURL:url delimiter:0x00A6];
+        XCTAssertEqual(parsed.count, totalFields / columns, @"Unexpected number of lines");
+    }];
+}
+
+- (void)testPerformance_10Columns {
+    [self measureParsingRowsWithColumns:10];
+}
+
+- (void)testPerformance_1000Columns {
+    [self measureParsingRowsWithColumns:1000];
+}
+
+- (void)testPerformance_10000Columns {
+    [self measureParsingRowsWithColumns:10000];
+}
+
 #pragma mark - Testing Backslashes
 
 - (void)testUnrecognizedBackslash {
@@ -577,6 +1062,34 @@ TEST_ARRAYS(_parsed, _expected); \
     XCTAssertNotEqualObjects(regularDictionary, expected, @"Somehow equal??");
 }
 
+- (void)testOrderedDictionariesOfOneFile {
+    NSString *csv = FIELD1 COMMA FIELD2 COMMA FIELD1 NEWLINE @"a" COMMA @"b" COMMA @"c" NEWLINE @"a" COMMA @"b" COMMA @"c" NEWLINE @"d" COMMA @"b" COMMA @"c";
+    NSArray *parsed = [csv componentsSeparatedByDelimiter:',' options:CHCSVParserOptionsUsesFirstLineAsKeys];
+    XCTAssertEqual(parsed.count, 3);
+    
+    // a repeated key has its last value, as in any other dictionary
+    CHCSVOrderedDictionary *row = parsed[0];
+    NSArray *keys = @[FIELD1, FIELD2, FIELD1];
+    XCTAssertEqualObjects(row.allKeys, keys);
+    XCTAssertEqual(row.count, 2);
+    XCTAssertEqualObjects(row[FIELD1], @"c");
+    XCTAssertEqualObjects(row[0], @"c");
+    XCTAssertEqualObjects(row[1], @"b");
+    XCTAssertNil(row[FIELD3]);
+    XCTAssertEqualObjects(row, ([CHCSVOrderedDictionary dictionaryWithObjects:@[@"a", @"b", @"c"] forKeys:keys]));
+    
+    XCTAssertEqualObjects(parsed[0], parsed[1]);
+    XCTAssertEqualObjects(parsed[1], parsed[2], @"Only the value of the last repeated key counts");
+    XCTAssertEqual([parsed[0] hash], [parsed[1] hash]);
+    
+    csv = FIELD1 COMMA FIELD2 NEWLINE @"a" COMMA @"b" NEWLINE @"a" COMMA @"c";
+    parsed = [csv componentsSeparatedByDelimiter:',' options:CHCSVParserOptionsUsesFirstLineAsKeys];
+    XCTAssertNotEqualObjects(parsed[0], parsed[1]);
+    
+    NSDictionary *decoded = [NSKeyedUnarchiver unarchiveObjectWithData:[NSKeyedArchiver archivedDataWithRootObject:parsed[0]]];
+    XCTAssertEqualObjects((@{FIELD1: @"a", FIELD2: @"b"}), decoded);
+}
+
 - (void)testFirstLineAsKeys {
     NSString *csv = FIELD1 COMMA FIELD2 COMMA FIELD3 NEWLINE FIELD1 COMMA FIELD2 COMMA FIELD3;
     NSArray *expected = @[
@@ -604,6 +1117,50 @@ TEST_ARRAYS(_parsed, _expected); \
     XCTAssertEqual(error.code, CHCSVErrorCodeIncorrectNumberOfFields, @"Unexpected error");
 }
 
+- (void)testIncludedColumns {
+    // the quoted delimiter and newline in the skipped second column are still honored
+    NSString *csv = FIELD1 COMMA @"\"a,\"\"b" NEWLINE @"\"" COMMA FIELD2 COMMA UTF8FIELD4 COMMA FIELD3 NEWLINE FIELD3 COMMA FIELD2 COMMA FIELD2 COMMA QUOTED_FIELD1 NEWLINE FIELD1;
+    NSArray *expected = @[@[FIELD1, UTF8FIELD4], @[FIELD3, QUOTED_FIELD1], @[FIELD1]];
+    
+    NSArray *parsed = [csv componentsSeparatedByDelimiter:[COMMA characterAtIndex:0] options:0 columns:@[@0, @3] error:nil];
+    TEST_ARRAYS(parsed, expected);
+    
+    // a non-ASCII delimiter is parsed as characters
+    NSString *brokenBar = @"\u00A6";
+    parsed = [[csv stringByReplacingOccurrencesOfString:COMMA withString:brokenBar] componentsSeparatedByDelimiter:[brokenBar characterAtIndex:0] options:0 columns:@[@0, @3] error:nil];
+    TEST_ARRAYS(parsed, expected);
+}
+
+- (void)testIncludedColumnsKeepColumnIndexes {
+    NSString *csv = FIELD1 COMMA FIELD2 COMMA FIELD3 NEWLINE FIELD1 COMMA QUOTED_FIELD2;
+    NSArray *expected = @[@"begin 1", @"1: " FIELD2, @"end 1", @"begin 2", @"1: " FIELD2, @"end 2"];
+    
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithCSVString:csv];
+    parser.sanitizesFields = YES;
+    parser.includedColumns = [NSIndexSet indexSetWithIndex:1];
+    parser.delegate = recorder;
+    [parser parse];
+    
+    XCTAssertEqualObjects(recorder.events, expected);
+}
+
+- (void)testIncludedColumnNames {
+    NSString *csv = FIELD1 COMMA QUOTED_FIELD2 COMMA FIELD3 NEWLINE @"a" COMMA @"b" COMMA @"c" NEWLINE @"d" COMMA @"e" COMMA @"f";
+    NSArray *expected = @[
+                          [CHCSVOrderedDictionary dictionaryWithObjects:@[@"b", @"c"] forKeys:@[FIELD2, FIELD3]],
+                          [CHCSVOrderedDictionary dictionaryWithObjects:@[@"e", @"f"] forKeys:@[FIELD2, FIELD3]]
+                          ];
+    
+    CHCSVParserOptions options = CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsUsesFirstLineAsKeys;
+    NSArray *columns = @[FIELD3, FIELD2, @"missing"];
+    NSArray *parsed = [csv componentsSeparatedByDelimiter:[COMMA characterAtIndex:0] options:options columns:columns error:nil];
+    XCTAssertEqualObjects(parsed, expected);
+    
+    XCTAssertThrows([csv componentsSeparatedByDelimiter:[COMMA characterAtIndex:0] options:0 columns:columns error:nil]);
+    XCTAssertThrows([csv componentsSeparatedByDelimiter:[COMMA characterAtIndex:0] options:options columns:@[@0, FIELD1] error:nil]);
+}
+
 #pragma mark - Testing Valid Delimiters
 
 - (void)testAllowedDelimiter_Octothorpe {
@@ -664,4 +1221,710 @@ TEST_ARRAYS(_parsed, _expected); \
     TEST(csv, expected, CHCSVParserOptionsRecognizesLeadingEqualSign | CHCSVParserOptionsSanitizesFields);
 }
 
+#pragma mark - Testing Writing
+
+- (void)testWriterRoundTrip {
+    NSArray *lines = @[@[FIELD1, @"a,b", @"say \"hi\"", MULTILINE_FIELD],
+                       @[UTF8FIELD4, EMPTY, @"\"\"", @"1⃣"],
+                       @[@" ", SPACE FIELD2 SPACE, @42, @"a\"b,c\nd\"\"e"]];
+    NSArray *expected = @[lines[0], lines[1], @[@" ", SPACE FIELD2 SPACE, @"42", @"a\"b,c\nd\"\"e"]];
+    
+    // a buffer smaller than some of the fields makes them straddle several flushes
+    for (NSNumber *bufferSize in @[@16, @17, @64, @65536]) {
+        for (NSNumber *encoding in @[@(NSUTF8StringEncoding), @(NSUTF16StringEncoding)]) {
+            NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+            CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:encoding.unsignedIntegerValue delimiter:','];
+            writer.bufferSize = bufferSize.unsignedIntegerValue;
+            for (NSArray *line in lines) {
+                [writer writeLineOfFields:line];
+            }
+            [writer closeStream];
+            
+            NSData *data = [output propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+            NSString *csv = [[NSString alloc] initWithData:data encoding:encoding.unsignedIntegerValue];
+            NSArray *parsed = [csv componentsSeparatedByDelimiter:',' options:CHCSVParserOptionsSanitizesFields];
+            
+            XCTAssertEqualObjects(parsed, expected, @"Buffer size %@, encoding %@", bufferSize, encoding);
+        }
+    }
+}
+
+- (void)testWriterFlush {
+    NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+    CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:NSUTF8StringEncoding delimiter:','];
+    [writer writeLineOfFields:@[FIELD1, FIELD2]];
+    
+    // nothing reaches the stream until the buffer is flushed
+    XCTAssertEqual([[output propertyForKey:NSStreamDataWrittenToMemoryStreamKey] length], 0);
+    XCTAssertTrue([writer flush]);
+    
+    NSData *data = [output propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+    XCTAssertEqualObjects([[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding], FIELD1 COMMA FIELD2 NEWLINE);
+    XCTAssertThrows(writer.bufferSize = 15, @"The buffer must fit any character");
+    
+    // a stream that only has room for some of the bytes accepts part of them, and then fails
+    uint8_t bytes[8];
+    NSOutputStream *small = [NSOutputStream outputStreamToBuffer:bytes capacity:sizeof(bytes)];
+    writer = [[CHCSVWriter alloc] initWithOutputStream:small encoding:NSUTF8StringEncoding delimiter:','];
+    [writer writeLineOfFields:@[FIELD1, FIELD2]];
+    XCTAssertFalse([writer flush]);
+    XCTAssertEqual(memcmp(bytes, "field1,f", sizeof(bytes)), 0);
+}
+
+- (void)testWriterColumns {
+    int64_t integers[] = {0, -42, INT64_MIN, INT64_MAX};
+    double doubles[] = {0.5, -1.25, 1e20, 0.1 + 0.2};
+    BOOL nulls[] = {NO, YES, NO, NO};
+    const char *strings[] = {"field1", "a\"b", "ḟīễłđ➃", "x\ny"};
+    CHCSVFieldSpan spans[4];
+    for (NSUInteger i = 0; i < 4; i++) {
+        spans[i] = (CHCSVFieldSpan){(const uint8_t *)strings[i], strlen(strings[i]), NO};
+    }
+    CHCSVColumn columns[] = {
+        {CHCSVColumnTypeInt64, integers, NULL, 0},
+        {CHCSVColumnTypeDouble, doubles, nulls, 2},
+        {CHCSVColumnTypeDouble, doubles, NULL, -1},
+        {CHCSVColumnTypeUTF8, spans, NULL, 0},
+    };
+    NSArray *expected = @[@[@"0", @"0.50", @"0.5", FIELD1],
+                          @[@"-42", EMPTY, @"-1.25", @"a\"b"],
+                          @[@"-9223372036854775808", @"100000000000000000000.00", @"1e+20", UTF8FIELD4],
+                          @[@"9223372036854775807", @"0.30", @"0.30000000000000004", @"x\ny"]];
+    
+    for (NSNumber *encoding in @[@(NSUTF8StringEncoding), @(NSUTF16StringEncoding)]) {
+        // a delimiter that appears in the numbers makes them quoted
+        for (NSString *delimiter in @[COMMA, @"."]) {
+            NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+            CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:encoding.unsignedIntegerValue delimiter:[delimiter characterAtIndex:0]];
+            writer.bufferSize = 16;
+            [writer writeField:FIELD2];
+            [writer writeRows:4 columns:columns count:4];
+            [writer closeStream];
+            
+            NSData *data = [output propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+            NSString *csv = [[NSString alloc] initWithData:data encoding:encoding.unsignedIntegerValue];
+            NSArray *parsed = [csv componentsSeparatedByDelimiter:[delimiter characterAtIndex:0] options:CHCSVParserOptionsSanitizesFields];
+            XCTAssertEqualObjects(parsed, [@[@[FIELD2]] arrayByAddingObjectsFromArray:expected], @"Encoding %@, delimiter %@", encoding, delimiter);
+        }
+    }
+}
+
+- (void)testWriterMapsMalformedUTF8 {
+    const char *strings[] = {"caf\xE9", "\xFF,x", "\xC0\xAF"};
+    CHCSVFieldSpan spans[3];
+    for (NSUInteger i = 0; i < 3; i++) {
+        spans[i] = (CHCSVFieldSpan){(const uint8_t *)strings[i], strlen(strings[i]), NO};
+    }
+    CHCSVColumn column = {CHCSVColumnTypeUTF8, spans, NULL, 0};
+    NSArray *expected = @[@[@"caf\u00E9"], @[@"\u00FF,x"], @[@"\u00C0\u00AF"]];
+    
+    // the same characters are written whatever the encoding, and the output is always valid
+    for (NSNumber *encoding in @[@(NSUTF8StringEncoding), @(NSUTF16StringEncoding)]) {
+        NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+        CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:encoding.unsignedIntegerValue delimiter:','];
+        [writer writeRows:3 columns:&column count:1];
+        [writer closeStream];
+        
+        NSData *data = [output propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+        NSString *csv = [[NSString alloc] initWithData:data encoding:encoding.unsignedIntegerValue];
+        XCTAssertNotNil(csv, @"Encoding %@", encoding);
+        XCTAssertEqualObjects([csv componentsSeparatedByDelimiter:',' options:CHCSVParserOptionsSanitizesFields], expected, @"Encoding %@", encoding);
+    }
+}
+
+- (void)testWriterBooleansAndTimestamps {
+    BOOL flags[] = {YES, NO, NO};
+    double times[] = {1582977600, -0.5, NAN};
+    CHCSVColumn columns[] = {
+        {CHCSVColumnTypeBoolean, flags, NULL, 0},
+        {CHCSVColumnTypeTimestamp, times, NULL, -1},
+        {CHCSVColumnTypeTimestamp, times, NULL, 3},
+    };
+    
+    NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+    CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:NSUTF8StringEncoding delimiter:','];
+    [writer writeRows:3 columns:columns count:3];
+    [writer closeStream];
+    
+    NSData *data = [output propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+    NSString *expected = @"true,2020-02-29T12:00:00Z,2020-02-29T12:00:00.000Z" NEWLINE @"false,1969-12-31T23:59:59.5Z,1969-12-31T23:59:59.500Z" NEWLINE @"false,," NEWLINE;
+    XCTAssertEqualObjects([[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding], expected);
+    
+    columns[2].precision = 10;
+    XCTAssertThrows([writer writeRows:3 columns:columns count:3]);
+}
+
+- (void)testParallelWritingMatchesSequential {
+    int64_t integers[100];
+    for (NSUInteger i = 0; i < 100; i++) {
+        integers[i] = (int64_t)(i * i) - 50;
+    }
+    CHCSVColumn column = {CHCSVColumnTypeInt64, integers, NULL, 0};
+    
+    NSMutableArray *outputs = [NSMutableArray array];
+    for (NSNumber *parallel in @[@NO, @YES]) {
+        NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+        CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:NSUTF16StringEncoding delimiter:','];
+        writer.linesPerBatch = 3;
+        writer.maximumBatchesInFlight = 2;
+        writer.writesInParallel = parallel.boolValue;
+        
+        // a mutable string that is changed after every line, and a mutable object that isn't a string
+        NSMutableString *reused = [NSMutableString string];
+        NSMutableArray *described = [NSMutableArray array];
+        for (NSUInteger line = 0; line < 50; line++) {
+            [reused setString:[NSString stringWithFormat:@"line %lu", (unsigned long)line]];
+            [writer writeLineOfFields:@[@(line), FIELD1, @"a,\"b\"", UTF8FIELD4, reused, described]];
+            [reused appendString:@" changed"];
+            [described addObject:@(line)];
+            if (line % 7 == 0) {
+                [writer writeComment:@"comment" NEWLINE FIELD2];
+            }
+        }
+        [writer writeRows:100 columns:&column count:1];
+        // an unfinished line at the end is written too
+        [writer writeField:FIELD3];
+        [writer writeField:MULTILINE_FIELD];
+        [writer closeStream];
+        
+        [outputs addObject:[output propertyForKey:NSStreamDataWrittenToMemoryStreamKey]];
+    }
+    XCTAssertEqualObjects(outputs[1], outputs[0]);
+    
+    NSMutableArray *lines = [NSMutableArray array];
+    for (NSUInteger line = 0; line < 3000; line++) {
+        [lines addObject:@[@(line), QUOTED_FIELD1, @"x\ny"]];
+    }
+    NSArray *parsed = [[lines CSVString] componentsSeparatedByDelimiter:',' options:CHCSVParserOptionsSanitizesFields];
+    XCTAssertEqual(parsed.count, lines.count);
+    XCTAssertEqualObjects(parsed.lastObject, (@[@"2999", QUOTED_FIELD1, @"x\ny"]));
+}
+
+
+#pragma mark - Testing Tables
+
+- (void)testTableMatchesArrays {
+    NSString *csv = FIELD1 COMMA QUOTED_FIELD2 COMMA @"\"" MULTILINE_FIELD @"\"" NEWLINE UTF8FIELD4 NEWLINE EMPTY COMMA FIELD3 COMMA FIELD1 COMMA @"\"a,\"\"b\"";
+    NSArray *expected = [csv componentsSeparatedByDelimiter:',' options:CHCSVParserOptionsSanitizesFields];
+    
+    NSError *error = nil;
+    CHCSVTable *table = [CHCSVTable tableWithDelimitedString:csv options:CHCSVParserOptionsSanitizesFields delimiter:',' columns:nil error:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(table.rowCount, expected.count);
+    XCTAssertEqual(table.columnCount, 4);
+    XCTAssertNil(table.columnNames);
+    for (NSUInteger row = 0; row < table.rowCount; row++) {
+        XCTAssertEqualObjects([table fieldsOfRowAtIndex:row], expected[row], @"Row %lu", (unsigned long)row);
+    }
+    
+    // the fields past the end of a shorter record are empty, but aren't part of the record
+    XCTAssertEqual([table fieldCountOfRowAtIndex:1], 1);
+    XCTAssertNil([table stringAtRow:1 column:2]);
+    XCTAssertEqual([table fieldSpanAtRow:1 column:2].length, 0);
+    XCTAssertEqualObjects([table stringAtRow:2 column:3], @"a,\"b");
+}
+
+- (void)testTableDictionaryEncoding {
+    NSMutableString *csv = [NSMutableString string];
+    for (NSUInteger row = 0; row < 10000; row++) {
+        [csv appendFormat:@"%lu,%@\n", (unsigned long)row, (row % 3 == 0) ? FIELD1 : UTF8FIELD4];
+    }
+    
+    CHCSVTable *table = [CHCSVTable tableWithDelimitedString:csv options:0 delimiter:',' columns:nil error:nil];
+    XCTAssertEqual(table.rowCount, 10000);
+    XCTAssertFalse([table isDictionaryEncodedColumn:0], @"Every value is distinct");
+    XCTAssertTrue([table isDictionaryEncodedColumn:1]);
+    XCTAssertEqualObjects([table fieldsOfRowAtIndex:9998], (@[@"9998", UTF8FIELD4]));
+    XCTAssertEqualObjects([table fieldsOfRowAtIndex:9999], (@[@"9999", FIELD1]));
+}
+
+- (void)testTableFirstLineAsKeys {
+    NSString *csv = FIELD1 COMMA FIELD2 COMMA FIELD3 NEWLINE @"a" COMMA @"b" COMMA @"c";
+    CHCSVTable *table = [CHCSVTable tableWithDelimitedString:csv options:CHCSVParserOptionsUsesFirstLineAsKeys delimiter:',' columns:@[FIELD3, FIELD1] error:nil];
+    XCTAssertEqualObjects(table.columnNames, (@[FIELD1, FIELD3]));
+    XCTAssertEqual(table.rowCount, 1);
+    XCTAssertEqualObjects([table fieldsOfRowAtIndex:0], (@[@"a", @"c"]));
+    
+    NSError *error = nil;
+    table = [CHCSVTable tableWithDelimitedString:[csv stringByAppendingString:COMMA FIELD1] options:CHCSVParserOptionsUsesFirstLineAsKeys delimiter:',' columns:nil error:&error];
+    XCTAssertNil(table);
+    XCTAssertEqualObjects(error.domain, CHCSVErrorDomain, @"Unexpected error");
+    XCTAssertEqual(error.code, CHCSVErrorCodeIncorrectNumberOfFields, @"Unexpected error");
+}
+
+#pragma mark - Testing Record Indexes
+
+- (void)testRecordIndexResumesParsing {
+    NSMutableString *csv = [NSMutableString string];
+    for (NSUInteger i = 0; i < 200; i++) {
+        [csv appendFormat:@"%lu,\"multi" NEWLINE @"line\",%@" NEWLINE, (unsigned long)i, UTF8FIELD4];
+    }
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+    parser.recordIndexInterval = 16;
+    parser.delegate = recorder;
+    [parser parse];
+    NSArray *allEvents = recorder.events;
+    
+    CHCSVRecordIndex *index = parser.recordIndex;
+    XCTAssertEqual(index.recordCount, 200);
+    XCTAssertEqual(index.recordInterval, 16);
+    
+    NSError *error = nil;
+    NSURL *indexURL = [CHCSVRecordIndex sidecarURLForFileAtURL:url];
+    XCTAssertTrue([index writeToURL:indexURL error:&error], @"Unable to write index: %@", error);
+    index = [CHCSVRecordIndex indexWithContentsOfURL:indexURL forFileAtURL:url error:&error];
+    XCTAssertNotNil(index, @"Unable to read index: %@", error);
+    XCTAssertEqual(index.recordCount, 200);
+    
+    for (NSNumber *record in @[@1, @2, @16, @17, @18, @100, @200]) {
+        NSUInteger recordNumber = [record unsignedIntegerValue];
+        NSUInteger first = [allEvents indexOfObject:[NSString stringWithFormat:@"begin %lu", (unsigned long)recordNumber]];
+        NSArray *expected = [allEvents subarrayWithRange:NSMakeRange(first, allEvents.count - first)];
+        
+        recorder = [[CHCSVEventRecorder alloc] init];
+        parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+        parser.delegate = recorder;
+        XCTAssertTrue([parser startAtRecord:recordNumber usingIndex:index]);
+        [parser parse];
+        XCTAssertEqualObjects(recorder.events, expected, @"Record %lu", (unsigned long)recordNumber);
+    }
+    
+    // any record boundary will do
+    NSString *firstRecord = [NSString stringWithFormat:@"0,\"multi" NEWLINE @"line\",%@" NEWLINE, UTF8FIELD4];
+    recorder = [[CHCSVEventRecorder alloc] init];
+    parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+    parser.delegate = recorder;
+    XCTAssertTrue([parser startAtByteOffset:[firstRecord lengthOfBytesUsingEncoding:NSUTF8StringEncoding] recordNumber:2]);
+    [parser parse];
+    NSUInteger second = [allEvents indexOfObject:@"begin 2"];
+    XCTAssertEqualObjects(recorder.events, [allEvents subarrayWithRange:NSMakeRange(second, allEvents.count - second)]);
+}
+
+- (void)testRecordIndexFromParallelParse {
+    NSMutableString *csv = [NSMutableString string];
+    [csv appendString:@"id,text," FIELD1 NEWLINE];
+    for (NSUInteger i = 0; csv.length < 5 * 1024 * 1024; i++) {
+        [csv appendFormat:@"%lu,\"multi" NEWLINE @"line\",%@" NEWLINE, (unsigned long)i, UTF8FIELD4];
+    }
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    NSMutableArray *indexes = [NSMutableArray array];
+    for (NSNumber *parallel in @[@NO, @YES]) {
+        CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+        parser.parsesInParallel = [parallel boolValue];
+        parser.recordIndexInterval = 1000;
+        [parser parse];
+        XCTAssertNotNil(parser.recordIndex);
+        [indexes addObject:parser.recordIndex];
+    }
+    XCTAssertEqual([indexes[1] recordCount], [indexes[0] recordCount]);
+    
+    // chunks start counting afresh, so the records are indexed in different places, but they must lead to the same records
+    NSUInteger recordCount = [indexes[0] recordCount];
+    for (NSNumber *record in @[@1500, @(recordCount - 2)]) {
+        NSMutableArray *events = [NSMutableArray array];
+        for (CHCSVRecordIndex *index in indexes) {
+            CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+            CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+            parser.includedColumnNames = @[FIELD1, @"id"];
+            parser.delegate = recorder;
+            XCTAssertTrue([parser startAtRecord:[record unsignedIntegerValue] usingIndex:index]);
+            [parser parse];
+            [events addObject:recorder.events];
+        }
+        
+        NSArray *expected = @[[NSString stringWithFormat:@"begin %@", record], [NSString stringWithFormat:@"0: %lu", [record unsignedLongValue] - 2], @"2: " UTF8FIELD4];
+        XCTAssertEqualObjects([events[0] subarrayWithRange:NSMakeRange(0, 3)], expected);
+        XCTAssertEqualObjects(events[1], events[0], @"Record %@", record);
+    }
+}
+
+- (void)testStaleRecordIndex {
+    NSURL *url = [self temporaryURLForDelimitedString:FIELD1 NEWLINE FIELD2 NEWLINE FIELD3];
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+    parser.recordIndexInterval = 1;
+    [parser parse];
+    
+    CHCSVRecordIndex *index = parser.recordIndex;
+    NSURL *indexURL = [CHCSVRecordIndex sidecarURLForFileAtURL:url];
+    XCTAssertTrue([index isValidForFileAtURL:url]);
+    XCTAssertTrue([index writeToURL:indexURL error:nil]);
+    
+    [(FIELD1 NEWLINE FIELD3) writeToURL:url atomically:YES encoding:NSUTF8StringEncoding error:nil];
+    XCTAssertFalse([index isValidForFileAtURL:url]);
+    
+    NSError *error = nil;
+    XCTAssertNil([CHCSVRecordIndex indexWithContentsOfURL:indexURL forFileAtURL:url error:&error]);
+    XCTAssertEqualObjects(error.domain, CHCSVErrorDomain, @"Unexpected error");
+    XCTAssertEqual(error.code, CHCSVErrorCodeInvalidIndex, @"Unexpected error");
+    
+    parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+    XCTAssertFalse([parser startAtRecord:2 usingIndex:index]);
+    
+    // only local UTF-8 files are indexed
+    parser = [[CHCSVParser alloc] initWithCSVString:FIELD1 NEWLINE FIELD2];
+    parser.recordIndexInterval = 1;
+    XCTAssertFalse([parser startAtByteOffset:0 recordNumber:1]);
+    [parser parse];
+    XCTAssertNil(parser.recordIndex);
+}
+
+- (void)testRecordCache {
+    NSString *csv = FIELD1 COMMA FIELD2 COMMA FIELD3 NEWLINE QUOTED_FIELD1 COMMA UTF8FIELD4 COMMA EMPTY NEWLINE FIELD3 NEWLINE DOUBLEQUOTE MULTILINE_FIELD DOUBLEQUOTE COMMA FIELD1;
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    NSURL *cacheURL = [url URLByAppendingPathExtension:@"chcsvcache"];
+    CHCSVParserOptions options = CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsUsesCache;
+    
+    NSArray *expected = [NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsSanitizesFields delimiter:',' error:nil];
+    XCTAssertEqualObjects([NSArray arrayWithContentsOfDelimitedURL:url options:options delimiter:',' error:nil], expected);
+    XCTAssertTrue([cacheURL checkResourceIsReachableAndReturnError:nil]);
+    NSArray *cached = [NSArray arrayWithContentsOfDelimitedURL:url options:options delimiter:',' error:nil];
+    XCTAssertFalse([cached isKindOfClass:[NSMutableArray class]], @"Expected the records to come from the cache");
+    XCTAssertEqualObjects(cached, expected);
+    
+    // other options have their own caches
+    NSURL *directory = [NSURL fileURLWithPath:NSTemporaryDirectory() isDirectory:YES];
+    csv = FIELD1 COMMA FIELD2 NEWLINE FIELD3 COMMA UTF8FIELD4 NEWLINE FIELD1 COMMA EMPTY;
+    url = [self temporaryURLForDelimitedString:csv];
+    expected = [NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsUsesFirstLineAsKeys delimiter:',' error:nil];
+    for (NSUInteger i = 0; i < 2; i++) {
+        cached = [NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsUsesFirstLineAsKeys delimiter:',' cacheDirectory:directory error:nil];
+        XCTAssertEqualObjects(cached, expected);
+        XCTAssertEqualObjects([cached[1] allKeys], (@[FIELD1, FIELD2]));
+    }
+}
+
+- (void)testStaleAndDamagedRecordCache {
+    NSURL *url = [self temporaryURLForDelimitedString:FIELD1 COMMA FIELD2 NEWLINE FIELD3];
+    NSURL *cacheURL = [url URLByAppendingPathExtension:@"chcsvcache"];
+    XCTAssertEqualObjects([NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsUsesCache delimiter:',' error:nil], (@[@[FIELD1, FIELD2], @[FIELD3]]));
+    
+    [(FIELD3 COMMA FIELD2 NEWLINE FIELD1 COMMA FIELD1) writeToURL:url atomically:YES encoding:NSUTF8StringEncoding error:nil];
+    NSArray *expected = @[@[FIELD3, FIELD2], @[FIELD1, FIELD1]];
+    XCTAssertEqualObjects([NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsUsesCache delimiter:',' error:nil], expected);
+    
+    NSMutableData *cache = [NSMutableData dataWithContentsOfURL:cacheURL];
+    XCTAssertNotNil(cache);
+    [cache setLength:[cache length] - 1];
+    XCTAssertTrue([cache writeToURL:cacheURL atomically:YES]);
+    XCTAssertEqualObjects([NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsUsesCache delimiter:',' error:nil], expected);
+    
+    // damage the column offsets, which the checksum covers
+    cache = [NSMutableData dataWithContentsOfURL:cacheURL];
+    ((uint8_t *)[cache mutableBytes])[[cache length] - 3 * sizeof(uint64_t)] ^= 0xFF;
+    XCTAssertTrue([cache writeToURL:cacheURL atomically:YES]);
+    XCTAssertEqualObjects([NSArray arrayWithContentsOfDelimitedURL:url options:CHCSVParserOptionsUsesCache delimiter:',' error:nil], expected);
+}
+
+#pragma mark - Testing Incremental Parsing
+
+- (void)testIncrementalParsingMatchesWholeParse {
+    // a byte order mark, every kind of newline, quoted newlines, escapes, comments and multibyte characters, split everywhere
+    NSString *csv = @"\uFEFF" FIELD1 COMMA QUOTED_FIELD2 NEWLINE @"#" FIELD3 @",\"" NEWLINE @"\"multi\r\nline\",=\"007\", \"a\"\"b\" ,x\\,y\r\n" UTF8FIELD4 COMMA @" \"" UTF8FIELD4 @"\" \r" EMPTY COMMA @"x\\" NEWLINE @"y" NEWLINE NEWLINE FIELD1;
+    NSData *data = [csv dataUsingEncoding:NSUTF8StringEncoding];
+    
+    CHCSVParserOptions optionSets[] = {
+        CHCSVParserOptionsRecognizesComments,
+        CHCSVParserOptionsRecognizesComments | CHCSVParserOptionsSanitizesFields,
+        CHCSVParserOptionsRecognizesComments | CHCSVParserOptionsSanitizesFields | CHCSVParserOptionsTrimsWhitespace | CHCSVParserOptionsRecognizesBackslashesAsEscapes | CHCSVParserOptionsRecognizesLeadingEqualSign
+    };
+    for (NSUInteger i = 0; i < sizeof(optionSets) / sizeof(optionSets[0]); i++) {
+        CHCSVParserOptions options = optionSets[i];
+        void (^configure)(CHCSVParser *) = ^(CHCSVParser *parser) {
+            parser.sanitizesFields = !!(options & CHCSVParserOptionsSanitizesFields);
+            parser.trimsWhitespace = !!(options & CHCSVParserOptionsTrimsWhitespace);
+            parser.recognizesComments = !!(options & CHCSVParserOptionsRecognizesComments);
+            parser.recognizesBackslashesAsEscapes = !!(options & CHCSVParserOptionsRecognizesBackslashesAsEscapes);
+            parser.recognizesLeadingEqualSign = !!(options & CHCSVParserOptionsRecognizesLeadingEqualSign);
+        };
+        
+        CHCSVEventRecorder *expected = [[CHCSVEventRecorder alloc] init];
+        CHCSVParser *parser = [[CHCSVParser alloc] initWithCSVString:csv];
+        configure(parser);
+        parser.delegate = expected;
+        [parser parse];
+        
+        for (NSNumber *pieceLength in @[@1, @2, @3, @5, @64, @(data.length)]) {
+            for (CHCSVEventRecorder *recorder in @[[[CHCSVEventRecorder alloc] init], [[CHCSVBatchEventRecorder alloc] init]]) {
+                parser = [[CHCSVParser alloc] initForIncrementalParsingWithDelimiter:','];
+                configure(parser);
+                parser.delegate = recorder;
+                for (NSUInteger location = 0; location < data.length; location += [pieceLength unsignedIntegerValue]) {
+                    NSUInteger length = MIN([pieceLength unsignedIntegerValue], data.length - location);
+                    [parser feedData:[data subdataWithRange:NSMakeRange(location, length)]];
+                }
+                [parser finish];
+                
+                XCTAssertEqualObjects(recorder.events, expected.events, @"Options %lu, pieces of %@", (unsigned long)options, pieceLength);
+            }
+        }
+    }
+}
+
+- (void)testIncrementalParsingReportsRecordsImmediately {
+    CHCSVBatchEventRecorder *recorder = [[CHCSVBatchEventRecorder alloc] init];
+    CHCSVParser *parser = [[CHCSVParser alloc] initForIncrementalParsingWithDelimiter:','];
+    parser.sanitizesFields = YES;
+    parser.delegate = recorder;
+    
+    [parser feedData:[@"a,b" NEWLINE @"c,\"d" dataUsingEncoding:NSUTF8StringEncoding]];
+    XCTAssertEqualObjects(recorder.events, (@[@"begin 1", @"0: a", @"1: b", @"end 1"]));
+    
+    // the second record waits for its closing quote, and for the rest of its last character
+    NSData *rest = [NEWLINE @"e\"," UTF8FIELD4 @"\r" dataUsingEncoding:NSUTF8StringEncoding];
+    [parser feedData:[rest subdataWithRange:NSMakeRange(0, rest.length - 2)]];
+    XCTAssertEqual(recorder.events.count, 4);
+    [parser feedData:[rest subdataWithRange:NSMakeRange(rest.length - 2, 2)]];
+    XCTAssertEqualObjects([recorder.events subarrayWithRange:NSMakeRange(4, recorder.events.count - 4)], (@[@"begin 2", @"0: c", @"1: d" NEWLINE @"e", @"2: " UTF8FIELD4, @"end 2"]));
+    
+    // the line feed finishes the carriage return before it, rather than being an empty record
+    [parser feedData:[@"\nf" dataUsingEncoding:NSUTF8StringEncoding]];
+    XCTAssertEqual(recorder.events.count, 9);
+    [parser finish];
+    XCTAssertEqualObjects(recorder.events.lastObject, @"end 3");
+    XCTAssertEqual(recorder.events.count, 12);
+    
+    XCTAssertThrowsSpecificNamed((void)[[CHCSVParser alloc] initForIncrementalParsingWithDelimiter:0x00A6], NSException, NSInvalidArgumentException);
+}
+
+#pragma mark - Testing Reading Ahead
+
+- (void)testReadAheadMatchesSequential {
+    NSMutableString *csv = [NSMutableString string];
+    for (NSUInteger i = 0; i < 100000; i++) {
+        [csv appendFormat:@"%lu," QUOTED_FIELD2 COMMA UTF8FIELD4 NEWLINE, (unsigned long)i];
+    }
+    NSData *data = [csv dataUsingEncoding:NSUTF8StringEncoding];
+    
+    CHCSVEventRecorder *expected = [[CHCSVEventRecorder alloc] init];
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithInputStream:[NSInputStream inputStreamWithData:data] usedEncoding:NULL delimiter:','];
+    parser.delegate = expected;
+    [parser parse];
+    
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    parser = [[CHCSVParser alloc] initWithInputStream:[NSInputStream inputStreamWithData:data] usedEncoding:NULL delimiter:','];
+    parser.readAheadBufferSize = 1024 * 1024;
+    parser.delegate = recorder;
+    [parser parse];
+    
+    XCTAssertEqual(recorder.events.count, expected.events.count);
+    XCTAssertEqualObjects(recorder.events, expected.events);
+    
+    XCTAssertThrows(parser.readAheadBufferSize = 512);
+    XCTAssertThrows(parser.readAheadBufferSize = 32 * 1024 * 1024);
+}
+
+- (void)testGzippedInput {
+    NSString *csv = FIELD1 COMMA QUOTED_FIELD2 NEWLINE UTF8FIELD4 COMMA FIELD3;
+    NSMutableData *data = [CHCSVGzippedData([csv dataUsingEncoding:NSUTF8StringEncoding]) mutableCopy];
+    // a second member continues the first
+    [data appendData:CHCSVGzippedData([NEWLINE FIELD1 dataUsingEncoding:NSUTF8StringEncoding])];
+    NSArray *expected = @[@[FIELD1, QUOTED_FIELD2], @[UTF8FIELD4, FIELD3], @[FIELD1]];
+    NSArray *expectedEvents = [self eventsParsingData:[[csv stringByAppendingString:NEWLINE FIELD1] dataUsingEncoding:NSUTF8StringEncoding] encoding:NSUTF8StringEncoding];
+    
+    NSStringEncoding encoding = 0;
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithInputStream:[NSInputStream inputStreamWithData:data] usedEncoding:&encoding delimiter:','];
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    parser.delegate = recorder;
+    [parser parse];
+    XCTAssertEqual(encoding, NSUTF8StringEncoding);
+    XCTAssertEqualObjects(recorder.events, expectedEvents);
+    
+    NSURL *fileURL = [[self temporaryURLForDelimitedString:@""] URLByAppendingPathExtension:@"gz"];
+    [data writeToURL:fileURL atomically:YES];
+    NSArray *parsed = [NSArray arrayWithContentsOfCSVURL:fileURL];
+    TEST_ARRAYS(parsed, expected);
+}
+
+- (void)testGzippedStreamIsParsedAsItArrives {
+    CFReadStreamRef readStream = NULL;
+    CFWriteStreamRef writeStream = NULL;
+    CFStreamCreateBoundPair(kCFAllocatorDefault, &readStream, &writeStream, 4096);
+    NSInputStream *input = CFBridgingRelease(readStream);
+    NSOutputStream *output = CFBridgingRelease(writeStream);
+    [output open];
+    
+    CHCSVRecordSignaller *recorder = [[CHCSVRecordSignaller alloc] init];
+    recorder.recordEnded = dispatch_semaphore_create(0);
+    __block BOOL arrivedBeforeClose = NO;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        void (^write)(NSData *) = ^(NSData *data) {
+            for (NSUInteger offset = 0; offset < data.length; offset += 16) {
+                NSUInteger length = MIN(16, data.length - offset);
+                [output write:(const uint8_t *)data.bytes + offset maxLength:length];
+            }
+        };
+        // the first record is complete once the first member has been written, and must be reported before anything else arrives
+        write(CHCSVGzippedData([FIELD1 COMMA FIELD2 NEWLINE FIELD3 dataUsingEncoding:NSUTF8StringEncoding]));
+        arrivedBeforeClose = (dispatch_semaphore_wait(recorder.recordEnded, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)) == 0);
+        write(CHCSVGzippedData([COMMA FIELD1 NEWLINE dataUsingEncoding:NSUTF8StringEncoding]));
+        [output close];
+    });
+    
+    NSStringEncoding encoding = 0;
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithInputStream:input usedEncoding:&encoding delimiter:','];
+    parser.delegate = recorder;
+    [parser parse];
+    
+    XCTAssertTrue(arrivedBeforeClose);
+    XCTAssertEqualObjects(recorder.events, (@[@"begin 1", @"0: " FIELD1, @"1: " FIELD2, @"end 1", @"begin 2", @"0: " FIELD3, @"1: " FIELD1, @"end 2"]));
+}
+
+- (void)testTruncatedGzippedInput {
+    NSData *data = CHCSVGzippedData([FIELD1 COMMA FIELD2 NEWLINE FIELD3 dataUsingEncoding:NSUTF8StringEncoding]);
+    data = [data subdataWithRange:NSMakeRange(0, data.length - 4)];
+    
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithInputStream:[NSInputStream inputStreamWithData:data] usedEncoding:NULL delimiter:','];
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    parser.delegate = recorder;
+    [parser parse];
+    XCTAssertEqualObjects(recorder.events.lastObject, @"error");
+}
+
+#pragma mark - Testing Statistics
+
+- (void)testParserStatistics {
+    NSString *csv = FIELD1 COMMA FIELD2 NEWLINE FIELD3 NEWLINE UTF8FIELD4 COMMA FIELD1 COMMA FIELD2;
+    NSData *data = [csv dataUsingEncoding:NSUTF8StringEncoding];
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:[self temporaryURLForDelimitedString:csv]];
+    parser.measuresTime = YES;
+    parser.delegate = recorder;
+    XCTAssertNil(parser.statistics);
+    XCTAssertEqual(parser.totalBytesRead, 0, @"Nothing has been published yet");
+    XCTAssertEqualWithAccuracy(parser.statisticsInterval, 0.1, 1e-9);
+    [parser parse];
+    
+    CHCSVParserStatistics *statistics = parser.statistics;
+    XCTAssertEqual(statistics.bytesRead, data.length);
+    XCTAssertEqual(statistics.decodedLength, data.length);
+    XCTAssertEqual(parser.totalBytesRead, data.length);
+    XCTAssertEqual(statistics.recordCount, 3);
+    XCTAssertEqual(statistics.fieldCount, 6);
+    XCTAssertGreaterThan(statistics.elapsedTime, 0);
+    XCTAssertGreaterThan(statistics.delegateTime, 0);
+    XCTAssertEqualWithAccuracy(statistics.readingTime + statistics.decodingTime + statistics.delegateTime + statistics.tokenizingTime, statistics.elapsedTime, 1e-6);
+    XCTAssertGreaterThan(statistics.allocationCount, 0);
+    XCTAssertGreaterThan(statistics.peakBufferSize, 0);
+    
+    // other encodings are counted in the UTF-8 they're converted to
+    NSStringEncoding encoding = NSUTF16LittleEndianStringEncoding;
+    NSData *utf16 = [csv dataUsingEncoding:encoding];
+    parser = [[CHCSVParser alloc] initWithInputStream:[NSInputStream inputStreamWithData:utf16] usedEncoding:&encoding delimiter:','];
+    [parser parse];
+    statistics = [parser currentStatistics];
+    XCTAssertEqual(statistics.bytesRead, utf16.length);
+    XCTAssertEqual(statistics.decodedLength, data.length);
+    XCTAssertEqual(statistics.fieldCount, 6);
+    XCTAssertEqual(statistics.delegateTime, 0, @"Times are only measured if asked for");
+}
+
+- (void)testStatisticsArePublishedWhileParsing {
+    // several chunks' worth of input
+    NSMutableString *csv = [NSMutableString string];
+    for (NSUInteger i = 0; i < 20000; i++) {
+        [csv appendString:FIELD1 COMMA FIELD2 NEWLINE];
+    }
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    for (NSNumber *intervalNumber in @[@0, @1e-9]) {
+        NSTimeInterval interval = [intervalNumber doubleValue];
+        CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+        parser.statisticsInterval = interval;
+        CHCSVStatisticsObserver *observer = [[CHCSVStatisticsObserver alloc] init];
+        [parser addObserver:observer forKeyPath:@"statistics" options:0 context:NULL];
+        [parser addObserver:observer forKeyPath:@"totalBytesRead" options:0 context:NULL];
+        [parser parse];
+        [parser removeObserver:observer forKeyPath:@"statistics"];
+        [parser removeObserver:observer forKeyPath:@"totalBytesRead"];
+        
+        if (interval == 0) {
+            XCTAssertEqual(observer.published.count, 1, @"Statistics should only be published once parsing finishes");
+        } else {
+            XCTAssertGreaterThan(observer.published.count, 2);
+        }
+        XCTAssertEqual(observer.totalBytesReadChanges, observer.published.count);
+        unsigned long long bytesRead = 0;
+        for (CHCSVParserStatistics *statistics in observer.published) {
+            XCTAssertGreaterThanOrEqual(statistics.bytesRead, bytesRead);
+            bytesRead = statistics.bytesRead;
+        }
+        XCTAssertEqual(bytesRead, [[csv dataUsingEncoding:NSUTF8StringEncoding] length]);
+        XCTAssertEqual([observer.published.lastObject recordCount], 20000);
+    }
+}
+
+- (void)testWriterStatistics {
+    NSOutputStream *output = [NSOutputStream outputStreamToMemory];
+    CHCSVWriter *writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:NSUTF8StringEncoding delimiter:','];
+    [writer writeLineOfFields:@[FIELD1, FIELD2]];
+    [writer writeComment:FIELD3];
+    [writer writeField:FIELD3];
+    [writer finishLine];
+    XCTAssertEqual([writer currentStatistics].bytesWritten, 0, @"Buffered bytes haven't been written yet");
+    XCTAssertTrue([writer flush]);
+    
+    CHCSVWriterStatistics *statistics = [writer currentStatistics];
+    XCTAssertEqual(statistics.bytesWritten, [[output propertyForKey:NSStreamDataWrittenToMemoryStreamKey] length]);
+    XCTAssertEqual(statistics.lineCount, 2);
+    XCTAssertEqual(statistics.fieldCount, 3);
+    XCTAssertEqual(statistics.allocationCount, 1);
+    XCTAssertEqual(statistics.peakBufferSize, writer.bufferSize);
+    
+    // in parallel, the bytes of every batch submitted so far are counted
+    output = [NSOutputStream outputStreamToMemory];
+    writer = [[CHCSVWriter alloc] initWithOutputStream:output encoding:NSUTF8StringEncoding delimiter:','];
+    writer.bufferSize = 16;
+    writer.linesPerBatch = 2;
+    writer.writesInParallel = YES;
+    for (NSUInteger line = 0; line < 10; line++) {
+        [writer writeLineOfFields:@[FIELD1, FIELD2]];
+    }
+    statistics = [writer currentStatistics];
+    XCTAssertGreaterThan(statistics.bytesWritten, 0);
+    XCTAssertEqual(statistics.bytesWritten, [[output propertyForKey:NSStreamDataWrittenToMemoryStreamKey] length]);
+    XCTAssertEqual(statistics.lineCount, 10);
+    XCTAssertEqual(statistics.fieldCount, 20);
+    [writer closeStream];
+}
+
+#pragma mark - Testing Scanning
+
+- (void)testScanSummary {
+    NSString *csv = FIELD1 COMMA QUOTED_FIELD2 COMMA FIELD3 NEWLINE OCTOTHORPE FIELD1 NEWLINE DOUBLEQUOTE MULTILINE_FIELD DOUBLEQUOTE NEWLINE UTF8FIELD4 COMMA FIELD2 NEWLINE FIELD1 COMMA EMPTY;
+    NSURL *url = [self temporaryURLForDelimitedString:csv];
+    
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithContentsOfCSVURL:url];
+    parser.recognizesComments = YES;
+    CHCSVEventRecorder *recorder = [[CHCSVEventRecorder alloc] init];
+    parser.delegate = recorder;
+    CHCSVScanSummary *summary = [parser scan];
+    
+    XCTAssertEqual(recorder.events.count, 0);
+    XCTAssertNil(summary.error);
+    XCTAssertEqual(summary.errorRecordNumber, NSNotFound);
+    XCTAssertEqual(summary.recordCount, 4);
+    XCTAssertEqual(summary.commentCount, 1);
+    XCTAssertEqual(summary.minimumFieldCount, 1);
+    XCTAssertEqual(summary.maximumFieldCount, 3);
+    XCTAssertEqualObjects(summary.fieldCountHistogram, (@{@1 : @1, @2 : @2, @3 : @1}));
+    // the quoted multiline field, with its quotes
+    XCTAssertEqual(summary.maximumFieldLength, [MULTILINE_FIELD length] + 2);
+}
+
+- (void)testScanReportsFirstError {
+    NSString *csv = FIELD1 COMMA FIELD2 NEWLINE FIELD1 COMMA QUOTED_FIELD2 @"x" COMMA FIELD3 NEWLINE QUOTED_FIELD1 @"y";
+    CHCSVParser *parser = [[CHCSVParser alloc] initWithCSVString:csv];
+    CHCSVScanSummary *summary = [parser scan];
+    
+    XCTAssertEqual(summary.error.code, CHCSVErrorCodeInvalidFormat);
+    XCTAssertEqual(summary.errorRecordNumber, 2);
+    XCTAssertEqual(summary.errorOffset, [FIELD1 COMMA FIELD2 NEWLINE FIELD1 COMMA QUOTED_FIELD2 length]);
+    XCTAssertEqual(summary.recordCount, 2);
+}
+
 @end